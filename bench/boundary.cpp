@@ -0,0 +1,113 @@
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <fastcgi++/http.hpp>
+
+// Compares the multipart delimiter search against the byte at a time scan the
+// old multipart parser did in it's BODY state. Run it with an optional payload
+// size in megabytes.
+
+const char delimiter[]="\r\n------WebKitFormBoundary7MA4YWxkTrZu0gW";
+const size_t delimiterSize=sizeof(delimiter)-1;
+
+// The old parser compared the boundary at every single offset
+const char* byteScan(const char* data, size_t size, const char* pattern, size_t patternSize)
+{
+	const char* const end=data+size;
+	for(const char* i=data; i+patternSize<=end; ++i)
+		if(!std::memcmp(i, pattern, patternSize))
+			return i;
+	return end;
+}
+
+typedef const char* (*Search)(const char*, size_t, const char*, size_t);
+
+double run(Search search, const std::vector<char>& payload, size_t& found)
+{
+	using namespace boost::posix_time;
+
+	found=0;
+	const char* data=&payload[0];
+	size_t size=payload.size();
+	const ptime start=microsec_clock::universal_time();
+	while(true)
+	{
+		const char* position=search(data, size, delimiter, delimiterSize);
+		if(position==data+size)
+			break;
+		++found;
+		size-=position+delimiterSize-data;
+		data=position+delimiterSize;
+	}
+	const double seconds=(microsec_clock::universal_time()-start).total_microseconds()/1e6;
+	return payload.size()/1048576.0/seconds;
+}
+
+void compare(const char* name, const std::vector<char>& payload)
+{
+	size_t byteFound;
+	size_t patternFound;
+	const double byteRate=run(byteScan, payload, byteFound);
+	const double patternRate=run(Fastcgipp::Http::findPattern, payload, patternFound);
+
+	std::cout << std::setw(8) << name
+		<< std::fixed << std::setprecision(1)
+		<< "  byte scan " << std::setw(8) << byteRate << " MB/s"
+		<< "  findPattern " << std::setw(8) << patternRate << " MB/s"
+		<< "  x" << std::setprecision(2) << patternRate/byteRate;
+	if(byteFound!=patternFound)
+		std::cout << "  MISMATCH " << byteFound << '/' << patternFound;
+	std::cout << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	const size_t size=(argc>1?std::atoi(argv[1]):64)*1048576;
+	std::srand(1);
+
+	// Uniformly random bytes like compressed or encrypted uploads with a part every megabyte
+	std::vector<char> binary(size);
+	for(std::vector<char>::iterator it=binary.begin(); it!=binary.end(); ++it)
+		*it=char(std::rand());
+	for(size_t i=1048576; i+delimiterSize<size; i+=1048576)
+		std::memcpy(&binary[i], delimiter, delimiterSize);
+
+	// Text with short CRLF terminated lines is the worst case for a search keyed on '\r'
+	std::vector<char> text(size);
+	for(size_t i=0; i<size; ++i)
+		text[i]=i%40==38?'\r':(i%40==39?'\n':char('a'+i%26));
+
+	// Dashes give a lot of partial matches on the boundary itself
+	std::vector<char> dashes(size, '-');
+	for(size_t i=0; i<size; i+=64)
+		std::memcpy(&dashes[i], "\r\n----", 6);
+
+	compare("binary", binary);
+	compare("text", text);
+	compare("dashes", dashes);
+	return 0;
+}
@@ -0,0 +1,122 @@
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <map>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <fastcgi++/fcgistream.hpp>
+
+// Compares the table driven escaping used by Fcgistream's encoder against the
+// std::map lookup per character it used to do. Run it with an optional
+// payload size in megabytes.
+
+// The old encoder looked every single character up in a map of escape sequences
+template<class charT> void mapEscape(const charT* s, size_t n, Fastcgipp::OutputEncoding encoding, std::vector<charT>& out)
+{
+	static std::map<charT, std::basic_string<charT> > characters[2];
+	std::map<charT, std::basic_string<charT> >& table=characters[encoding==Fastcgipp::HTML?0:1];
+	if(table.empty())
+		for(wchar_t c=0; c<128; ++c)
+			if(const char* sequence=Fastcgipp::escapeSequence(c, encoding))
+				table[charT(c)].assign(sequence, sequence+std::strlen(sequence));
+
+	for(const charT* i=s; i<s+n; ++i)
+	{
+		typename std::map<charT, std::basic_string<charT> >::const_iterator it=table.find(*i);
+		if(it!=table.end())
+			out.insert(out.end(), it->second.begin(), it->second.end());
+		else
+			out.push_back(*i);
+	}
+}
+
+// What Fcgistream's encoder does now
+template<class charT> void tableEscape(const charT* s, size_t n, Fastcgipp::OutputEncoding encoding, std::vector<charT>& out)
+{
+	const charT* const end=s+n;
+	while(s!=end)
+	{
+		const charT* escape=Fastcgipp::findEscape(s, end, encoding);
+		out.insert(out.end(), s, escape);
+		if(escape==end)
+			break;
+		for(const char* sequence=Fastcgipp::escapeSequence(*escape, encoding); *sequence; ++sequence)
+			out.push_back(*sequence);
+		s=escape+1;
+	}
+}
+
+template<class charT> double run(void (*escape)(const charT*, size_t, Fastcgipp::OutputEncoding, std::vector<charT>&), const std::vector<charT>& payload, Fastcgipp::OutputEncoding encoding, std::vector<charT>& out)
+{
+	using namespace boost::posix_time;
+
+	// Feed it in pieces the size of a typical write to the stream
+	const size_t piece=256;
+	out.clear();
+	const ptime start=microsec_clock::universal_time();
+	for(size_t i=0; i<payload.size(); i+=piece)
+		escape(&payload[i], std::min(piece, payload.size()-i), encoding, out);
+	const double seconds=(microsec_clock::universal_time()-start).total_microseconds()/1e6;
+	return payload.size()*sizeof(charT)/1048576.0/seconds;
+}
+
+template<class charT> void compare(const char* name, const std::vector<charT>& payload, Fastcgipp::OutputEncoding encoding)
+{
+	std::vector<charT> mapOut;
+	std::vector<charT> tableOut;
+	mapOut.reserve(payload.size()*2);
+	tableOut.reserve(payload.size()*2);
+	const double mapRate=run(mapEscape<charT>, payload, encoding, mapOut);
+	const double tableRate=run(tableEscape<charT>, payload, encoding, tableOut);
+
+	std::cout << std::setw(14) << name
+		<< std::fixed << std::setprecision(1)
+		<< "  map " << std::setw(8) << mapRate << " MB/s"
+		<< "  table " << std::setw(8) << tableRate << " MB/s"
+		<< "  x" << std::setprecision(2) << tableRate/mapRate;
+	if(mapOut!=tableOut)
+		std::cout << "  MISMATCH";
+	std::cout << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	const size_t size=(argc>1?std::atoi(argv[1]):32)*1048576;
+	std::srand(1);
+
+	// Template output is mostly plain words with the odd character to escape
+	const char words[]="Lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor";
+	std::vector<char> text(size);
+	for(size_t i=0; i<size; ++i)
+		text[i]=std::rand()%64?words[i%(sizeof(words)-1)]:"<>&\"'/?="[std::rand()%8];
+	std::vector<wchar_t> wideText(text.begin(), text.end());
+
+	compare("char HTML", text, Fastcgipp::HTML);
+	compare("char URL", text, Fastcgipp::URL);
+	compare("wchar_t HTML", wideText, Fastcgipp::HTML);
+	compare("wchar_t URL", wideText, Fastcgipp::URL);
+	return 0;
+}
@@ -0,0 +1,374 @@
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <iterator>
+#include <algorithm>
+#include <locale>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <fastcgi++/protocol.hpp>
+#include <fastcgi++/http.hpp>
+#include <fastcgi++/fcgistream.hpp>
+#include <fastcgi++/transceiver.hpp>
+
+#include "utf8_codecvt.hpp"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
+// Times the functions every request goes through one at a time on payloads
+// shaped like what a web server sends. Each one is run until it has taken up at
+// least the time given as the optional argument in milliseconds so the figures
+// are comparable between runs and revisions.
+
+namespace
+{
+	// A PARAMS record body like a web server sends for a plain GET request
+	std::string params;
+	// The same for a multipart/form-data upload
+	std::string uploadParams;
+	// A query string with a handful of fields
+	std::string query;
+	// Text with the odd percent escaped character in it
+	std::string escaped;
+	std::vector<char> unescaped;
+	// Binary data and it's base64 encoding
+	std::vector<char> binary;
+	std::string encoded;
+	// A multipart/form-data body with a few fields and a file
+	std::string multipart;
+	// HTML with the odd character to escape
+	std::string html;
+	std::wstring wideHtml;
+	// The same as UTF-8 and a buffer to convert to
+	std::string utf8Html;
+	std::vector<char> narrowed;
+	std::vector<wchar_t> widened;
+
+	// Output goes to /dev/null through a transceiver nobody ever talks to
+	Fastcgipp::Transceiver* transceiver;
+	Fastcgipp::Protocol::FullId sinkId;
+	int sinkFd;
+
+	void discard(Fastcgipp::Protocol::FullId, Fastcgipp::Message) { }
+
+	void appendLength(std::string& record, size_t length)
+	{
+		if(length<128)
+			record.push_back(char(length));
+		else
+		{
+			record.push_back(char((length>>24)|0x80));
+			record.push_back(char(length>>16));
+			record.push_back(char(length>>8));
+			record.push_back(char(length));
+		}
+	}
+
+	void appendParam(std::string& record, const std::string& name, const std::string& value)
+	{
+		appendLength(record, name.size());
+		appendLength(record, value.size());
+		record.append(name);
+		record.append(value);
+	}
+
+	void buildPayloads()
+	{
+		const char* const common[][2]=
+		{
+			{ "GATEWAY_INTERFACE", "CGI/1.1" },
+			{ "SERVER_SOFTWARE", "nginx/1.24.0" },
+			{ "SERVER_PROTOCOL", "HTTP/1.1" },
+			{ "SERVER_NAME", "www.example.com" },
+			{ "SERVER_ADDR", "192.168.1.10" },
+			{ "SERVER_PORT", "443" },
+			{ "REMOTE_ADDR", "203.0.113.54" },
+			{ "REMOTE_PORT", "51874" },
+			{ "DOCUMENT_ROOT", "/srv/www/example" },
+			{ "SCRIPT_NAME", "/app/index.fcgi" },
+			{ "SCRIPT_FILENAME", "/srv/www/example/app/index.fcgi" },
+			{ "PATH_INFO", "/articles/2024/fastcgi" },
+			{ "HTTP_HOST", "www.example.com" },
+			{ "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64; rv:124.0) Gecko/20100101 Firefox/124.0" },
+			{ "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" },
+			{ "HTTP_ACCEPT_LANGUAGE", "en-CA,en-US;q=0.7,en;q=0.3" },
+			{ "HTTP_ACCEPT_CHARSET", "utf-8" },
+			{ "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" },
+			{ "HTTP_COOKIE", "session=Zm9vYmFyYmF6cXV4; theme=dark; lang=en" },
+			{ "HTTP_KEEP_ALIVE", "300" },
+			{ "HTTP_IF_NONE_MATCH", "\"1234\"" },
+			{ "HTTP_IF_MODIFIED_SINCE", "Sun, 06 Nov 1994 08:49:37 GMT" }
+		};
+
+		query="page=3&sort=date&order=desc&q=fastcgi%20c%2B%2B&tag=performance&tag=c%2B%2B&limit=50&offset=100&lang=en&format=html";
+
+		for(size_t i=0; i<sizeof(common)/sizeof(common[0]); ++i)
+		{
+			appendParam(params, common[i][0], common[i][1]);
+			appendParam(uploadParams, common[i][0], common[i][1]);
+		}
+		appendParam(params, "REQUEST_METHOD", "GET");
+		appendParam(params, "REQUEST_URI", "/app/index.fcgi/articles/2024/fastcgi?"+query);
+		appendParam(params, "QUERY_STRING", query);
+
+		const std::string boundary("----WebKitFormBoundary7MA4YWxkTrZu0gW");
+		multipart.append("--"+boundary+"\r\nContent-Disposition: form-data; name=\"title\"\r\n\r\nHolidays 2024\r\n");
+		multipart.append("--"+boundary+"\r\nContent-Disposition: form-data; name=\"description\"\r\n\r\n");
+		multipart.append(2048, 'd');
+		multipart.append("\r\n--"+boundary+"\r\nContent-Disposition: form-data; name=\"photo\"; filename=\"beach.jpg\"\r\nContent-Type: image/jpeg\r\n\r\n");
+		for(size_t i=0; i<65536; ++i)
+			multipart.push_back(char(std::rand()));
+		multipart.append("\r\n--"+boundary+"--\r\n");
+
+		char length[16];
+		std::sprintf(length, "%u", (unsigned int)multipart.size());
+		appendParam(uploadParams, "REQUEST_METHOD", "POST");
+		appendParam(uploadParams, "REQUEST_URI", "/app/upload.fcgi");
+		appendParam(uploadParams, "CONTENT_TYPE", "multipart/form-data; boundary="+boundary);
+		appendParam(uploadParams, "CONTENT_LENGTH", length);
+
+		const char words[]="Lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor";
+		for(size_t i=0; i<4096; ++i)
+			escaped.append(std::rand()%8?std::string(1, words[i%(sizeof(words)-1)]):std::string("%2F"));
+		unescaped.resize(escaped.size());
+
+		binary.resize(3072);
+		for(std::vector<char>::iterator it=binary.begin(); it!=binary.end(); ++it)
+			*it=char(std::rand());
+		Fastcgipp::Http::base64Encode(&binary[0], &binary[0]+binary.size(), std::back_inserter(encoded));
+
+		for(size_t i=0; i<16384; ++i)
+			html.push_back(std::rand()%64?words[i%(sizeof(words)-1)]:"<>&\"'"[std::rand()%5]);
+		for(size_t i=0; i<html.size(); ++i)
+			// Some characters beyond ASCII to give the UTF-8 conversion something to do
+			wideHtml.push_back(i%16?wchar_t(html[i]):wchar_t(0xe9));
+		narrowed.resize(wideHtml.size()*Fastcgipp::Http::maxUtf8Size);
+		utf8Html.assign(&narrowed[0], Fastcgipp::Http::wideToUtf8(wideHtml.data(), wideHtml.data()+wideHtml.size(), &narrowed[0]));
+		widened.resize(utf8Html.size());
+	}
+
+	size_t processParamHeader()
+	{
+		const char* data=params.data();
+		size_t size=params.size();
+		size_t total=0;
+		while(size)
+		{
+			const char* name;
+			const char* value;
+			size_t nameSize;
+			size_t valueSize;
+			Fastcgipp::Protocol::processParamHeader(data, size, name, nameSize, value, valueSize);
+			total+=nameSize+valueSize;
+			size-=value-data+valueSize;
+			data=value+valueSize;
+		}
+		return total?params.size():0;
+	}
+
+	template<bool lazy> size_t environmentFill()
+	{
+		Fastcgipp::Http::Environment<char> environment;
+		environment.setLazy(lazy);
+		environment.fill(params.data(), params.size());
+		return environment.requestMethod==Fastcgipp::Http::HTTP_METHOD_GET?params.size():0;
+	}
+
+	size_t decodeUrlEncoded()
+	{
+		std::map<std::string, std::string> gets;
+		Fastcgipp::Http::decodeUrlEncoded(query.data(), query.size(), gets);
+		return gets.size()?query.size():0;
+	}
+
+	size_t percentEscapedToRealBytes()
+	{
+		return Fastcgipp::Http::percentEscapedToRealBytes(escaped.data(), &unescaped[0], escaped.size())?escaped.size():0;
+	}
+
+	size_t parsePostsMultipart()
+	{
+		Fastcgipp::Http::Environment<char> environment;
+		environment.fill(uploadParams.data(), uploadParams.size());
+		// IN records carry up to 64kB but servers tend to send them in pieces of 16kB
+		const size_t piece=16384;
+		for(size_t i=0; i<multipart.size(); i+=piece)
+			environment.fillPostBuffer(multipart.data()+i, std::min(piece, multipart.size()-i));
+		environment.parsePostsMultipart();
+		return environment.posts.size()==3?multipart.size():0;
+	}
+
+	size_t base64Encode()
+	{
+		char output[4096];
+		Fastcgipp::Http::base64Encode(&binary[0], &binary[0]+binary.size(), output);
+		return binary.size();
+	}
+
+	size_t base64Decode()
+	{
+		char output[4096];
+		return Fastcgipp::Http::base64Decode(encoded.begin(), encoded.end(), output)?encoded.size():0;
+	}
+
+	template<class charT> size_t fcgistream(const std::basic_string<charT>& text, Fastcgipp::OutputEncoding encoding)
+	{
+		Fastcgipp::Fcgistream<charT> out;
+		out.set(sinkId, *transceiver, Fastcgipp::Protocol::OUT);
+		// Like a template engine writing a page a line at a time
+		const size_t piece=80;
+		out << Fastcgipp::encoding(encoding);
+		for(size_t i=0; i<text.size(); i+=piece)
+			out.write(text.data()+i, std::min(piece, text.size()-i));
+		out.drain();
+		transceiver->flush();
+		return text.size()*sizeof(charT);
+	}
+
+	size_t charToString()
+	{
+		std::wstring string;
+		Fastcgipp::Http::charToString(utf8Html.data(), utf8Html.size(), string);
+		return string.size()==wideHtml.size()?utf8Html.size():0;
+	}
+
+	size_t wideToUtf8()
+	{
+		const char* const end=Fastcgipp::Http::wideToUtf8(wideHtml.data(), wideHtml.data()+wideHtml.size(), &narrowed[0]);
+		return size_t(end-&narrowed[0])==utf8Html.size()?utf8Html.size():0;
+	}
+
+	// What the conversions were done with before for comparison
+	const std::codecvt<wchar_t, char, std::mbstate_t>& facet()
+	{
+		static const std::locale utf8Locale(std::locale::classic(), new utf8CodeCvt::utf8_codecvt_facet);
+		return std::use_facet<std::codecvt<wchar_t, char, std::mbstate_t> >(utf8Locale);
+	}
+
+	size_t facetIn()
+	{
+		std::mbstate_t state=std::mbstate_t();
+		const char* next;
+		wchar_t* to;
+		facet().in(state, utf8Html.data(), utf8Html.data()+utf8Html.size(), next, &widened[0], &widened[0]+widened.size(), to);
+		return size_t(to-&widened[0])==wideHtml.size()?utf8Html.size():0;
+	}
+
+	size_t facetOut()
+	{
+		std::mbstate_t state=std::mbstate_t();
+		const wchar_t* next;
+		char* to;
+		facet().out(state, wideHtml.data(), wideHtml.data()+wideHtml.size(), next, &narrowed[0], &narrowed[0]+narrowed.size(), to);
+		return size_t(to-&narrowed[0])==utf8Html.size()?utf8Html.size():0;
+	}
+
+	size_t fcgistreamNone() { return fcgistream(html, Fastcgipp::NONE); }
+	size_t fcgistreamHtml() { return fcgistream(html, Fastcgipp::HTML); }
+	size_t fcgistreamWide() { return fcgistream(wideHtml, Fastcgipp::NONE); }
+
+	size_t sinkWrite()
+	{
+		Fastcgipp::FcgistreamSink sink;
+		sink.set(sinkId, *transceiver, Fastcgipp::Protocol::OUT);
+		sink.write(multipart.data(), multipart.size());
+		transceiver->flush();
+		return multipart.size();
+	}
+
+	typedef size_t (*Benchmark)();
+
+	void measure(const char* name, Benchmark benchmark, double minimum)
+	{
+		using namespace boost::posix_time;
+
+		// Warm up caches and allocators first
+		benchmark();
+
+		size_t iterations=1;
+		size_t bytes;
+		double seconds;
+		while(true)
+		{
+			bytes=0;
+			const ptime start=microsec_clock::universal_time();
+			for(size_t i=0; i<iterations; ++i)
+				bytes+=benchmark();
+			seconds=(microsec_clock::universal_time()-start).total_microseconds()/1e6;
+			if(seconds>=minimum)
+				break;
+			iterations*=2;
+		}
+
+		std::cout << std::left << std::setw(28) << name << std::right
+			<< std::fixed << std::setprecision(1)
+			<< std::setw(12) << seconds/iterations*1e9 << " ns/op"
+			<< std::setw(10) << bytes/1048576.0/seconds << " MB/s";
+		if(!bytes)
+			std::cout << "  BROKEN";
+		std::cout << std::endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const double minimum=(argc>1?std::atoi(argv[1]):500)/1000.0;
+	std::srand(1);
+	buildPayloads();
+
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+	{
+		std::cerr << "socketpair() failed" << std::endl;
+		return 1;
+	}
+	sinkFd=open("/dev/null", O_WRONLY);
+	sinkId=Fastcgipp::Protocol::FullId(1, sinkFd);
+	transceiver=new Fastcgipp::Transceiver(pair[0], discard);
+
+	measure("processParamHeader", processParamHeader, minimum);
+	measure("Environment::fill", environmentFill<false>, minimum);
+	measure("Environment::fill lazy", environmentFill<true>, minimum);
+	measure("decodeUrlEncoded", decodeUrlEncoded, minimum);
+	measure("percentEscapedToRealBytes", percentEscapedToRealBytes, minimum);
+	measure("parsePostsMultipart", parsePostsMultipart, minimum);
+	measure("base64Encode", base64Encode, minimum);
+	measure("base64Decode", base64Decode, minimum);
+	measure("charToString<wchar_t>", charToString, minimum);
+	measure("utf8_codecvt_facet::in", facetIn, minimum);
+	measure("wideToUtf8", wideToUtf8, minimum);
+	measure("utf8_codecvt_facet::out", facetOut, minimum);
+	measure("Fcgistream<char>", fcgistreamNone, minimum);
+	measure("Fcgistream<char> HTML", fcgistreamHtml, minimum);
+	measure("Fcgistream<wchar_t>", fcgistreamWide, minimum);
+	measure("FcgistreamSink::write", sinkWrite, minimum);
+
+	delete transceiver;
+	return 0;
+}
@@ -0,0 +1,169 @@
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <deque>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <asql/data.hpp>
+
+// Compares binding result rows through Data::Layout offsets, as ASql::MySQL
+// statements now do, against calling getSqlIndex() for every member of every
+// row. Rows come from the containers the way they do in a multi-row fetch so it
+// also checks they really get bound by offset. Run it with an optional amount
+// of rows in thousands.
+
+struct Log
+{
+	ASql::Data::Uint id;
+	ASql::Data::Datetime timestamp;
+	ASql::Data::TextN referral;
+	ASql::Data::Int status;
+	ASql::Data::DoubleN duration;
+	ASql::Data::Text path;
+	ASQL_BUILDSET((id)(timestamp)(referral)(status)(duration)(path))
+};
+
+// Stands in for MYSQL_BIND
+struct Binding
+{
+	void* buffer;
+	bool* isNull;
+};
+
+// What binding a row used to take
+bool indexBind(ASql::Data::Set& set, const ASql::Data::Layout&, std::vector<Binding>& bindings)
+{
+	for(size_t i=0; i<bindings.size(); ++i)
+	{
+		ASql::Data::Index element=set.getSqlIndex(i);
+		if(element.type>=ASql::Data::U_TINY_N)
+		{
+			bindings[i].isNull=&static_cast<ASql::Data::NullablePar*>(element.data)->nullness;
+			element.data=static_cast<ASql::Data::NullablePar*>(element.data)->getVoid();
+		}
+		bindings[i].buffer=element.data;
+	}
+	return true;
+}
+
+// What it takes now. Returns false if the row couldn't be bound by offset.
+bool layoutBind(ASql::Data::Set& set, const ASql::Data::Layout& layout, std::vector<Binding>& bindings)
+{
+	char* const base=layout.base(set);
+	if(!base)
+	{
+		indexBind(set, layout, bindings);
+		return false;
+	}
+	for(size_t i=0; i<bindings.size(); ++i)
+	{
+		if(layout.nullness[i]!=-1)
+			bindings[i].isNull=(bool*)(base+layout.nullness[i]);
+		bindings[i].buffer=base+layout.data[i];
+	}
+	return true;
+}
+
+// Keeps the compiler from throwing the bindings away
+size_t checksum;
+
+template<class Container, class Bind> double run(Bind bind, const ASql::Data::Layout& layout, size_t rows)
+{
+	using namespace boost::posix_time;
+
+	Container container;
+	ASql::Data::SetContainer& results=container;
+	std::vector<Binding> bindings(layout.data.size());
+
+	const ptime start=microsec_clock::universal_time();
+	for(size_t i=0; i<rows; ++i)
+	{
+		bind(results.manufacture(), layout, bindings);
+		for(size_t j=0; j<bindings.size(); ++j)
+			checksum+=size_t(bindings[j].buffer)+size_t(bindings[j].isNull);
+	}
+	const double seconds=(microsec_clock::universal_time()-start).total_microseconds()/1e6;
+	return rows/1e6/seconds;
+}
+
+// Binds the same rows both ways and makes sure every row got an offset binding
+// that points where getSqlIndex() says it should.
+template<class Container> void verify(const ASql::Data::Layout& layout, bool& offset, bool& mismatch)
+{
+	Container container;
+	ASql::Data::SetContainer& results=container;
+	std::vector<Binding> expected(layout.data.size());
+	std::vector<Binding> actual(layout.data.size());
+	offset=true;
+	mismatch=false;
+
+	for(size_t i=0; i<1000; ++i)
+	{
+		ASql::Data::Set& row=results.manufacture();
+		for(size_t j=0; j<expected.size(); ++j)
+			expected[j].isNull=actual[j].isNull=0;
+		indexBind(row, layout, expected);
+		if(!layoutBind(row, layout, actual))
+			offset=false;
+		for(size_t j=0; j<expected.size(); ++j)
+			if(expected[j].buffer!=actual[j].buffer || expected[j].isNull!=actual[j].isNull)
+				mismatch=true;
+	}
+}
+
+template<class Container> void compare(const char* name, const ASql::Data::Layout& layout, size_t rows)
+{
+	bool offset;
+	bool mismatch;
+	verify<Container>(layout, offset, mismatch);
+	const double indexRate=run<Container>(indexBind, layout, rows);
+	const double layoutRate=run<Container>(layoutBind, layout, rows);
+
+	std::cout << std::setw(22) << name
+		<< std::fixed << std::setprecision(1)
+		<< "  getSqlIndex " << std::setw(7) << indexRate << " Mrows/s"
+		<< "  layout " << std::setw(7) << layoutRate << " Mrows/s"
+		<< "  x" << std::setprecision(2) << layoutRate/indexRate;
+	if(mismatch)
+		std::cout << "  MISMATCH";
+	if(!offset)
+		std::cout << "  NOT BOUND BY OFFSET";
+	std::cout << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	const size_t rows=(argc>1?std::atoi(argv[1]):1000)*1000;
+
+	// Built from the template object a statement is initialised with
+	const ASql::Data::SetBuilder<Log> templateSet;
+	ASql::Data::Layout layout;
+	layout.build(templateSet);
+
+	compare<ASql::Data::STLSetContainer<std::vector<Log> > >("STLSetContainer", layout, rows);
+	compare<ASql::Data::STLSetContainer<std::deque<Log> > >("STLSetContainer<deque>", layout, rows);
+	compare<ASql::Data::BlockSetContainer<Log> >("BlockSetContainer", layout, rows);
+	return 0;
+}
@@ -0,0 +1,338 @@
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <fastcgi++/request.hpp>
+#include <fastcgi++/manager.hpp>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// A FastCGI client playing the web server. It opens a number of connections and
+// sends requests over each of them one after the other, as a web server with a
+// pool of keep-alive connections does, then reports the requests answered per
+// second and the latency percentiles. Unless it's given the path of a unix
+// socket to connect to it serves the requests itself with a Manager in the same
+// process.
+//
+// load.bench [connections [requests per connection [workers [socket]]]]
+
+namespace
+{
+	// What the requests are answered with when served in process
+	class Responder: public Fastcgipp::Request<char>
+	{
+		bool response()
+		{
+			using namespace Fastcgipp::Http;
+			out << "Content-Type: text/plain; charset=ISO-8859-1\r\n\r\n";
+			if(environment().requestMethod==HTTP_METHOD_POST)
+			{
+				size_t size=0;
+				for(Environment<char>::Posts::const_iterator it=environment().posts.begin(); it!=environment().posts.end(); ++it)
+					size+=it->second.type==Post<char>::file?it->second.size():it->second.value.size();
+				out << environment().posts.size() << " posts of " << size << " bytes\n";
+			}
+			else
+			{
+				out << "Host: " << environment().host << '\n'
+					<< "User Agent: " << environment().userAgent << '\n'
+					<< "Request URI: " << environment().requestUri << '\n';
+				for(Environment<char>::Gets::const_iterator it=environment().gets.begin(); it!=environment().gets.end(); ++it)
+					out << it->first << ": " << it->second << '\n';
+			}
+			return true;
+		}
+	};
+
+	void appendRecord(std::string& message, Fastcgipp::Protocol::RecordType type, const char* content, size_t size)
+	{
+		Fastcgipp::Protocol::Header header=Fastcgipp::Protocol::Header();
+		header.setVersion(Fastcgipp::Protocol::version);
+		header.setType(type);
+		header.setRequestId(1);
+		header.setContentLength(size);
+		header.setPaddingLength(0);
+		message.append((const char*)&header, sizeof(header));
+		message.append(content, size);
+	}
+
+	void appendLength(std::string& record, size_t length)
+	{
+		if(length<128)
+			record.push_back(char(length));
+		else
+		{
+			record.push_back(char((length>>24)|0x80));
+			record.push_back(char(length>>16));
+			record.push_back(char(length>>8));
+			record.push_back(char(length));
+		}
+	}
+
+	void appendParam(std::string& record, const std::string& name, const std::string& value)
+	{
+		appendLength(record, name.size());
+		appendLength(record, value.size());
+		record.append(name);
+		record.append(value);
+	}
+
+	// Everything sent for a single request
+	std::string buildMessage(const char* const params[][2], size_t count, const std::string& body)
+	{
+		std::string message;
+
+		// Role RESPONDER and the connection is kept open
+		const char beginRequest[8]={ 0, Fastcgipp::Protocol::RESPONDER, 1, 0, 0, 0, 0, 0 };
+		appendRecord(message, Fastcgipp::Protocol::BEGIN_REQUEST, beginRequest, sizeof(beginRequest));
+
+		std::string record;
+		for(size_t i=0; i<count; ++i)
+			appendParam(record, params[i][0], params[i][1]);
+		appendRecord(message, Fastcgipp::Protocol::PARAMS, record.data(), record.size());
+		appendRecord(message, Fastcgipp::Protocol::PARAMS, 0, 0);
+
+		const size_t maxRecord=65535;
+		for(size_t i=0; i<body.size(); i+=maxRecord)
+			appendRecord(message, Fastcgipp::Protocol::IN, body.data()+i, std::min(maxRecord, body.size()-i));
+		appendRecord(message, Fastcgipp::Protocol::IN, 0, 0);
+		return message;
+	}
+
+	std::string echoMessage()
+	{
+		const char* const params[][2]=
+		{
+			{ "GATEWAY_INTERFACE", "CGI/1.1" },
+			{ "SERVER_PROTOCOL", "HTTP/1.1" },
+			{ "SERVER_NAME", "www.example.com" },
+			{ "SERVER_ADDR", "192.168.1.10" },
+			{ "SERVER_PORT", "443" },
+			{ "REMOTE_ADDR", "203.0.113.54" },
+			{ "REMOTE_PORT", "51874" },
+			{ "SCRIPT_NAME", "/app/echo.fcgi" },
+			{ "HTTP_HOST", "www.example.com" },
+			{ "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64; rv:124.0) Gecko/20100101 Firefox/124.0" },
+			{ "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" },
+			{ "HTTP_ACCEPT_LANGUAGE", "en-CA,en-US;q=0.7,en;q=0.3" },
+			{ "HTTP_COOKIE", "session=Zm9vYmFyYmF6cXV4; theme=dark" },
+			{ "REQUEST_METHOD", "GET" },
+			{ "REQUEST_URI", "/app/echo.fcgi?page=3&sort=date&q=fastcgi%20c%2B%2B" },
+			{ "QUERY_STRING", "page=3&sort=date&q=fastcgi%20c%2B%2B" }
+		};
+		return buildMessage(params, sizeof(params)/sizeof(params[0]), std::string());
+	}
+
+	std::string uploadMessage()
+	{
+		const std::string boundary("----WebKitFormBoundary7MA4YWxkTrZu0gW");
+		std::string body;
+		body.append("--"+boundary+"\r\nContent-Disposition: form-data; name=\"title\"\r\n\r\nHolidays 2024\r\n");
+		body.append("--"+boundary+"\r\nContent-Disposition: form-data; name=\"photo\"; filename=\"beach.jpg\"\r\nContent-Type: image/jpeg\r\n\r\n");
+		for(size_t i=0; i<65536; ++i)
+			body.push_back(char(std::rand()));
+		body.append("\r\n--"+boundary+"--\r\n");
+
+		char length[16];
+		std::sprintf(length, "%u", (unsigned int)body.size());
+		const std::string contentType("multipart/form-data; boundary="+boundary);
+		const char* const params[][2]=
+		{
+			{ "GATEWAY_INTERFACE", "CGI/1.1" },
+			{ "SERVER_PROTOCOL", "HTTP/1.1" },
+			{ "SERVER_NAME", "www.example.com" },
+			{ "REMOTE_ADDR", "203.0.113.54" },
+			{ "SCRIPT_NAME", "/app/upload.fcgi" },
+			{ "HTTP_HOST", "www.example.com" },
+			{ "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64; rv:124.0) Gecko/20100101 Firefox/124.0" },
+			{ "REQUEST_METHOD", "POST" },
+			{ "REQUEST_URI", "/app/upload.fcgi" },
+			{ "CONTENT_TYPE", contentType.c_str() },
+			{ "CONTENT_LENGTH", length }
+		};
+		return buildMessage(params, sizeof(params)/sizeof(params[0]), body);
+	}
+
+	int connectTo(const std::string& path)
+	{
+		const int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un address=sockaddr_un();
+		address.sun_family=AF_UNIX;
+		std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path)-1);
+		if(fd<0 || connect(fd, (const sockaddr*)&address, sizeof(address)))
+		{
+			std::perror("connect()");
+			std::exit(1);
+		}
+		return fd;
+	}
+
+	// Read records until the END_REQUEST one. False if the connection closed.
+	bool receive(int fd, std::vector<char>& buffer)
+	{
+		size_t filled=0;
+		while(true)
+		{
+			size_t position=0;
+			while(filled-position>=sizeof(Fastcgipp::Protocol::Header))
+			{
+				const Fastcgipp::Protocol::Header& header=*(const Fastcgipp::Protocol::Header*)&buffer[position];
+				const size_t size=sizeof(header)+header.getContentLength()+header.getPaddingLength();
+				if(filled-position<size)
+					break;
+				if(header.getType()==Fastcgipp::Protocol::END_REQUEST)
+					return true;
+				position+=size;
+			}
+
+			std::memmove(&buffer[0], &buffer[position], filled-position);
+			filled-=position;
+			if(filled==buffer.size())
+				buffer.resize(buffer.size()*2);
+
+			const ssize_t received=recv(fd, &buffer[filled], buffer.size()-filled, 0);
+			if(received<=0)
+				return false;
+			filled+=received;
+		}
+	}
+
+	// Send requests one after the other over a connection recording the latency of each in microseconds
+	void client(const std::string& path, const std::string& message, size_t requests, std::vector<uint32_t>& latencies)
+	{
+		using namespace boost::posix_time;
+
+		const int fd=connectTo(path);
+		std::vector<char> buffer(65536);
+		latencies.reserve(requests);
+		for(size_t i=0; i<requests; ++i)
+		{
+			const ptime start=microsec_clock::universal_time();
+			for(size_t sent=0; sent<message.size();)
+			{
+				const ssize_t result=send(fd, message.data()+sent, message.size()-sent, MSG_NOSIGNAL);
+				if(result<=0)
+				{
+					std::perror("send()");
+					std::exit(1);
+				}
+				sent+=result;
+			}
+			if(!receive(fd, buffer))
+			{
+				std::cerr << "The connection was closed" << std::endl;
+				std::exit(1);
+			}
+			latencies.push_back((microsec_clock::universal_time()-start).total_microseconds());
+		}
+		close(fd);
+	}
+
+	void run(const char* name, const std::string& path, const std::string& message, size_t connections, size_t requests)
+	{
+		using namespace boost::posix_time;
+
+		std::vector<std::vector<uint32_t> > latencies(connections);
+		const ptime start=microsec_clock::universal_time();
+		boost::thread_group clients;
+		for(size_t i=0; i<connections; ++i)
+			clients.create_thread(boost::bind(client, boost::cref(path), boost::cref(message), requests, boost::ref(latencies[i])));
+		clients.join_all();
+		const double seconds=(microsec_clock::universal_time()-start).total_microseconds()/1e6;
+
+		std::vector<uint32_t> all;
+		for(size_t i=0; i<connections; ++i)
+			all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+		std::sort(all.begin(), all.end());
+
+		const double quantiles[]={ 0.5, 0.9, 0.99, 0.999 };
+		const char* const labels[]={ "p50", "p90", "p99", "p99.9" };
+		std::cout << std::left << std::setw(8) << name << std::right
+			<< std::fixed << std::setprecision(0)
+			<< std::setw(10) << all.size()/seconds << " req/s"
+			<< std::setprecision(1) << std::setw(8) << all.size()*message.size()/1048576.0/seconds << " MB/s in";
+		for(size_t i=0; i<sizeof(quantiles)/sizeof(quantiles[0]); ++i)
+			std::cout << "  " << labels[i] << ' ' << all[std::min(all.size()-1, size_t(all.size()*quantiles[i]))] << "us";
+		std::cout << "  max " << all.back() << "us" << std::endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const size_t connections=argc>1?std::atoi(argv[1]):16;
+	const size_t requests=argc>2?std::atoi(argv[2]):2000;
+	const unsigned int workers=argc>3?std::atoi(argv[3]):0;
+	std::string path(argc>4?argv[4]:"");
+	std::srand(1);
+
+	Fastcgipp::Manager<Responder>* manager=0;
+	boost::thread* server=0;
+	if(path.empty())
+	{
+		char name[64];
+		std::sprintf(name, "/tmp/fastcgipp-load-%d", (int)getpid());
+		path=name;
+
+		const int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un address=sockaddr_un();
+		address.sun_family=AF_UNIX;
+		std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path)-1);
+		unlink(path.c_str());
+		if(fd<0 || bind(fd, (const sockaddr*)&address, sizeof(address)) || listen(fd, SOMAXCONN))
+		{
+			std::perror("listen()");
+			return 1;
+		}
+
+		manager=new Fastcgipp::Manager<Responder>(fd, false, workers);
+		server=new boost::thread(boost::bind(&Fastcgipp::Manager<Responder>::handler, manager));
+	}
+
+	std::cout << connections << " connections, " << requests << " requests each";
+	if(manager)
+		std::cout << ", served in process with " << workers << " workers";
+	std::cout << std::endl;
+
+	run("echo", path, echoMessage(), connections, requests);
+	run("upload", path, uploadMessage(), connections, requests/10?requests/10:1);
+
+	if(manager)
+	{
+		manager->stop();
+		server->join();
+		delete server;
+		delete manager;
+		unlink(path.c_str());
+	}
+	return 0;
+}
@@ -57,7 +57,7 @@ Fastcgipp::Transceiver's transmit half implements a cyclic buffer that can grow
 
 \section dep Dependencies
 
-	\li Boost C++ Libraries >1.35.0
+	\li Boost C++ Libraries >1.53.0
 	\li Posix compliant OS (socket stuff)
 
 \section installation Installation
@@ -89,7 +89,7 @@ This is a collection of tutorials that should cover most aspects of the fastcgi+
 
 \subpage showGnu : A tutorial explaining how to display images and non-html data as well as setting locales
 
-\subpage timer : A tutorial covering the use of the task manager and threads to have requests efficiently communicate with non-fastcgi++ data.
+\subpage timer : A tutorial covering the use of the task manager and it's timers to have requests efficiently wait on things without tying up a thread.
 
 \subpage sessions : An example of how to utilize the internal mechanism in fastcgi++ to handle HTTP sessions.
 
@@ -103,9 +103,9 @@ This is a collection of tutorials that should cover most aspects of the fastcgi+
 
 \section timerTutorial Tutorial
 
-Our goal here will be to make a FastCGI application that responds to clients with some text, waits five seconds and then sends more. We're going to use threading and boost::asio to handle our timer. Your going to need the boost C++ libraries for this. At least version 1.35.0.
+Our goal here will be to make a FastCGI application that responds to clients with some text, waits five seconds and then sends more. We're going to use the timers built into the manager for this so no extra threads are needed.
 
-All code and data is located in the examples directory of the tarball. You'll have to compile with: `pkg-config --libs --cflags fastcgi++` -lboost_system
+All code and data is located in the examples directory of the tarball. You'll have to compile with: `pkg-config --libs --cflags fastcgi++`
 
 \subsection timerError Error Logging
 
@@ -132,29 +132,22 @@ void error_log(const char* msg)
 
 \subsection timerRequest Request Handler
 
-Now we need to write the code that actually handles the request. In this examples we still need to derive from Fastcgipp::Request and define the Fastcgipp::Request::response() function, but also some more. We're also going to need some member data to keep track of our requests execution state, a default constructor to initialize it and a global boost::asio::io_service object. In this example let's just use plain old ISO-8859-1 and pass char as the template parameter.
+Now we need to write the code that actually handles the request. In this examples we still need to derive from Fastcgipp::Request and define the Fastcgipp::Request::response() function, but also some more. We're also going to need some member data to keep track of our requests execution state and a default constructor to initialize it. In this example let's just use plain old ISO-8859-1 and pass char as the template parameter.
 
 \code
 #include <fastcgi++/request.hpp>
 
 #include <cstring>
-#include <boost/asio.hpp>
-#include <boost/bind.hpp>
-#include <boost/thread.hpp>
-#include <boost/scoped_ptr.hpp>
-
-boost::asio::io_service io;
 
 class Timer: public Fastcgipp::Request<char>
 {
 private:
 \endcode
 
-We'll start with our data to keep track of the execution state and a pointer for our timer object.
+We'll start with our data to keep track of the execution state.
 
 \code
 	enum State { START, FINISH } state;
-	boost::scoped_ptr<boost::asio::deadline_timer> t;
 \endcode
 
 Now we can define our response function. It is this function that is called to generate a response for the client. We'll start it off with a switch statement that tests our execution state. It isn't a good idea to define the response() function inline as it is called from numerous spots, but for the examples readability we will make an exception.
@@ -193,32 +186,26 @@ If we want to the client to see everything that we just outputted now instead of
 				out.flush();
 \endcode
 
-Now let's make a five second timer.
-
-\code
-				t.reset(new boost::asio::deadline_timer(io, boost::posix_time::seconds(5)));
-\endcode
+Now we work with Fastcgipp::Request::setTimer(). It takes a Fastcgipp::Message and passes it on to this request once the time is up thereby having Fastcgipp::Request::response() called again, just like a message passed through Fastcgipp::Request::callback() from another thread would. The timer is run by the thread calling Fastcgipp::Manager::handler() which sleeps no longer than until it is due.
 
-Now we work with our Fastcgipp::Request::callback(). It is a boost::function that takes a Fastcgipp::Message as a single argument. This callback function will pass the message on to this request thereby having Fastcgipp::Request::response() called function again. The callback function is thread safe. That means you can pass messages back to requests from other threads.
-
-First we'll build the message we want sent back here. Normally the message would be built by whatever is calling the callback, but this is just a simple example. A type of 0 means a FastCGI record and is used internally. All other values we can use ourselves to define different message types (sql queries, file grabs, etc...). In this example we will use type=1 for timer stuff.
+First we'll build the message we want sent back here. A type of 0 means a FastCGI record and is used internally as are negative values. All positive values we can use ourselves to define different message types (sql queries, file grabs, etc...). In this example we will use type=1 for timer stuff.
 
 \code
 				Fastcgipp::Message msg;
 				msg.type=1;
 
 				{
-					char cString[] = "I was passed between two threads!!";
+					char cString[] = "I was passed along by a timer!!";
 					msg.size=sizeof(cString);
 					msg.data.reset(new char[sizeof(cString)]);
 					std::strncpy(msg.data.get(), cString, sizeof(cString));
 				}
 \endcode
 
-Now we can give our callback function to our timer.
+Now let's make a five second timer. Should the request go away before it's due, the timer is cancelled.
 
 \code
-				t->async_wait(boost::bind(callback(), msg));
+				setTimer(5000, msg);
 \endcode
 
 We need to set our state to FINISH so that when this response is called a second time, we don't repeat this.
@@ -268,7 +255,7 @@ public:
 
 \subsection timerManager Requests Manager
 
-Now we need to make our main() function. In addition to creating a Fastcgipp::Manager object with the new class we made as a template parameter and calling it's handler, we also need to set up our threads and io stuff. This isn't a boost::asio tutorial, check the boost documentation for clarification on it.
+Now we need to make our main() function. All it does is create a Fastcgipp::Manager object with the new class we made as a template parameter and call it's handler.
 
 \code
 #include <fastcgi++/manager.hpp>
@@ -276,8 +263,6 @@ int main()
 {
 	try
 	{
-		boost::asio::io_service::work w(io);
-		boost::thread t(boost::bind(&boost::asio::io_service::run, &io));
 		Fastcgipp::Manager<Timer> fcgi;
 		fcgi.handler();
 	}
@@ -295,11 +280,6 @@ int main()
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <cstring>
-#include <boost/asio.hpp>
-#include <boost/bind.hpp>
-#include <boost/thread.hpp>
-#include <boost/scoped_ptr.hpp>
-boost::asio::io_service io;
 
 #include <fastcgi++/request.hpp>
 #include <fastcgi++/manager.hpp>
@@ -323,8 +303,6 @@ class Timer: public Fastcgipp::Request<char>
 private:
 	enum State { START, FINISH } state;
 
-	boost::scoped_ptr<boost::asio::deadline_timer> t;
-
 	bool response()
 	{
 		switch(state)
@@ -340,19 +318,17 @@ private:
 
 				out.flush();
 
-				t.reset(new boost::asio::deadline_timer(io, boost::posix_time::seconds(5)));
-
 				Fastcgipp::Message msg;
 				msg.type=1;
 
 				{
-					char cString[] = "I was passed between two threads!!";
+					char cString[] = "I was passed along by a timer!!";
 					msg.size=sizeof(cString);
 					msg.data.reset(new char[sizeof(cString)]);
 					std::strncpy(msg.data.get(), cString, sizeof(cString));
 				}
 
-				t->async_wait(boost::bind(callback(), msg));
+				setTimer(5000, msg);
 
 				state=FINISH;
 
@@ -376,9 +352,6 @@ int main()
 {
 	try
 	{
-		boost::asio::io_service::work w(io);
-		boost::thread t(boost::bind(&boost::asio::io_service::run, &io));
-
 		Fastcgipp::Manager<Timer> fcgi;
 		fcgi.handler();
 	}
@@ -433,6 +406,7 @@ Now we need to write the code that actually handles the request. Quite simply, a
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 class ShowGnu: public Fastcgipp::Request<char>
@@ -489,10 +463,10 @@ If the modification time of the file is older or equal to the if-modified-since
 		}
 \endcode
 
-We're going to use std::fstream to read the file data.
+We're going to use the POSIX open() function (man 2 open) to open the file.
 
 \code
-		ifstream image("gnu.png");
+		int image=open("gnu.png", O_RDONLY);
 \endcode
 
 Now we transmit our HTTP header containing the modification data, file size and etag value.
@@ -504,10 +478,11 @@ Now we transmit our HTTP header containing the modification data, file size and
 		out << "Content-Type: image/png\r\n\r\n";
 \endcode
 
-Now that the header is sent, we can transmit the actual image. To send raw binary data to the client, the streams have a dump function that bypasses the stream buffer and it's code conversion. The function is overloaded to either Fastcgipp::Fcgistream::dump(std::basic_istream<char>& stream) or Fastcgipp::Fcgistream::dump(char* data, size_t size). Remember that if we are using wide characters internally, the stream converts anything sent into the stream to UTF-8 before transmitting to the client. If we want to send binary data, we definitely don't want any code conversion so that is why this function exists.
+Now that the header is sent, we can transmit the actual image. To send raw binary data to the client, the streams have a dump function that bypasses the stream buffer and it's code conversion. The function is overloaded to either Fastcgipp::Fcgistream::dump(int fd, off_t offset, size_t size), Fastcgipp::Fcgistream::dump(std::basic_istream<char>& stream) or Fastcgipp::Fcgistream::dump(char* data, size_t size). Dumping from a file descriptor is the fastest since the file data is sent by the kernel without ever being copied into the stream. The stream keeps its own copy of the file descriptor so we can close ours right away. Remember that if we are using wide characters internally, the stream converts anything sent into the stream to UTF-8 before transmitting to the client. If we want to send binary data, we definitely don't want any code conversion so that is why this function exists.
 
 \code
-		out.dump(image);
+		out.dump(image, 0, fileSize);
+		close(image);
 \endcode
 
 And we're basically done defining our response! All we need to do is return a boolean value. Always return true if you are done. This will let apache and the manager know we are done so they can destroy the request and free it's resources. Return false if you are not finished but want to relinquish control and allow other requests to operate. You would do this if the request needed to wait for a message to be passed back to it through the task manager.
@@ -546,6 +521,7 @@ int main()
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <fastcgi++/request.hpp>
@@ -593,14 +569,15 @@ class ShowGnu: public Fastcgipp::Request<char>
 			return true;
 		}
 
-		std::ifstream image("gnu.png");
+		int image=open("gnu.png", O_RDONLY);
 
 		out << "Last-Modified: " << modTime << '\n';
 		out << "Etag: " << etag << '\n';
 		out << "Content-Length: " << fileSize << '\n';
 		out << "Content-Type: image/png\r\n\r\n";
 
-		out.dump(image);
+		out.dump(image, 0, fileSize);
+		close(image);
 		return true;
 	}
 };
@@ -1689,7 +1666,7 @@ const char Database::selectStatementString[] = "SELECT SQL_CALC_FOUND_ROWS ipAdd
 sessionId, referral FROM logs ORDER BY timeStamp DESC LIMIT 10";
 \endcode
 
-The next line initializes the database connection and decides how many concurrent SQL queries can be operating. Keep in mind that this doesn't dictate how many queries can be queued up, but more how many queues there are. When you queue up a query to be executed it always puts it in the smallest queue.
+The next line initializes the database connection and decides how many concurrent SQL queries can be operating. Keep in mind that this doesn't dictate how many queries can be queued up, but more how many queues there are. When you queue up a query to be executed it puts it in the smallest queue, and should that thread still be busy when another runs out of work it is picked up by the idle one. Transactions always stay together on one connection. Should you rather have the amount of connections follow the load, ASql::ConnectionPar::setPool() keeps only a minimum of them open, adds more while all are busy and closes them again once they have been idle for a while. Lost connections are reopened either way.
 
 \code
 ASql::MySQL::Connection Database::sqlConnection(4);
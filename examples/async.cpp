@@ -0,0 +1,102 @@
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#include <fstream>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <fastcgi++/async.hpp>
+#include <fastcgi++/manager.hpp>
+
+// This example does the same as the timer example but without a state machine. Our response is
+// written as straight line code that goes to sleep in the middle while the manager gets on with
+// other requests. Unfortunately because fastcgi buffers the output before sending it to the client
+// by default, we will only get to see the true effects if you put the following directive in your
+// apache configuration: FastCgiConfig -flush
+
+// I like to have an independent error log file to keep track of exceptions while debugging.
+// You might want a different filename. I just picked this because everything has access there.
+void error_log(const char* msg)
+{
+	using namespace std;
+	using namespace boost;
+	static ofstream error;
+	if(!error.is_open())
+	{
+		error.open("/tmp/errlog", ios_base::out | ios_base::app);
+		error.imbue(locale(error.getloc(), new posix_time::time_facet()));
+	}
+
+	error << '[' << posix_time::second_clock::local_time() << "] " << msg << endl;
+}
+
+// Let's make our request handling class. It must do the following:
+// 1) Be derived from Fastcgipp::AsyncRequest
+// 2) Define the virtual handle() member function from Fastcgipp::AsyncRequest()
+
+// Let's just use good old ISO-8859-1 this time. No wide characters
+
+class Countdown: public Fastcgipp::AsyncRequest<char>
+{
+	void handle()
+	{
+		out << "Content-Type: text/html; charset=ISO-8859-1\r\n\r\n";
+		out << "<html><head><meta http-equiv='Content-Type' content='text/html; charset=ISO-8859-1' />";
+		out << "<title>fastcgi++: Asynchronous Countdown</title></head><body>";
+
+		// Local variables survive the waits just fine since handle() has a stack of it's own
+		for(int i=3; i>0; --i)
+		{
+			out << i << "...<br />";
+			// Let's flush the buffer so the client sees the count as it happens
+			out.flush();
+
+			// Here is where handle() is suspended for a second. No thread is blocked meanwhile,
+			// the one executing it gets on with other requests until the timer is due.
+			sleep(1000);
+		}
+
+		// Messages passed to the request through callback() are waited on with await(). We'll pass
+		// ourselves one just to show how it works. Normally it would come from another thread,
+		// or be given as the callback of an ASql query through resumer().
+		callback()(Fastcgipp::Message(1));
+		const Fastcgipp::Message& reply=await();
+		out << "Liftoff! Our message had type " << reply.type;
+		out << "</body></html>";
+
+		// Returning from handle() completes the request
+	}
+};
+
+// The main function is easy to set up
+int main()
+{
+	try
+	{
+		// Now we make a Fastcgipp::Manager object, with our request handling class
+		// as a template parameter.
+		Fastcgipp::Manager<Countdown> fcgi;
+		// Now just call the object handler function. It will sleep quietly when there
+		// are no requests and efficiently manage them when there are many.
+		fcgi.handler();
+	}
+	catch(std::exception& e)
+	{
+		error_log(e.what());
+	}
+}
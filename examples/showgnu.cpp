@@ -23,6 +23,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <fastcgi++/request.hpp>
@@ -92,8 +93,8 @@ class ShowGnu: public Fastcgipp::Request<char>
 			return true;
 		}
 
-		// Setup an fstream for our file.
-		std::ifstream image("gnu.png");
+		// Open our file.
+		int image=open("gnu.png", O_RDONLY);
 
 		// Now we transmit our HTTP header to the client
 		// First we send the modification time of the file
@@ -110,14 +111,20 @@ class ShowGnu: public Fastcgipp::Request<char>
 		// To send raw binary data to the client, the streams have a
 		// dump function that bypasses the streambuffer and it's code
 		// conversion. The function is overloaded to either:
+		// out.dump(int fd, off_t offset, size_t size);
 		// out.dump(basic_istream<char>& stream); or
 		// out.dump(char* data, size_t size);
 		//
+		// Dumping from a file descriptor is the fastest of these since the image
+		// is sent by the kernel straight from the file. The stream keeps its
+		// own copy of the file descriptor so we can close ours right away.
+		//
 		// Remember that if we are using wide characters internally, the stream
 		// converts anything sent into the stream to UTF-8 before transmitting
 		// to the client. If we want to send binary data, we definitely don't want
 		// any code conversion so that is why this function exists.
-		out.dump(image);
+		out.dump(image, 0, fileSize);
+		close(image);
 		
 		// Always return true if you are done. This will let apache know we are done
 		// and the manager will destroy the request and free it's resources.
@@ -24,16 +24,11 @@
 #include <fastcgi++/request.hpp>
 #include <fastcgi++/manager.hpp>
 
-// In this example we are going to use boost::asio to handle our timers and callback.
+// In this example we are going to use the timers built into the manager for our callback.
 // Unfortunately because fastcgi buffers the output before sending it to the client by
 // default, we will only get to see the true effects of the timer if you put the following
 // directive in your apache configuration: FastCgiConfig -flush
 #include <cstring>
-#include <boost/asio.hpp>
-#include <boost/bind.hpp>
-#include <boost/thread.hpp>
-#include <boost/scoped_ptr.hpp>
-boost::asio::io_service io;
 
 // I like to have an independent error log file to keep track of exceptions while debugging.
 // You might want a different filename. I just picked this because everything has access there.
@@ -66,8 +61,6 @@ private:
 	// We need to define a state variable so we know where we are when response() is called a second time.
 	enum State { START, FINISH } state;
 
-	boost::scoped_ptr<boost::asio::deadline_timer> t;
-
 	bool response()
 	{
 		switch(state)
@@ -88,32 +81,28 @@ private:
 				// Let's flush the buffer just to get it out there.
 				out.flush();
 
-				// Make a five second timer
-				t.reset(new boost::asio::deadline_timer(io, boost::posix_time::seconds(5)));
-
-				// Now we work with our callback. Defined in the Fastcgipp::Request is a boost::function
-				// that takes a Fastcgipp::Message (defined in fastcgi++/protocol.hpp) as a single argument.
-				// This callback function will pass the message on to this request therebye calling the response()
-				// function again. The callback function is thread safe. That means you can pass messages back to
-				// requests from other threads.
+				// Now we work with a timer. Fastcgipp::Request::setTimer() takes a Fastcgipp::Message (defined in
+				// fastcgi++/message.hpp) and passes it to this request once the time is up, thereby calling the
+				// response() function again. No extra threads are needed; the timer is run by the thread calling
+				// the manager's handler() which sleeps no longer than until it is due.
 
 				// Let's build the message we want sent back to here.
 				Fastcgipp::Message msg;
 				// The first part of the message we have to define is the type. A type of 0 means a fastcgi message
-				// and is used internally. All other values we can use ourselves to define different message types (sql queries,
-				// file grabs, etc...). We will use type=1 for timer stuff.
+				// and is used internally as are negative values. All positive values we can use ourselves to define
+				// different message types (sql queries, file grabs, etc...). We will use type=1 for timer stuff.
 				msg.type=1;
 
 				// Now let's put a character string into the message as well. Just for fun.
 				{
-					char cString[] = "I was passed between two threads!!";
+					char cString[] = "I was passed along by a timer!!";
 					msg.size=sizeof(cString);
 					msg.data.reset(new char[sizeof(cString)]);
 					std::strncpy(msg.data.get(), cString, sizeof(cString));
 				}
 
-				// Now we will give our callback data to boost::asio
-				t->async_wait(boost::bind(callback(), msg));
+				// Make a five second timer. Should the request go away before it's due the timer is cancelled.
+				setTimer(5000, msg);
 
 				// We need to set our state to FINISH so that when this response is called a second time, we don't repeat this.
 				state=FINISH;
@@ -145,12 +134,6 @@ int main()
 {
 	try
 	{
-		// Let's first setup a thread for our timers. We assign a work object
-		// to it so that boost::asio::io_service::run does not return until
-		// the work object goes out of scope.
-		boost::asio::io_service::work w(io);
-		boost::thread t(boost::bind(&boost::asio::io_service::run, &io));
-
 		// Now we make a Fastcgipp::Manager object, with our request handling class
 		// as a template parameter.
 		Fastcgipp::Manager<Timer> fcgi;
@@ -22,9 +22,13 @@
 #define ASQL_HPP
 
 #include <vector>
-#include <queue>
+#include <deque>
+#include <algorithm>
 #include <cstring>
 
+#include <stdint.h>
+#include <time.h>
+
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/shared_array.hpp>
@@ -112,55 +116,200 @@ namespace ASql
 	class Connection
 	{
 	public:
-		//! Returns the number of threads
+		//! Returns the maximum number of threads
 		int threads() const { return maxThreads; }
 
 		//! Return true if the handler is running
 		bool running() const { return m_threads; }
 	protected:
 		/** 
-		 * @brief Number of threads to pool for simultaneous queries.
+		 * @brief Maximum number of threads to pool for simultaneous queries.
 		 */
 		const int maxThreads;
 		boost::mutex threadsMutex;
 		boost::condition_variable threadsChanged;
 		int m_threads;
 
+		//! Amount of threads that have ever started
+		unsigned int m_started;
+
 		virtual void commit(const unsigned int thread=0)=0;
 		virtual void rollback(const unsigned int thread=0)=0;
 
-		boost::scoped_array<boost::condition_variable> wakeUp;
+		/** 
+		 * @brief Make sure the connection of a thread is open.
+		 *
+		 * Called by a thread before every query or transaction it executes. Throws an Error should
+		 * the connection not open.
+		 *
+		 * @param[in] thread Thread the connection belongs to.
+		 * @param[in] check If true an already open connection should be checked and reopened if
+		 * it no longer works.
+		 */
+		virtual void open(const unsigned int thread, const bool check) {}
+
+		/** 
+		 * @brief Close the connection of a thread.
+		 */
+		virtual void close(const unsigned int thread) {}
+
+		/** 
+		 * @brief Return true if the error means the connection was lost.
+		 *
+		 * @param[in] error Error thrown while executing a query.
+		 * @param[out] retry Set to true if the query never reached the server and can safely be
+		 * executed again on a new connection.
+		 */
+		virtual bool lost(const Error& error, bool& retry) const { return false; }
 
-		boost::mutex terminateMutex;
 		bool terminateBool;
 
-		Connection(const int maxThreads_): maxThreads(maxThreads_), m_threads(0), wakeUp(new boost::condition_variable[maxThreads_]) {}
+		Connection(const int maxThreads_): maxThreads(maxThreads_), m_threads(0), m_started(0), terminateBool(true) {}
+		virtual ~Connection() {}
 	};
 
 	/** 
 	 * @brief Defines some functions and data types shared between ASql engines
+	 *
+	 * Every thread has it's own connection to the server and it's own queue of queries. A query is
+	 * queued on the thread with the least work but should that thread still be busy when another
+	 * one runs out of work, the idle thread steals it. Queries queued on a specific thread with an
+	 * instance number are never stolen and a transaction is always taken as a whole so all of it
+	 * runs through one connection.
+	 *
+	 * By default all threads are started by start() and run until terminate(). With setPool() the
+	 * amount of threads, and so connections, can follow the load instead. A thread is added when
+	 * a query is queued while all running ones are busy, and a thread that has been idle long
+	 * enough goes away again. Connections are opened by the thread that uses them, pinged after
+	 * having been idle for a while and reopened when they are lost.
 	 */
 	template<class T> class ConnectionPar: public Connection
 	{
+	public:
+		//! Scheduling statistics of a thread
+		struct ThreadStats
+		{
+			ThreadStats(): depth(0), executed(0), stolen(0), waitTime(0), runTime(0), busy(false), running(false), reconnects(0) {}
+			//! Amount of queries and transactions waiting in the thread's queue.
+			size_t depth;
+			//! Amount of queries and transactions executed by the thread.
+			uint64_t executed;
+			//! How many of the executed were stolen from the queues of other threads.
+			uint64_t stolen;
+			//! Total amount of microseconds the executed spent waiting in a queue.
+			uint64_t waitTime;
+			//! Total amount of microseconds spent executing.
+			uint64_t runTime;
+			//! True if the thread is currently executing.
+			bool busy;
+			//! True if the thread is running.
+			bool running;
+			//! Amount of times the thread lost it's connection.
+			uint64_t reconnects;
+		};
+
 	private:
 		struct QuerySet
 		{
-			QuerySet(QueryPar& query, T* const& statement, const bool commit): m_query(query), m_statement(statement), m_commit(commit) {}
+			QuerySet(QueryPar& query, T* const& statement, const bool commit): m_query(query), m_commit(commit), m_statement(statement) {}
 			QueryPar m_query;
 			bool m_commit;
 			T* m_statement;
 		};
+
 		/** 
-		 * @brief Thread safe queue of queries.
+		 * @brief A query or transaction. Always executed as a whole by a single thread.
 		 */
-		class Queries: public std::queue<QuerySet>, public boost::mutex {};
-		boost::scoped_array<Queries> queries;
+		struct Unit
+		{
+			Unit(const bool pinned): m_pinned(pinned), m_queued(now()) {}
+			std::vector<QuerySet> m_querySets;
+			//! True if the unit must be executed by the thread it was queued on
+			bool m_pinned;
+			//! Time the unit was queued at in microseconds
+			uint64_t m_queued;
+		};
+
+		/** 
+		 * @brief Queues of queries. One for each thread.
+		 */
+		boost::scoped_array<std::deque<Unit> > queries;
+
+		boost::scoped_array<ThreadStats> m_stats;
+
+		//! Time each thread last finished executing in microseconds. Only touched by the thread.
+		boost::scoped_array<uint64_t> m_lastUsed;
+
+		//! Amount of threads running
+		int m_running;
+
+		//! Amount of threads kept running regardless of load
+		int m_minThreads;
+
+		//! Microseconds a thread above m_minThreads may be idle before it goes away. 0 is forever.
+		uint64_t m_idleTimeout;
+
+		//! Microseconds a connection may be idle before it is checked when next used. 0 is never.
+		uint64_t m_checkInterval;
+
+		/** 
+		 * @brief Protects the queues, the statistics, the pool settings and terminateBool.
+		 */
+		mutable boost::mutex m_queriesMutex;
+
+		/** 
+		 * @brief Signalled when queries are queued or terminate() is called.
+		 */
+		boost::condition_variable m_queriesChanged;
 
 		/** 
 		 * @brief Function that runs in threads.
 		 */
 		void intHandler(const unsigned int id);
 
+		/** 
+		 * @brief Wait for the next query or transaction for a thread.
+		 *
+		 * The front of the thread's own queue is taken first. If it's empty the oldest unit that
+		 * isn't pinned is stolen from the longest queue of another thread.
+		 *
+		 * Should the thread be idle for as long as the idle timeout while there are more than the
+		 * minimum amount of threads running, it's connection is closed and it is told to stop.
+		 *
+		 * @param[in] id Thread to take for.
+		 * @param[out] unit Set to the unit taken.
+		 * @return False if the thread should stop.
+		 */
+		bool take(const unsigned int id, Unit& unit);
+
+		/** 
+		 * @brief Start a thread. m_queriesMutex must be locked.
+		 */
+		void spawn(const unsigned int id);
+
+		/** 
+		 * @brief Execute a unit of queries on a thread.
+		 */
+		void execute(const unsigned int id, Unit& unit);
+
+		/** 
+		 * @brief Queue up a unit.
+		 *
+		 * @param[in/out] unit Unit to queue. It's queries are moved out of it.
+		 * @param[in] instance Thread to queue on. -1 means the one with the least work.
+		 */
+		void push(Unit& unit, int instance);
+
+		/** 
+		 * @brief Monotonic time in microseconds.
+		 */
+		static uint64_t now()
+		{
+			timespec time;
+			clock_gettime(CLOCK_MONOTONIC, &time);
+			return (uint64_t)time.tv_sec*1000000+time.tv_nsec/1000;
+		}
+
 		/** 
 		 * @brief Locks the mutex on a statement and set's the canceller to the queries canceller
 		 */
@@ -173,11 +322,28 @@ namespace ASql
 		};
 
 	protected:
-		ConnectionPar(const int maxThreads_): Connection(maxThreads_), queries(new Queries[maxThreads_]) {}
+		ConnectionPar(const int maxThreads_): Connection(maxThreads_), queries(new std::deque<Unit>[maxThreads_]), m_stats(new ThreadStats[maxThreads_]), m_lastUsed(new uint64_t[maxThreads_]), m_running(0), m_minThreads(maxThreads_), m_idleTimeout(0), m_checkInterval(0) {}
 	public:
-		//! Returns the number of queued queries
+		/** 
+		 * @brief Let the amount of threads follow the load.
+		 *
+		 * @param[in] minThreads Amount of threads kept running regardless of load. Capped at threads().
+		 * @param[in] idleTimeout Seconds a thread above minThreads may be idle before it and it's
+		 * connection go away. 0 means never.
+		 * @param[in] checkInterval Seconds a connection may be idle before it is pinged when next used.
+		 * 0 means never.
+		 */
+		void setPool(const int minThreads, const unsigned int idleTimeout, const unsigned int checkInterval);
+
+		//! Returns the amount of threads kept running regardless of load
+		int minThreads() const { return m_minThreads; }
+
+		//! Returns the number of queued queries and transactions
 		int queriesSize() const; 
 
+		//! Returns the scheduling statistics of a thread
+		ThreadStats stats(const unsigned int thread) const;
+
 		/** 
 		 * @brief Start all threads of the handler
 		 */
@@ -212,66 +378,161 @@ namespace ASql
 
 template<class T> void ASql::ConnectionPar<T>::start()
 {
+	boost::unique_lock<boost::mutex> threadsLock(threadsMutex);
+	unsigned int target=m_started;
+
 	{
-		boost::lock_guard<boost::mutex> terminateLock(terminateMutex);
+		boost::lock_guard<boost::mutex> queriesLock(m_queriesMutex);
 		terminateBool=false;
+		for(int i=0; i<m_minThreads; ++i)
+			if(!m_stats[i].running)
+			{
+				spawn(i);
+				++target;
+			}
 	}
-	
-	boost::unique_lock<boost::mutex> threadsLock(threadsMutex);
-	while(m_threads<maxThreads)
-	{
-		boost::thread(boost::bind(&ConnectionPar<T>::intHandler, boost::ref(*this), m_threads));
+
+	while(m_started<target)
 		threadsChanged.wait(threadsLock);
-	}
 }
 
 template<class T> void ASql::ConnectionPar<T>::terminate()
 {
 	{
-		boost::lock_guard<boost::mutex> terminateLock(terminateMutex);
+		boost::lock_guard<boost::mutex> queriesLock(m_queriesMutex);
 		terminateBool=true;
 	}
-	for(boost::condition_variable* i=wakeUp.get(); i<wakeUp.get()+threads(); ++i)
-		i->notify_all();
+	m_queriesChanged.notify_all();
 
 	boost::unique_lock<boost::mutex> threadsLock(threadsMutex);
 	while(m_threads)
 		threadsChanged.wait(threadsLock);
 }
 
+template<class T> void ASql::ConnectionPar<T>::setPool(const int minThreads, const unsigned int idleTimeout, const unsigned int checkInterval)
+{
+	boost::lock_guard<boost::mutex> queriesLock(m_queriesMutex);
+	m_minThreads=std::max(0, std::min(minThreads, maxThreads));
+	m_idleTimeout=(uint64_t)idleTimeout*1000000;
+	m_checkInterval=(uint64_t)checkInterval*1000000;
+	m_queriesChanged.notify_all();
+}
+
+template<class T> void ASql::ConnectionPar<T>::spawn(const unsigned int id)
+{
+	m_stats[id].running=true;
+	++m_running;
+	boost::thread(boost::bind(&ConnectionPar<T>::intHandler, boost::ref(*this), id));
+}
+
+template<class T> bool ASql::ConnectionPar<T>::take(const unsigned int id, Unit& unit)
+{
+	boost::unique_lock<boost::mutex> queriesLock(m_queriesMutex);
+
+	while(!terminateBool)
+	{
+		std::deque<Unit>* source=&queries[id];
+		typename std::deque<Unit>::iterator it=source->begin();
+
+		if(it==source->end())
+		{
+			source=0;
+			for(int i=0; i<threads(); ++i)
+			{
+				if(i==(int)id || (source && queries[i].size()<=source->size()))
+					continue;
+				for(typename std::deque<Unit>::iterator jt=queries[i].begin(); jt!=queries[i].end(); ++jt)
+					if(!jt->m_pinned)
+					{
+						source=&queries[i];
+						it=jt;
+						break;
+					}
+			}
+		}
+
+		if(source)
+		{
+			unit.m_querySets.swap(it->m_querySets);
+			unit.m_queued=it->m_queued;
+			if(source!=&queries[id])
+				++m_stats[id].stolen;
+			source->erase(it);
+			m_stats[id].waitTime += now()-unit.m_queued;
+			m_stats[id].busy=true;
+			return true;
+		}
+
+		if(m_idleTimeout && m_running>m_minThreads)
+		{
+			const uint64_t idle=now()-m_lastUsed[id];
+			if(idle>=m_idleTimeout)
+			{
+				close(id);
+				break;
+			}
+			m_queriesChanged.timed_wait(queriesLock, boost::posix_time::microseconds(m_idleTimeout-idle));
+		}
+		else
+			m_queriesChanged.wait(queriesLock);
+	}
+
+	m_stats[id].running=false;
+	--m_running;
+	return false;
+}
+
 template<class T> void ASql::ConnectionPar<T>::intHandler(const unsigned int id)
 {
 	{
 		boost::lock_guard<boost::mutex> threadsLock(threadsMutex);
 		++m_threads;
+		++m_started;
 	}
-	threadsChanged.notify_one();
+	threadsChanged.notify_all();
 	
-	boost::unique_lock<boost::mutex> terminateLock(terminateMutex, boost::defer_lock_t());
-	boost::unique_lock<boost::mutex> queriesLock(queries[id], boost::defer_lock_t());
+	Unit unit(false);
+	m_lastUsed[id]=now();
 
-	while(1)
+	while(take(id, unit))
 	{
-		terminateLock.lock();
-		if(terminateBool)
-			break;
-		terminateLock.unlock();
-		
-		queriesLock.lock();
-		if(!queries[id].size())
-		{
-			wakeUp[id].wait(queriesLock);
-			queriesLock.unlock();
-			continue;
-		}
-		QuerySet querySet=queries[id].front();
-		queries[id].pop();
-		queriesLock.unlock();
+		const uint64_t started=now();
+		execute(id, unit);
+		unit.m_querySets.clear();
+		m_lastUsed[id]=now();
+
+		boost::lock_guard<boost::mutex> queriesLock(m_queriesMutex);
+		++m_stats[id].executed;
+		m_stats[id].runTime += m_lastUsed[id]-started;
+		m_stats[id].busy=false;
+	}
 
-		Error error;
+	{
+		boost::lock_guard<boost::mutex> threadsLock(threadsMutex);
+		--m_threads;
+	}
+	threadsChanged.notify_all();
+}
+
+template<class T> void ASql::ConnectionPar<T>::execute(const unsigned int id, Unit& unit)
+{
+	bool retried=false;
+	uint64_t checkInterval;
+	{
+		boost::lock_guard<boost::mutex> queriesLock(m_queriesMutex);
+		checkInterval=m_checkInterval;
+	}
+
+	typename std::vector<QuerySet>::iterator it=unit.m_querySets.begin();
+	while(it!=unit.m_querySets.end())
+	{
+		QuerySet& querySet=*it;
 
 		try
 		{
+			if(it==unit.m_querySets.begin())
+				open(id, checkInterval && now()-m_lastUsed[id]>=checkInterval);
+
 			SetCanceler SetCanceler(querySet.m_statement->m_stop[id], querySet.m_query.m_sharedData->m_cancel);
 			if(querySet.m_query.m_sharedData->m_flags & QueryPar::SharedData::FLAG_SINGLE_PARAMETERS)
 			{
@@ -294,73 +555,103 @@ template<class T> void ASql::ConnectionPar<T>::intHandler(const unsigned int id)
 		}
 		catch(const Error& e)
 		{
-			querySet.m_query.m_sharedData->m_error=e;
-
-			rollback(id);
-
-			queriesLock.lock();
-			QuerySet tmpQuerySet=querySet;
-			while(!querySet.m_commit && queries[id].size())
+			bool retry=false;
+			if(lost(e, retry))
 			{
-				tmpQuerySet=queries[id].front();
-				queries[id].pop();
-				if(!querySet.m_query.isCallback() && tmpQuerySet.m_query.isCallback())
-					querySet.m_query.setCallback(tmpQuerySet.m_query.getCallback());
+				close(id);
+				{
+					boost::lock_guard<boost::mutex> queriesLock(m_queriesMutex);
+					++m_stats[id].reconnects;
+				}
 
+				// Nothing of the unit has reached the server yet so it can go again on a new connection
+				if(retry && !retried && it==unit.m_querySets.begin())
+				{
+					retried=true;
+					continue;
+				}
 			}
-			queriesLock.unlock();
+			else
+				rollback(id);
+
+			querySet.m_query.m_sharedData->m_error=e;
+
+			// The rest of the transaction is dropped
+			for(typename std::vector<QuerySet>::iterator jt=it+1; jt!=unit.m_querySets.end() && !querySet.m_query.isCallback(); ++jt)
+				if(jt->m_query.isCallback())
+					querySet.m_query.setCallback(jt->m_query.getCallback());
+
+			querySet.m_query.callback();
+			break;
 		}
 
 		querySet.m_query.callback();
+		++it;
 	}
+}
 
+template<class T> void ASql::ConnectionPar<T>::push(Unit& unit, int instance)
+{
 	{
-		boost::lock_guard<boost::mutex> threadsLock(threadsMutex);
-		--m_threads;
+		boost::lock_guard<boost::mutex> queriesLock(m_queriesMutex);
+
+		if(instance == -1)
+		{
+			instance=0;
+			for(int i=1; i<threads(); ++i)
+				if(m_stats[i].running > m_stats[instance].running || (m_stats[i].running == m_stats[instance].running && queries[i].size()+m_stats[i].busy < queries[instance].size()+m_stats[instance].busy))
+					instance=i;
+		}
+
+		queries[instance].push_back(Unit(unit.m_pinned));
+		queries[instance].back().m_querySets.swap(unit.m_querySets);
+		queries[instance].back().m_queued=unit.m_queued;
+
+		if(!terminateBool)
+		{
+			if(!m_stats[instance].running)
+				spawn(instance);
+			else if(m_running<maxThreads)
+			{
+				// Grow if every running thread is busy
+				int idle=-1;
+				int free=-1;
+				for(int i=0; i<threads() && idle==-1; ++i)
+				{
+					if(!m_stats[i].running)
+					{
+						if(free==-1) free=i;
+					}
+					else if(!m_stats[i].busy)
+						idle=i;
+				}
+				if(idle==-1 && free!=-1)
+					spawn(free);
+			}
+		}
 	}
-	threadsChanged.notify_one();
+
+	m_queriesChanged.notify_all();
 }
 
 template<class T> void ASql::ConnectionPar<T>::queue(T* const& statement, QueryPar& query, int instance)
 {
-	if(instance == -1)
-	{
-		instance=0;
-		for(unsigned int i=1; i<threads(); ++i)
-		{{
-			boost::lock_guard<boost::mutex> queriesLock(queries[i]);
-			if(queries[i].size() < queries[instance].size())
-				instance=i;
-		}}
-	}
-
-	boost::lock_guard<boost::mutex> queriesLock(queries[instance]);
-	queries[instance].push(QuerySet(query, statement, true));
-	wakeUp[instance].notify_one();
+	Unit unit(instance != -1);
+	unit.m_querySets.push_back(QuerySet(query, statement, true));
+	push(unit, instance);
 }
 
 template<class T> const bool ASql::ConnectionPar<T>::s_false = false;
 
 template<class T> void ASql::ConnectionPar<T>::queue(Transaction<T>& transaction, int instance)
 {
-	if(instance == -1)
-	{
-		instance=0;
-		for(unsigned int i=1; i<threads(); ++i)
-		{{
-			boost::lock_guard<boost::mutex> queriesLock(queries[i]);
-			if(queries[i].size() < queries[instance].size())
-				instance=i;
-		}}
-	}
-
-	boost::lock_guard<boost::mutex> queriesLock(queries[instance]);
+	Unit unit(instance != -1);
 
 	for(typename Transaction<T>::iterator it=transaction.begin(); it!=transaction.end(); ++it)
-		queries[instance].push(QuerySet(it->m_query, it->m_statement, false));
-	queries[instance].back().m_commit = true;
+		unit.m_querySets.push_back(QuerySet(it->m_query, it->m_statement, false));
+	unit.m_querySets.back().m_commit = true;
 
-	wakeUp[instance].notify_one();
+	push(unit, instance);
 }
 
 template<class T> void ASql::Transaction<T>::cancel()
@@ -371,14 +662,22 @@ template<class T> void ASql::Transaction<T>::cancel()
 
 template<class T> int ASql::ConnectionPar<T>::queriesSize() const
 {
+	boost::lock_guard<boost::mutex> queriesLock(m_queriesMutex);
+
 	int size=0;
-	for(unsigned int i=1; i<threads(); ++i)
-	{{
-		boost::lock_guard<boost::mutex> queriesLock(queries[i]);
+	for(int i=0; i<threads(); ++i)
 		size += queries[i].size();
-	}}
 	
 	return size;
 }
 
+template<class T> typename ASql::ConnectionPar<T>::ThreadStats ASql::ConnectionPar<T>::stats(const unsigned int thread) const
+{
+	boost::lock_guard<boost::mutex> queriesLock(m_queriesMutex);
+
+	ThreadStats stats=m_stats[thread];
+	stats.depth=queries[thread].size();
+	return stats;
+}
+
 #endif
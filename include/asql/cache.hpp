@@ -0,0 +1,432 @@
+//! \file cache.hpp Declares the ASql::StatementRegistry and ASql::ResultCache classes
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef ASQLCACHE_HPP
+#define ASQLCACHE_HPP
+
+#include <map>
+#include <list>
+#include <string>
+#include <cstring>
+
+#include <stdint.h>
+#include <time.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/type_traits/is_base_of.hpp>
+
+#include <asql/query.hpp>
+#include <asql/data.hpp>
+
+//! Defines classes and functions relating to SQL querying
+namespace ASql
+{
+	/** 
+	 * @brief Statements shared by query text.
+	 *
+	 * Identical queries issued from many places needn't each keep around their own statement.
+	 * The first get() for a query text builds the statement and every later one returns that
+	 * same statement. Statements are prepared lazily by the connection threads that execute
+	 * them, so get() never touches a connection and is safe to call from any thread. For the
+	 * same reason the statements should only be executed through queue().
+	 *
+	 * @tparam C %Connection type of the SQL engine.
+	 * @tparam T %Statement type of the SQL engine.
+	 */
+	template<class C, class T> class StatementRegistry
+	{
+	public:
+		StatementRegistry(C& connection): m_connection(connection) {}
+
+		/** 
+		 * @brief Get the statement for a query.
+		 *
+		 * @param[in] query SQL query with '?' placeholders. See the engine's %Statement::init().
+		 * @param[in] parameterSet Template object of parameter data set. Null means no parameters.
+		 * @param[in] resultSet Template object of result data set. Null means no results.
+		 * Both are only looked at when the statement is built, so every call for the same query
+		 * must pass sets of the same type.
+		 */
+		T& get(const std::string& query, const Data::Set* const parameterSet, const Data::Set* const resultSet)
+		{
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			boost::shared_ptr<T>& statement=m_statements[query];
+			if(!statement)
+			{
+				boost::shared_ptr<T> built(new T(m_connection));
+				built->init(query.data(), query.size(), parameterSet, resultSet, false, true);
+				statement=built;
+			}
+			return *statement;
+		}
+
+		//! Returns the amount of statements built
+		size_t size()
+		{
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			return m_statements.size();
+		}
+
+	private:
+		C& m_connection;
+		std::map<std::string, boost::shared_ptr<T> > m_statements;
+		boost::mutex m_mutex;
+
+		StatementRegistry(const StatementRegistry&);
+		StatementRegistry& operator=(const StatementRegistry&);
+	};
+
+	/** 
+	 * @brief Append the content of a data set to a string.
+	 *
+	 * Two sets of the same type append the same bytes if, and only if, they hold the same values.
+	 * Used to build cache keys from query parameters.
+	 */
+	inline void appendKey(std::string& key, const Data::Set& set)
+	{
+		using namespace Data;
+
+		for(size_t i=0; i<set.numberOfSqlElements(); ++i)
+		{
+			Index element=set.getSqlIndex(i);
+
+			if(element.type>=U_TINY_N && element.type!=NOTHING)
+			{
+				NullablePar& nullable=*static_cast<NullablePar*>(element.data);
+				key += nullable.nullness?'0':'1';
+				if(nullable.nullness) continue;
+				element.data=nullable.getVoid();
+				element.type=Type(element.type-U_TINY_N);
+			}
+
+			size_t size=0;
+			switch(element.type)
+			{
+				case U_TINY:
+				case TINY:
+					size=1;
+					break;
+				case U_SHORT:
+				case SHORT:
+					size=sizeof(Short);
+					break;
+				case U_INT:
+				case INT:
+					size=sizeof(Int);
+					break;
+				case U_BIGINT:
+				case BIGINT:
+					size=sizeof(Bigint);
+					break;
+				case FLOAT:
+					size=sizeof(Float);
+					break;
+				case DOUBLE:
+					size=sizeof(Double);
+					break;
+				case TIME:
+					size=sizeof(Time);
+					break;
+				case DATE:
+					size=sizeof(Date);
+					break;
+				case DATETIME:
+					size=sizeof(Datetime);
+					break;
+				case CHAR:
+					size=strnlen(static_cast<const char*>(element.data), element.size);
+					break;
+				case BINARY:
+					size=element.size;
+					break;
+				case TEXT:
+				{
+					const Text& text=*static_cast<const Text*>(element.data);
+					key.append((const char*)&(size=text.size()), sizeof(size));
+					key.append(text.data(), text.size());
+					continue;
+				}
+				case WTEXT:
+				{
+					const Wtext& text=*static_cast<const Wtext*>(element.data);
+					key.append((const char*)&(size=text.size()), sizeof(size));
+					key.append((const char*)text.data(), text.size()*sizeof(wchar_t));
+					continue;
+				}
+				case BLOB:
+				{
+					Blob& blob=*static_cast<Blob*>(element.data);
+					key.append((const char*)&(size=blob.size()), sizeof(size));
+					if(size) key.append(&blob[0], size);
+					continue;
+				}
+				default:
+					continue;
+			}
+			if(element.type==CHAR)
+				key.append((const char*)&size, sizeof(size));
+			key.append(static_cast<const char*>(element.data), size);
+		}
+	}
+
+	/** 
+	 * @brief Cache of read query results in front of statements.
+	 *
+	 * queue() answers a query straight from the cache when the same statement was executed with
+	 * the same parameters before, without going anywhere near the connection threads. Otherwise
+	 * the query is queued as usual and it's results stored once it completes without error.
+	 * Entries go once their time to live is up, when their tag is invalidated or to make room
+	 * for new ones, oldest first.
+	 *
+	 * Only single row parameter queries are cached. Results are copied in and out of the cache
+	 * by assignment so their type must make a deep copy on assignment, as Data::SetBuilder,
+	 * Data::IndySetBuilder and Data::STLSetContainer do.
+	 *
+	 * The cache must outlive every query queued through it.
+	 *
+	 * @tparam Parameters Parameters type of the Query.
+	 * @tparam Results Results type of the Query.
+	 */
+	template<class Parameters, class Results> class ResultCache
+	{
+	public:
+		typedef ASql::Query<Parameters, Results> Query;
+
+		/** 
+		 * @param[in] maxEntries Amount of results stored before the oldest are dropped.
+		 */
+		ResultCache(const size_t maxEntries=1024): m_maxEntries(maxEntries), m_invalidations(0), m_cleared(0), m_hits(0), m_misses(0) {}
+
+		/** 
+		 * @brief Answer a query from the cache or queue it.
+		 *
+		 * @param[in] statement Statement to execute the query with.
+		 * @param[in/out] query The query.
+		 * @param[in] ttl Seconds the results stay in the cache. 0 means until invalidated.
+		 * @param[in] tag Tag to invalidate the results by.
+		 * @param[in] instance Passed on to the statement's queue().
+		 *
+		 * @return True if the results were copied into the query from the cache. The callback
+		 * isn't called in that case. False if the query was queued.
+		 */
+		template<class T> bool queue(T& statement, Query& query, const unsigned int ttl=0, const std::string& tag=std::string(), int instance=-1);
+
+		/** 
+		 * @brief Drop all results stored with a tag.
+		 *
+		 * Queries with the tag still running are not stored once they complete either, as
+		 * their results may well be from before whatever the invalidation is for.
+		 */
+		void invalidate(const std::string& tag);
+
+		/** 
+		 * @brief Drop all results.
+		 *
+		 * As with invalidate() queries still running are not stored once they complete.
+		 */
+		void clear()
+		{
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			m_entries.clear();
+			m_order.clear();
+			m_cleared=++m_invalidations;
+		}
+
+		//! Returns the amount of results stored
+		size_t size()
+		{
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			return m_entries.size();
+		}
+
+		//! Returns the amount of queries answered from the cache
+		uint64_t hits()
+		{
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			return m_hits;
+		}
+
+		//! Returns the amount of queries that had to be queued
+		uint64_t misses()
+		{
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			return m_misses;
+		}
+
+	private:
+		struct Entry
+		{
+			//! Results of the query. Null if it returned no row.
+			boost::shared_ptr<const Results> results;
+			//! Time the entry expires at in seconds. 0 if never.
+			uint64_t expires;
+			std::string tag;
+			std::list<std::string>::iterator order;
+		};
+
+		typedef std::map<std::string, Entry> Entries;
+
+		const size_t m_maxEntries;
+		Entries m_entries;
+		//! Keys in the order they were stored
+		std::list<std::string> m_order;
+		//! Amount of calls to invalidate() and clear() so far
+		uint64_t m_invalidations;
+		//! Value of m_invalidations each tag was last invalidated at
+		std::map<std::string, uint64_t> m_invalidated;
+		//! Value of m_invalidations the cache was last cleared at
+		uint64_t m_cleared;
+		uint64_t m_hits;
+		uint64_t m_misses;
+		boost::mutex m_mutex;
+
+		//! Store the results of a completed query and call it's original callback
+		/** 
+		 * @param[in] invalidations Value of m_invalidations when the query was queued. The
+		 * results are thrown away if the tag was invalidated or the cache cleared since.
+		 */
+		void store(const std::string& key, const unsigned int ttl, const std::string& tag, const uint64_t invalidations, boost::weak_ptr<QueryPar::SharedData> data, boost::function<void()> callback);
+
+		void erase(typename Entries::iterator it)
+		{
+			m_order.erase(it->second.order);
+			m_entries.erase(it);
+		}
+
+		static const Results* results(const void* data, boost::true_type) { return static_cast<const Results*>((const Data::Set*)data); }
+		static const Results* results(const void* data, boost::false_type) { return static_cast<const Results*>((const Data::SetContainer*)data); }
+
+		//! Monotonic time in seconds
+		static uint64_t now()
+		{
+			timespec time;
+			clock_gettime(CLOCK_MONOTONIC, &time);
+			return time.tv_sec;
+		}
+
+		ResultCache(const ResultCache&);
+		ResultCache& operator=(const ResultCache&);
+	};
+}
+
+template<class Parameters, class Results> template<class T> bool ASql::ResultCache<Parameters, Results>::queue(T& statement, Query& query, const unsigned int ttl, const std::string& tag, int instance)
+{
+	if(!(query.m_sharedData->m_flags & QueryPar::SharedData::FLAG_SINGLE_PARAMETERS))
+	{
+		statement.queue(query, instance);
+		return false;
+	}
+
+	const T* const address=&statement;
+	std::string key((const char*)&address, sizeof(address));
+	if(query.QueryPar::parameters())
+		appendKey(key, *(const Data::Set*)query.QueryPar::parameters());
+
+	uint64_t invalidations;
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		invalidations=m_invalidations;
+		typename Entries::iterator it=m_entries.find(key);
+		if(it!=m_entries.end())
+		{
+			if(it->second.expires && it->second.expires<=now())
+				erase(it);
+			else
+			{
+				++m_hits;
+				if(it->second.results)
+				{
+					if(!query.results()) query.createResults();
+					*query.results()=*it->second.results;
+				}
+				else
+					query.clearResults();
+				query.m_sharedData->m_error=Error();
+				return true;
+			}
+		}
+		++m_misses;
+	}
+
+	if(!query.results()) query.createResults();
+	query.setCallback(boost::bind(&ResultCache::store, this, key, ttl, tag, invalidations, boost::weak_ptr<QueryPar::SharedData>(query.m_sharedData), query.getCallback()));
+	statement.queue(query, instance);
+	return false;
+}
+
+template<class Parameters, class Results> void ASql::ResultCache<Parameters, Results>::store(const std::string& key, const unsigned int ttl, const std::string& tag, const uint64_t invalidations, boost::weak_ptr<QueryPar::SharedData> data, boost::function<void()> callback)
+{
+	{
+		const boost::shared_ptr<QueryPar::SharedData> shared(data.lock());
+		if(shared && !shared->m_error.erno && !shared->m_cancel)
+		{
+			boost::shared_ptr<Results> copy;
+			if(shared->m_results)
+			{
+				copy.reset(new Results);
+				*copy=*results(shared->m_results, typename boost::is_base_of<Data::Set, Results>::type());
+			}
+
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			const std::map<std::string, uint64_t>::const_iterator invalidated=m_invalidated.find(tag);
+			const bool stale=m_cleared>invalidations || (invalidated!=m_invalidated.end() && invalidated->second>invalidations);
+
+			if(!stale)
+			{
+				typename Entries::iterator it=m_entries.find(key);
+				if(it!=m_entries.end())
+					erase(it);
+				while(m_entries.size() && m_entries.size()>=m_maxEntries)
+					erase(m_entries.find(m_order.front()));
+
+				if(m_maxEntries)
+				{
+					Entry& entry=m_entries[key];
+					entry.results=copy;
+					entry.expires=ttl?now()+ttl:0;
+					entry.tag=tag;
+					entry.order=m_order.insert(m_order.end(), key);
+				}
+			}
+		}
+	}
+
+	if(!callback.empty())
+		callback();
+}
+
+template<class Parameters, class Results> void ASql::ResultCache<Parameters, Results>::invalidate(const std::string& tag)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_invalidated[tag]=++m_invalidations;
+	for(typename Entries::iterator it=m_entries.begin(); it!=m_entries.end();)
+	{
+		typename Entries::iterator current=it++;
+		if(current->second.tag==tag)
+			erase(current);
+	}
+}
+
+#endif
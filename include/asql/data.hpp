@@ -6,6 +6,9 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <deque>
+#include <typeinfo>
+#include <cstddef>
 
 #include <boost/preprocessor/seq/size.hpp>
 #include <boost/preprocessor/seq/for_each_i.hpp>
@@ -20,7 +23,10 @@
 			BOOST_PP_SEQ_FOR_EACH_I(ASQL_BUILDSETLINE, 0, elements) \
 			default: return ASql::Data::Index(); \
 		} \
-	}
+	} \
+	const void* sqlBase() const { return this; } \
+	size_t sqlSize() const { return sizeof(*this); } \
+	const std::type_info* sqlType() const { return &typeid(*this); }
 
 namespace ASql
 {
@@ -251,6 +257,7 @@ namespace ASql
 		 * - STLSetContainer
 		 * - STLSetRefContainer
 		 * - STLSharedSetContainer
+		 * - BlockSetContainer
 		 *
 		 * If you use this technique you MUST still define the numberOfSqlElements() and getSqlIndex() in
 		 * your dataset as below but do not derive from Set. The function will be called from the templates
@@ -358,6 +365,33 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 			 */
 			virtual Index getSqlIndex(const size_t index) const =0; 
 
+			//! Get constant void pointer to the object holding the indexable data members.
+			/*! 
+			 * Statements use this along with sqlType() to find the members of every row at the
+			 * same offsets they were found at in the template object (see Layout), so getSqlIndex()
+			 * needn't be called for every member of every row. The default returns null which
+			 * always calls getSqlIndex().
+			 *
+			 * All the set builders below and the ASQL_BUILDSET macro override this.
+			 *
+			 * \return Constant void pointer to the object or null.
+			 */
+			virtual const void* sqlBase() const { return 0; }
+
+			//! Get the size in bytes of the object returned by sqlBase().
+			virtual size_t sqlSize() const { return 0; }
+
+			//! Get the type of the object returned by sqlBase().
+			/*! 
+			 * Any two sets returning the same type must have their indexable data members at the
+			 * same offsets from sqlBase(). The set builders return the dynamic type of the object
+			 * they wrap, so sets wrapping the same type share one layout whichever builder they
+			 * come from.
+			 *
+			 * \return Type of the object or null if there is none.
+			 */
+			virtual const std::type_info* sqlType() const { return 0; }
+
 			virtual ~Set() {}
 		};
 
@@ -377,6 +411,9 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 			virtual size_t numberOfSqlElements() const { return data.numberOfSqlElements(); }
 			//! Wrapper function for the %getSqlIndex() function in the data object.
 			virtual Index getSqlIndex(const size_t index) const { return data.getSqlIndex(index); }
+			virtual const void* sqlBase() const { return &data; }
+			virtual size_t sqlSize() const { return sizeof(T); }
+			virtual const std::type_info* sqlType() const { return &typeid(data); }
 		};
 
 		//! Wraps a Set object around a reference to a dataset of type T
@@ -390,6 +427,9 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 			virtual size_t numberOfSqlElements() const { return m_data.numberOfSqlElements(); }
 			//! Wrapper function for the %getSqlIndex() function in the data object.
 			virtual Index getSqlIndex(const size_t index) const { return m_data.getSqlIndex(index); }
+			virtual const void* sqlBase() const { return &m_data; }
+			virtual size_t sqlSize() const { return sizeof(T); }
+			virtual const std::type_info* sqlType() const { return &typeid(m_data); }
 			//! Reference to the dataset
 			const T& m_data;
 		public:
@@ -417,6 +457,9 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 
 			//! Wrapper function for the %getSqlIndex() function in the data object.
 			virtual Index getSqlIndex(const size_t index) const { return m_data->getSqlIndex(index); }
+			virtual const void* sqlBase() const { return m_data; }
+			virtual size_t sqlSize() const { return sizeof(T); }
+			virtual const std::type_info* sqlType() const { return m_data?&typeid(*m_data):0; }
 		public:
 			//! Default constructor set's the pointer to null
 			inline SetPtrBuilder(): m_data(0) {}
@@ -451,6 +494,9 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 			//! Wrapper function for the %getSqlIndex() function in the data object.
 		public:
 			virtual Index getSqlIndex(const size_t index) const { return data->getSqlIndex(index); }
+			virtual const void* sqlBase() const { return data.get(); }
+			virtual size_t sqlSize() const { return sizeof(T); }
+			virtual const std::type_info* sqlType() const { return data?&typeid(*data):0; }
 			inline SetSharedPtrBuilder() {}
 			inline SetSharedPtrBuilder(const boost::shared_ptr<T>& x): data(x) {}
 			inline SetSharedPtrBuilder(SetSharedPtrBuilder& x): data(x.data) {}
@@ -473,6 +519,9 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 			virtual size_t numberOfSqlElements() const { return 1; }
 			//! Just returns an index to data.
 			virtual Index getSqlIndex(const size_t index) const { return data; }
+			virtual const void* sqlBase() const { return &data; }
+			virtual size_t sqlSize() const { return sizeof(T); }
+			virtual const std::type_info* sqlType() const { return &typeid(data); }
 		};
 
 		//! Wraps a Set object around a reference to an individual object of type T
@@ -487,6 +536,9 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 			virtual size_t numberOfSqlElements() const { return 1; }
 			//! Just returns an index to data.
 			virtual Index getSqlIndex(const size_t index) const { return data; }
+			virtual const void* sqlBase() const { return &data; }
+			virtual size_t sqlSize() const { return sizeof(T); }
+			virtual const std::type_info* sqlType() const { return &typeid(data); }
 		public:
 			/*! 
 			 * \param x Reference to the object of type T to reference to.
@@ -508,6 +560,9 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 			 
 			//! Just returns an index to data.
 			virtual Index getSqlIndex(const size_t index) const { return *m_data; }
+			virtual const void* sqlBase() const { return m_data; }
+			virtual size_t sqlSize() const { return sizeof(T); }
+			virtual const std::type_info* sqlType() const { return m_data?&typeid(*m_data):0; }
 		public:
 			//! Default constructor set's the pointer to null
 			inline IndySetPtrBuilder(): m_data(0) {}
@@ -541,6 +596,12 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 			 */
 			virtual const Set* pull() const =0;
 			virtual void init() const =0;
+			//! Hint at how many rows are about to be manufactured.
+			/*! 
+			 * Called when the amount of result rows is known before they are fetched so
+			 * containers can allocate room for them all at once. Ignoring it is fine.
+			 */
+			virtual void reserve(const size_t /*rows*/) {}
 		};
 
 		//! Wraps a SetContainer object around a new auto-allocated STL container of type T
@@ -686,6 +747,154 @@ typedef ASql::Data::SetContainer<std::deque<TestSet> > FunctionalTestContainer;
 			void init() const {  m_itBuffer = const_cast<T*>(data)->begin(); }
 		};
 
+		//! SetContainer that stores it's rows in fixed size blocks of type T objects
+		/*! 
+		 * Intended for pulling large results into memory. Rows are allocated blockSize at a time
+		 * and never move once manufactured, so unlike a std::vector there is no copying as the
+		 * container grows and unlike a std::list there is no heap allocation per row. Blocks
+		 * are kept through clear() so a container that is reused for the same query allocates
+		 * nothing once it has grown to fit.
+		 *
+		 * \tparam T Row type. Must have %numberOfSqlElements() and %getSqlIndex() function defined as
+		 * per the instruction in Data::Set.
+		 * \tparam blockSize Amount of rows allocated at a time.
+		 */
+		template<class T, size_t blockSize=256> class BlockSetContainer: public SetContainer
+		{
+			mutable SetPtrBuilder<T> m_buffer;
+			mutable size_t m_pulled;
+			std::vector<T*> m_blocks;
+			size_t m_size;
+
+			void grow()
+			{
+				m_blocks.reserve(m_blocks.size()+1);
+				m_blocks.push_back(new T[blockSize]);
+			}
+
+			Set& manufacture()
+			{
+				if(m_size == m_blocks.size()*blockSize)
+					grow();
+				m_buffer.set((*this)[m_size++]);
+				return m_buffer;
+			}
+			void trim() { (*this)[--m_size]=T(); }
+			const Set* pull() const
+			{
+				if(m_pulled == m_size) return 0;
+				m_buffer.set((*this)[m_pulled++]);
+				return &m_buffer;
+			}
+
+			BlockSetContainer(const BlockSetContainer&);
+			BlockSetContainer& operator=(const BlockSetContainer&);
+		public:
+			void init() const { m_pulled=0; }
+			void reserve(const size_t rows)
+			{
+				while(m_blocks.size()*blockSize < m_size+rows)
+					grow();
+			}
+
+			//! Amount of rows in the container
+			size_t size() const { return m_size; }
+
+			//! Return true if there are no rows in the container
+			bool empty() const { return !m_size; }
+
+			//! Access a row
+			T& operator[](const size_t row) { return m_blocks[row/blockSize][row%blockSize]; }
+
+			//! Access a row
+			const T& operator[](const size_t row) const { return m_blocks[row/blockSize][row%blockSize]; }
+
+			//! Remove all rows. The blocks holding them stay allocated.
+			void clear()
+			{
+				while(m_size) trim();
+				m_pulled=0;
+			}
+
+			BlockSetContainer(): m_pulled(0), m_size(0) {}
+			~BlockSetContainer()
+			{
+				for(typename std::vector<T*>::iterator it=m_blocks.begin(); it!=m_blocks.end(); ++it)
+					delete [] *it;
+			}
+		};
+
+		//! Where the indexable data members of a data set type lie within it.
+		/*!
+		 * Built once from a template object, it lets the members of any other set of the same
+		 * Set::sqlType() be found by offset from Set::sqlBase() without calling getSqlIndex().
+		 */
+		struct Layout
+		{
+			Layout(): type(0) {}
+
+			//! Type of the set the layout was built from. Null if it's members can't be found by offset.
+			const std::type_info* type;
+
+			//! Offset of the value of each member from Set::sqlBase().
+			std::vector<std::ptrdiff_t> data;
+
+			//! Offset of the nullness of each member from Set::sqlBase(). -1 if it can't be null.
+			std::vector<std::ptrdiff_t> nullness;
+
+			//! Build the layout from a template object.
+			/*!
+			 * Should the set have no type or any member returned by getSqlIndex() not lie within
+			 * the object at sqlBase() the type is left null.
+			 *
+			 * \param[in] set Template object.
+			 * \param[in] order Order the members are indexed in. Null means as by getSqlIndex().
+			 */
+			void build(const Set& set, const std::deque<unsigned char>* order=0)
+			{
+				const size_t size=order?order->size():set.numberOfSqlElements();
+				type=0;
+				data.assign(size, std::ptrdiff_t(0));
+				nullness.assign(size, std::ptrdiff_t(-1));
+
+				const char* const begin=static_cast<const char*>(set.sqlBase());
+				const std::type_info* const setType=set.sqlType();
+				if(!begin || !setType) return;
+				const char* const end=begin+set.sqlSize();
+
+				for(size_t i=0; i<size; ++i)
+				{
+					Index element=set.getSqlIndex(order?(*order)[i]:i);
+
+					if(element.type>=U_TINY_N)
+					{
+						NullablePar* const nullable=static_cast<NullablePar*>(element.data);
+						const char* const null=(const char*)&nullable->nullness;
+						if(null<begin || null>=end) return;
+						nullness[i]=null-begin;
+						element.data=nullable->getVoid();
+					}
+
+					const char* const value=static_cast<const char*>(element.data);
+					if(value<begin || value>=end) return;
+					data[i]=value-begin;
+				}
+
+				type=setType;
+			}
+
+			//! Find the members of a set by the layout.
+			/*!
+			 * \return Pointer the offsets are from or null if the set isn't of the layout's type.
+			 */
+			char* base(const Set& set) const
+			{
+				if(!type) return 0;
+				const std::type_info* const setType=set.sqlType();
+				return setType && *setType==*type?(char*)set.sqlBase():0;
+			}
+		};
+
 		//! Handle data conversion from standard data types to internal SQL engine types.
 		struct Conversion
 		{
@@ -26,8 +26,11 @@
 #include <boost/scoped_array.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <deque>
+#include <string>
+#include <vector>
 
 #include <asql/asql.hpp>
+#include <asql/cache.hpp>
 
 //! Defines classes and functions relating to SQL querying
 namespace ASql
@@ -56,7 +59,38 @@ namespace ASql
 			 */
 			boost::scoped_array<MYSQL_BIND> foundRowsBinding;
 
-			bool m_initialized;
+			//! True for every thread whose connection is open.
+			boost::scoped_array<bool> m_open;
+
+			//! Incremented every time the connection of a thread is opened.
+			boost::scoped_array<unsigned int> m_generation;
+
+			//! What connect() was called with so connections can be opened later.
+			struct Parameters
+			{
+				std::string host;
+				std::string user;
+				std::string passwd;
+				std::string db;
+				std::string unixSocket;
+				std::string charset;
+				bool hasHost;
+				bool hasUser;
+				bool hasPasswd;
+				bool hasDb;
+				bool hasUnixSocket;
+				unsigned int port;
+				unsigned long clientFlag;
+			} m_parameters;
+
+			//! Open the connection of a thread, or check an open one and reopen it if it's gone.
+			void open(const unsigned int thread, const bool check);
+
+			//! Close the connection of a thread.
+			void close(const unsigned int thread);
+
+			//! Return true if the error means the connection was lost.
+			bool lost(const ASql::Error& error, bool& retry) const;
 
 		public:
 			/** 
@@ -73,7 +107,13 @@ namespace ASql
 			 * \param[in] threads_ Number of threads to have for simultaneous queries. The higher this number is the more concurrent
 			 * SQL requeries can be processed.
 			 */
-			Connection(const char* host, const char* user, const char* passwd, const char* db, unsigned int port, const char* unix_socket, unsigned long client_flag, const char* const charset="latin1", const int threads_=1): ConnectionPar<MySQL::Statement>(threads_), m_initialized(false)
+			Connection(const char* host, const char* user, const char* passwd, const char* db, unsigned int port, const char* unix_socket, unsigned long client_flag, const char* const charset="latin1", const int threads_=1):
+				ConnectionPar<MySQL::Statement>(threads_),
+				m_connection(new MYSQL[threads_]),
+				foundRowsStatement(new MYSQL_STMT*[threads_]),
+				foundRowsBinding(new MYSQL_BIND[threads_]),
+				m_open(new bool[threads_]()),
+				m_generation(new unsigned int[threads_]())
 			{
 				connect(host, user, passwd, db, port, unix_socket, client_flag, charset);
 			}
@@ -89,11 +129,16 @@ namespace ASql
 				m_connection(new MYSQL[threads_]),
 				foundRowsStatement(new MYSQL_STMT*[threads_]),
 				foundRowsBinding(new MYSQL_BIND[threads_]),
-				m_initialized(false) {}
+				m_open(new bool[threads_]()),
+				m_generation(new unsigned int[threads_]()) {}
 			~Connection();
 
 			/**
 			//! Connect to a MySQL server.
+			 *
+			 * Opens the connections of the first minThreads() threads, or just the first if that is 0.
+			 * The rest are opened by their threads once they are needed. Every connection is reopened
+			 * with the same parameters should it be lost.
 			 *
 			 * \param[in] host The value of host may be either a hostname or an IP address. If host is NULL or the string "localhost", a connection to the local host is assumed. For Windows, the client connects using a shared-memory connection, if the server has shared-memory connections enabled. Otherwise, TCP/IP is used. For Unix, the client connects using a Unix socket file.
 			 * \param[in] user The user parameter contains the user's %MySQL login ID. If user is NULL or the empty string "", the current user is assumed. Under Unix, this is the current login name. Under Windows ODBC, the current username must be specified explicitly.
@@ -115,6 +160,12 @@ namespace ASql
 
 			MYSQL& connection(unsigned int id) { return m_connection[id]; }
 
+			//! Returns true if the connection of a thread is open
+			bool isOpen(unsigned int id) const { return m_open[id]; }
+
+			//! Returns a number that changes every time the connection of a thread is opened. 0 if never.
+			unsigned int generation(unsigned int id) const { return m_generation[id]; }
+
 			inline void commit(const unsigned int thread=0)	{ mysql_commit(&m_connection[thread]); }
 			inline void rollback(const unsigned int thread=0)	{ mysql_rollback(&m_connection[thread]); }
 		};
@@ -124,6 +175,10 @@ namespace ASql
 		 * This class will store up a prepared %MySQL statement for both
 		 * synchronous and asynchronous execution.  It should be initialized
 		 * either by the full constructor or init().
+		 *
+		 * The statement is prepared on every open connection by init() and on
+		 * any other connection the first time it is executed through it. Should
+		 * a connection be reopened the statement is prepared again on it.
 		 */
 		class Statement: public ASql::Statement
 		{
@@ -156,11 +211,19 @@ namespace ASql
 			Statement(Connection& connection_, const char* const queryString, const size_t queryLength, const Data::Set* const parameterSet, const Data::Set* const resultSet):
 				ASql::Statement(connection_.threads()),
 				connection(connection_),
-				stmt(new MYSQL_STMT*[connection_.threads()]),
+				stmt(new MYSQL_STMT*[connection_.threads()]()),
 				m_initialized(false),
 				paramsBindings(new boost::scoped_array<MYSQL_BIND>[connection_.threads()]),
 				resultsBindings(new boost::scoped_array<MYSQL_BIND>[connection_.threads()]),
-				m_stop(new const bool*[connection_.threads()])
+				m_paramsLayouts(new Layout[connection_.threads()]),
+				m_resultsLayouts(new Layout[connection_.threads()]),
+				m_stop(new const bool*[connection_.threads()]),
+				m_generations(new unsigned int[connection_.threads()]()),
+				m_batchRows(0),
+				m_batches(new Batch[connection_.threads()]),
+				m_tails(new Batch[connection_.threads()]),
+				m_storeResult(false),
+				m_prefetchRows(0)
 			{
 				init(queryString, queryLength, parameterSet, resultSet);
 			}
@@ -172,11 +235,19 @@ namespace ASql
 			Statement(Connection& connection_):
 				ASql::Statement(connection_.threads()),
 				connection(connection_),
-				stmt(new MYSQL_STMT*[connection_.threads()]),
+				stmt(new MYSQL_STMT*[connection_.threads()]()),
 				m_initialized(false),
 				paramsBindings(new boost::scoped_array<MYSQL_BIND>[connection_.threads()]),
 				resultsBindings(new boost::scoped_array<MYSQL_BIND>[connection_.threads()]),
-				m_stop(new const bool*[connection_.threads()]) {}
+				m_paramsLayouts(new Layout[connection_.threads()]),
+				m_resultsLayouts(new Layout[connection_.threads()]),
+				m_stop(new const bool*[connection_.threads()]),
+				m_generations(new unsigned int[connection_.threads()]()),
+				m_batchRows(0),
+				m_batches(new Batch[connection_.threads()]),
+				m_tails(new Batch[connection_.threads()]),
+				m_storeResult(false),
+				m_prefetchRows(0) {}
 
 			~Statement();
 			
@@ -204,8 +275,11 @@ namespace ASql
 			 * \param[in] queryLength Length of SQL query. No null termination.
 			 * \param[in] parameterSet Template object of parameter data set. Null means no parameters.
 			 * \param[in] resultSet Template object of result data set. Null means no results.
+			 * \param[in] lazy If true the statement isn't prepared on the open connections right
+			 * away but only by the connection threads the first time they execute it. Needed when
+			 * initializing from a thread other than the connection threads while queries are running.
 			 */
-			void init(const char* const& queryString, const size_t& queryLength, const Data::Set* const parameterSet, const Data::Set* const resultSet, bool customPlaceholders=false);
+			void init(const char* const& queryString, const size_t& queryLength, const Data::Set* const parameterSet, const Data::Set* const resultSet, bool customPlaceholders=false, bool lazy=false);
 
 			//! Execute multi-row result %MySQL statement.
 			/** 
@@ -268,12 +342,59 @@ namespace ASql
 			 *	a Data::SetContainer templated to the same derived type passed upon
 			 *	construction of the statement for the single result result row.
 			 
+			 *	If setBatchRows() has been called the rows are sent batchRows() at a
+			 *	time through a multi-row version of the statement instead of one
+			 *	round trip per row.
+			 
 			 * \param[in] parameters  %Data set of %MySQL query parameter data.
 			 * \param[out] rows Pointer to integer for writing the number of rows affected from last query.
 			 * \param[in] docommit Set to true a transaction commit should be completed at the end of this query.
 			 */
 			void execute(const Data::SetContainer& parameters, unsigned long long int* rows=0, bool docommit=true, const unsigned int thread=0);
 
+			//! Send multi-row parameter executions in batches.
+			/** 
+			 * Only applies to INSERT/REPLACE statements of the form "INSERT INTO
+			 * table (a, b) VALUES (?, ?)" where all the placeholders are in the
+			 * single VALUES row. That row is repeated to build a second prepared
+			 * statement taking the parameters of the given amount of rows at once
+			 * so execute(const Data::SetContainer&, ...) costs one round trip
+			 * per that many rows. Whatever rows are left over at the end go
+			 * through a statement prepared for exactly that many of them.
+			 *
+			 * The amount of rows is lowered for the prepared statement should it
+			 * take it over %MySQL's limit of 65535 placeholders. It can be called
+			 * before or after init().
+			 *
+			 * \param[in] rows Parameter rows to send per round trip. 0 or 1 turns batching off.
+			 */
+			void setBatchRows(unsigned int rows);
+
+			//! Parameter rows sent per round trip by execute(const Data::SetContainer&, ...)
+			unsigned int batchRows() const { return m_batchRows; }
+
+			//! Buffer entire multi-row results on the client before fetching them.
+			/** 
+			 * If set, execute(const Data::Set* const, Data::SetContainer* const, ...)
+			 * transfers the whole result with mysql_stmt_store_result() in one go
+			 * instead of a row at a time and tells the result container how many
+			 * rows are coming through Data::SetContainer::reserve() before any are
+			 * manufactured. Takes precedence over setPrefetchRows().
+			 *
+			 * \param[in] store True to buffer entire results.
+			 */
+			void setStoreResult(bool store) { m_storeResult=store; }
+
+			//! Fetch multi-row results through a read-only server side cursor.
+			/** 
+			 * Results are fetched from the server the given amount of rows at a time
+			 * instead of all at once or row by row. Useful for large results that
+			 * shouldn't be buffered entirely.
+			 *
+			 * \param[in] rows Rows per fetch. 0 turns the cursor off.
+			 */
+			void setPrefetchRows(unsigned long rows);
+
 			//! Asynchronously execute a %MySQL statement.
 			/** 
 			 * This function will queue the statement to be executed in a separate
@@ -328,8 +449,9 @@ namespace ASql
 			 * \param[in] set Reference to a template object.
 			 * \param[out] conversions Reference to an array to write conversion data to.
 			 * \param[out] bindings Reference to a %MySQL bind array to write data to.
+			 * \param[in] rows Amount of consecutive copies of the bindings for multi-row statements.
 			 */
-			static void buildBindings(MYSQL_STMT* const& stmt, const Data::Set& set, Data::Conversions& conversions, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order=0);
+			static void buildBindings(MYSQL_STMT* const& stmt, const Data::Set& set, Data::Conversions& conversions, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order=0, const unsigned int rows=1);
 
 			//! Bind an array of %MySQL bindings to the passed data set.
 			/** 
@@ -345,8 +467,46 @@ namespace ASql
 			 * \param[in/out] set Reference to a data set object.
 			 * \param[in] conversions Reference to an array to pass conversion data through.
 			 * \param[in] bindings Reference to a %MySQL bind array to write data to.
+			 * \param[in] offset Index of the first binding to bind the set to.
+			 */
+			static void bindBindings(Data::Set& set, Data::Conversions& conversions, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order=0, const int offset=0);
+
+			//! Where the members of a data set type lie within it along with their conversions.
+			struct Layout: public Data::Layout
+			{
+				//! Conversion of each binding. Null if it needs none.
+				std::vector<Data::Conversion*> conversions;
+			};
+
+			//! Find where the members of a data set type lie within it.
+			/** 
+			 * See Data::Layout::build(). The conversions are always filled in so
+			 * the Conversions container needn't be searched by binding.
+			 *
+			 * \param[in] set Reference to a template object.
+			 * \param[in] conversions Conversions built for the set by buildBindings().
+			 * \param[out] layout Layout of the set.
 			 */
-			static void bindBindings(Data::Set& set, Data::Conversions& conversions, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order=0);
+			static void buildLayout(const Data::Set& set, Data::Conversions& conversions, const std::deque<unsigned char>* order, Layout& layout);
+
+			//! Bind an array of %MySQL bindings to the passed data set through it's layout.
+			/** 
+			 * If the set is of the same Data::Set::sqlType() the layout was found
+			 * in it's members are bound straight from their offsets without a call to
+			 * Data::Set::getSqlIndex(). Otherwise they are bound as by the other
+			 * bindBindings().
+			 *
+			 * \param[in/out] set Reference to a data set object.
+			 * \param[in] layout Layout found by buildLayout().
+			 * \param[in] bindings Reference to a %MySQL bind array to write data to.
+			 */
+			static void bindBindings(Data::Set& set, const Layout& layout, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order=0);
+
+			//! Array of parameter layouts. One for each thread.
+			boost::scoped_array<Layout> m_paramsLayouts;
+
+			//! Array of result layouts. One for each thread.
+			boost::scoped_array<Layout> m_resultsLayouts;
 
 			//! Execute parameter part of statement
 			/** 
@@ -366,11 +526,92 @@ namespace ASql
 
 			boost::scoped_array<const bool*> m_stop;
 
+			//! Query string as it was prepared.
+			std::string m_query;
+
+			//! Connection generation each thread's statement was prepared for. 0 if not prepared.
+			boost::scoped_array<unsigned int> m_generations;
+
+			//! Prepare the statement on the current connection of a thread.
+			void prepare(const unsigned int thread);
+
+			//! Prepare the statement if the connection of the thread was opened since it last was.
+			void ready(const unsigned int thread)
+			{
+				if(m_generations[thread]!=connection.generation(thread))
+					prepare(thread);
+			}
+
+			//! True if the statement is prepared on the current connection of a thread.
+			bool prepared(const unsigned int thread) const { return m_generations[thread] && m_generations[thread]==connection.generation(thread); }
+
+			//! Multi-row version of the statement.
+			struct Batch
+			{
+				Batch(): stmt(0), rows(0), built(false) {}
+				~Batch() { close(); }
+				void close();
+
+				//! Pointer to actual %MySQL C API prepared statement object.
+				MYSQL_STMT* stmt;
+
+				//! Amount of parameter rows the statement takes.
+				unsigned int rows;
+
+				//! Conversions for the parameters of all rows.
+				Data::Conversions conversions;
+
+				//! Parameter bindings for all rows.
+				boost::scoped_array<MYSQL_BIND> bindings;
+
+				//! True once the bindings have been built.
+				bool built;
+			};
+
+			//! Parameter rows per batch. 0 if not batching.
+			unsigned int m_batchRows;
+
+			//! Array of multi-row statements. One for each thread.
+			boost::scoped_array<Batch> m_batches;
+
+			//! Array of multi-row statements for the rows left over after the full batches. One for each thread.
+			/** 
+			 * Only the last amount of rows used is kept so sets of parameters of the same size
+			 * don't prepare one every time.
+			 */
+			boost::scoped_array<Batch> m_tails;
+
+			//! True if results should be buffered entirely with mysql_stmt_store_result().
+			bool m_storeResult;
+
+			//! Rows per fetch through a read-only cursor. 0 if no cursor.
+			unsigned long m_prefetchRows;
+
+			//! Apply the cursor attributes to the statement of a thread.
+			void setCursor(const unsigned int thread);
+
+			//! Prepare a multi-row version of the statement.
+			/** 
+			 * \param[out] batch Batch to prepare.
+			 * \param[in] rows Amount of parameter rows it should take.
+			 * \param[in] thread Thread it is prepared on.
+			 */
+			void prepareBatch(Batch& batch, const unsigned int rows, const unsigned int thread);
+
+			//! Pull the next rows from parameters and execute them with a multi-row statement.
+			/** 
+			 * \param[in] batch Multi-row statement. It's amount of rows must be left in parameters.
+			 * \param[in] parameters Parameters to use in query
+			 * \param[in] thread Thread it is executed on.
+			 */
+			void executeBatch(Batch& batch, const Data::SetContainer& parameters, const unsigned int thread);
+
 			friend class ConnectionPar<Statement>;
 			friend class Transaction<Statement>;
 		};
 
 		typedef ASql::Transaction<Statement> Transaction;
+		typedef ASql::StatementRegistry<Connection, Statement> StatementRegistry;
 
 		//! Handle retrieval of variable length data chunks.
 		/** 
@@ -489,6 +730,7 @@ namespace ASql
 		};
 
 		extern const char CodeConversionErrorMsg[];
+		extern const char BatchQueryErrorMsg[];
 	}
 }
 
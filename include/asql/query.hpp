@@ -149,6 +149,7 @@ namespace ASql
 		void clearParameters() { m_sharedData->destroyParameters(); } 
 
 		template<class T> friend class ConnectionPar;
+		template<class Parameters, class Results> friend class ResultCache;
 
 	protected:
 		//! Constructed by derived classes
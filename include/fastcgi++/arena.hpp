@@ -0,0 +1,110 @@
+//! \file arena.hpp Defines the Fastcgipp::Arena class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+
+#include <boost/thread/mutex.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Region based memory allocator
+	/*!
+	 * Memory is handed out from large chunks by simply bumping a pointer and is only ever
+	 * returned all at once with release() or destruction. Chunks are recycled through a
+	 * process wide free list so an arena that is created and destroyed with every request
+	 * doesn't touch the global heap once things have warmed up. Allocations too large for
+	 * a chunk get a block of their own that is freed on release.
+	 *
+	 * An arena itself should only be used by one thread at a time.
+	 */
+	class Arena
+	{
+	public:
+		Arena(): m_chunks(0), m_position(0), m_end(0) { }
+		~Arena() { release(); }
+
+		//! Allocate a block of memory
+		/*!
+		 * The memory is suitably aligned for any type and remains valid until release() is
+		 * called or the arena is destroyed.
+		 *
+		 * @param[in] size Size in bytes of the block
+		 * @return Pointer to the first byte of the block
+		 */
+		void* allocate(size_t size);
+
+		//! Allocate an array
+		/*!
+		 * No constructors are called so this is only suitable for POD types.
+		 *
+		 * @param[in] count Amount of elements in the array
+		 * @return Pointer to the first element of the array
+		 */
+		template<class T> T* allocate(size_t count) { return static_cast<T*>(allocate(count*sizeof(T))); }
+
+		//! Free everything allocated from the arena
+		void release();
+
+		//! Size in bytes of the chunks memory is handed out from
+		static const size_t chunkSize=16384;
+		//! Maximum amount of unused chunks kept in the free list
+		static const size_t maxFreeChunks=1024;
+
+	private:
+		//! Header at the start of every block of memory owned by an arena
+		struct Chunk
+		{
+			//! Next block owned by the same arena or the next free chunk
+			Chunk* next;
+			//! True if the block is a regular chunk that can be recycled
+			bool recycle;
+			//! Pointer to the first byte following the header
+			char* data() { return (char*)this+headerSize; }
+		};
+		//! Alignment of every allocation
+		static const size_t alignment=16;
+		//! Size of the chunk header rounded up to the alignment
+		static const size_t headerSize=(sizeof(Chunk)+alignment-1)/alignment*alignment;
+
+		//! Blocks owned by the arena. The first one is the chunk currently allocated from.
+		Chunk* m_chunks;
+		//! First free byte in the current chunk
+		char* m_position;
+		//! One past the last byte in the current chunk
+		char* m_end;
+
+		//! Chunks available for reuse by any arena
+		static Chunk* s_freeChunks;
+		//! Amount of chunks in s_freeChunks
+		static size_t s_freeCount;
+		//! Mutex to make accessing s_freeChunks thread safe
+		static boost::mutex s_freeMutex;
+
+		Arena(const Arena&);
+		Arena& operator=(const Arena&);
+	};
+}
+
+#endif
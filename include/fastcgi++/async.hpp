@@ -0,0 +1,208 @@
+//! \file async.hpp Defines the Fastcgipp::AsyncRequest and Fastcgipp::Fiber classes
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+#include <deque>
+
+#include <ucontext.h>
+
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+
+#include <fastcgi++/request.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! A function executed on a stack of it's own that can suspend itself
+	/*!
+	 * resume() switches to the fiber and returns once the function calls suspend() or returns.
+	 * The next call to resume() carries on right after suspend(). Resuming may be done from a
+	 * different thread every time but never from two at once.
+	 *
+	 * Stacks are guarded against overflow by an inaccessible page and are kept for reuse by
+	 * other fibers once done with.
+	 */
+	class Fiber
+	{
+	public:
+		//! Construct without allocating anything yet
+		/*!
+		 * @param[in] function Function to execute
+		 * @param[in] stackSize Size in bytes of the stack the function is executed on
+		 */
+		Fiber(const boost::function<void()>& function, size_t stackSize);
+		//! The fiber must not be suspended when destroyed
+		~Fiber();
+
+		//! Switch to the fiber until it suspends itself or returns
+		void resume();
+		//! Switch back to whatever called resume(). Only to be called from the fiber itself.
+		void suspend();
+
+		//! True once resume() has been called at least once
+		bool started() const { return m_started; }
+		//! True once the function has returned
+		bool finished() const { return m_finished; }
+
+	private:
+		//! The function to execute
+		boost::function<void()> m_function;
+		//! Size in bytes of the usable part of the stack
+		const size_t m_stackSize;
+		//! Start of the memory holding the stack and it's guard page
+		char* m_stack;
+		//! Saved state of the fiber itself
+		ucontext_t m_context;
+		//! Saved state of whatever last called resume()
+		ucontext_t m_caller;
+		bool m_started;
+		bool m_finished;
+
+		//! Entry point of every fiber
+		/*!
+		 * makecontext() only passes int arguments so the pointer to the fiber is split in two.
+		 */
+		static void trampoline(unsigned int high, unsigned int low);
+
+		//! Size in bytes of a memory page
+		static size_t pageSize();
+		//! Get a stack from the pool or map a new one
+		static char* allocateStack(size_t size);
+		//! Give a stack back to the pool or unmap it
+		static void freeStack(char* stack, size_t size);
+
+		Fiber(const Fiber&);
+		Fiber& operator=(const Fiber&);
+	};
+
+	//! %Request handling class for responses written as straight line code
+	/*!
+	 * Instead of response() derivations define handle() which is executed on a Fiber of it's own.
+	 * Whenever it has to wait for something, like an ASql query or a timer, it calls await() or
+	 * sleep() which suspend it until the message it's waiting for is passed to the request. In
+	 * the meantime the thread executing it gets on with other requests, just as it would if
+	 * response() returned false, so nothing blocks and no state has to be stashed in between.
+	 * A query is awaited by giving it resumer() as callback.
+	 *
+	 * \code
+	 * void handle()
+	 * {
+	 *     query.setCallback(resumer());
+	 *     statement.queue(query);
+	 *     await();
+	 *     out << query.results()->data.size() << " results";
+	 * }
+	 * \endcode
+	 *
+	 * Should the request be destroyed before handle() returns, for example because it timed out
+	 * or the connection closed, the fiber is unwound so the destructors of the objects on it's
+	 * stack are run. This is done by await() throwing an exception that isn't derived from
+	 * std::exception so it must never be swallowed by a catch(...) in handle(). By the time it's
+	 * thrown the members of the derived class have already been destroyed.
+	 *
+	 * \tparam charT Character type for internal processing (wchar_t or char)
+	 */
+	template<class charT> class AsyncRequest: public Request<charT>
+	{
+	public:
+		//! Default size in bytes of the stack handle() is executed on
+		static const size_t defaultStackSize=262144;
+
+		//! Initializes what it can. See Request::Request().
+		/*!
+		 * \param maxPostSize Maximum size of post data. See Request::Request().
+		 * \param lazyEnvironment Should the environment be decoded lazily. See Request::Request().
+		 * \param stackSize Size in bytes of the stack handle() is executed on. No memory is
+		 * touched until it's used so a generous size is cheap.
+		 */
+		AsyncRequest(const size_t maxPostSize=0, const bool lazyEnvironment=false, const size_t stackSize=defaultStackSize);
+		//! Unwinds handle() should it still be suspended
+		~AsyncRequest();
+
+		//! Type of the message passed to the request by sleep()
+		static const int WAKE=-2;
+
+	protected:
+		//! Response generator executed on a stack of it's own
+		/*!
+		 * Called once all request data has been received from the other side. The request is
+		 * complete once it returns. Exceptions derived from std::exception are passed to
+		 * Request::errorHandler() as they would be from response().
+		 */
+		virtual void handle() =0;
+
+		//! Suspend handle() until a message is passed to the request
+		/*!
+		 * Messages passed while handle() is busy or sleeping aren't lost. They are returned by
+		 * the following calls in the order they were passed.
+		 *
+		 * @return The message. It stays valid until the next call to await() or sleep().
+		 */
+		const Message& await();
+
+		//! Suspend handle() for some time
+		/*!
+		 * Messages passed meanwhile are kept for await().
+		 *
+		 * @param[in] milliseconds How long to sleep
+		 */
+		void sleep(unsigned int milliseconds);
+
+		//! Callback for asynchronous operations like ASql queries that passes a message to the request
+		/*!
+		 * The function is built on the first call and the same one returned from then on.
+		 *
+		 * @return Function that passes a message of type 1 to the request
+		 */
+		const boost::function<void()>& resumer()
+		{
+			if(m_resumer.empty())
+				m_resumer=boost::bind(this->callback(), Message(1));
+			return m_resumer;
+		}
+
+	private:
+		//! Resumes handle() with the message that was passed
+		bool response();
+
+		//! Executes handle() on the fiber
+		void run();
+
+		//! Thrown by await() to unwind the fiber
+		struct Unwind { };
+
+		//! The fiber handle() is executed on
+		Fiber m_fiber;
+		//! Messages passed while handle() wasn't waiting for them
+		std::deque<Message> m_deferred;
+		//! The message last returned by await()
+		Message m_awaited;
+		//! True if the fiber is being unwound
+		bool m_unwinding;
+		//! Shared callback returned by resumer()
+		boost::function<void()> m_resumer;
+	};
+}
+
+#endif
@@ -0,0 +1,180 @@
+//! \file cache.hpp Defines the Fastcgipp::ResponseCache class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <string>
+#include <ostream>
+
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Size bounded cache of complete responses
+	/*!
+	 * Responses are stored as the FastCGI OUT records that were sent for them, headers and
+	 * padding included, so a hit is answered by copying them straight into the Transceiver
+	 * buffer with nothing but the request ID rewritten. Once the stored responses take up more
+	 * than the capacity the least recently used ones are evicted.
+	 *
+	 * Requests make use of it by way of Request::cacheKey(). The cache is safe to use from any
+	 * thread, so entries can be erased from outside of requests once what they were generated
+	 * from changes.
+	 */
+	class ResponseCache
+	{
+	public:
+		//! A stored response
+		struct Response
+		{
+			Response(): etag(0) { }
+			//! The OUT records. Shared so they needn't be copied out of the cache.
+			boost::shared_ptr<const std::string> records;
+			//! Numeric entity tag of the response or 0 if it has none
+			int etag;
+			//! Time the response was last modified at or not_a_date_time if unknown
+			boost::posix_time::ptime lastModified;
+		};
+
+		//! A cache with a capacity of 0 stores nothing
+		ResponseCache(): m_capacity(0), m_maxEntrySize(0), m_bytes(0), m_oldest(0), m_newest(0), m_hits(0), m_misses(0), m_notModified(0), m_stores(0), m_evictions(0) { }
+		~ResponseCache() { clear(); }
+
+		//! Set how much the cache may store
+		/*!
+		 * Should it already hold more than the new capacity, the least recently used responses
+		 * are evicted right away.
+		 *
+		 * @param[in] capacity Size in bytes all responses together may take up. 0 disables the cache.
+		 * @param[in] maxEntrySize Size in bytes of the largest response stored. 0 means an eighth
+		 * of the capacity.
+		 */
+		void setCapacity(size_t capacity, size_t maxEntrySize=0);
+
+		//! Size in bytes all responses together may take up
+		size_t getCapacity() const { return m_capacity; }
+
+		//! Size in bytes of the largest response stored
+		size_t getMaxEntrySize() const { return m_maxEntrySize; }
+
+		//! True if the cache stores anything at all
+		bool enabled() const { return m_capacity; }
+
+		//! Look up a response
+		/*!
+		 * @param[in] key Key the response was stored with
+		 * @param[out] response Set to the response if one was found
+		 * @return True if a response was found that hasn't expired
+		 */
+		bool find(const std::string& key, Response& response);
+
+		//! Store a response
+		/*!
+		 * A response already stored with the same key is replaced. Responses larger than
+		 * getMaxEntrySize() are ignored.
+		 *
+		 * @param[in] key Key to find the response with
+		 * @param[in] response The response
+		 * @param[in] maxAge Seconds until the response expires. 0 means it only goes once it's
+		 * evicted or erased.
+		 */
+		void store(const std::string& key, const Response& response, unsigned int maxAge);
+
+		//! Erase a response
+		/*!
+		 * @return True if there was one stored with the key
+		 */
+		bool erase(const std::string& key);
+
+		//! Erase all responses
+		void clear();
+
+		//! Amount of responses stored
+		size_t size();
+
+		//! Size in bytes of all responses stored
+		size_t bytes();
+
+		//! Count a request answered with 304 Not Modified from the cache
+		void notModified() { m_notModified.fetch_add(1, boost::memory_order_relaxed); }
+
+		//! Output the counters of the cache in the Prometheus text format
+		void dumpMetrics(std::ostream& stream);
+
+	private:
+		//! A stored response in the list ordered by use
+		struct Node
+		{
+			Node(const std::string& key_): key(key_), older(0), newer(0), expires(0) { }
+			const std::string key;
+			Response response;
+			Node* older;
+			Node* newer;
+			//! Time the response expires at in milliseconds (see Timers::now()). 0 if never.
+			uint64_t expires;
+		};
+
+		typedef boost::unordered_map<std::string, Node*> Nodes;
+
+		//! Size in bytes all responses together may take up
+		size_t m_capacity;
+		//! Size in bytes of the largest response stored
+		size_t m_maxEntrySize;
+		//! Size in bytes of all responses stored
+		size_t m_bytes;
+		//! The responses
+		Nodes m_nodes;
+		//! The least recently used response
+		Node* m_oldest;
+		//! The most recently used response
+		Node* m_newest;
+		//! Protects everything but the counters
+		boost::mutex m_mutex;
+
+		boost::atomic<uint64_t> m_hits;
+		boost::atomic<uint64_t> m_misses;
+		boost::atomic<uint64_t> m_notModified;
+		boost::atomic<uint64_t> m_stores;
+		boost::atomic<uint64_t> m_evictions;
+
+		//! Take a node out of the list ordered by use
+		void unlink(Node* node);
+		//! Put a node at the newest end of the list ordered by use
+		void link(Node* node);
+		//! Unlink, forget and delete a node
+		void remove(Node* node);
+		//! Evict the least recently used responses until the cache is within it's capacity
+		void shrink();
+
+		ResponseCache(const ResponseCache&);
+		ResponseCache& operator=(const ResponseCache&);
+	};
+}
+
+#endif
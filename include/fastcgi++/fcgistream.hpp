@@ -23,9 +23,10 @@
 #define FCGISTREAM_HPP
 
 #include <iosfwd>
-#include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/categories.hpp>
-#include <boost/iostreams/concepts.hpp>
+#include <ostream>
+#include <streambuf>
+#include <vector>
+#include <string>
 
 #include <fastcgi++/protocol.hpp>
 #include <fastcgi++/transceiver.hpp>
@@ -168,53 +169,226 @@ namespace Fastcgipp
 	 */
 	enum OutputEncoding {NONE, HTML, URL};
 
+	//! Find the first character in a string that has to be escaped
+	/*!
+	 * The characters to escape are those in the tables of OutputEncoding. Characters outside of
+	 * the ASCII range are never escaped. Where SSE2 is available char strings are scanned
+	 * sixteen characters at a time.
+	 *
+	 * @param[in] begin Pointer to the first character of the string
+	 * @param[in] end Pointer to one past the last character of the string
+	 * @param[in] encoding Encoding to escape for. NONE escapes nothing.
+	 * @return Pointer to the first character to escape or end if there is none
+	 */
+	const char* findEscape(const char* begin, const char* end, OutputEncoding encoding);
+	//! Find the first character in a wide string that has to be escaped
+	/*!
+	 * @sa findEscape(const char*, const char*, OutputEncoding)
+	 */
+	const wchar_t* findEscape(const wchar_t* begin, const wchar_t* end, OutputEncoding encoding);
+
+	//! Get the escape sequence for a character
+	/*!
+	 * @param[in] c Character to escape
+	 * @param[in] encoding Encoding to escape for
+	 * @return Null terminated escape sequence or null if the character needn't be escaped
+	 */
+	const char* escapeSequence(wchar_t c, OutputEncoding encoding);
+
+	//! Controls how a Fcgistream groups its output into FastCGI records
+	/*!
+	 * Output collects in the stream buffer and goes out as records once the buffer fills or the
+	 * stream is flushed. Larger buffers mean larger records for big responses while a minimum
+	 * flush size or corking the stream keeps frequent flushes from producing lots of tiny
+	 * records. Whatever is buffered when the request completes is always sent and ends up in
+	 * the same write as the END_REQUEST record.
+	 */
+	struct OutputPolicy
+	{
+		//! Size in characters of the stream buffer
+		size_t bufferSize;
+		//! flush() only sends output once at least this many characters are buffered
+		size_t minFlushSize;
+		//! Pad records so their size is a multiple of eight bytes as the specification recommends
+		bool padding;
+
+		OutputPolicy(): bufferSize(8192), minFlushSize(0), padding(true) { }
+	};
+
+	//! Copy of the records built by a FcgistreamSink
+	/*!
+	 * Used to fill the ResponseCache. Should the records outgrow the limit or a region of a
+	 * file be sent straight from the file, the copy is abandoned.
+	 */
+	struct RecordCapture
+	{
+		RecordCapture(): limit(0), abandoned(false) { }
+		//! The records including their headers and padding
+		std::string records;
+		//! Size in bytes the records may take up
+		size_t limit;
+		//! True if the records couldn't all be copied
+		bool abandoned;
+		//! Copy a record unless the capture is abandoned
+		void append(const Protocol::Header& header, const char* content);
+		//! Abandon the capture and free the records
+		void abandon() { abandoned=true; std::string().swap(records); }
+	};
+
 	//! Encapsulates data into FastCGI records to be sent back to the web server
-	class FcgistreamSink: public boost::iostreams::device<boost::iostreams::output, char>
+	/*!
+	 * Records are as large as the protocol allows and may span chunks of the Transceiver
+	 * buffer.
+	 */
+	class FcgistreamSink
 	{
 	private:
 		Protocol::FullId m_id;
 		Protocol::RecordType m_type;
 		Transceiver* m_transceiver;
+		bool m_padding;
+		//! Where records are copied to or null
+		RecordCapture* m_capture;
+		//! Build the header of the next record for the amount of content remaining
+		Protocol::Header header(size_t remaining) const;
 	public:
+		FcgistreamSink(): m_transceiver(0), m_padding(true), m_capture(0) { }
+
 		std::streamsize write(const char* s, std::streamsize n);
 
 		void set(Protocol::FullId id, Transceiver &transceiver, Protocol::RecordType type) {m_id=id, m_type=type, m_transceiver=&transceiver;}
+		//! Set whether records are padded to a multiple of eight bytes
+		void setPadding(bool padding) { m_padding=padding; }
+		//! Copy every record built from now on. Null stops copying.
+		void setCapture(RecordCapture* capture) { m_capture=capture; }
 		void dump(const char* data, size_t size) { write(data, size); }
 		void dump(std::basic_istream<char>& stream);
+		//! Send a region of a file
+		/*!
+		 * Regions of regular files are queued in the Transceiver to be sent directly from the
+		 * file. Anything else is read and copied into records.
+		 *
+		 * @param[in] fd File descriptor of the file. It is duplicated so it may be closed right away.
+		 * @param[in] offset Offset in the file of the first byte to send. Ignored for files that can't be seeked.
+		 * @param[in] size Amount of bytes to send. Regions of regular files are cut short at the end of the file.
+		 */
+		void dump(int fd, off_t offset, size_t size);
+	};
+
+	//! Stream buffer that builds FastCGI records from client output
+	/*!
+	 * Output is formatted straight into the put area of this buffer and handed to
+	 * FcgistreamSink::write() when it fills or is flushed, which builds the records in the
+	 * Transceiver buffer with a single copy. Wide output is converted to UTF-8 on the way.
+	 * Writes at least as large as the buffer skip it altogether. Space can't be reserved in
+	 * the Transceiver buffer itself across calls since it stays locked between
+	 * Transceiver::requestWrite() and Transceiver::secureWrite().
+	 *
+	 * With an output encoding other than NONE the put area is kept empty so that every
+	 * character goes through xsputn() or overflow() to be escaped.
+	 *
+	 * @tparam charT Character type (char or wchar_t)
+	 */
+	template<class charT> class FcgistreamBuf: public std::basic_streambuf<charT>
+	{
+	public:
+		typedef typename std::basic_streambuf<charT>::int_type int_type;
+		typedef typename std::basic_streambuf<charT>::traits_type traits_type;
+
+		FcgistreamBuf(): m_encoding(NONE), m_corked(false) { setPolicy(OutputPolicy()); }
+
+		//! Arguments passed directly to FcgistreamSink::set()
+		void set(Protocol::FullId id, Transceiver& transceiver, Protocol::RecordType type) { m_sink.set(id, transceiver, type); }
+		//! Sets the output encoding
+		void setEncoding(OutputEncoding encoding) { m_encoding=encoding; place(this->pptr()); }
+		//! Sets the output policy. Anything buffered is sent first.
+		void setPolicy(const OutputPolicy& policy);
+		//! Gets the output policy
+		const OutputPolicy& policy() const { return m_policy; }
+		//! Hold back output on flushes until uncork() is called
+		void cork() { m_corked=true; }
+		//! Stop holding back output and send anything buffered
+		void uncork() { m_corked=false; emit(); }
+		//! Sends buffered data and then the raw data passed
+		void dump(const char* data, size_t size) { emit(); m_sink.dump(data, size); }
+		//! Sends buffered data and then the raw stream passed
+		void dump(std::basic_istream<char>& stream) { emit(); m_sink.dump(stream); }
+		//! Sends buffered data and then the file region passed
+		void dump(int fd, off_t offset, size_t size) { emit(); m_sink.dump(fd, offset, size); }
+		//! Send the contents of the buffer regardless of the output policy
+		void emit();
+		//! Argument passed directly to FcgistreamSink::setCapture()
+		void setCapture(RecordCapture* capture) { m_sink.setCapture(capture); }
+
+	protected:
+		int_type overflow(int_type c);
+		std::streamsize xsputn(const charT* s, std::streamsize n);
+		int sync();
+
+	private:
+		//! Builds the records
+		FcgistreamSink m_sink;
+		//! Current output encoding
+		OutputEncoding m_encoding;
+		//! Current output policy
+		OutputPolicy m_policy;
+		//! True if flushes are being held back
+		bool m_corked;
+		//! Output waiting to be sent
+		std::vector<charT> m_buffer;
+		//! Scratch space for converting wide output to UTF-8
+		std::vector<char> m_converted;
+
+		//! Pointer to the first character of the buffer
+		charT* begin() { return m_buffer.empty()?0:&m_buffer[0]; }
+		//! Pointer to one past the last character of the buffer
+		charT* end() { return begin()+m_buffer.size(); }
+		//! Set the put area to start at position
+		void place(charT* position) { this->setp(position, m_encoding==NONE?end():position); }
+		//! Append data to the buffer without escaping it
+		void append(const charT* data, size_t size);
+		//! Pass data on to the sink converting it if need be
+		void send(const charT* data, size_t size);
 	};
 
 	//! Stream class for output of client data through FastCGI
 	/*!
-	 * This class is derived from std::basic_ostream<charT, traits>. It acts just
-	 * the same as any stream does with the added feature of the dump() function
-	 * and the ability to set output %encoding with the setEncoding() function
-	 * and the Fastcgipp::encoding manipulator.
+	 * This class is derived from std::basic_ostream<charT>. It acts just
+	 * the same as any stream does with the added feature of the dump() function,
+	 * the ability to set output %encoding with the setEncoding() function
+	 * and the Fastcgipp::encoding manipulator, and control over how output is
+	 * grouped into records with setPolicy(), cork() and uncork().
 	 *
 	 * @tparam charT Character type (char or wchar_t)
-	 * @tparam traits Character traits
 	 * @sa OutputEncoding
+	 * @sa OutputPolicy
 	 */
-	template <typename charT> class Fcgistream: public boost::iostreams::filtering_stream<boost::iostreams::output, charT>
+	template <typename charT> class Fcgistream: public std::basic_ostream<charT>
 	{
 	private:
-		struct Encoder: public boost::iostreams::multichar_filter<boost::iostreams::output, charT>
-		{
-			template<typename Sink> std::streamsize write(Sink& dest, const charT* s, std::streamsize n);
-			OutputEncoding m_state;
-			Encoder(): m_state(NONE) {}
-		};
-		
-		Encoder& m_encoder;
-
-		FcgistreamSink& m_sink;
+		FcgistreamBuf<charT> m_buffer;
 
 	public:
-		Fcgistream();
+		Fcgistream(): std::basic_ostream<charT>(0) { this->rdbuf(&m_buffer); }
 		//! Arguments passed directly to FcgistreamSink::set()
-		void set(Protocol::FullId id, Transceiver& transceiver, Protocol::RecordType type) { m_sink.set(id, transceiver, type); }
+		void set(Protocol::FullId id, Transceiver& transceiver, Protocol::RecordType type) { m_buffer.set(id, transceiver, type); }
 
 		//! Called to flush all buffers to the sink
-		void flush() { boost::iostreams::filtering_stream<boost::iostreams::output, charT>::strict_sync(); }
+		/*!
+		 * Output may be held back by the output policy or by cork().
+		 */
+		void flush() { std::basic_ostream<charT>::flush(); }
+
+		//! Sends all buffered output regardless of the output policy
+		void drain() { m_buffer.emit(); }
+
+		//! Copy every record sent from now on
+		/*!
+		 * Output still buffered is copied once it's sent.
+		 *
+		 * @param[in] capture Where to copy the records to. Null stops copying.
+		 */
+		void setCapture(RecordCapture* capture) { m_buffer.setCapture(capture); }
 		
 		//! Dumps raw data directly into the FastCGI protocol
 		/*!
@@ -225,7 +399,7 @@ namespace Fastcgipp
 		 * @param[in] data Pointer to first byte of data to send
 		 * @param[in] size Size in bytes of data to be sent
 		 */
-		void dump(const char* data, size_t size) { flush(); m_sink.dump(data, size); }
+		void dump(const char* data, size_t size) { m_buffer.dump(data, size); }
 		//! Dumps an input stream directly into the FastCGI protocol
 		/*!
 		 * This function exists as a mechanism to dump a raw input stream out this stream bypassing
@@ -234,7 +408,21 @@ namespace Fastcgipp
 		 *
 		 * @param[in] stream Reference to input stream that should be transmitted.
 		 */
-		void dump(std::basic_istream<char>& stream) { flush(); m_sink.dump(stream); }
+		void dump(std::basic_istream<char>& stream) { m_buffer.dump(stream); }
+		//! Dumps a region of a file directly into the FastCGI protocol
+		/*!
+		 * For regular files only the record headers are built in memory. The file data itself
+		 * is sent by the kernel with sendfile() once the records are transmitted, so this is
+		 * the way to send static files. The file descriptor is duplicated and kept open until
+		 * the data is sent so the caller may close it right after this returns. Should the file
+		 * shrink before then, the missing data is sent as zeros. Files that aren't regular, like
+		 * pipes, are read up to size bytes and copied.
+		 *
+		 * @param[in] fd File descriptor of the file to send from
+		 * @param[in] offset Offset in the file of the first byte to send
+		 * @param[in] size Amount of bytes to send
+		 */
+		void dump(int fd, off_t offset, size_t size) { m_buffer.dump(fd, offset, size); }
 
 		//! Sets the output encoding for this stream
 		/*!
@@ -243,7 +431,20 @@ namespace Fastcgipp
 		 * @param[in] x Encoding type to use
 		 * @sa OutputEncoding
 		 */
-		void setEncoding(OutputEncoding x) { m_encoder.m_state=x; }
+		void setEncoding(OutputEncoding x) { m_buffer.setEncoding(x); }
+
+		//! Sets the output policy for this stream
+		void setPolicy(const OutputPolicy& policy) { m_buffer.setPolicy(policy); }
+		//! Gets the output policy of this stream
+		const OutputPolicy& policy() const { return m_buffer.policy(); }
+		//! Hold back output on flushes until uncork() is called
+		/*!
+		 * Output is still sent whenever the buffer fills, with dump() and when the request
+		 * completes.
+		 */
+		void cork() { m_buffer.cork(); }
+		//! Stop holding back output and send anything buffered
+		void uncork() { m_buffer.uncork(); }
 	};
 
 	//! Stream manipulator for setting output encoding.
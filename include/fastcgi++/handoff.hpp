@@ -0,0 +1,108 @@
+//! \file handoff.hpp Defines the Fastcgipp::Handoff class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Passes the listening socket and connections on to a successor process
+	/*!
+	 * The successor is started with one end of a UNIX domain socket pair whose file descriptor
+	 * number is put in the environment variable named by #environment. File descriptors are
+	 * passed over it with SCM_RIGHTS, each message tagged by a single byte of data.
+	 *
+	 *  1. The predecessor sends its listening socket tagged #LISTENER.
+	 *  2. The successor uses it in place of whatever it was told to listen on and replies with
+	 *     #READY once it is set up.
+	 *  3. The predecessor stops accepting connections. From then on it passes every connection
+	 *     that is idle on to the successor, a batch at a time tagged #CONNECTIONS.
+	 *  4. Closing the channel ends the handoff.
+	 *
+	 * Should the successor close the channel before it's ready the predecessor carries on as if
+	 * nothing happened. Connections are only passed on while nothing of them is held in user
+	 * space. Anything the other side has sent meanwhile stays in the socket for the successor.
+	 */
+	class Handoff
+	{
+	public:
+		//! Tags of the messages sent over the channel
+		enum Tag { LISTENER='L', READY='R', CONNECTIONS='C' };
+
+		//! Name of the environment variable the channel is passed to the successor in
+		static const char environment[];
+
+		//! Maximum amount of file descriptors passed in a single message
+		static const size_t maxFds=252;
+
+		//! Start a successor process
+		/*!
+		 * The process is started with posix_spawnp() so the path is searched for the command
+		 * and nothing unsafe happens between fork and exec in a threaded process. Only file
+		 * descriptors without FD_CLOEXEC set are inherited by it.
+		 *
+		 * @param[in] command The program and it's arguments. If empty, the command line of the
+		 * calling process is read from /proc/self/cmdline.
+		 * @param[out] pid Process id of the successor
+		 * @return Our end of the channel or -1 should the process not have been started
+		 */
+		static int spawn(const std::vector<std::string>& command, pid_t& pid);
+
+		//! Take the channel passed to us by a predecessor
+		/*!
+		 * The environment variable is removed so that it's only ever taken once.
+		 *
+		 * @return The channel or -1 should the process not have been started by spawn()
+		 */
+		static int inherited();
+
+		//! Pass file descriptors over the channel
+		/*!
+		 * @param[in] channel The channel
+		 * @param[in] tag Tag of the message
+		 * @param[in] fds File descriptors to pass. No more than maxFds.
+		 * @param[in] count Amount of file descriptors
+		 * @return True on success
+		 */
+		static bool send(int channel, Tag tag, const int* fds=0, size_t count=0);
+
+		//! Receive a message from the channel
+		/*!
+		 * The file descriptors received have FD_CLOEXEC set.
+		 *
+		 * @param[in] channel The channel
+		 * @param[out] fds File descriptors passed with the message are appended to this
+		 * @param[in] block If false, nothing waits for a message to arrive
+		 * @return The tag of the message, 0 if the channel was closed or -1 if there was no
+		 * message or an error
+		 */
+		static int receive(int channel, std::vector<int>& fds, bool block);
+	};
+}
+
+#endif
@@ -36,6 +36,7 @@
 
 #include <fastcgi++/exceptions.hpp>
 #include <fastcgi++/protocol.hpp>
+#include <fastcgi++/arena.hpp>
 
 //! Topmost namespace for the fastcgi++ library
 namespace Fastcgipp
@@ -53,6 +54,10 @@ namespace Fastcgipp
 		 * is omitted from the class so it can be linked in an associative
 		 * container.
 		 *
+		 * File data larger than Environment::postSpillSize is written to an unlinked temporary
+		 * file as it arrives and mapped back into memory once complete, so it only occupies
+		 * page cache rather than heap.
+		 *
 		 * @tparam charT Type of character to use in the value string (char or wchar_t)
 		 */
 		template<class charT> struct Post
@@ -70,24 +75,37 @@ namespace Fastcgipp
 			const char* data() const { return m_data; }
 			//! Size of file data
 			size_t size() const { return m_size; }
-			//! Expropriates the file data. Beyond this you must free it when done
-			char* steal() const { char* ptr=m_data; m_data=0; m_size=0; return ptr; }
+			//! Expropriates the file data. Beyond this you must free it with delete [] when done
+			/*!
+			 * Should the data be mapped from a temporary file it is copied into a regular array
+			 * first.
+			 */
+			char* steal() const;
 
-			Post(): filename(value), m_data(0), m_size(0) {}
+			Post(): filename(value), m_data(0), m_size(0), m_mapped(false) {}
 			Post(const Post& x):
 				type(x.type),
 				value(x.value),
 				filename(value),
 				contentType(x.contentType),
-				m_data(x.steal()),
-				m_size(x.m_size)
-			{}
-			~Post() { delete [] m_data; }
+				m_data(x.m_data),
+				m_size(x.m_size),
+				m_mapped(x.m_mapped)
+			{
+				x.m_data=0;
+				x.m_size=0;
+				x.m_mapped=false;
+			}
+			~Post() { release(); }
 		private:
 			//! Pointer to file data
 			mutable char* m_data;
 			//! Size of data in bytes pointed to by data.
 			mutable size_t m_size;
+			//! True if m_data is mapped from a file rather than allocated with new
+			mutable bool m_mapped;
+			//! Free the file data
+			void release() const;
 			template<class T> friend class Environment;
 		};
 
@@ -192,11 +210,71 @@ namespace Fastcgipp
 		 */
 		template<class charT, class Traits> std::basic_istream<charT, Traits>& operator>>(std::basic_istream<charT, Traits>& is, Address& address);
 
+		//! Non-owning reference to a string of raw characters
+		/*!
+		 * The referenced data is not null terminated and remains owned by whoever handed out the
+		 * view.
+		 */
+		struct CharView
+		{
+			CharView(): data(0), size(0) { }
+			CharView(const char* data_, size_t size_): data(data_), size(size_) { }
+			//! Pointer to the first character
+			const char* data;
+			//! Amount of characters
+			size_t size;
+
+			const char* begin() const { return data; }
+			const char* end() const { return data+size; }
+			bool empty() const { return !size; }
+			//! Copy the characters into a std::string
+			std::string str() const { return std::string(data, size); }
+			//! Compare to a null terminated string
+			bool operator==(const char* x) const { return std::strlen(x)==size && !std::memcmp(data, x, size); }
+			bool operator!=(const char* x) const { return !(*this==x); }
+		};
+
+		//! A raw FastCGI parameter
+		/*!
+		 * The name and value point straight into the parameter record data kept by Environment
+		 * and are neither null terminated nor decoded in any way.
+		 */
+		struct Param
+		{
+			Param(const char* name_, size_t nameSize_, const char* value_, size_t valueSize_): name(name_), nameSize(nameSize_), value(value_), valueSize(valueSize_) { }
+			//! Pointer to the first character of the name
+			const char* name;
+			//! Size of the name
+			size_t nameSize;
+			//! Pointer to the first character of the value
+			const char* value;
+			//! Size of the value
+			size_t valueSize;
+
+			//! Get the name as a view
+			CharView nameView() const { return CharView(name, nameSize); }
+			//! Get the value as a view
+			CharView valueView() const { return CharView(value, valueSize); }
+			//! Orders parameters by name size and then by name
+			bool operator<(const Param& x) const;
+		};
+
+		//! Container of raw parameters
+		typedef std::vector<Param> Params;
+		template<class charT, class Traits> inline std::basic_ostream<charT, Traits>& operator<<(std::basic_ostream<charT, Traits>& os, const CharView& view) { return os << view.str().c_str(); }
+
 		//! Data structure of HTTP environment data
 		/*!
 		 * This structure contains all HTTP environment data for each individual request. The data is processed
 		 * from FastCGI parameter records.
 		 *
+		 * Should the environment be set to be lazy with setLazy() the parameter records are kept as
+		 * they are and only the few values needed by the library itself (content length, content
+		 * type, request method, addresses, ports and the cache validators) are parsed right away.
+		 * Everything else is decoded on first access through findParam(), param(), getPathInfo(),
+		 * findGet(), checkForGet() and findCookie(). In that case the string members, pathInfo,
+		 * gets and cookies should not be read directly.
+		 *
 		 * @tparam charT Character type to use for strings
 		 */
 		template<class charT> struct Environment
@@ -226,7 +304,7 @@ namespace Fastcgipp
 			//! Path Information
 			typedef std::vector<std::basic_string<charT> > PathInfo;
 			PathInfo pathInfo;
-			//! The etag the client assumes this document should have
+			//! The etag the client assumes this document should have (If-None-Match). Only numeric etags are understood. 0 if none.
 			int etag;
 			//! How many seconds the connection should be kept alive
 			int keepAlive;
@@ -287,6 +365,55 @@ namespace Fastcgipp
 			 */
 			bool checkForPost(const charT* key) const;
 
+			//! Only decode parameters as they are accessed
+			/*!
+			 * Must be called before any parameter data is filled in.
+			 *
+			 * @param[in] lazy True to decode parameters on first access
+			 */
+			void setLazy(bool lazy) { m_lazy=lazy; }
+
+			//! True if parameters are decoded on first access
+			bool isLazy() const { return m_lazy; }
+
+			//! Get the raw value of any parameter passed by the server
+			/*!
+			 * This works for every parameter, not only the ones with a member in this structure,
+			 * so things like HTTP_X_FORWARDED_FOR or SERVER_PROTOCOL can be had as well. No
+			 * decoding or character conversion is done at all and the view remains valid as long
+			 * as the environment exists. The lookup is a binary search of the parameter index.
+			 *
+			 * @param[in] name Null terminated name of the parameter, for example "HTTP_HOST"
+			 * @return View of the value. Empty if the parameter wasn't passed.
+			 */
+			CharView findParam(const char* name) const;
+
+			//! Check whether a parameter was passed by the server
+			/*!
+			 * @param[in] name Null terminated name of the parameter
+			 * @return True if the parameter was passed, even with an empty value
+			 */
+			bool checkForParam(const char* name) const;
+
+			//! Get every raw parameter passed by the server
+			/*!
+			 * The parameters are sorted by name size and then by name. Parameters passed more than
+			 * once keep the order they were received in.
+			 */
+			const Params& params() const { return m_params; }
+
+			//! Get the value of a parameter converted to charT
+			/*!
+			 * The conversion happens on first access and is kept around for subsequent ones.
+			 *
+			 * @param[in] name Null terminated name of the parameter, for example "HTTP_HOST"
+			 * @return Constant reference to the value. Empty if the parameter wasn't passed.
+			 */
+			const std::basic_string<charT>& param(const char* name) const;
+
+			//! Get the path info in both lazy and regular mode
+			const PathInfo& getPathInfo() const;
+
 			//! Parses FastCGI parameter data into the data structure
 			/*!
 			 * This function will take the body of a FastCGI parameter record and parse
@@ -301,50 +428,182 @@ namespace Fastcgipp
 			//! Consolidates POST data into a single buffer
 			/*!
 			 * This function will take arbitrarily divided chunks of raw http post
-			 * data and consolidate them into m_postBuffer.
+			 * data and consolidate them into m_postBuffer. The exception is
+			 * "multipart/form-data" which is never assembled in full but fed to an
+			 * incremental parser as it arrives. Memory used for it is bounded by the
+			 * size of the part headers, Environment::postSpillSize for file parts,
+			 * and the form values themselves.
 			 *
 			 * @param[in] data Pointer to the first byte of post data
 			 * @param[in] size Size of data in bytes
-			 * @return Returns true unless the buffer overflowed
+			 * @return Returns true unless more than contentLength bytes were received
 			 */
 			bool fillPostBuffer(const char* data, size_t size);
 
-			//! Parses "multipart/form-data" http post data into the posts object
+			//! Finishes parsing "multipart/form-data" http post data into the posts object
+			/*!
+			 * Parts are added to posts as they are completed by fillPostBuffer(). This only
+			 * discards a last part left unfinished by a truncated body.
+			 */
 			void parsePostsMultipart();
 
 			//! Parses "application/x-www-form-urlencoded" post data into the posts object.
 			void parsePostsUrlEncoded();
 
 			//! Get the post buffer
-			const char* postBuffer() const { return m_postBuffer.get(); }
+			/*!
+			 * This is always null for "multipart/form-data" as it is parsed incrementally.
+			 */
+			const char* postBuffer() const { return m_postBuffer; }
+
+			//! File parts larger than this many bytes are spilled to a temporary file
+			static const size_t postSpillSize=262144;
+			//! Maximum size of the headers of a single multipart part
+			static const size_t maxPartHeaderSize=16384;
 
 			//! Clear the post buffer
-			void clearPostBuffer() { m_postBuffer.reset(); pPostBuffer=0; }
+			/*!
+			 * The memory itself belongs to the arena and is freed along with the environment.
+			 */
+			void clearPostBuffer() { m_postBuffer=0; pPostBuffer=0; }
 
-			Environment(): requestMethod(HTTP_METHOD_ERROR), etag(0), keepAlive(0), contentLength(0), serverPort(0), remotePort(0) {}
+			Environment(): requestMethod(HTTP_METHOD_ERROR), etag(0), keepAlive(0), contentLength(0), serverPort(0), remotePort(0), m_lazy(false), m_getsDecoded(false), m_cookiesDecoded(false), m_pathInfoDecoded(false), boundary(0), boundarySize(0), m_postBuffer(0), pPostBuffer(0), m_postReceived(0), m_multipartState(MULTIPART_NONE), m_delimiter(0), m_delimiterSize(0), m_partNamed(false), m_partFile(false), m_partFd(-1), m_partSize(0) {}
+			~Environment() { discardPart(); }
 		private:
+			//! Every raw parameter sorted by name. The data they point to lives in m_arena.
+			Params m_params;
+			//! Find a raw parameter with a binary search. Returns 0 if it wasn't passed.
+			const Param* locateParam(const char* name) const;
+
+			//! True if parameters are decoded on first access
+			bool m_lazy;
+			//! True once gets has been filled in lazy mode
+			mutable bool m_getsDecoded;
+			//! True once cookies has been filled in lazy mode
+			mutable bool m_cookiesDecoded;
+			//! True once pathInfo has been filled in lazy mode
+			mutable bool m_pathInfoDecoded;
+			//! Container of values converted by param() associated with the raw value
+			typedef std::map<const char*, std::basic_string<charT> > Converted;
+			//! Values converted by param()
+			mutable Converted m_converted;
+
+			//! Decode the query string and cookies if in lazy mode and they haven't been yet
+			void decodeLazy() const;
+
+			//! Decode a PATH_INFO value into pathInfo
+			void decodePathInfo(const char* value, size_t valueSize);
+
+			//! Scratch memory for parsing that lives as long as the environment
+			Arena m_arena;
+
 			//! Raw string of characters representing the post boundary
-			boost::scoped_array<char> boundary;
+			char* boundary;
 			//! Size of boundary
 			size_t boundarySize;
 
 			//! Buffer for processing post data
-			boost::scoped_array<char> m_postBuffer;
+			char* m_postBuffer;
 			//! Pointer in buffer
 			char* pPostBuffer;
 			//! Returns minimum buffer size remaining
-			size_t minPostBufferSize(const size_t size) { return std::min(size, size_t(m_postBuffer.get()+contentLength-pPostBuffer)); }
+			size_t minPostBufferSize(const size_t size) { return std::min(size, size_t(m_postBuffer+contentLength-pPostBuffer)); }
+			//! Amount of post data received so far
+			size_t m_postReceived;
+
+			//! States of the incremental multipart parser
+			enum MultipartState
+			{
+				//! Not parsing multipart data
+				MULTIPART_NONE,
+				//! Skipping data before the first boundary
+				MULTIPART_PREAMBLE,
+				//! Accumulating the headers of a part
+				MULTIPART_HEADERS,
+				//! Passing data on to the current part
+				MULTIPART_BODY,
+				//! The closing boundary was seen or the data is malformed. Ignore the rest.
+				MULTIPART_DONE
+			};
+			//! Current state of the incremental multipart parser
+			MultipartState m_multipartState;
+			//! Part headers or a possible partial delimiter carried over between records
+			std::vector<char> m_carry;
+			//! The part delimiter "\r\n--" followed by the boundary
+			char* m_delimiter;
+			//! Size of m_delimiter
+			size_t m_delimiterSize;
+			//! True if the part being received has a name. Parts without one are ignored.
+			bool m_partNamed;
+			//! Name of the part being received
+			std::basic_string<charT> m_partName;
+			//! Filename of the part being received
+			std::basic_string<charT> m_partFilename;
+			//! Content type of the part being received
+			std::basic_string<charT> m_partContentType;
+			//! True if the part being received is a file
+			bool m_partFile;
+			//! Data of the current part that hasn't been spilled
+			std::vector<char> m_partData;
+			//! Temporary file the current part is spilled to or -1
+			int m_partFd;
+			//! Total size of the current part
+			size_t m_partSize;
+
+			//! Feed a chunk of multipart data to the incremental parser
+			void parseMultipart(const char* data, size_t size);
+			//! Pass body data on to the current part
+			void partData(const char* data, size_t size);
+			//! Parse the headers of a part held in m_carry and start it
+			void startPart(size_t size);
+			//! Complete the current part
+			void finishPart();
+			//! Throw away the current part
+			void discardPart();
 		};
 
 		//! Convert a char string to a std::wstring
 		/*!
+		 * The string is decoded as UTF-8 by utf8ToWide() and appended to the wstring. Should it
+		 * not be valid UTF-8 the wstring is left as it was and Exceptions::CodeCvt is thrown.
+		 *
 		 * @param[in] data First byte in char string
 		 * @param[in] size Size in bytes of the string (no null terminator)
 		 * @param[out] string Reference to the wstring that should be modified
-		 * @return Returns true on success, false on failure
 		 */
 		void charToString(const char* data, size_t size, std::wstring& string);
 
+		//! Decode UTF-8 into wide characters
+		/*!
+		 * Where SSE2 is available runs of ASCII are widened sixteen bytes at a time, so mostly
+		 * ASCII text is decoded about as fast as it can be copied. Anything that isn't valid UTF-8
+		 * throws Exceptions::CodeCvt. That includes truncated and overlong sequences, surrogates
+		 * and code points beyond U+10FFFF.
+		 *
+		 * @param[in] data Pointer to the first byte of UTF-8
+		 * @param[in] end Pointer to one past the last byte of UTF-8
+		 * @param[out] destination Where to write the wide characters. Must have room for end-data
+		 * of them.
+		 * @return Pointer to one past the last wide character written
+		 */
+		wchar_t* utf8ToWide(const char* data, const char* end, wchar_t* destination);
+
+		//! Encode wide characters as UTF-8
+		/*!
+		 * Where SSE2 is available runs of ASCII are narrowed sixteen characters at a time.
+		 * Surrogates and characters beyond U+10FFFF throw Exceptions::CodeCvt.
+		 *
+		 * @param[in] data Pointer to the first wide character
+		 * @param[in] end Pointer to one past the last wide character
+		 * @param[out] destination Where to write the UTF-8. Must have room for
+		 * maxUtf8Size*(end-data) bytes.
+		 * @return Pointer to one past the last byte written
+		 */
+		char* wideToUtf8(const wchar_t* data, const wchar_t* end, char* destination);
+
+		//! Most bytes wideToUtf8() encodes a single wide character in
+		const size_t maxUtf8Size=4;
+
 		//! Convert a char string to a std::string
 		/*!
 		 * @param[in] data First byte in char string
@@ -354,6 +613,21 @@ namespace Fastcgipp
 		 */
 		inline void charToString(const char* data, size_t size, std::string& string) { string.assign(data, size); }
 
+		//! Find the first occurrence of a pattern in a block of memory
+		/*!
+		 * This is what the multipart parser uses to find part delimiters. Where SSE2 is
+		 * available sixteen candidate offsets are checked at once by comparing both the first
+		 * and the last byte of the pattern, so only real candidates get a full comparison.
+		 * Otherwise it falls back to memchr() for the first byte.
+		 *
+		 * @param[in] data Pointer to the first byte of data to search
+		 * @param[in] size Size of data in bytes
+		 * @param[in] pattern Pointer to the first byte of the pattern
+		 * @param[in] patternSize Size of pattern in bytes
+		 * @return Pointer to the start of the pattern in data or data+size if it isn't there
+		 */
+		const char* findPattern(const char* data, size_t size, const char* pattern, size_t patternSize);
+
 		//! Convert a char string to an integer
 		/*!
 		 * This function is very similar to std::atoi() except that it takes start/end values
@@ -367,6 +641,17 @@ namespace Fastcgipp
 		 */
 		int atoi(const char* start, const char* end);
 
+		//! Parse an RFC 1123 HTTP date
+		/*!
+		 * This parses dates in the format "Sun, 06 Nov 1994 08:49:37 GMT" without the help of
+		 * streams or locales.
+		 *
+		 * @param[in] start Pointer to the first byte in the string
+		 * @param[in] end Pointer to the last byte in the string + 1
+		 * @return The time represented by the string or not_a_date_time if it could not be parsed
+		 */
+		boost::posix_time::ptime parseHttpDate(const char* start, const char* end);
+
 		//! Decodes a url-encoded string into a container
 		/*! 
 		 * @param[in] data Data to decode
@@ -445,18 +730,19 @@ namespace Fastcgipp
 
 			/** 
 			 * @brief Contains the time this session was last used
+			 *
+			 * Only Sessions makes use of it. Being bookkeeping rather than part of the ID
+			 * it may be refreshed through a const reference.
 			 */
-			boost::posix_time::ptime timestamp;
-
-			/** 
-			 * @brief Set to true once the random number generator has been seeded
-			 */
-			static bool seeded;
+			mutable boost::posix_time::ptime timestamp;
 
 			template<class T> friend class Sessions;
 		public:
 			/** 
 			 * @brief The default constructor initializes the ID data to a random value
+			 *
+			 * The value comes from the cryptographically secure generator of the system
+			 * (getrandom() or /dev/urandom) so it can't be guessed from other IDs.
 			 */
 			SessionId();
 
@@ -489,11 +775,24 @@ namespace Fastcgipp
 			/** 
 			 * @brief Resets the last access timestamp to the current time.
 			 */
-			void refresh() const { *const_cast<boost::posix_time::ptime*>(&timestamp)=boost::posix_time::second_clock::universal_time(); }
+			void refresh() const { timestamp=boost::posix_time::second_clock::universal_time(); }
 
 			const char* getInternalPointer() const { return data; }
+
+			/** 
+			 * @brief Hash value of the ID
+			 *
+			 * The ID data is random so it's simply taken as is. IDs made up by a client can't
+			 * crowd a hash table since only generated ones are ever stored.
+			 */
+			size_t hash() const { size_t value; std::memcpy(&value, data, sizeof(value)); return value; }
 		};
 
+		/** 
+		 * @brief Hash value of a SessionId for boost::hash
+		 */
+		inline size_t hash_value(const SessionId& x) { return x.hash(); }
+
 		/** 
 		 * @brief Output the ID data in base64 encoding
 		 */
@@ -507,6 +806,10 @@ namespace Fastcgipp
 		 *	part of the std::pair<> is a SessionId object, and the second is a object of class T (passed as
 		 *	the template parameter.
 		 *
+		 *	Cleaning up walks the whole container and nothing in it is thread safe. Applications with
+		 *	many sessions or worker threads are better off with ShardedSessions and those running in
+		 *	several processes with SharedSessions, both found in sessions.hpp.
+		 *
 		 * @tparam T Class containing session data.
 		 */
 		template<class T> class Sessions: public std::map<SessionId, T>
@@ -655,4 +958,20 @@ template<class T> typename Fastcgipp::Http::Sessions<T>::iterator Fastcgipp::Htt
 	return retVal.first;
 }
 
+namespace Fastcgipp
+{
+	namespace Exceptions
+	{
+		//! %Exception for errors spilling uploaded file data to a temporary file
+		struct PostSpill: public CodedException
+		{
+			//! Sole Constructor
+			/*!
+			 * @param[in] erno_ Associated errno
+			 */
+			PostSpill(int erno_): CodedException("Unable to spill uploaded file data to a temporary file.", erno_) { }
+		};
+	}
+}
+
 #endif
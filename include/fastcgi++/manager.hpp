@@ -22,21 +22,27 @@
 #ifndef MANAGER_HPP
 #define MANAGER_HPP
 
-#include <map>
+#include <vector>
 #include <string>
-#include <queue>
 #include <algorithm>
 #include <cstring>
+#include <new>
 
 #include <boost/bind.hpp>
-#include <boost/shared_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/pool/pool_alloc.hpp>
 #include <boost/thread.hpp>
-#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/atomic.hpp>
 
 #include <signal.h>
+#include <sys/resource.h>
 
 #include <fastcgi++/protocol.hpp>
 #include <fastcgi++/transceiver.hpp>
+#include <fastcgi++/mpscqueue.hpp>
+#include <fastcgi++/metrics.hpp>
+#include <fastcgi++/cache.hpp>
 
 //! Topmost namespace for the fastcgi++ library
 namespace Fastcgipp
@@ -65,11 +71,12 @@ namespace Fastcgipp
 		 *
 		 * @param[in] fd File descriptor to listen on.
 		 * @param[in] sendMessage_ Function Transceiver should use to communicate with Manager.
-		 * @param[in] doSetupSignals If true, signal handlers will be set up for SIGTERM and SIGUSR1. If false, no signal handlers will be set up.
+		 * @param[in] doSetupSignals If true, signal handlers will be set up for SIGTERM, SIGUSR1 and SIGHUP. If false, no signal handlers will be set up.
+		 * @param[in] workers_ Amount of worker threads to execute requests in. 0 means requests are executed in the thread calling handler().
 		 */
-		ManagerPar(int fd, const boost::function<void(Protocol::FullId, Message)>& sendMessage_, bool doSetupSignals);
+		ManagerPar(int fd, const boost::function<void(Protocol::FullId, Message)>& sendMessage_, bool doSetupSignals, unsigned int workers_);
 
-		~ManagerPar() { instance=0; }
+		virtual ~ManagerPar() { instances.erase(std::remove(instances.begin(), instances.end(), this), instances.end()); }
 
 		//! Halter for the handler() function
 		/*!
@@ -93,11 +100,35 @@ namespace Fastcgipp
 		 * @sa signalHandler()
 		 */
 		void terminate();
+
+		//! Hand over to a freshly started process and terminate
+		/*!
+		 * This function is intended to be called from a signal handler in the case of a SIGHUP.
+		 * A successor process is started and passed the listening socket through
+		 * Transceiver::handOff(). Once it is ready to take over nothing new is accepted here and
+		 * handler() terminates as it would after terminate() while idle connections are passed
+		 * on to the successor. Requests in progress are therefore completed and the successor
+		 * picks up new ones without a gap. Should the successor fail to start up nothing
+		 * changes. Since the successor is a process of it's own, whatever supervises this one
+		 * must not take it's exit as that of the application.
+		 *
+		 * @sa setReload()
+		 */
+		void reload();
+
+		//! Configure how reload() hands over
+		/*!
+		 * @param[in] command The program to start and it's arguments. If empty, the command line
+		 * this process was started with is used, so a binary replaced on disk is picked up.
+		 * @param[in] connections True if idle connections should be passed on to the successor
+		 * as well. Otherwise they are closed once this process terminates.
+		 */
+		void setReload(const std::vector<std::string>& command, bool connections=true) { reloadCommand=command; reloadConnections=connections; }
 		
 		//! Configure the handlers for POSIX signals
 		/*!
-		 * By calling this function appropriate handlers will be set up for SIGPIPE, SIGUSR1 and
-		 * SIGTERM. It is called by default upon construction of a Manager object. Should
+		 * By calling this function appropriate handlers will be set up for SIGPIPE, SIGUSR1,
+		 * SIGTERM and SIGHUP. It is called by default upon construction of a Manager object. Should
 		 * the user want to override these handlers, it should be done post-construction.
 		 *
 		 * @sa signalHandler()
@@ -107,24 +138,247 @@ namespace Fastcgipp
 		//! Tells you the size of the message queue
 		size_t getMessagesSize() const { return messages.size(); }
 
+		//! Return the amount of active requests
+		virtual size_t getRequestsSize() const =0;
+
+		//! Amount of worker threads requests are executed in
+		unsigned int getWorkers() const { return workers; }
+
+		//! Output statistics of the Transceiver
+		Transceiver::Statistics getStatistics() { return transceiver.statistics(); }
+
+		//! Set the limits on output buffered for connections
+		/*!
+		 * %Requests on a connection that has too much output buffered aren't handled again
+		 * until it drains. Should a request keep writing during a single call to response() it
+		 * waits for the connection to drain whenever it goes over the limit. Large responses are
+		 * best produced a piece at a time with the request passing itself a message through
+		 * it's callback to continue so that other requests can be handled meanwhile.
+		 *
+		 * @sa Transceiver::Watermarks
+		 */
+		void setWatermarks(const Transceiver::Watermarks& watermarks) { transceiver.setWatermarks(watermarks); }
+
+		//! Change how output is stored in memory
+		/*!
+		 * This should be done before calling handler().
+		 *
+		 * @return False if output was already buffered in which case nothing is changed
+		 * @sa Transceiver::Storage
+		 */
+		bool setStorage(const Transceiver::Storage& storage) { return transceiver.setStorage(storage); }
+
+		//! Limits on the work accepted from the other side
+		/*!
+		 * These are also what GET_VALUES management records are answered with so the other
+		 * side can size it's connection pools accordingly. A limit of 0 means unlimited in which
+		 * case it isn't included in the answer.
+		 */
+		struct Limits
+		{
+			Limits(): maxConns(0), maxReqs(0), multiplex(true) { }
+			//! Maximum amount of connections open at a time (FCGI_MAX_CONNS)
+			/*!
+			 * Further connections aren't accepted until one closes.
+			 */
+			unsigned int maxConns;
+			//! Maximum amount of requests active at a time (FCGI_MAX_REQS)
+			/*!
+			 * Further requests are rejected right away with an END_REQUEST record of status
+			 * OVERLOADED.
+			 */
+			unsigned int maxReqs;
+			//! True if requests can be multiplexed over a single connection (FCGI_MPXS_CONNS)
+			/*!
+			 * If false, a request beginning on a connection that already has one active is
+			 * rejected with an END_REQUEST record of status CANT_MPX_CONN.
+			 */
+			bool multiplex;
+		};
+
+		//! Change the limits on the work accepted from the other side
+		/*!
+		 * This should be done before calling handler().
+		 */
+		void setLimits(const Limits& limits_) { limits=limits_; transceiver.setMaxConnections(limits.maxConns); }
+
+		//! Get the limits on the work accepted from the other side
+		const Limits& getLimits() const { return limits; }
+
+		//! Time limits on requests and connections
+		/*!
+		 * A value of 0 means no limit.
+		 */
+		struct Timeouts
+		{
+			Timeouts(): request(0), idle(0) { }
+			//! Milliseconds a request may take from it's beginning until it completes
+			/*!
+			 * Once it runs out the request is passed a Message of type Message::TIMEOUT that has
+			 * it call Request::timeoutHandler() and complete. A request that is in the middle of
+			 * response() at the time is only timed out once it returns.
+			 */
+			unsigned int request;
+			//! Milliseconds a connection may be idle before it's closed
+			/*!
+			 * @sa Transceiver::setIdleTimeout()
+			 */
+			unsigned int idle;
+		};
+
+		//! Change the time limits on requests and connections
+		/*!
+		 * This should be done before calling handler().
+		 */
+		void setTimeouts(const Timeouts& timeouts_) { timeouts=timeouts_; transceiver.setIdleTimeout(timeouts.idle); }
+
+		//! Get the time limits on requests and connections
+		const Timeouts& getTimeouts() const { return timeouts; }
+
+		//! The timers run by handler()
+		/*!
+		 * Callbacks are called from the thread calling handler() so they should only do as much
+		 * as passing a message on. Requests are better off with Request::setTimer().
+		 */
+		Timers& timers() { return transceiver.timers(); }
+
+		//! Counters and histograms describing the work done
+		/*!
+		 * Safe to read from any thread at any time.
+		 */
+		const Metrics& metrics() { return transceiver.metrics(); }
+
+		//! Output the metrics and current state of the manager in the Prometheus text format
+		/*!
+		 * Safe to call from any thread so the output can be handed to whatever collects it.
+		 * It's also what is served from the path set with setMetricsPath().
+		 */
+		void dumpMetrics(std::ostream& stream);
+
+		//! Serve the metrics from a reserved path
+		/*!
+		 * Requests whose REQUEST_URI, not counting the query string, matches the path are
+		 * answered by the library with the output of dumpMetrics() and never reach
+		 * Request::response(). This should be done before calling handler().
+		 *
+		 * @param[in] path Path to reserve, for example "/metrics". Empty to serve nothing.
+		 */
+		void setMetricsPath(const std::string& path) { metricsPath=path; }
+
+		//! Get the path the metrics are served from. Empty if they aren't.
+		const std::string& getMetricsPath() const { return metricsPath; }
+
+		//! The cache of responses requests share
+		/*!
+		 * It stores nothing until it's given a capacity with ResponseCache::setCapacity(),
+		 * which should be done before calling handler(). Requests decide what is cached by way
+		 * of Request::cacheKey(). Responses can be erased from any thread once they're stale.
+		 */
+		ResponseCache& responseCache() { return cache; }
+
 	protected:
 		//! Handles low level communication with the other side
 		Transceiver transceiver;
 
 		//! Queue type for pending tasks
 		/*!
-		 * This is merely a derivation of a std::queue<Protocol::FullId> and a
-		 * boost::mutex that gives data locking abilities to the STL container.
+		 * Tasks are pushed without locking. The mutex is only taken by the threads consuming
+		 * the queue, by producers waking up idle worker threads and for the rarely touched
+		 * data documented as protected by it.
 		 */
-		class Tasks: public std::queue<Protocol::FullId>, public boost::mutex {};
+		class Tasks: public MpscQueue<Protocol::FullId>, public boost::mutex {};
 		//! Queue for pending tasks
 		/*!
 		 * This contains a queue of Protocol::FullId that need their handlers called.
 		 */
 		Tasks tasks;
 
+		//! Add a task to the queue and see that somebody gets to it
+		/*!
+		 * Either an idle worker thread is signalled or should handler() be executing the tasks
+		 * itself and be sleeping, it is woken up.
+		 */
+		void schedule(Protocol::FullId id)
+		{
+			tasks.push(id);
+			if(workers)
+			{
+				if(idleWorkers.load())
+				{
+					boost::lock_guard<boost::mutex> tasksLock(tasks);
+					tasksCondition.notify_one();
+				}
+			}
+			else if(asleep.load())
+				transceiver.wake();
+		}
+
 		//! A queue of messages for the manager itself
-		std::queue<Message> messages;
+		/*!
+		 * Pops are protected by the mutex in tasks.
+		 */
+		MpscQueue<Message> messages;
+
+		//! Tasks held back because their connection is throttled
+		/*!
+		 * Access to this container is protected by the mutex in tasks.
+		 */
+		std::vector<Protocol::FullId> throttledTasks;
+
+		//! Put held back tasks whose connection is no longer throttled back in the task queue
+		/*!
+		 * Called by handler() every time around.
+		 */
+		void releaseThrottled();
+
+		//! Amount of worker threads requests are executed in
+		/*!
+		 * Should this be non-zero, handler() only drives the Transceiver while the worker threads
+		 * consume the task queue.
+		 */
+		const unsigned int workers;
+		//! The worker threads
+		boost::thread_group workerThreads;
+		//! Signalled whenever a task is added to the queue while workers are idle or the workers must halt
+		boost::condition_variable tasksCondition;
+		//! Amount of worker threads waiting on tasksCondition
+		/*!
+		 * A worker counts itself before it checks the queue one last time and waits so that
+		 * schedule() can skip signalling when nobody is waiting.
+		 */
+		boost::atomic<unsigned int> idleWorkers;
+		//! Boolean value indicating that the worker threads should halt. Protected by the mutex in tasks.
+		bool workersStop;
+
+		//! Wake up handler() should it be sleeping
+		/*!
+		 * Used by the worker threads when a completed request requires attention from the thread
+		 * driving the Transceiver.
+		 */
+		void wake();
+
+		//! Limits on the work accepted from the other side
+		Limits limits;
+
+		//! Time limits on requests and connections
+		Timeouts timeouts;
+
+		//! Path the metrics are served from or empty
+		std::string metricsPath;
+
+		//! The cache of responses requests share
+		ResponseCache cache;
+
+		//! Refuse a request that is beginning
+		/*!
+		 * Sends an END_REQUEST record right away. The request is never created so any further
+		 * records for it are discarded.
+		 *
+		 * @param[in] id Id of the request
+		 * @param[in] status Reason for the refusal
+		 * @param[in] kill True if the connection should be closed afterwards
+		 */
+		void reject(Protocol::FullId id, Protocol::ProtocolStatus status, bool kill);
 
 		//! Handles management messages
 		/*!
@@ -138,9 +392,12 @@ namespace Fastcgipp
 		void localHandler(Protocol::FullId id);
 
 		//! Indicated whether or not the manager is currently in sleep mode
-		bool asleep;
-		//! Mutex to make accessing asleep thread safe
-		boost::mutex sleepMutex;
+		/*!
+		 * It is set before handler() checks the task queue one last time and sleeps so that a
+		 * task added meanwhile always results in a call to Transceiver::wake(). Redundant
+		 * calls are coalesced by the Transceiver.
+		 */
+		boost::atomic<bool> asleep;
 
 		//! Boolean value indicating that handler() should halt
 		/*!
@@ -156,12 +413,32 @@ namespace Fastcgipp
 		bool terminateBool;
 		//! Mutex to make terminateMutex thread safe
 		boost::mutex terminateMutex;
+		//! Boolean value indicating that handler() should hand over to a successor
+		/*!
+		 * @sa reload()
+		 */
+		bool reloadBool;
+		//! Mutex to make reloadBool thread safe
+		boost::mutex reloadMutex;
+		//! Command starting the successor. See setReload().
+		std::vector<std::string> reloadCommand;
+		//! True if idle connections are passed on to the successor
+		bool reloadConnections;
+		//! Start handing over should reload() have been called and terminate once handed over
+		/*!
+		 * Called by handler() every time around.
+		 */
+		void checkReload();
 
 	private:
 		//! General function to handler POSIX signals
+		/*!
+		 * The signal is passed on to every existing %Manager object so a process running several
+		 * of them (see ShardedManager) halts all of them at once.
+		 */
 		static void signalHandler(int signum);
-		//! Pointer to the %Manager object
-		static ManagerPar* instance;
+		//! Pointers to all existing %Manager objects
+		static std::vector<ManagerPar*> instances;
 	};
 	
 	//! General task and protocol management class
@@ -186,16 +463,22 @@ namespace Fastcgipp
 		 * passed by default to the constructor. The only time it would be another
 		 * value is if an external FastCGI server was defined.
 		 *
+		 * Should workers be non-zero, that many threads will be spawned by handler() to execute
+		 * requests concurrently while the thread calling handler() takes care of all communication
+		 * with the other side. A single request is never executed by two threads at once.
+		 *
 		 * @param[in] fd File descriptor to listen on.
-		 * @param[in] doSetupSignals If true, signal handlers will be set up for SIGTERM and SIGUSR1. If false, no signal handlers will be set up.
+		 * @param[in] doSetupSignals If true, signal handlers will be set up for SIGTERM, SIGUSR1 and SIGHUP. If false, no signal handlers will be set up.
+		 * @param[in] workers Amount of worker threads to execute requests in. 0 means requests are executed in the thread calling handler().
 		 */
-		Manager(int fd=0, bool doSetupSignals=true): ManagerPar(fd, boost::bind(&Manager::push, boost::ref(*this), _1, _2), doSetupSignals) {}
+		Manager(int fd=0, bool doSetupSignals=true, unsigned int workers=0): ManagerPar(fd, boost::bind(&Manager::push, boost::ref(*this), _1, _2), doSetupSignals, workers) {}
 
 		//! General handling function to be called after construction
 		/*!
 		 * This function will loop continuously manager tasks and FastCGI
 		 * requests until either the stop() function is called (obviously from another
-		 * thread) or the appropriate signals are caught.
+		 * thread) or the appropriate signals are caught. Any worker threads are started
+		 * upon calling and joined before returning.
 		 *
 		 * @sa setupSignals()
 		 */
@@ -219,24 +502,183 @@ namespace Fastcgipp
 		 */
 		void push(Protocol::FullId id, Message message);
 
-		//! Return the amount of pending requests
+		//! Return the amount of active requests
 		size_t getRequestsSize() const { return requests.size(); }
 	private:
-		//! Associative container type for active requests
+		//! Table of active requests
 		/*!
-		 * This is merely a derivation of a std::map<Protocol::FullId, boost::shared_ptr<T> > and a
-		 * boost::shared_mutex that gives data locking abilities to the STL container.
+		 * Connections are found by indexing an array with their file descriptor and each one has a
+		 * small table of the requests multiplexed on it with a mutex of its own, so threads only
+		 * ever contend over requests on the same connection. The array is made of pages that are
+		 * allocated the first time one of their file descriptors is seen and kept until destruction
+		 * so a connection never moves while in use.
+		 *
+		 * The table owns the requests. One that is scheduled (see Request::Messages::scheduled)
+		 * is never destroyed or replaced by anybody but the thread handling it so no reference
+		 * counting is needed to use it outside the lock.
 		 */
-		class Requests: public std::map<Protocol::FullId, boost::shared_ptr<T> >, public boost::shared_mutex {};
-		//! Associative container type for active requests
+		class Requests
+		{
+		public:
+			//! A request in a connection's table
+			struct Slot
+			{
+				Slot(Protocol::RequestId id_, T* request_): id(id_), request(request_), pending(0) {}
+				//! FastCGI request id
+				Protocol::RequestId id;
+				//! The request itself
+				T* request;
+				//! A request that reuses the id while the current one is still being handled
+				/*!
+				 * It is scheduled from the start so it receives messages without being handled
+				 * and takes the place of the current request once it completes.
+				 */
+				T* pending;
+			};
+
+			//! The requests multiplexed on a single connection
+			class Connection: public boost::mutex
+			{
+			public:
+				//! Find a request by id
+				/*!
+				 * @return Pointer to the slot or 0 should it not exist
+				 */
+				Slot* find(Protocol::RequestId id)
+				{
+					for(typename std::vector<Slot>::iterator it=slots.begin(); it!=slots.end(); ++it)
+						if(it->id==id) return &*it;
+					return 0;
+				}
+				//! Remove a slot. Nothing is destroyed.
+				void erase(Slot* slot) { *slot=slots.back(); slots.pop_back(); }
+
+				std::vector<Slot> slots;
+			};
+
+			Requests();
+			~Requests();
+
+			//! Get the connection associated with a file descriptor
+			/*!
+			 * @return Pointer to the connection or 0 should the file descriptor be beyond the
+			 * process' hard limit
+			 */
+			Connection* connection(int fd)
+			{
+				if(fd<0 || (size_t)fd>=pageCount*pageSize)
+					return 0;
+
+				boost::atomic<Connection*>& page=pages[fd/pageSize];
+				Connection* connections=page.load(boost::memory_order_acquire);
+				if(!connections)
+				{
+					Connection* fresh=new Connection[pageSize];
+					if(page.compare_exchange_strong(connections, fresh, boost::memory_order_acq_rel, boost::memory_order_acquire))
+						connections=fresh;
+					else
+						delete [] fresh;
+				}
+				return connections+fd%pageSize;
+			}
+
+			//! Construct a new request from the pool
+			T* create();
+			//! Destruct a request and return it to the pool
+			void destroy(T* request);
+
+			//! Amount of requests in the table
+			size_t size() const { return m_size.load(); }
+			//! True if there are no requests in the table
+			bool empty() const { return !size(); }
+
+			//! Amount of requests in the table. Changed with the lock of a connection held.
+			boost::atomic<size_t> m_size;
+
+		private:
+			//! Amount of connections per page
+			static const size_t pageSize=256;
+			//! Amount of pages
+			size_t pageCount;
+			//! The pages. 0 if not allocated yet.
+			boost::scoped_array<boost::atomic<Connection*> > pages;
+
+			Requests(const Requests&);
+			Requests& operator=(const Requests&);
+		};
+		//! Table of active requests
+		Requests requests;
+
+		//! Execute a single task from the task queue
 		/*!
-		 * This container associated the Protocol::FullId of each active request with a pointer
-		 * to the actual Request object.
+		 * A task is either a management message or a request with messages waiting for it. If the
+		 * request still has messages waiting once it's handled it is put at the back of the task
+		 * queue.
+		 *
+		 * @param[in] id The id of the request (or 0 for management messages) to execute
 		 */
-		Requests requests;
+		void task(Protocol::FullId id);
+
+		//! Function executed by each worker thread
+		void worker();
+
+		//! Replacement for handler() when worker threads are used
+		void threadedHandler();
 	};
 }
 
+template<class T> Fastcgipp::Manager<T>::Requests::Requests(): m_size(0)
+{
+	// With the hard limit on file descriptors known the array never needs to grow
+	size_t fds=1<<20;
+	rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit)==0 && limit.rlim_max!=RLIM_INFINITY && limit.rlim_max<fds)
+		fds=limit.rlim_max;
+	pageCount=(fds+pageSize-1)/pageSize;
+	pages.reset(new boost::atomic<Connection*>[pageCount]);
+	for(size_t i=0; i<pageCount; ++i)
+		pages[i].store(0, boost::memory_order_relaxed);
+}
+
+template<class T> Fastcgipp::Manager<T>::Requests::~Requests()
+{
+	for(size_t i=0; i<pageCount; ++i)
+	{
+		Connection* connections=pages[i].load();
+		if(!connections) continue;
+		for(size_t j=0; j<pageSize; ++j)
+			for(typename std::vector<Slot>::iterator it=connections[j].slots.begin(); it!=connections[j].slots.end(); ++it)
+			{
+				destroy(it->request);
+				if(it->pending) destroy(it->pending);
+			}
+		delete [] connections;
+	}
+}
+
+template<class T> T* Fastcgipp::Manager<T>::Requests::create()
+{
+	// Request objects are recycled through a pool
+	boost::fast_pool_allocator<T> allocator;
+	T* request=allocator.allocate(1);
+	try
+	{
+		new(request) T;
+	}
+	catch(...)
+	{
+		allocator.deallocate(request, 1);
+		throw;
+	}
+	return request;
+}
+
+template<class T> void Fastcgipp::Manager<T>::Requests::destroy(T* request)
+{
+	request->~T();
+	boost::fast_pool_allocator<T>().deallocate(request, 1);
+}
+
 template<class T> void Fastcgipp::Manager<T>::push(Protocol::FullId id, Message message)
 {
 	using namespace std;
@@ -245,42 +687,189 @@ template<class T> void Fastcgipp::Manager<T>::push(Protocol::FullId id, Message
 
 	if(id.fcgiId)
 	{
-		shared_lock<shared_mutex> reqReadLock(requests);
-		typename Requests::iterator it(requests.find(id));
-		if(it!=requests.end())
-		{
-			lock_guard<mutex> mesLock(it->second->messages);
-			it->second->messages.push(message);
-			lock_guard<mutex> tasksLock(tasks);
-			tasks.push(id);
-		}
-		else if(!message.type)
+		typename Requests::Connection* connection=requests.connection(id.fd);
+		if(!connection)
+			return;
+
+		// With worker threads a finished request can linger until its worker removes it while a new
+		// connection reuses the file descriptor and request id, so a begin record always starts afresh.
+		if(!message.type && ((Header*)message.data.get())->getType()==BEGIN_REQUEST)
 		{
-			Header& header=*(Header*)message.data.get();
-			if(header.getType()==BEGIN_REQUEST)
+			BeginRequest& body=*(BeginRequest*)(message.data.get()+sizeof(Header));
+			if(limits.maxReqs && requests.size()>=limits.maxReqs)
 			{
-				BeginRequest& body=*(BeginRequest*)(message.data.get()+sizeof(Header));
+				reject(id, OVERLOADED, !body.getKeepConn());
+				return;
+			}
 
-				reqReadLock.unlock();
-				unique_lock<shared_mutex> reqWriteLock(requests);
+			T* request=requests.create();
+			request->set(id, transceiver, body.getRole(), !body.getKeepConn(), boost::bind(&Manager::push, boost::ref(*this), id, _1), *this);
+			if(timeouts.request)
+				request->m_timers.push_back(transceiver.timers().add(timeouts.request, boost::bind(&Manager::push, boost::ref(*this), id, Message(Message::TIMEOUT))));
 
-				boost::shared_ptr<T>& request = requests[id];
-				request.reset(new T);
-				request->set(id, transceiver, body.getRole(), !body.getKeepConn(), boost::bind(&Manager::push, boost::ref(*this), id, _1));
+			T* discarded=0;
+			bool refused=false;
+			{
+				lock_guard<mutex> connectionLock(*connection);
+				typename Requests::Slot* slot=connection->find(id.fcgiId);
+				if(!slot && !limits.multiplex && !connection->slots.empty())
+				{
+					discarded=request;
+					refused=true;
+				}
+				else if(!slot)
+				{
+					connection->slots.push_back(typename Requests::Slot(id.fcgiId, request));
+					++requests.m_size;
+				}
+				else if(slot->request->messages.scheduled)
+				{
+					request->messages.scheduled=true;
+					discarded=slot->pending;
+					slot->pending=request;
+				}
+				else
+				{
+					discarded=slot->request;
+					slot->request=request;
+				}
 			}
-			else
+			if(discarded)
+				requests.destroy(discarded);
+			if(refused)
+				reject(id, CANT_MPX_CONN, !body.getKeepConn());
+			return;
+		}
+
+		{
+			lock_guard<mutex> connectionLock(*connection);
+			typename Requests::Slot* slot=connection->find(id.fcgiId);
+			if(!slot)
+				return;
+			T* request=slot->pending?slot->pending:slot->request;
+			request->messages.push(message);
+			if(request->messages.scheduled.exchange(true))
 				return;
+			request->messages.scheduledAt=Metrics::now();
 		}
+		schedule(id);
 	}
 	else
 	{
 		messages.push(message);
-		tasks.push(id);
+		schedule(id);
+	}
+}
+
+template<class T> void Fastcgipp::Manager<T>::task(Protocol::FullId id)
+{
+	using namespace std;
+	using namespace boost;
+
+	if(id.fcgiId==0)
+	{
+		localHandler(id);
+		transceiver.flush();
+		return;
+	}
+
+	if(transceiver.throttled(id.fd))
+	{
+		// The request stays scheduled so it only gets back in the task queue through releaseThrottled()
+		lock_guard<mutex> tasksLock(tasks);
+		throttledTasks.push_back(id);
+		return;
+	}
+
+	typename Requests::Connection& connection=*requests.connection(id.fd);
+	T* request;
+	{
+		lock_guard<mutex> connectionLock(connection);
+		typename Requests::Slot* slot=connection.find(id.fcgiId);
+		if(!slot)
+			return;
+		request=slot->request;
+	}
+	transceiver.metrics().taskLatency.record(Metrics::now()-request->messages.scheduledAt);
+
+	const bool complete=request->handler();
+	// Everything the request wrote during this call goes out in as few system calls as possible
+	transceiver.flush();
+
+	bool reschedule=false;
+	{
+		lock_guard<mutex> connectionLock(connection);
+		T* next=request;
+		if(complete)
+		{
+			typename Requests::Slot* slot=connection.find(id.fcgiId);
+			next=slot->pending;
+			if(next)
+			{
+				slot->request=next;
+				slot->pending=0;
+			}
+			else
+			{
+				connection.erase(slot);
+				--requests.m_size;
+			}
+		}
+
+		// A message pushed meanwhile either finds the request unscheduled or is seen here
+		if(next)
+		{
+			next->messages.scheduled.exchange(false);
+			reschedule=!next->messages.empty() && !next->messages.scheduled.exchange(true);
+			if(reschedule)
+				next->messages.scheduledAt=Metrics::now();
+		}
 	}
+	if(reschedule)
+		schedule(id);
 
-	lock_guard<mutex> sleepLock(sleepMutex);
-	if(asleep)
-		transceiver.wake();
+	if(complete)
+	{
+		// The transceiver thread has to close the connection or notice that we might be done terminating
+		if(workers)
+		{
+			bool terminating;
+			{
+				lock_guard<mutex> terminateLock(terminateMutex);
+				terminating=terminateBool;
+			}
+			if(request->killCon || terminating)
+				wake();
+		}
+		requests.destroy(request);
+	}
+}
+
+template<class T> void Fastcgipp::Manager<T>::worker()
+{
+	using namespace boost;
+
+	while(1)
+	{{
+		Protocol::FullId id;
+		{
+			unique_lock<mutex> tasksLock(tasks);
+			while(1)
+			{
+				if(workersStop)
+					return;
+				if(tasks.pop(id))
+					break;
+
+				++idleWorkers;
+				if(tasks.empty() && !workersStop)
+					tasksCondition.wait(tasksLock);
+				--idleWorkers;
+			}
+		}
+
+		task(id);
+	}}
 }
 
 template<class T> void Fastcgipp::Manager<T>::handler()
@@ -288,6 +877,12 @@ template<class T> void Fastcgipp::Manager<T>::handler()
 	using namespace std;
 	using namespace boost;
 
+	if(workers)
+	{
+		threadedHandler();
+		return;
+	}
+
 	while(1)
 	{{
 		{
@@ -300,13 +895,14 @@ template<class T> void Fastcgipp::Manager<T>::handler()
 		}
 		
 		bool sleep=transceiver.handler();
+		releaseThrottled();
+		checkReload();
 
 		{
 			lock_guard<mutex> terminateLock(terminateMutex);
 			if(terminateBool)
 			{
-				shared_lock<shared_mutex> requestsLock(requests);
-				if(requests.empty() && sleep)
+				if(requests.empty() && sleep && transceiver.empty())
 				{
 					terminateBool=false;
 					return;
@@ -314,45 +910,78 @@ template<class T> void Fastcgipp::Manager<T>::handler()
 			}
 		}
 
-		unique_lock<mutex> tasksLock(tasks);
-		unique_lock<mutex> sleepLock(sleepMutex);
-
-		if(tasks.empty())
+		Protocol::FullId id;
+		if(!tasks.pop(id))
 		{
-			tasksLock.unlock();
-
 			asleep=true;
-			sleepLock.unlock();
-
-			if(sleep) transceiver.sleep();
-
-			sleepLock.lock();
+			if(sleep && tasks.empty()) transceiver.sleep();
 			asleep=false;
-			sleepLock.unlock();
 
 			continue;
 		}
 
-		sleepLock.unlock();
+		task(id);
+	}}
+}
+
+template<class T> void Fastcgipp::Manager<T>::threadedHandler()
+{
+	using namespace std;
+	using namespace boost;
 
-		Protocol::FullId id=tasks.front();
-		tasks.pop();
-		tasksLock.unlock();
+	{
+		lock_guard<mutex> tasksLock(tasks);
+		workersStop=false;
+	}
+	for(unsigned int i=0; i<workers; ++i)
+		workerThreads.create_thread(boost::bind(&Manager::worker, boost::ref(*this)));
 
-		if(id.fcgiId==0)
-			localHandler(id);
-		else
+	while(1)
+	{{
+		bool sleep=transceiver.handler();
+		releaseThrottled();
+		checkReload();
+
+		asleep=true;
+
+		// Halting is checked for after declaring ourselves asleep so that no call to wake() is missed
+		bool halt=false;
+		{
+			lock_guard<mutex> stopLock(stopMutex);
+			if(stopBool)
+			{
+				stopBool=false;
+				halt=true;
+			}
+		}
+		if(!halt)
 		{
-			shared_lock<shared_mutex> reqReadLock(requests);
-			typename map<Protocol::FullId, boost::shared_ptr<T> >::iterator it(requests.find(id));
-			if(it!=requests.end() && it->second->handler())
+			lock_guard<mutex> terminateLock(terminateMutex);
+			if(terminateBool)
 			{
-				reqReadLock.unlock();
-				unique_lock<shared_mutex> reqWriteLock(requests);
+				if(requests.empty() && sleep && transceiver.empty())
+				{
+					terminateBool=false;
+					halt=true;
+				}
+			}
+		}
 
-				requests.erase(it);
+		if(halt)
+		{
+			asleep=false;
+			{
+				lock_guard<mutex> tasksLock(tasks);
+				workersStop=true;
 			}
+			tasksCondition.notify_all();
+			workerThreads.join_all();
+			return;
 		}
+
+		if(sleep) transceiver.sleep();
+
+		asleep=false;
 	}}
 }
 
@@ -30,8 +30,8 @@ namespace Fastcgipp
 	 * This data structure is crucial to all operation in the FastCGI library as all
 	 * data passed to requests must be encapsulated in this data structure. A type value
 	 * of 0 means that the message is a FastCGI record and will be processed at a low
-	 * level by the library. Any other type value and the message will be passed up to
-	 * the user to be processed. The data may contain any data that can be casted to/from
+	 * level by the library as are the negative values it reserves for itself. Any
+	 * positive type value and the message will be passed up to the user to be processed. The data may contain any data that can be casted to/from
 	 * a raw character array. The size obviously represents the exact size of the data
 	 * section.
 	 */
@@ -39,8 +39,10 @@ namespace Fastcgipp
 	{
 		Message(const int type_): type(type_) {}
 		Message(): type(0) {}
-		//! Type of message. A 0 means FastCGI record. Anything else is open.
+		//! Type of message. A 0 means FastCGI record. Negative values are reserved. Anything else is open.
 		int type;
+		//! Type of the message passed to a request once it's time is up (see ManagerPar::Timeouts)
+		static const int TIMEOUT=-1;
 		//! Size of the data section.
 		size_t size;
 		//! Pointer to the raw data being passed along with the message.
@@ -0,0 +1,136 @@
+//! \file metrics.hpp Defines the Fastcgipp::Metrics and Fastcgipp::Histogram classes
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <ostream>
+
+#include <stdint.h>
+#include <time.h>
+
+#include <boost/atomic.hpp>
+
+#include <fastcgi++/protocol.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Lock free histogram with power of two bucket bounds
+	/*!
+	 * Bucket i counts the values no greater than 2^i that didn't fit in a lower bucket and
+	 * the last bucket counts everything else. Recording a value costs two relaxed atomic
+	 * additions so it can be done from any thread on the hot path.
+	 */
+	class Histogram
+	{
+	public:
+		//! Amount of buckets including the last unbounded one
+		static const unsigned int buckets=24;
+
+		Histogram(): m_sum(0) { for(unsigned int i=0; i<buckets; ++i) m_counts[i].store(0, boost::memory_order_relaxed); }
+
+		//! Count a value
+		void record(uint64_t value)
+		{
+			unsigned int bucket=value<=1?0:64-__builtin_clzll(value-1);
+			if(bucket>=buckets) bucket=buckets-1;
+			m_counts[bucket].fetch_add(1, boost::memory_order_relaxed);
+			m_sum.fetch_add(value, boost::memory_order_relaxed);
+		}
+
+		//! Amount of values counted in a bucket
+		uint64_t count(unsigned int bucket) const { return m_counts[bucket].load(boost::memory_order_relaxed); }
+		//! Sum of all values counted
+		uint64_t sum() const { return m_sum.load(boost::memory_order_relaxed); }
+		//! Upper bound of a bucket. The last bucket has none.
+		static uint64_t bound(unsigned int bucket) { return (uint64_t)1<<bucket; }
+
+	private:
+		boost::atomic<uint64_t> m_counts[buckets];
+		boost::atomic<uint64_t> m_sum;
+
+		Histogram(const Histogram&);
+		Histogram& operator=(const Histogram&);
+	};
+
+	//! Counters and histograms describing the work done by a Manager and it's Transceiver
+	/*!
+	 * Everything in here is updated with relaxed atomic operations so it can be read from any
+	 * thread at any time. Values that describe the current state rather than accumulate, like
+	 * the amount of active requests, are kept by their owners and are part of
+	 * ManagerPar::dumpMetrics().
+	 */
+	struct Metrics
+	{
+		Metrics();
+
+		//! Amount of distinct FastCGI record types plus one for the invalid type 0
+		static const unsigned int recordTypes=Protocol::UNKNOWN_TYPE+1;
+
+		//! Connections accepted
+		boost::atomic<uint64_t> connections;
+		//! Bytes received
+		boost::atomic<uint64_t> bytesIn;
+		//! Records received by type. Unknown types are counted as type 0.
+		boost::atomic<uint64_t> recordsIn[recordTypes];
+		//! Records queued for transmission by type
+		boost::atomic<uint64_t> recordsOut[recordTypes];
+		//! Write system calls made by each call to Transceiver::transmit() that made any
+		Histogram transmitWrites;
+		//! Microseconds a request waits in the task queue
+		Histogram taskLatency;
+		//! Microseconds spent in Request::response() over the whole life of a request
+		Histogram responseTime;
+
+		//! Count a received record
+		void recordIn(int type) { recordsIn[(unsigned int)type<recordTypes?type:0].fetch_add(1, boost::memory_order_relaxed); }
+		//! Count a record queued for transmission
+		void recordOut(int type) { recordsOut[(unsigned int)type<recordTypes?type:0].fetch_add(1, boost::memory_order_relaxed); }
+
+		//! Output everything in the Prometheus text format
+		void dump(std::ostream& stream) const;
+
+		//! Output a single value in the Prometheus text format
+		/*!
+		 * @param[out] stream Stream to output to
+		 * @param[in] name Name of the metric without the fastcgipp_ prefix
+		 * @param[in] type Prometheus type of the metric (counter or gauge)
+		 * @param[in] help Description of the metric
+		 * @param[in] value The value
+		 */
+		static void print(std::ostream& stream, const char* name, const char* type, const char* help, uint64_t value);
+
+		//! Current time in microseconds from an arbitrary point that never jumps
+		static uint64_t now()
+		{
+			timespec time;
+			clock_gettime(CLOCK_MONOTONIC, &time);
+			return (uint64_t)time.tv_sec*1000000+time.tv_nsec/1000;
+		}
+
+	private:
+		Metrics(const Metrics&);
+		Metrics& operator=(const Metrics&);
+	};
+}
+
+#endif
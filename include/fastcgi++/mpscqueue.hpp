@@ -0,0 +1,128 @@
+//! \file mpscqueue.hpp Defines the Fastcgipp::MpscQueue class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#ifndef MPSCQUEUE_HPP
+#define MPSCQUEUE_HPP
+
+#include <cstddef>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Lock free multiple producer, single consumer queue
+	/*!
+	 * Any amount of threads may push() at once without ever waiting on each other, each push
+	 * costing one atomic exchange. Only a single thread at a time may call pop() or empty() so
+	 * should several threads consume, they must serialize themselves with a lock of their own.
+	 * The producers never take it.
+	 *
+	 * The queue is a singly linked list with a stub node that producers append to by swapping
+	 * the head pointer. All operations are sequentially consistent so a producer that
+	 * pushes and then reads a flag and a consumer that writes that flag and then calls
+	 * empty() always see at least one of each other's changes.
+	 *
+	 * @tparam T Type of the elements. Must be default constructible and assignable.
+	 */
+	template<class T> class MpscQueue
+	{
+	public:
+		MpscQueue(): m_head(new Node), m_size(0) { m_tail=m_head.load(boost::memory_order_relaxed); }
+		~MpscQueue()
+		{
+			while(m_tail)
+			{
+				Node* next=m_tail->next.load(boost::memory_order_relaxed);
+				delete m_tail;
+				m_tail=next;
+			}
+		}
+
+		//! Add an element to the back of the queue. Safe to call from any thread.
+		void push(const T& value)
+		{
+			Node* node=new Node(value);
+			m_size.fetch_add(1);
+			Node* previous=m_head.exchange(node);
+			previous->next.store(node);
+		}
+
+		//! Take the element at the front of the queue
+		/*!
+		 * Should a producer be in the middle of appending the only element this waits for it to
+		 * finish so false is only ever returned if every completed push() has been popped.
+		 *
+		 * @param[out] value Set to the front element
+		 * @return False if the queue was empty
+		 */
+		bool pop(T& value)
+		{
+			Node* next=m_tail->next.load();
+			while(!next)
+			{
+				if(m_head.load()==m_tail)
+					return false;
+				boost::this_thread::yield();
+				next=m_tail->next.load();
+			}
+
+			value=next->value;
+			// The new stub shouldn't hold on to anything the element references
+			next->value=T();
+			delete m_tail;
+			m_tail=next;
+			m_size.fetch_sub(1);
+			return true;
+		}
+
+		//! True if there are no elements in the queue
+		bool empty() const { return m_head.load()==m_tail; }
+
+		//! Approximate amount of elements in the queue. Safe to call from any thread.
+		size_t size() const { return m_size.load(boost::memory_order_relaxed); }
+
+	private:
+		//! Link in the queue
+		struct Node
+		{
+			Node(): next(0) { }
+			Node(const T& value_): next(0), value(value_) { }
+			//! Next element or 0 should this be the last one
+			boost::atomic<Node*> next;
+			//! The element itself
+			T value;
+		};
+
+		//! Last node in the list where producers append
+		boost::atomic<Node*> m_head;
+		//! Stub node that precedes the front element. Only touched by the consumer.
+		Node* m_tail;
+		//! Amount of elements in the queue
+		boost::atomic<size_t> m_size;
+
+		MpscQueue(const MpscQueue&);
+		MpscQueue& operator=(const MpscQueue&);
+	};
+}
+
+#endif
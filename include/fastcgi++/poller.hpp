@@ -0,0 +1,162 @@
+//! \file poller.hpp Defines the Fastcgipp::Poller class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#ifndef POLLER_HPP
+#define POLLER_HPP
+
+#include <fastcgi++/config.h>
+
+#include <vector>
+
+#if defined (HAVE_SYS_EPOLL_H)
+#define FASTCGIPP_POLLER_EPOLL
+#include <sys/epoll.h>
+#elif defined (HAVE_SYS_EVENT_H)
+#define FASTCGIPP_POLLER_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#define FASTCGIPP_POLLER_POLL
+#include <poll.h>
+#endif
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Waits for activity on a set of file descriptors
+	/*!
+	 * This class wraps the best event notification facility the system has to offer. On Linux
+	 * this is epoll, on the BSDs kqueue and everywhere else plain poll(). Registration and
+	 * removal of file descriptors are constant time operations with all backends. A call to
+	 * poll() collects every ready file descriptor at once so they can be handled in a batch
+	 * before waiting again.
+	 *
+	 * The backend is selected at configure time by the presence of sys/epoll.h or sys/event.h.
+	 */
+	class Poller
+	{
+	public:
+		//! Event flags reported by poll()
+		enum Flags
+		{
+			//! There is data to read (or a connection to accept)
+			READ=1,
+			//! The other side hung up
+			HANGUP=2,
+			//! An error condition occurred on the file descriptor
+			ERROR=4,
+			//! Data can be written without blocking
+			WRITE=8
+		};
+
+		//! A file descriptor reported as ready by poll()
+		struct Event
+		{
+			//! The file descriptor
+			int fd;
+			//! OR'ed combination of Flags
+			unsigned int flags;
+		};
+
+		Poller();
+		~Poller();
+
+		//! Start watching a file descriptor for incoming data
+		/*!
+		 * @param[in] fd File descriptor to watch
+		 */
+		void add(int fd);
+
+		//! Stop watching a file descriptor
+		/*!
+		 * It is safe to call this with a file descriptor that isn't being watched. Any events
+		 * gathered for the file descriptor that have yet to be cleared are dropped so they can't
+		 * be mistaken for events on a new file descriptor with the same number.
+		 *
+		 * @param[in] fd File descriptor to stop watching
+		 */
+		void del(int fd);
+
+		//! Start or stop watching a file descriptor for the ability to write
+		/*!
+		 * The file descriptor must already be watched for incoming data with add(). It is only
+		 * watched for writing while output to it is stalled since it would be reported as ready
+		 * almost all of the time otherwise.
+		 *
+		 * @param[in] fd File descriptor to watch
+		 * @param[in] watch True to start watching, false to stop
+		 */
+		void watchWrite(int fd, bool watch);
+
+		//! Wait for events on the watched file descriptors
+		/*!
+		 * All ready file descriptors are gathered in one go and can be accessed with operator[]
+		 * until the next call to poll() or clear().
+		 *
+		 * @param[in] timeout Maximum time in milliseconds to wait. -1 waits indefinitely and 0 returns immediately.
+		 * @return Amount of ready file descriptors
+		 */
+		size_t poll(int timeout);
+
+		//! Amount of events gathered by the last call to poll() that have yet to be cleared
+		size_t ready() const { return m_ready; }
+
+		//! Access an event gathered by the last call to poll()
+		const Event& operator[](size_t i) const { return m_events[i]; }
+
+		//! Forget about the events gathered by the last call to poll()
+		void clear() { m_ready=0; }
+
+	private:
+		//! Ready events in a backend neutral format
+		std::vector<Event> m_events;
+		//! Amount of valid entries in m_events
+		size_t m_ready;
+
+#if defined (FASTCGIPP_POLLER_EPOLL)
+		//! epoll file descriptor
+		int m_epoll;
+		//! Buffer for epoll_wait()
+		std::vector<epoll_event> m_backendEvents;
+#elif defined (FASTCGIPP_POLLER_KQUEUE)
+		//! kqueue file descriptor
+		int m_kqueue;
+		//! Buffer for kevent()
+		std::vector<struct kevent> m_backendEvents;
+#else
+		//! poll() file descriptors container
+		std::vector<pollfd> m_pollFds;
+		//! Position of each file descriptor in m_pollFds indexed by file descriptor. -1 means not watched.
+		std::vector<int> m_positions;
+#endif
+		//! Drop gathered events for a file descriptor
+		void forget(int fd);
+
+		//! Maximum amount of events gathered by a single call to poll()
+		static const size_t maxEvents=256;
+
+		Poller(const Poller&);
+		Poller& operator=(const Poller&);
+	};
+}
+
+#endif
@@ -360,67 +360,6 @@ namespace Fastcgipp
 		 * @param[out] valueSize Reference to a value to will be given the size in bytes of the parameter value
 		 */
 		void processParamHeader(const char* data, size_t dataSize, const char*& name, size_t& nameSize, const char*& value, size_t& valueSize);
-
-		
-		//!Used for the reply of FastCGI management records of type GET_VALUES
-		/*!
-		 * This class template is an efficient tool for replying to GET_VALUES management
-		 * records. The structure represents a complete record (body+header) of a name-value pair to be
-		 * sent as a reply to a management value query. The templating allows the structure
-		 * to be exactly the size that is needed so it can be casted to raw data and transmitted
-		 * as is. Note that the name and value lengths are left as single bytes so they are limited
-		 * in range from 0-127.
-		 *
-		 * @tparam NAMELENGTH Length of name in bytes (0-127). Null terminator not included.
-		 * @tparam VALUELENGTH Length of value in bytes (0-127). Null terminator not included.
-		 * @tparam PADDINGLENGTH Length of padding at the end of the record. This is needed to keep
-		 * the record size a multiple of chunkSize.
-		 */
-		template<int NAMELENGTH, int VALUELENGTH, int PADDINGLENGTH> struct ManagementReply
-		{
-		private:
-			//! Management records header
-			Header header;
-			//! Length in bytes of name
-			uint8_t nameLength;
-			//! Length in bytes of value
-			uint8_t valueLength;
-			//! Name data
-			uint8_t name[NAMELENGTH];
-			//! Value data
-			uint8_t value[VALUELENGTH];
-			//! Padding data
-			uint8_t padding[PADDINGLENGTH];
-		public:
-			//! Construct the record based on the name data and value data
-			/*!
-			 * A full record is constructed from the name-value data. After
-			 * construction the structure can be casted to raw data and transmitted
-			 * as is. The size of the data arrays pointed to by name_ and value_ are
-			 * assumed to correspond with the NAMELENGTH and PADDINGLENGTH template
-			 * parameters passed to the class.
-			 *
-			 * @param[in] name_ Pointer to name data
-			 * @param[in] value_ Pointer to value data
-			 */
-			ManagementReply(const char* name_, const char* value_): nameLength(NAMELENGTH), valueLength(VALUELENGTH)
-			{
-				for(int i=0; i<NAMELENGTH; i++) name[i]=*(name_+i);
-				for(int i=0; i<VALUELENGTH; i++) value[i]=*(value_+i);
-				header.setVersion(version);
-				header.setType(GET_VALUES_RESULT);
-				header.setRequestId(0);
-				header.setContentLength(NAMELENGTH+VALUELENGTH);
-				header.setPaddingLength(PADDINGLENGTH);
-			}
-		};
-
-		//! Reply record that will be sent when asked the maximum allowed file descriptors open at a time
-		extern ManagementReply<14, 2, 8> maxConnsReply;
-		//! Reply record that will be sent when asked the maximum allowed requests at a time
-		extern ManagementReply<13, 2, 1> maxReqsReply;
-		//! Reply record that will be sent when asked if requests can be multiplexed over a single connections
-		extern ManagementReply<15, 1, 8> mpxsConnsReply;
 	}
 }
 
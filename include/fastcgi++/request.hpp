@@ -22,25 +22,30 @@
 #ifndef REQUEST_HPP
 #define REQUEST_HPP
 
-#include <queue>
 #include <map>
 #include <string>
 #include <locale>
+#include <vector>
 
 #include <boost/shared_array.hpp>
 #include <boost/thread.hpp>
 #include <boost/function.hpp>
+#include <boost/atomic.hpp>
 
 #include <fastcgi++/transceiver.hpp>
 #include <fastcgi++/protocol.hpp>
 #include <fastcgi++/exceptions.hpp>
 #include <fastcgi++/fcgistream.hpp>
 #include <fastcgi++/http.hpp>
+#include <fastcgi++/mpscqueue.hpp>
+#include <fastcgi++/timers.hpp>
+#include <fastcgi++/cache.hpp>
 
 //! Topmost namespace for the fastcgi++ library
 namespace Fastcgipp
 {
 	template<class T> class Manager;
+	class ManagerPar;
 
 	//! %Request handling class
 	/*!
@@ -66,8 +71,13 @@ namespace Fastcgipp
 		 * \param maxPostSize This would be the maximum size you want to allow for
 		 * post data. Any data beyond this size would result in a call to
 		 * bigPostErrorHandler(). A value of 0 represents unlimited.
+		 * \param lazyEnvironment If true, the environment only decodes parameters as they are
+		 * accessed. See Http::Environment::setLazy().
 		 */
-		Request(const size_t maxPostSize=0): m_maxPostSize(maxPostSize), state(Protocol::PARAMS)  { setloc(std::locale::classic()); out.exceptions(std::ios_base::badbit | std::ios_base::failbit | std::ios_base::eofbit); m_environment.clearPostBuffer(); }
+		Request(const size_t maxPostSize=0, const bool lazyEnvironment=false): m_maxPostSize(maxPostSize), state(Protocol::PARAMS), m_responseTime(0), m_cacheMaxAge(0), m_caching(false)  { setloc(std::locale::classic()); out.exceptions(std::ios_base::badbit | std::ios_base::failbit | std::ios_base::eofbit); m_environment.clearPostBuffer(); m_environment.setLazy(lazyEnvironment); }
+
+		//! Cancels whatever timers the request still has pending
+		virtual ~Request();
 
 		//! Accessor for  the data structure containing all HTTP environment data
 		const Http::Environment<charT>& environment() const { return m_environment; }
@@ -100,6 +110,15 @@ namespace Fastcgipp
 		//! Called when too much post data is recieved.
 		virtual void bigPostErrorHandler();
 
+		//! Called when the request runs out of time
+		/*!
+		 * By default it logs the request to the error log and sends a standard 504 Gateway
+		 * Timeout message to the user. The request is completed right after.
+		 *
+		 * @sa ManagerPar::Timeouts
+		 */
+		virtual void timeoutHandler();
+
 		//! See the requests role
 		Protocol::Role role() const { return m_role; }
 
@@ -117,6 +136,24 @@ namespace Fastcgipp
 		 */
 		const boost::function<void(Message)>& callback() const { return m_callback; }
 
+		//! Have a message passed to the request once some time has passed
+		/*!
+		 * The message arrives just like one passed through callback() so response() is called
+		 * with it. No extra threads are involved; the timer is run by the thread calling
+		 * Manager::handler(). Timers still pending once the request completes are cancelled.
+		 *
+		 * @param[in] milliseconds How long from now the message should be passed
+		 * @param[in] message The message. It's type should be positive.
+		 * @return Handle to pass to cancelTimer()
+		 */
+		Timers::Handle setTimer(unsigned int milliseconds, const Message& message);
+
+		//! Cancel a timer set with setTimer()
+		/*!
+		 * @return True if the message won't be passed. False if it already has been.
+		 */
+		bool cancelTimer(const Timers::Handle& handle) { return transceiver->timers().cancel(handle); }
+
 		//! Set the requests locale
 		/*!
 		 * This function both sets loc to the locale passed to it and imbues the locale into the
@@ -173,6 +210,10 @@ namespace Fastcgipp
 		 * data in the post buffer. Should you return false, the system will try
 		 * to internally process it.
 		 *
+		 * "multipart/form-data" is the exception. It is parsed into
+		 * environment().posts as it arrives and is never assembled in the post
+		 * buffer.
+		 *
 		 * @return Return true if you've processed the data.
 		 */
 		bool virtual inProcessor() { return false; }
@@ -186,6 +227,43 @@ namespace Fastcgipp
 		 */
 		const Message& message() const { return m_message; }
 
+		//! Key to look the response up with in the manager's ResponseCache
+		/*!
+		 * Called for GET requests once the environment is complete, should the cache be
+		 * enabled (see ManagerPar::responseCache()). Append whatever the response depends on to
+		 * the key, for example the script name and the gets it reads, and return true. Should a
+		 * response be stored with the key it is sent right away and response() is never called.
+		 * Otherwise the OUT records response() sends are stored with the key once it completes,
+		 * unless dontCache() is called or an exception is thrown. Output to err isn't stored.
+		 *
+		 * Clients whose If-None-Match or If-Modified-Since agree with the validators the
+		 * response was stored with (see setCacheValidators()) are answered with a bodiless
+		 * 304 Not Modified instead.
+		 *
+		 * @param[out] key Empty string to append the key to
+		 * @return True if the response may come from and go in the cache
+		 */
+		virtual bool cacheKey(std::string& /*key*/) { return false; }
+
+		//! Set the validators the response being generated is stored in the cache with
+		/*!
+		 * The response should send them in it's ETag and Last-Modified headers itself. Only
+		 * whole seconds of the modification time are compared, as is all HTTP dates carry.
+		 *
+		 * @param[in] etag Numeric entity tag. 0 means none.
+		 * @param[in] lastModified Time the document was last modified at. not_a_date_time means unknown.
+		 */
+		void setCacheValidators(int etag, const boost::posix_time::ptime& lastModified=boost::posix_time::ptime());
+
+		//! Set how many seconds the response being generated stays in the cache
+		/*!
+		 * The default of 0 keeps it until it's evicted or erased.
+		 */
+		void setCacheMaxAge(unsigned int seconds) { m_cacheMaxAge=seconds; }
+
+		//! Keep the response being generated out of the cache
+		void dontCache() { m_capture.abandon(); }
+
 	private:
 		template<class T> friend class Manager;
 
@@ -220,10 +298,22 @@ namespace Fastcgipp
 
 		//! Queue type for pending messages
 		/*!
-		 * This is merely a derivation of a std::queue<Message> and a
-		 * boost::mutex that gives data locking abilities to the STL container.
+		 * Messages are pushed by any thread without locking while only the thread currently
+		 * handling the request pops them.
 		 */
-		class Messages: public std::queue<Message>, public boost::mutex {};
+		class Messages: public MpscQueue<Message>
+		{
+		public:
+			Messages(): scheduled(false), scheduledAt(0) {}
+			//! True if the request is in the Manager's task queue or is currently being handled
+			/*!
+			 * This guarantees a request is never handled by two threads at once. Whoever
+			 * changes it from false to true puts the request in the task queue.
+			 */
+			boost::atomic<bool> scheduled;
+			//! When the request was last put in the task queue (see Metrics::now())
+			uint64_t scheduledAt;
+		};
 		//! A queue of messages to be handler by the request
 		Messages messages;
 
@@ -251,6 +341,39 @@ namespace Fastcgipp
 		Protocol::RecordType state;
 		//! Generates an END_REQUEST FastCGI record
 		void complete();
+		//! The manager handling the request
+		ManagerPar* manager;
+		//! Microseconds spent in response() so far
+		uint64_t m_responseTime;
+		//! Timers set for the request including the one for it's deadline
+		/*!
+		 * Some may have run already. They are weeded out whenever another is set.
+		 */
+		std::vector<Timers::Handle> m_timers;
+		//! Call response() and count the time spent in it
+		bool timedResponse();
+		//! Check if the request is for the manager's metrics. If so they are output.
+		/*!
+		 * @return True if the request was answered
+		 */
+		bool metricsResponse();
+		//! Key the response is stored in the cache with
+		std::string m_cacheKey;
+		//! Copy of the OUT records to store in the cache
+		RecordCapture m_capture;
+		//! The validators to store the response with
+		ResponseCache::Response m_cached;
+		//! Seconds the response stays in the cache
+		unsigned int m_cacheMaxAge;
+		//! True if the OUT records are being copied to be stored in the cache
+		bool m_caching;
+		//! Look the request up in the manager's cache. If found the response is output.
+		/*!
+		 * @return True if the request was answered
+		 */
+		bool cachedResponse();
+		//! Store the copied OUT records in the manager's cache
+		void storeResponse();
 		//! Set's up the request with the data it needs.
 		/*!
 		 * This function is an "after-the-fact" constructor that build vital initial data for the request.
@@ -260,10 +383,12 @@ namespace Fastcgipp
 		 * @param[in] role_ The role that the other side expects this request to play
 		 * @param[in] killCon_ Boolean value indicating whether or not the file descriptor should be closed upon completion
 		 * @param[in] callback_ Callback function capable of passing messages to the request
+		 * @param[in] manager_ The manager handling the request
 		 */
-		void set(Protocol::FullId id_, Transceiver& transceiver_, Protocol::Role role_, bool killCon_, boost::function<void(Message)> callback_)
+		void set(Protocol::FullId id_, Transceiver& transceiver_, Protocol::Role role_, bool killCon_, boost::function<void(Message)> callback_, ManagerPar& manager_)
 		{
 			killCon=killCon_;
+			manager=&manager_;
 			id=id_;
 			transceiver=&transceiver_;
 			m_role=role_;
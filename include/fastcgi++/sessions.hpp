@@ -0,0 +1,452 @@
+//! \file sessions.hpp Defines the Fastcgipp::Http::ShardedSessions and Fastcgipp::Http::SharedSessions classes
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+
+#ifndef SESSIONS_HPP
+#define SESSIONS_HPP
+
+#include <cstring>
+#include <utility>
+
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_pod.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <fastcgi++/http.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	namespace Http
+	{
+		//! Non-template helpers for the session containers
+		class SessionsPar
+		{
+		public:
+			//! Current time in milliseconds on a clock that never jumps and is the same for every process
+			static uint64_t now();
+
+			//! Shard a session belongs in
+			/*!
+			 * Taken from other bytes of the ID than SessionId::hash() so that the sessions of a
+			 * shard still spread evenly over it's buckets.
+			 */
+			static unsigned int shard(const SessionId& id, unsigned int shards)
+			{
+				uint32_t value;
+				std::memcpy(&value, id.getInternalPointer()+SessionId::size-sizeof(value), sizeof(value));
+				return value%shards;
+			}
+
+			//! Time a session used right now expires at. Meant for the expiry of cookies.
+			static boost::posix_time::ptime expiry(unsigned int keepAlive) { return boost::posix_time::second_clock::universal_time()+boost::posix_time::seconds(keepAlive); }
+		};
+
+		//! Container for HTTP sessions shared by many threads
+		/*!
+		 * Sessions are spread over a number of shards by their ID and each shard has a lock and a
+		 * hash table of it's own, so threads seldom wait on each other. Every shard keeps it's
+		 * sessions in a list ordered by when they were last used. Since all sessions are kept
+		 * alive for the same time the front of that list is always the next to expire; every
+		 * access to a shard removes the expired sessions from the front, so there is never a
+		 * scan of the whole container and the cost of expiry is spread over the accesses.
+		 *
+		 * Sessions are handed out as shared pointers so a request may keep using one even if
+		 * it's erased or expires meanwhile. The container doesn't synchronize access to the
+		 * session data itself; that's up to T should the same session be used by several
+		 * requests at once.
+		 *
+		 * \code
+		 * static Fastcgipp::Http::ShardedSessions<Data> sessions(1800);
+		 *
+		 * boost::shared_ptr<Data> session=sessions.find(environment().findCookie("SESSIONID").data());
+		 * if(!session)
+		 * {
+		 *     Fastcgipp::Http::SessionId id;
+		 *     session=sessions.generate(id);
+		 *     out << "Set-Cookie: SESSIONID=" << encoding(URL) << id << encoding(NONE) << '\n';
+		 * }
+		 * \endcode
+		 *
+		 * @tparam T Class containing session data.
+		 */
+		template<class T> class ShardedSessions: public SessionsPar
+		{
+		public:
+			//! Pointer to the data of a session
+			typedef boost::shared_ptr<T> Pointer;
+
+			//! Constructor
+			/*!
+			 * @param[in] keepAlive Amount of seconds a session stays alive for once last used
+			 * @param[in] shards Amount of shards. A few times the amount of threads using the container.
+			 */
+			ShardedSessions(unsigned int keepAlive, unsigned int shards=16): m_keepAlive(keepAlive), m_shards(shards?shards:1), m_shard(new Shard[m_shards]) { }
+			~ShardedSessions();
+
+			//! Find a session and keep it alive for another keepAlive seconds
+			/*!
+			 * @return The session data or an empty pointer should there be no such session
+			 */
+			Pointer find(const SessionId& id);
+
+			//! Start a new session with a random ID
+			/*!
+			 * @param[out] id The ID of the new session
+			 * @param[in] value Initial session data
+			 * @return The session data
+			 */
+			Pointer generate(SessionId& id, const T& value=T());
+
+			//! Remove a session
+			/*!
+			 * @return True if there was such a session
+			 */
+			bool erase(const SessionId& id);
+
+			//! Amount of sessions alive
+			size_t size();
+
+			//! Remove every expired session
+			/*!
+			 * Expired sessions are removed as the shards are used anyway so this is only needed to
+			 * free the memory of those in shards that aren't.
+			 */
+			void cleanup();
+
+			//! Amount of seconds sessions stay alive for once last used
+			unsigned int getKeepAlive() const { return m_keepAlive; }
+
+			//! Time a session found or generated right now expires at
+			boost::posix_time::ptime getExpiry() const { return expiry(m_keepAlive); }
+
+		private:
+			//! A session
+			struct Node
+			{
+				SessionId id;
+				Pointer value;
+				//! Time the session expires at (see now())
+				uint64_t expires;
+				//! Session used just before this one
+				Node* previous;
+				//! Session used just after this one
+				Node* next;
+			};
+
+			//! A part of the sessions with a lock of it's own
+			struct Shard
+			{
+				Shard(): oldest(0), newest(0) { }
+				boost::mutex mutex;
+				boost::unordered_map<SessionId, Node*> table;
+				//! Least recently used session
+				Node* oldest;
+				//! Most recently used session
+				Node* newest;
+			};
+
+			//! Amount of seconds sessions stay alive for once last used
+			const unsigned int m_keepAlive;
+			//! Amount of shards
+			const unsigned int m_shards;
+			//! The shards
+			boost::scoped_array<Shard> m_shard;
+
+			//! Put a session at the back of the list of a shard
+			static void append(Shard& shard, Node* node);
+			//! Take a session out of the list of a shard
+			static void unlink(Shard& shard, Node* node);
+			//! Remove a session from a shard altogether
+			static void remove(Shard& shard, Node* node);
+			//! Remove the expired sessions from the front of the list of a locked shard
+			static void expire(Shard& shard, uint64_t now);
+
+			ShardedSessions(const ShardedSessions&);
+			ShardedSessions& operator=(const ShardedSessions&);
+		};
+
+		//! Type independent implementation of SharedSessions
+		/*!
+		 * The sessions live in a single memory region laid out as a header followed by the
+		 * shards, the buckets of every shard and then the sessions of every shard. Everything in
+		 * it refers to everything else by index so it can be mapped at any address.
+		 */
+		class SharedSessionTable: public SessionsPar
+		{
+		public:
+			//! Constructor
+			/*!
+			 * @param[in] capacity Maximum amount of sessions
+			 * @param[in] keepAlive Amount of seconds a session stays alive for once last used
+			 * @param[in] valueSize Size in bytes of the data of a session
+			 * @param[in] name Name of the POSIX shared memory object or 0 for anonymous memory
+			 * @param[in] shards Amount of shards
+			 */
+			SharedSessionTable(size_t capacity, unsigned int keepAlive, size_t valueSize, const char* name, unsigned int shards);
+			~SharedSessionTable();
+
+			//! Copy the data of a session out and keep it alive for another keepAlive seconds
+			bool find(const SessionId& id, void* value);
+			//! Copy the data of a session in and keep it alive for another keepAlive seconds
+			bool update(const SessionId& id, const void* value);
+			//! Start a new session with a random ID
+			void generate(SessionId& id, const void* value);
+			//! Remove a session
+			bool erase(const SessionId& id);
+			//! Amount of sessions alive
+			size_t size();
+			//! Remove every expired session
+			void cleanup();
+
+			//! Amount of seconds sessions stay alive for once last used
+			unsigned int getKeepAlive() const { return m_keepAlive; }
+			//! Time a session found or generated right now expires at
+			boost::posix_time::ptime getExpiry() const { return expiry(m_keepAlive); }
+
+			//! Remove a named shared memory object
+			/*!
+			 * Processes that have it mapped keep using it. The next process to construct a
+			 * container with the name starts afresh.
+			 */
+			static bool unlink(const char* name);
+
+		private:
+			struct Header;
+			struct Shard;
+			struct Entry;
+			class Lock;
+
+			//! Index standing for no entry at all
+			static const uint32_t none=0xffffffff;
+
+			//! Amount of seconds sessions stay alive for once last used
+			const unsigned int m_keepAlive;
+			//! The mapped memory
+			char* m_region;
+			//! Size in bytes of the mapped memory
+			size_t m_regionSize;
+			//! The header at the start of the memory
+			Header* m_header;
+
+			Shard& shard(unsigned int index);
+			uint32_t* buckets(unsigned int index);
+			Entry& entry(unsigned int index, uint32_t position);
+			static char* value(Entry& entry);
+			//! Bucket of a shard the ID data of a session belongs in
+			uint32_t bucket(const char* id) const;
+
+			//! Lay out an empty table in freshly mapped memory whose header is filled in
+			void initialize();
+			//! Remove every session from a shard
+			void clear(unsigned int index);
+			//! Find a session in a locked shard
+			uint32_t lookup(unsigned int index, const SessionId& id);
+			//! Remove a session from a locked shard
+			void remove(unsigned int index, uint32_t position);
+			//! Keep a session of a locked shard alive for another keepAlive seconds
+			void touch(unsigned int index, uint32_t position, uint64_t now);
+			//! Remove the expired sessions of a locked shard
+			void expire(unsigned int index, uint64_t now);
+
+			SharedSessionTable(const SharedSessionTable&);
+			SharedSessionTable& operator=(const SharedSessionTable&);
+		};
+
+		//! Container for HTTP sessions shared by many processes
+		/*!
+		 * Works like ShardedSessions but keeps the sessions in shared memory with
+		 * process-shared locks so several processes running the same application share them.
+		 * There is room for a fixed amount of sessions; once a shard is full the least recently
+		 * used session in it is dropped to make room.
+		 *
+		 * With a name the memory is a POSIX shared memory object any process may open. Without
+		 * one it is anonymous and shared with the processes forked after construction. A process
+		 * dying while holding the lock of a shard loses the sessions in that shard but nobody is
+		 * left waiting for the lock where robust mutexes are supported.
+		 *
+		 * Since the data has to be copied in and out it must be plain old data.
+		 *
+		 * @tparam T Plain old data type containing session data.
+		 */
+		template<class T> class SharedSessions: public SharedSessionTable
+		{
+			BOOST_STATIC_ASSERT(boost::is_pod<T>::value);
+		public:
+			//! Constructor
+			/*!
+			 * Every process opening the same named memory must pass the same capacity, size of
+			 * T and amount of shards.
+			 *
+			 * @param[in] capacity Maximum amount of sessions
+			 * @param[in] keepAlive Amount of seconds a session stays alive for once last used
+			 * @param[in] name Name of the POSIX shared memory object (like "/sessions") or 0 for anonymous memory
+			 * @param[in] shards Amount of shards
+			 */
+			SharedSessions(size_t capacity, unsigned int keepAlive, const char* name=0, unsigned int shards=16): SharedSessionTable(capacity, keepAlive, sizeof(T), name, shards) { }
+
+			//! Copy the data of a session and keep it alive for another keepAlive seconds
+			/*!
+			 * @return True if there was such a session
+			 */
+			bool find(const SessionId& id, T& value) { return SharedSessionTable::find(id, &value); }
+
+			//! Replace the data of a session and keep it alive for another keepAlive seconds
+			/*!
+			 * @return True if there was such a session
+			 */
+			bool update(const SessionId& id, const T& value) { return SharedSessionTable::update(id, &value); }
+
+			//! Start a new session with a random ID
+			/*!
+			 * @return The ID of the new session
+			 */
+			SessionId generate(const T& value=T()) { SessionId id; SharedSessionTable::generate(id, &value); return id; }
+		};
+	}
+}
+
+template<class T> Fastcgipp::Http::ShardedSessions<T>::~ShardedSessions()
+{
+	for(unsigned int i=0; i<m_shards; ++i)
+		while(m_shard[i].oldest)
+			remove(m_shard[i], m_shard[i].oldest);
+}
+
+template<class T> void Fastcgipp::Http::ShardedSessions<T>::append(Shard& shard, Node* node)
+{
+	node->previous=shard.newest;
+	node->next=0;
+	if(shard.newest)
+		shard.newest->next=node;
+	else
+		shard.oldest=node;
+	shard.newest=node;
+}
+
+template<class T> void Fastcgipp::Http::ShardedSessions<T>::unlink(Shard& shard, Node* node)
+{
+	if(node->previous)
+		node->previous->next=node->next;
+	else
+		shard.oldest=node->next;
+	if(node->next)
+		node->next->previous=node->previous;
+	else
+		shard.newest=node->previous;
+}
+
+template<class T> void Fastcgipp::Http::ShardedSessions<T>::remove(Shard& shard, Node* node)
+{
+	unlink(shard, node);
+	shard.table.erase(node->id);
+	delete node;
+}
+
+template<class T> void Fastcgipp::Http::ShardedSessions<T>::expire(Shard& shard, uint64_t now)
+{
+	while(shard.oldest && shard.oldest->expires<=now)
+		remove(shard, shard.oldest);
+}
+
+template<class T> typename Fastcgipp::Http::ShardedSessions<T>::Pointer Fastcgipp::Http::ShardedSessions<T>::find(const SessionId& id)
+{
+	Shard& shard=m_shard[SessionsPar::shard(id, m_shards)];
+	const uint64_t current=now();
+	boost::lock_guard<boost::mutex> lock(shard.mutex);
+	expire(shard, current);
+
+	const typename boost::unordered_map<SessionId, Node*>::iterator it=shard.table.find(id);
+	if(it==shard.table.end())
+		return Pointer();
+
+	Node* const node=it->second;
+	node->expires=current+(uint64_t)m_keepAlive*1000;
+	unlink(shard, node);
+	append(shard, node);
+	return node->value;
+}
+
+template<class T> typename Fastcgipp::Http::ShardedSessions<T>::Pointer Fastcgipp::Http::ShardedSessions<T>::generate(SessionId& id, const T& value)
+{
+	// Allocation is done before any lock is taken
+	Node* const node=new Node;
+	node->value.reset(new T(value));
+
+	while(1)
+	{
+		Shard& shard=m_shard[SessionsPar::shard(node->id, m_shards)];
+		const uint64_t current=now();
+		boost::lock_guard<boost::mutex> lock(shard.mutex);
+		expire(shard, current);
+		if(shard.table.insert(std::make_pair(node->id, node)).second)
+		{
+			node->expires=current+(uint64_t)m_keepAlive*1000;
+			append(shard, node);
+			id=node->id;
+			return node->value;
+		}
+		node->id=SessionId();
+	}
+}
+
+template<class T> bool Fastcgipp::Http::ShardedSessions<T>::erase(const SessionId& id)
+{
+	Shard& shard=m_shard[SessionsPar::shard(id, m_shards)];
+	boost::lock_guard<boost::mutex> lock(shard.mutex);
+	const typename boost::unordered_map<SessionId, Node*>::iterator it=shard.table.find(id);
+	if(it==shard.table.end())
+		return false;
+	remove(shard, it->second);
+	return true;
+}
+
+template<class T> size_t Fastcgipp::Http::ShardedSessions<T>::size()
+{
+	const uint64_t current=now();
+	size_t total=0;
+	for(unsigned int i=0; i<m_shards; ++i)
+	{
+		boost::lock_guard<boost::mutex> lock(m_shard[i].mutex);
+		expire(m_shard[i], current);
+		total+=m_shard[i].table.size();
+	}
+	return total;
+}
+
+template<class T> void Fastcgipp::Http::ShardedSessions<T>::cleanup()
+{
+	const uint64_t current=now();
+	for(unsigned int i=0; i<m_shards; ++i)
+	{
+		boost::lock_guard<boost::mutex> lock(m_shard[i].mutex);
+		expire(m_shard[i], current);
+	}
+}
+
+#endif
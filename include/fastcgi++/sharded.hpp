@@ -0,0 +1,192 @@
+//! \file sharded.hpp Defines the Fastcgipp::ShardedManager class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#ifndef SHARDED_HPP
+#define SHARDED_HPP
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <fastcgi++/manager.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Non-template helpers for ShardedManager
+	class ShardedManagerPar
+	{
+	public:
+		//! Open another listening socket on the address of an existing one
+		/*!
+		 * The new socket is bound with SO_REUSEPORT so that the kernel distributes incoming
+		 * connections between it and the other sockets on the same address. This only works
+		 * with TCP sockets and only if the existing socket allows port reuse as well. The new
+		 * socket has FD_CLOEXEC set.
+		 *
+		 * @param[in] fd Listening socket to copy the address from
+		 * @return The new listening socket or -1 if one could not be made
+		 */
+		static int reusePort(int fd);
+
+		//! Bind the calling thread to a single processor
+		/*!
+		 * @param[in] cpu Processor to bind to. It is taken modulo the amount of processors.
+		 * @return True on success, false if unsupported or it failed
+		 */
+		static bool pin(unsigned int cpu);
+	};
+
+	//! Runs a separate Manager on every processor
+	/*!
+	 * Every shard is a complete Manager with its own Transceiver, event loop and container of
+	 * requests running in its own thread. Nothing is shared between shards so no locking happens
+	 * across them. Where possible each shard gets its own listening socket through
+	 * ShardedManagerPar::reusePort() so the kernel balances connections between them. Where that
+	 * isn't possible (UNIX domain sockets for example) the shards share the listening socket and
+	 * whichever shard gets to a connection first accepts it.
+	 *
+	 * A connection stays with the shard that accepted it for its whole lifetime.
+	 *
+	 * On a reload (see ManagerPar::reload()) only the listening socket of the first shard is
+	 * handed over to the successor. Once it has taken over, the listening sockets of the other
+	 * shards are shut down so the kernel stops passing them connections, and any connections
+	 * still waiting in their queues are reset.
+	 *
+	 * @tparam T Class that will handle individual requests. Should be derived from
+	 * the Request class.
+	 */
+	template<class T> class ShardedManager: public ShardedManagerPar
+	{
+	public:
+		//! Construct from a file descriptor
+		/*!
+		 * @param[in] fd File descriptor to listen on.
+		 * @param[in] shards Amount of shards to run. 0 means one per processor.
+		 * @param[in] pinThreads If true, the thread of every shard is bound to its own processor.
+		 * @param[in] doSetupSignals If true, signal handlers will be set up for SIGTERM, SIGUSR1 and SIGHUP. They halt all shards.
+		 */
+		ShardedManager(int fd=0, unsigned int shards=0, bool pinThreads=true, bool doSetupSignals=true);
+
+		~ShardedManager();
+
+		//! General handling function to be called after construction
+		/*!
+		 * Runs the first shard in the calling thread and every other shard in a thread of its
+		 * own. It returns once all shards have been halted.
+		 *
+		 * @sa Manager::handler()
+		 */
+		void handler();
+
+		//! Halt all shards
+		/*!
+		 * @sa Manager::stop()
+		 */
+		void stop();
+
+		//! Terminate all shards
+		/*!
+		 * @sa Manager::terminate()
+		 */
+		void terminate();
+
+		//! Amount of shards
+		size_t size() const { return managers.size(); }
+
+		//! Access a single shard
+		Manager<T>& operator[](size_t i) { return *managers[i]; }
+
+	private:
+		//! The shards
+		std::vector<boost::shared_ptr<Manager<T> > > managers;
+		//! Listening sockets opened by the constructor that need closing
+		std::vector<int> listeners;
+		//! Bind each shard thread to a processor
+		const bool pinThreads;
+
+		//! Function executed by the thread of each shard
+		void run(size_t shard);
+
+		ShardedManager(const ShardedManager&);
+		ShardedManager& operator=(const ShardedManager&);
+	};
+}
+
+template<class T> Fastcgipp::ShardedManager<T>::ShardedManager(int fd, unsigned int shards, bool pinThreads_, bool doSetupSignals): pinThreads(pinThreads_)
+{
+	if(!shards)
+		shards=boost::thread::hardware_concurrency();
+	if(!shards)
+		shards=1;
+
+	managers.reserve(shards);
+	// Signals are passed on to every Manager object so setting them up once is enough
+	managers.push_back(boost::shared_ptr<Manager<T> >(new Manager<T>(fd, doSetupSignals)));
+	for(unsigned int i=1; i<shards; ++i)
+	{
+		int shardFd=reusePort(fd);
+		if(shardFd<0)
+			shardFd=fd;
+		else
+			listeners.push_back(shardFd);
+		managers.push_back(boost::shared_ptr<Manager<T> >(new Manager<T>(shardFd, false)));
+	}
+}
+
+template<class T> Fastcgipp::ShardedManager<T>::~ShardedManager()
+{
+	managers.clear();
+	for(std::vector<int>::iterator it=listeners.begin(); it!=listeners.end(); ++it)
+		close(*it);
+}
+
+template<class T> void Fastcgipp::ShardedManager<T>::handler()
+{
+	boost::thread_group threads;
+	for(size_t i=1; i<managers.size(); ++i)
+		threads.create_thread(boost::bind(&ShardedManager::run, boost::ref(*this), i));
+	run(0);
+	threads.join_all();
+}
+
+template<class T> void Fastcgipp::ShardedManager<T>::run(size_t shard)
+{
+	if(pinThreads)
+		pin(shard);
+	managers[shard]->handler();
+}
+
+template<class T> void Fastcgipp::ShardedManager<T>::stop()
+{
+	for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+		(*it)->stop();
+}
+
+template<class T> void Fastcgipp::ShardedManager<T>::terminate()
+{
+	for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+		(*it)->terminate();
+}
+
+#endif
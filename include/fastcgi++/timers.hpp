@@ -0,0 +1,201 @@
+//! \file timers.hpp Defines the Fastcgipp::Timers class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#ifndef TIMERS_HPP
+#define TIMERS_HPP
+
+#include <deque>
+
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <fastcgi++/metrics.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Hierarchical timer wheel with millisecond resolution
+	/*!
+	 * Timers are kept in four levels of 64 slots each. The first level holds the timers due
+	 * within the next 64 milliseconds, one slot per millisecond, and every further level
+	 * covers 64 times the span of the one below it. Whenever a level comes round to a new
+	 * slot the timers in it are spread over the levels below. Adding and cancelling a timer
+	 * is therefore O(1) and so is running them, no matter how many there are. Timers further
+	 * off than the wheel reaches (about four and a half hours) simply go round it again.
+	 *
+	 * Nothing here has a thread of it's own. The thread that drives it calls run() to call
+	 * the callbacks of the timers that are due and passes timeout() on to whatever it blocks
+	 * in. Timers may be added and cancelled from any thread. Should one be added that is due
+	 * before the driving thread would otherwise wake up, the function set with setWake() is
+	 * called so it can recalculate.
+	 */
+	class Timers
+	{
+		struct Node;
+	public:
+		//! Function called once a timer is due
+		typedef boost::function<void()> Callback;
+
+		//! Refers to a timer that was added
+		/*!
+		 * Handles stay safe to use after the timer has run or been cancelled, they just no
+		 * longer refer to anything then. A default constructed handle never refers to anything.
+		 */
+		class Handle
+		{
+		public:
+			Handle(): node(0), sequence(0) { }
+		private:
+			friend class Timers;
+			Handle(Node* node_, uint64_t sequence_): node(node_), sequence(sequence_) { }
+			Node* node;
+			//! Value of Node::sequence when the timer was added
+			uint64_t sequence;
+		};
+
+		Timers();
+
+		//! Add a timer
+		/*!
+		 * @param[in] milliseconds How long from now the timer is due
+		 * @param[in] callback Function to call once it is due. It's called from the thread calling run().
+		 * @return Handle to pass to cancel()
+		 */
+		Handle add(uint64_t milliseconds, const Callback& callback);
+
+		//! Cancel a timer
+		/*!
+		 * Should the callback be running in another thread this waits for it to return so once
+		 * this returns the callback is guaranteed not to be running nor to ever run.
+		 *
+		 * @return True if the timer was pending. False if it already ran or was cancelled.
+		 */
+		bool cancel(const Handle& handle);
+
+		//! Test if a timer is still waiting to run
+		bool pending(const Handle& handle);
+
+		//! Call the callbacks of every timer that is due
+		/*!
+		 * The callbacks are called without any lock held so they may add and cancel timers.
+		 *
+		 * @return Amount of callbacks called
+		 */
+		size_t run();
+
+		//! Milliseconds until the next call to run() has anything to do
+		/*!
+		 * Meant to be passed as the timeout of poll() or the like.
+		 *
+		 * @return Milliseconds or -1 should there be no timers at all
+		 */
+		int timeout();
+
+		//! Amount of timers waiting to run
+		size_t size() { boost::lock_guard<boost::mutex> lock(m_mutex); return m_size; }
+
+		//! Set the function that wakes up the thread calling run()
+		/*!
+		 * It's called from whatever thread adds a timer due earlier than the last call to
+		 * timeout() accounted for.
+		 */
+		void setWake(const boost::function<void()>& wake) { m_wake=wake; }
+
+		//! Current time in milliseconds as the timers see it
+		static uint64_t now() { return Metrics::now()/1000; }
+
+	private:
+		//! Amount of levels in the wheel
+		static const unsigned int levels=4;
+		//! Bits of the time covered by each level
+		static const unsigned int slotBits=6;
+		//! Slots per level. Exactly as many as there are bits in the occupancy masks.
+		static const unsigned int slots=1<<slotBits;
+
+		//! A timer
+		struct Node
+		{
+			Node(): next(0), previous(0), list(0), expires(0), sequence(1) { }
+			//! Next timer in the same list
+			Node* next;
+			//! The pointer pointing to this node or 0 should it not be in a list
+			Node** previous;
+			//! Head of the list the node is in
+			Node** list;
+			//! Tick the timer is due at
+			uint64_t expires;
+			//! Changed every time the node is freed so stale handles can be told apart
+			uint64_t sequence;
+			//! Function to call once due
+			Callback callback;
+		};
+
+		//! Storage for every node ever allocated. A deque so the nodes never move.
+		std::deque<Node> m_nodes;
+		//! Nodes not in use linked through Node::next
+		Node* m_free;
+		//! Heads of the slot lists
+		Node* m_slots[levels][slots];
+		//! Bit masks of the non-empty slots of each level
+		uint64_t m_occupied[levels];
+		//! Timers that are due but whose callback hasn't been called yet
+		Node* m_expired;
+		//! The next tick that hasn't been processed
+		uint64_t m_tick;
+		//! Tick the driving thread sleeps until. 0 while it's awake, ~0 if indefinitely.
+		uint64_t m_wakeAt;
+		//! Amount of timers waiting to run
+		size_t m_size;
+		//! Function that wakes up the driving thread
+		boost::function<void()> m_wake;
+
+		//! Protects everything but the callbacks
+		boost::mutex m_mutex;
+		//! Held by run() while it calls callbacks so cancel() can wait for them
+		boost::recursive_mutex m_runMutex;
+
+		//! Put a node in the slot it's expiry belongs in
+		void insert(Node* node);
+		//! Put a node at the front of a list
+		void link(Node* node, Node** list);
+		//! Take a node out of whatever list it's in
+		void unlink(Node* node);
+		//! Spread the timers in a slot over the levels below
+		void cascade(unsigned int level, unsigned int slot);
+		//! Process every tick up to and including a point in time
+		void advance(uint64_t now);
+		//! Earliest tick at which a non-empty slot is processed or ~0 if there is none
+		uint64_t next() const;
+		//! Get a free node
+		Node* acquire();
+		//! Give a node back
+		void release(Node* node);
+
+		Timers(const Timers&);
+		Timers& operator=(const Timers&);
+	};
+}
+
+#endif
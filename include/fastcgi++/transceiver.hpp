@@ -25,6 +25,7 @@
 #include <map>
 #include <list>
 #include <queue>
+#include <deque>
 #include <algorithm>
 #include <map>
 #include <vector>
@@ -33,17 +34,25 @@
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/atomic.hpp>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <signal.h>
 
 #include <fastcgi++/protocol.hpp>
 #include <fastcgi++/exceptions.hpp>
+#include <fastcgi++/poller.hpp>
+#include <fastcgi++/metrics.hpp>
+#include <fastcgi++/timers.hpp>
+#include <fastcgi++/handoff.hpp>
 
 //! Topmost namespace for the fastcgi++ library
 namespace Fastcgipp
@@ -71,6 +80,29 @@ namespace Fastcgipp
 		size_t size;
 	};
 
+	//! Shared ownership of an open file descriptor
+	/*!
+	 * The file descriptor is closed once the last copy referring to it is destroyed.
+	 */
+	class SharedFile
+	{
+	public:
+		//! Refers to no file
+		SharedFile() { }
+		//! Take ownership of a file descriptor. A negative value refers to no file.
+		explicit SharedFile(int fd) { if(fd>=0) m_owner.reset(new Owner(fd)); }
+		//! Get the file descriptor or -1 if there is none
+		int fd() const { return m_owner?m_owner->fd:-1; }
+	private:
+		struct Owner
+		{
+			Owner(int fd_): fd(fd_) { }
+			~Owner() { ::close(fd); }
+			const int fd;
+		};
+		boost::shared_ptr<Owner> m_owner;
+	};
+
 	//! Handles low level communication with "the other side"
 	/*!
 	 * This class handles the sending/receiving/buffering of data through the OS level sockets and also
@@ -83,47 +115,304 @@ namespace Fastcgipp
 		/*!
 		 * This function is called by Manager::handler() to both transmit data passed to it from
 		 * requests and relay received data back to them as a Message. The function will return true
-		 * if there is nothing at all for it to do.
+		 * if there is nothing at all for it to do. Output to connections that can't take any more
+		 * right now doesn't count as something to do; it waits for the connection to become
+		 * writable. Timers that are due are run first.
 		 *
 		 * @return Boolean value indicating whether there is data to be transmitted or received
 		 */
 		bool handler();
 
 		//! Direct interface to Buffer::requestWrite()
-		Block requestWrite(size_t size) { return buffer.requestWrite(size); }
+		/*!
+		 * The write buffer is locked from this call until the matching call to secureWrite() so
+		 * requests may safely write to it from different threads. Every call to requestWrite()
+		 * must be followed by exactly one call to secureWrite() from the same thread.
+		 */
+		Block requestWrite(size_t size) { writeMutex.lock(); return buffer.requestWrite(size); }
 		//! Direct interface to Buffer::secureWrite()
-		void secureWrite(size_t size, Protocol::FullId id, bool kill)	{ buffer.secureWrite(size, id, kill); transmit(); }
+		/*!
+		 * Commits the write and releases the write buffer locked by requestWrite(). The data is
+		 * only transmitted right away if it filled up a chunk of the buffer. Otherwise it waits for
+		 * a call to flush() or handler() so that it can be sent along with other records. The data
+		 * must be made up of complete records.
+		 */
+		void secureWrite(size_t size, Protocol::FullId id, bool kill)
+		{
+			boost::lock_guard<boost::mutex> writeLock(writeMutex, boost::adopt_lock);
+			countRecords(buffer.writePosition(), size, id.fd);
+			if(buffer.secureWrite(size, id, kill))
+				transmit();
+		}
+		//! Copy a complete record into the write buffer
+		/*!
+		 * Unlike requestWrite() this isn't limited to the space left in the current chunk of the
+		 * buffer. The record is split across chunks as needed while the buffer stays locked so
+		 * it can't get interleaved with other records. The content and padding lengths are
+		 * taken from the header and the padding is zeroed.
+		 *
+		 * Should the connection have more output buffered than Watermarks::connectionMax this
+		 * waits for it to drain below the low watermark before returning.
+		 *
+		 * @param[in] header Header of the record
+		 * @param[in] content Pointer to the first byte of the record content
+		 * @param[in] id Associated complete ID (contains file descriptor)
+		 */
+		void writeRecord(const Protocol::Header& header, const char* content, Protocol::FullId id);
+		//! Copy a run of complete records into the write buffer on behalf of a request
+		/*!
+		 * This is how responses are replayed from a ResponseCache. The request ID in the header
+		 * of every record is replaced by that of id as it's copied and the records are taken
+		 * exactly as they are otherwise. Like writeRecord() this waits for the connection to
+		 * drain should it have too much output buffered.
+		 *
+		 * @param[in] records Pointer to the first byte of the first record
+		 * @param[in] size Size in bytes of all records including headers and padding
+		 * @param[in] id Associated complete ID (contains file descriptor)
+		 */
+		void writeRecords(const char* records, size_t size, Protocol::FullId id);
+		//! Queue a complete record whose content is a region of a file
+		/*!
+		 * Only the header and padding are copied into the write buffer. The content is
+		 * transmitted straight from the file with sendfile() where it is available so it never
+		 * passes through user-space. The file is kept open until the region has been sent. The
+		 * content and padding lengths are taken from the header.
+		 *
+		 * @param[in] header Header of the record
+		 * @param[in] file Regular file to send the content from
+		 * @param[in] offset Offset in the file of the first byte of content
+		 * @param[in] id Associated complete ID (contains file descriptor)
+		 */
+		void writeFile(const Protocol::Header& header, const SharedFile& file, off_t offset, Protocol::FullId id);
+		//! Transmit all buffered data possible
+		/*!
+		 * Called by Manager once a request is done writing for the moment.
+		 */
+		void flush() { boost::lock_guard<boost::mutex> writeLock(writeMutex); transmit(); }
 		//! Constructor
 		/*!
 		 * Construct a transceiver object based on an initial file descriptor to listen on and
-		 * a function to pass messages on to.
+		 * a function to pass messages on to. Should the process have been started by a
+		 * predecessor handing off to it (see handOff()) the listening socket passed by it is used
+		 * instead of fd_.
 		 *
 		 * @param[in] fd_ File descriptor to listen for connections on
 		 * @param[in] sendMessage_ Function to call to pass messages to requests
 		 */
 		Transceiver(int fd_, boost::function<void(Protocol::FullId, Message)> sendMessage_);
-		//! Blocks until there is data to receive or a call to wake() is made
+		//! Blocks until there is data to receive, a timer is due or a call to wake() is made
+		/*!
+		 * The events gathered while sleeping are kept and processed by the next call to handler().
+		 * Should there be file descriptors waiting to be closed by handler() this returns
+		 * immediately.
+		 */
 		void sleep()
 		{
-			poll(&pollFds.front(), pollFds.size(), -1);
+			{
+				boost::lock_guard<boost::mutex> writeLock(writeMutex);
+				if(buffer.closePending() || buffer.blockPending()) return;
+			}
+			if(!poller.ready()) poller.poll(m_timers.timeout());
 		}
 		
 		//! Forces a wakeup from a call to sleep()
+		/*!
+		 * Safe to call from any thread. Calls made while a previous wakeup is still pending
+		 * cost nothing more than an atomic exchange.
+		 */
 		void wake();
 
+		//! Limits on the amount of output buffered in memory
+		/*!
+		 * Output for a connection that the other side is slow to read piles up in the write
+		 * buffer. Once a connection has more than connectionHigh bytes buffered, or all
+		 * connections together more than totalHigh bytes, the connection is throttled and Manager
+		 * stops handling its requests. A connection is released once it drops below
+		 * connectionLow and the total below totalLow. Should a single request keep on writing
+		 * past connectionMax bytes, writes of complete records wait for the connection to drop
+		 * below connectionLow. File data sent with writeFile() takes up no memory and doesn't
+		 * count. A value of 0 disables a limit.
+		 */
+		struct Watermarks
+		{
+			Watermarks(): connectionHigh(4194304), connectionLow(1048576), connectionMax(16777216), totalHigh(268435456), totalLow(134217728) { }
+			//! A connection is throttled once it has more than this many bytes buffered
+			size_t connectionHigh;
+			//! A throttled connection is released once it has less than this many bytes buffered
+			size_t connectionLow;
+			//! Writes wait for a connection to drain once it has more than this many bytes buffered
+			size_t connectionMax;
+			//! All connections are throttled once more than this many bytes are buffered in total
+			size_t totalHigh;
+			//! Connections are released once less than this many bytes are buffered in total
+			size_t totalLow;
+		};
+
+		//! How the write buffer is stored in memory
+		/*!
+		 * Output is buffered in chunks of chunkSize bytes. Chunks no longer needed are kept for
+		 * reuse, up to retainedChunks of them, so bursts of output don't keep going back to the
+		 * heap. Should hugePages be set, the retained chunks are carved out of a single memory
+		 * region that the system is advised to back with huge pages (MADV_HUGEPAGE) where it
+		 * supports them.
+		 */
+		struct Storage
+		{
+			Storage(): chunkSize(131072), retainedChunks(8), hugePages(false) { }
+			//! Size in bytes of the data section of each chunk
+			size_t chunkSize;
+			//! Maximum amount of unused chunks kept for reuse
+			size_t retainedChunks;
+			//! Back the retained chunks with a huge page region
+			bool hugePages;
+		};
+
+		//! Change how the write buffer is stored in memory
+		/*!
+		 * This should be done before any output is produced.
+		 *
+		 * @return False if output was buffered in which case nothing is changed
+		 */
+		bool setStorage(const Storage& storage) { boost::lock_guard<boost::mutex> writeLock(writeMutex); return buffer.setStorage(storage); }
+		//! Get how the write buffer is stored in memory
+		Storage storage() { boost::lock_guard<boost::mutex> writeLock(writeMutex); return buffer.storage(); }
+
+		//! Set the limits on buffered output
+		void setWatermarks(const Watermarks& watermarks) { boost::lock_guard<boost::mutex> writeLock(writeMutex); buffer.setWatermarks(watermarks); }
+		//! Get the limits on buffered output
+		Watermarks watermarks() { boost::lock_guard<boost::mutex> writeLock(writeMutex); return buffer.watermarks(); }
+		//! Test if a connection is throttled by the watermarks
+		/*!
+		 * @param[in] fd File descriptor of the connection
+		 */
+		bool throttled(int fd) { boost::lock_guard<boost::mutex> writeLock(writeMutex); return buffer.throttled(fd); }
+		//! Test if all output has been transmitted
+		bool empty() { boost::lock_guard<boost::mutex> writeLock(writeMutex); return buffer.empty(); }
+
+		//! Limit the amount of connections open at a time
+		/*!
+		 * Once the limit is reached the listening socket is no longer watched so further
+		 * connections wait in it's queue until one closes. This should be done before calling
+		 * handler().
+		 *
+		 * @param[in] max Maximum amount of connections. 0 means unlimited.
+		 */
+		void setMaxConnections(unsigned int max) { maxConnections=max; }
+		//! Amount of connections currently open
+		size_t connections() const { return connectionCount.load(); }
+
+		//! Close connections that have been idle for too long
+		/*!
+		 * A connection is idle while nothing is received from it, no request on it is active
+		 * and none of it's output is waiting to be transmitted. Once it has been idle for the
+		 * timeout it is closed. This should be done before calling handler().
+		 *
+		 * @param[in] milliseconds Time after which an idle connection is closed. 0 means never.
+		 */
+		void setIdleTimeout(unsigned int milliseconds) { idleTimeout=milliseconds; }
+		//! Get the time after which an idle connection is closed. 0 means never.
+		unsigned int getIdleTimeout() const { return idleTimeout; }
+
+		//! Hand the listening socket over to a successor process
+		/*!
+		 * The successor is started right away and passed the listening socket (see Handoff).
+		 * Connections are accepted as usual until it reports that it's ready. From then on none
+		 * are accepted and, should connections be true, every connection is passed on to the
+		 * successor as soon as it's idle. Requests already received are still handled here.
+		 * Should the successor fail to start up the handoff is abandoned.
+		 *
+		 * @param[in] command The program and it's arguments. See Handoff::spawn().
+		 * @param[in] connections True if idle connections should be passed on as well
+		 * @return False if the successor couldn't be started or a handoff is already underway
+		 */
+		bool handOff(const std::vector<std::string>& command, bool connections);
+
+		//! Test and clear whether the successor has taken over the listening socket
+		/*!
+		 * Once this returns true nothing new is accepted any more so it's time to terminate.
+		 */
+		bool handedOff() { const bool handedOff=m_handedOff; m_handedOff=false; return handedOff; }
+
+		//! Get the listening socket
+		int listener() const { return socket; }
+
+		//! Stop the listening socket from taking any more connections
+		/*!
+		 * Meant for listening sockets of the same address that aren't handed over to the
+		 * successor, like those of the other shards of a ShardedManager. The socket is shut down
+		 * so the kernel no longer passes it new connections and connections waiting in it's queue
+		 * are reset. It is not closed. Safe to call from any thread.
+		 */
+		void shutListener() { shutdown(socket, SHUT_RDWR); }
+
+		//! The timers run by handler()
+		/*!
+		 * Callbacks are called from the thread running handler() which sleeps no longer than
+		 * until the next one is due.
+		 */
+		Timers& timers() { return m_timers; }
+
+		//! Output statistics
+		struct Statistics
+		{
+			Statistics(): bytes(0), writes(0), frames(0), buffered(0), throttles(0) { }
+			//! Amount of bytes transmitted
+			uint64_t bytes;
+			//! Amount of write system calls made
+			uint64_t writes;
+			//! Amount of frames (FastCGI records or parts thereof) transmitted
+			uint64_t frames;
+			//! Amount of bytes currently buffered waiting to be transmitted
+			uint64_t buffered;
+			//! Amount of times a connection was throttled by the watermarks
+			uint64_t throttles;
+		};
+
+		//! Get the output statistics so far
+		Statistics statistics()
+		{
+			boost::lock_guard<boost::mutex> writeLock(writeMutex);
+			Statistics statistics(stats);
+			statistics.buffered=buffer.buffered();
+			statistics.throttles=buffer.throttles();
+			return statistics;
+		}
+
+		//! Counters and histograms describing the work done
+		Metrics& metrics() { return m_metrics; }
+
+		//! Output the metrics and current state of the transceiver in the Prometheus text format
+		void dumpMetrics(std::ostream& stream);
+
 	private:
 		//! %Buffer type for receiving FastCGI records
 		struct fdBuffer
 		{
-			//! Buffer for header information
-			Protocol::Header headerBuffer;
-			//! Buffer of complete Message
-			Message messageBuffer;
+			//! Data read from the connection. Unset while there is no partial record to hold.
+			boost::shared_array<char> data;
+			//! Position of the first byte of data not yet passed on in a Message
+			size_t start;
+			//! Position one past the last byte of data read
+			size_t end;
+			//! True if the file descriptor is an open connection owned by the transceiver
+			bool open;
+			//! True if the poller is watching the connection for the ability to write
+			bool writing;
+			//! When data was last received from the connection or it was last seen busy (see Timers::now())
+			uint64_t lastActive;
+			//! Timer that checks whether the connection has been idle too long
+			Timers::Handle idleTimer;
+			fdBuffer(): start(0), end(0), open(false), writing(false), lastActive(0) { }
 		};
+		//! Container associating file descriptors with their receive buffers
+		/*!
+		 * File descriptors are small integers so the container is simply indexed by them.
+		 */
+		typedef std::vector<fdBuffer> FdBuffers;
 
 		//! %Buffer type for transmission of FastCGI records
 		/*!
-		 * This buffer is implemented as a circle of Chunk objects; the number of which can grow and shrink as needed. Write
+		 * This buffer is implemented as a queue of Chunk objects; the number of which can grow and shrink as needed. Write
 		 * space is requested with requestWrite() which thereby returns a Block which may be smaller
 		 * than requested. The write is committed by calling secureWrite(). A smaller space can be
 		 * committed than was given to write on. 
@@ -131,6 +420,11 @@ namespace Fastcgipp
 		 * All data written to the buffer has an associated file descriptor through which it
 		 * is flushed. File descriptor association with data is managed through a queue of Frame
 		 * objects.
+		 *
+		 * Connections are non-blocking so one that can't take any more output is marked as blocked
+		 * and skipped over until the poller reports it as writable. Frames for other connections
+		 * behind it still go out, but the memory is only reclaimed in order once every frame in
+		 * front of it has been transmitted.
 		 */
 		class Buffer
 		{
@@ -142,56 +436,159 @@ namespace Fastcgipp
 				 * @param[in] size_ Size of the frame
 				 * @param[in] closeFd_ Boolean value indication whether or not the file descriptor should be closed when the frame has been flushed
 				 * @param[in] id_ Complete ID of the request making the frame
+				 * @param[in] data_ Pointer to the first byte of the frame
+				 * @param[in] file_ File the frame is sent from if it isn't in the buffer
+				 * @param[in] offset_ Offset in file_ of the first byte of the frame
 				 */
-				Frame(size_t size_, bool closeFd_, Protocol::FullId id_): size(size_), closeFd(closeFd_), id(id_) { }
+				Frame(size_t size_, bool closeFd_, Protocol::FullId id_, const char* data_, const SharedFile& file_=SharedFile(), off_t offset_=0): size(size_), sent(0), closeFd(closeFd_), id(id_), data(data_), file(file_), offset(offset_) { }
 				//! Size of the frame
 				size_t size;
+				//! Amount of bytes of the frame transmitted so far
+				size_t sent;
 				//! Boolean value indication whether or not the file descriptor should be closed when the frame has been flushed
 				bool closeFd;
 				//! Complete ID (contains a file descriptor) of associated with the data frame
 				Protocol::FullId id;
+				//! Pointer to the first byte of the frame. Valid until the frame is removed from the queue.
+				const char* data;
+				//! File the frame is sent from. Such frames take up no space in the buffer.
+				SharedFile file;
+				//! Offset in the file of the first byte of the frame
+				off_t offset;
 			};
 			//! Queue of frames waiting to be transmitted
-			std::queue<Frame> frames;
+			/*!
+			 * Frames that have been transmitted stay in the queue until every frame in front of
+			 * them has been as well.
+			 */
+			std::deque<Frame> frames;
+
+			//! Output state of a connection
+			struct Connection
+			{
+				Connection(): buffered(0), requests(0), lastEnd(0), blocked(false), throttled(false) { }
+				//! Amount of bytes of memory buffered for the connection
+				size_t buffered;
+				//! Amount of requests begun on the connection that haven't ended yet
+				unsigned int requests;
+				//! When a request last ended on the connection (see Timers::now())
+				uint64_t lastEnd;
+				//! True if the connection can't take any more output until it's reported as writable
+				bool blocked;
+				//! True if the connection is over its watermark
+				bool throttled;
+			};
+			//! Output state of the connections indexed by file descriptor
+			std::vector<Connection> connections;
+			//! Get the output state of a connection
+			Connection& connection(int fd)
+			{
+				if(fd>=(int)connections.size())
+					connections.resize(fd+1);
+				return connections[fd];
+			}
+			//! Amount of bytes of memory buffered for all connections
+			size_t m_buffered;
+			//! True if all connections are throttled by the total watermark
+			bool m_throttled;
+			//! Amount of times a connection has been throttled
+			uint64_t m_throttles;
+			//! Limits on the amount of output buffered
+			Watermarks m_watermarks;
+			//! Connections that became blocked since the last call to takeBlocked()
+			std::vector<int> blockedFds;
+			//! True if the thread running Transceiver::handler() has something new to look at
+			bool m_wake;
+			//! True if a request has ended since the last call to takeEnded()
+			bool m_ended;
+
+			//! Account for bytes added to or removed from the buffer for a connection
+			/*!
+			 * @param[in] fd File descriptor of the connection
+			 * @param[in] added Amount of bytes added
+			 * @param[in] removed Amount of bytes removed
+			 */
+			void account(int fd, size_t added, size_t removed);
+
+			//! Frames making up the batch handed out by the last call to requestRead()
+			std::vector<size_t> batch;
+			//! Position in frames to look for the next batch at
+			size_t scan;
 			//! Minimum Block size value that can be returned from requestWrite()
 			const static unsigned int minBlockSize = 256;
-			//! %Chunk of data in Buffer
+			//! Header at the start of every chunk of data in Buffer
+			/*!
+			 * The data section follows the header in the same block of memory. A chunk belongs
+			 * to exactly one of the queue of chunks in use or the free list at any time so no
+			 * reference counting is needed.
+			 */
 			struct Chunk
 			{
-				//! Size of data section of the chunk
-				const static unsigned int size = 131072;
-				//! Pointer to the first byte in the chunk data
-				boost::shared_array<char> data;
+				//! Next chunk in the queue or the free list
+				Chunk* next;
 				//! Pointer to the first write byte in the chunk or 1+ the last read byte
 				char* end;
-				//! Creates a new data chunk
-				Chunk(): data(new char[size]), end(data.get()) { }
-				~Chunk() { } 
-				//! Creates a new object that shares the data of the old one
-				Chunk(const Chunk& chunk): data(chunk.data), end(data.get()) { } 
+				//! Pointer to one past the last byte of the data section
+				char* limit;
+				//! Pointer to the first byte of the data section
+				char* data() { return (char*)this+headerSize; }
 			};
+			//! Alignment of the data section of a chunk
+			static const size_t alignment=16;
+			//! Size of the chunk header rounded up to the alignment
+			static const size_t headerSize=(sizeof(Chunk)+alignment-1)/alignment*alignment;
 
-			//! A list of chunks. Can contain from 2-infinity
-			std::list<Chunk> chunks;
-			//! Iterator pointing to the chunk currently used for writing
-			std::list<Chunk>::iterator writeIt;
+			//! Chunk currently being read from. The first in the queue.
+			Chunk* readChunk;
+			//! Chunk currently used for writing
+			Chunk* writeChunk;
+			//! Last chunk in the queue. Chunks after writeChunk are empty spares.
+			Chunk* lastChunk;
 
 			//! Current read spot in the buffer
 			char* pRead;
 
-			//! A reference to Transceiver::pollFds for removing file descriptors when they are closed
-			std::vector<pollfd>& pollFds;
-			//! A reference to Transceiver::fdBuffer for deleting buffers upon closing of the file descriptor
-			std::map<int, fdBuffer>& fdBuffers;
-			//! Helper function for freeFd(int fd, std::vector<pollfd> pollFds, std::map<int, fdBuffer> fdBuffers)
-			void freeFd(int fd_) { Fastcgipp::Transceiver::freeFd(fd_, pollFds, fdBuffers);  }
+			//! How chunks are stored
+			Storage m_storage;
+			//! Chunks available for reuse
+			Chunk* freeChunks;
+			//! Amount of chunks in freeChunks
+			size_t freeCount;
+			//! Start of the memory region chunks are carved from or null if there is none
+			char* region;
+			//! Size of the memory region
+			size_t regionSize;
+			//! First chunk in the memory region
+			char* regionStart;
+			//! One past the last chunk in the memory region
+			char* regionEnd;
+
+			//! Get an empty chunk from the free list or allocate a new one
+			Chunk* acquire();
+			//! Give a chunk back to the free list or free it
+			void release(Chunk* chunk);
+			//! Free every chunk in the free list along with the memory region
+			void freeStorage();
+			//! Size of a chunk including it's header
+			size_t blockSize() const { return headerSize+m_storage.chunkSize; }
+
+			Buffer(const Buffer&);
+			Buffer& operator=(const Buffer&);
+
+			//! File descriptors whose data has been flushed and are waiting to be closed
+			std::vector<int> closeFds;
 		public:
-			//! Constructor
+			Buffer();
+			~Buffer();
+
+			//! Change how chunks are stored
 			/*!
-			 * @param[out] pollFds_ A reference to Transceiver::pollFds is needed for removing file descriptors when they are closed
-			 * @param[out] fdBuffers_ A reference to Transceiver::fdBuffer is needed for deleting buffers upon closing of the file descriptor
+			 * @param[in] storage New storage settings
+			 * @return False if the buffer wasn't empty in which case nothing is changed
 			 */
-			Buffer(std::vector<pollfd>& pollFds_, std::map<int, fdBuffer>& fdBuffers_): chunks(1), writeIt(chunks.begin()), pRead(chunks.begin()->data.get()), pollFds(pollFds_), fdBuffers(fdBuffers_)  { }
+			bool setStorage(const Storage& storage);
+			//! Get how chunks are stored
+			const Storage& storage() const { return m_storage; }
 
 			//! Request a write block in the buffer
 			/*!
@@ -200,49 +597,118 @@ namespace Fastcgipp
 			 */
 			Block requestWrite(size_t size)
 			{
-				return Block(writeIt->end, std::min(size, (size_t)(writeIt->data.get()+Chunk::size-writeIt->end)));
+				return Block(writeChunk->end, std::min(size, (size_t)(writeChunk->limit-writeChunk->end)));
 			}
 			//! Secure a write in the buffer
 			/*!
 			 * @param[in] size Amount of bytes to secure
 			 * @param[in] id Associated complete ID (contains file descriptor)
 			 * @param[in] kill Boolean value indicating whether or not the file descriptor should be closed after transmission
+			 * @return True if the write filled up a chunk
+			 */
+			bool secureWrite(size_t size, Protocol::FullId id, bool kill);
+			//! Copy data into the buffer spanning chunks as needed
+			/*!
+			 * @param[in] data Pointer to the first byte of data
+			 * @param[in] size Size of data in bytes
+			 * @param[in] id Associated complete ID (contains file descriptor)
+			 * @return True if the write filled up a chunk
+			 */
+			bool write(const char* data, size_t size, Protocol::FullId id);
+			//! Write zeroed padding into the buffer
+			/*!
+			 * @param[in] size Amount of bytes of padding
+			 * @param[in] id Associated complete ID (contains file descriptor)
+			 * @return True if the write filled up a chunk
 			 */
-			void secureWrite(size_t size, Protocol::FullId id, bool kill);
+			bool pad(size_t size, Protocol::FullId id);
+			//! Queue a region of a file to be sent in sequence with the data in the buffer
+			/*!
+			 * @param[in] file File to send the data from
+			 * @param[in] offset Offset in the file of the first byte
+			 * @param[in] size Size of the region in bytes
+			 * @param[in] id Associated complete ID (contains file descriptor)
+			 */
+			void writeFile(const SharedFile& file, off_t offset, size_t size, Protocol::FullId id) { frames.push_back(Frame(size, false, id, 0, file, offset)); }
 
-			//! %Block of memory for extraction from Buffer
-			struct SendBlock
-			{
-				//! Constructor
-				/*!
-				 * @param[in] data_ Pointer to the first byte in the block
-				 * @param[in] size_ Size in bytes of the data
-				 * @param[in] fd_ File descriptor the data should be written to
-				 */
-				SendBlock(const char* data_, size_t size_, int fd_): data(data_), size(size_), fd(fd_) { }
-				//! Create a new object that shares the data of the old
-				SendBlock(const SendBlock& sendBlock): data(sendBlock.data), size(sendBlock.size), fd(sendBlock.fd) { }
-				//! Pointer to the first byte in the block
-				const char* data;
-				//! Size in bytes of the data
-				size_t size;
-				//! File descriptor the data should be written to
-				int fd;
-			};
+			//! Start looking for data to transmit from the front of the queue
+			void rewind() { scan=0; }
+			//! Request the next batch of data for a single connection for transmitting
+			/*!
+			 * Gathers the untransmitted frames for the first connection that isn't blocked, even
+			 * across chunk boundaries and frames for other connections, so they can be sent with a
+			 * single call to writev(). Gathering stops after a frame that closes the file
+			 * descriptor and before a frame that is sent from a file. Frames that are contiguous
+			 * in memory share an iovec. A frame sent from a file makes up a batch of it's own in
+			 * which case file is set and iov[0].iov_len holds the amount of bytes to send.
+			 *
+			 * @param[out] iov Array to store the data blocks in
+			 * @param[in] iovSize Amount of elements in iov
+			 * @param[out] iovCount Amount of elements in iov that were used
+			 * @param[out] file File descriptor to send the data from or -1 if it's in iov
+			 * @param[out] offset Offset in the file of the first byte to send
+			 * @return File descriptor the data should be written to or -1 if there is nothing to transmit
+			 */
+			int requestRead(iovec* iov, int iovSize, int& iovCount, int& file, off_t& offset);
+			//! Mark data from the last batch as transmitted
+			/*!
+			 * Should less than the whole batch have been transmitted the connection is marked as
+			 * blocked.
+			 *
+			 * @param size Amount of bytes to mark as transmitted
+			 * @return Amount of frames that were completely transmitted
+			 */
+			size_t freeRead(size_t size);
+			//! Free the memory of transmitted frames at the front of the queue
+			void reclaim();
 
-			//! Request a block of data for transmitting
+			//! Drop all untransmitted output for a connection and forget about it's state
 			/*!
-			 * @return A block of data with a file descriptor to transmit it out
+			 * @param[in] fd File descriptor of the connection
 			 */
-			SendBlock requestRead()
-			{
-				return SendBlock(pRead, frames.empty()?0:frames.front().size, frames.empty()?-1:frames.front().id.fd);
-			}
-			//! Mark data in the buffer as transmitted and free it's memory
+			void discard(int fd);
+			//! Mark a connection as able to take output again
+			void unblock(int fd) { connection(fd).blocked=false; }
+			//! Take the connections that became blocked
 			/*!
-			 * @param size Amount of bytes to mark as transmitted and free
+			 * @param[out] fds Container to swap the file descriptors into. It should be empty.
 			 */
-			void freeRead(size_t size);
+			void takeBlocked(std::vector<int>& fds) { fds.swap(blockedFds); }
+			//! Test if there are newly blocked connections
+			bool blockPending() const { return !blockedFds.empty(); }
+			//! Test if a connection is throttled by the watermarks
+			bool throttled(int fd) { return m_throttled || connection(fd).throttled; }
+			//! Test if a connection is over it's own watermark
+			bool connectionThrottled(int fd) { return connection(fd).throttled; }
+			//! Count a request beginning on a connection
+			void begin(int fd) { ++connection(fd).requests; }
+			//! Count a request ending on a connection
+			void end(int fd) { Connection& state=connection(fd); if(state.requests) --state.requests; state.lastEnd=Timers::now(); m_ended=true; }
+			//! Test and clear whether a request has ended since the last call
+			bool takeEnded() { const bool ended=m_ended; m_ended=false; return ended; }
+			//! When a request last ended on a connection (see Timers::now())
+			uint64_t lastEnd(int fd) { return connection(fd).lastEnd; }
+			//! Test if a connection has active requests or output waiting to be transmitted
+			bool busy(int fd);
+			//! Test if writes to a connection should wait for it to drain
+			bool full(int fd) { return m_watermarks.connectionMax && connection(fd).buffered>m_watermarks.connectionMax; }
+			//! Test and clear whether the thread running Transceiver::handler() should be woken up
+			bool takeWake() { const bool wake=m_wake; m_wake=false; return wake; }
+
+			//! Amount of bytes of memory buffered for all connections
+			size_t buffered() const { return m_buffered; }
+			//! Amount of chunks in the queue, spares included
+			size_t chunks() const { size_t count=1; for(const Chunk* chunk=readChunk; chunk!=lastChunk; chunk=chunk->next) ++count; return count; }
+			//! Amount of chunks kept for reuse in the free list
+			size_t retainedChunks() const { return freeCount; }
+			//! Where the data for the next call to secureWrite() goes
+			const char* writePosition() const { return writeChunk->end; }
+			//! Amount of times a connection has been throttled
+			uint64_t throttles() const { return m_throttles; }
+			//! Set the limits on buffered output
+			void setWatermarks(const Watermarks& watermarks) { m_watermarks=watermarks; }
+			//! Get the limits on buffered output
+			const Watermarks& watermarks() const { return m_watermarks; }
 
 			//! Test of the buffer is empty
 			/*!
@@ -250,29 +716,196 @@ namespace Fastcgipp
 			 */
 			bool empty()
 			{
-				return pRead==writeIt->end;
+				return frames.empty();
 			}
+
+			//! Queue a file descriptor to be closed
+			/*!
+			 * Transmission can happen in any thread that writes to the buffer, but file descriptors
+			 * are only ever closed by the thread running Transceiver::handler(). This records the file
+			 * descriptor so that handler() can close it.
+			 *
+			 * @param[in] fd File descriptor to close
+			 */
+			void closeFd(int fd) { closeFds.push_back(fd); }
+
+			//! Forget about a file descriptor waiting to be closed
+			/*!
+			 * Should the file descriptor be closed by other means first its number may be reused
+			 * by a new connection before handler() gets to it.
+			 *
+			 * @param[in] fd File descriptor that has already been closed
+			 */
+			void cancelClose(int fd) { closeFds.erase(std::remove(closeFds.begin(), closeFds.end(), fd), closeFds.end()); }
+
+			//! Test if there are file descriptors waiting to be closed
+			bool closePending() const { return !closeFds.empty(); }
+
+			//! Take the file descriptors waiting to be closed
+			/*!
+			 * @param[out] fds Container to swap the file descriptors into. It should be empty.
+			 */
+			void takeCloseFds(std::vector<int>& fds) { fds.swap(closeFds); }
 		};
 
 		//! %Buffer for transmitting data
 		Buffer buffer;
+		//! Transmission statistics. Protected by writeMutex.
+		Statistics stats;
+		//! Mutex to make accessing buffer thread safe
+		boost::mutex writeMutex;
+		//! File descriptors taken from the buffer to be closed by handler()
+		std::vector<int> closeFds;
+		//! Connections taken from the buffer to be watched for the ability to write by handler()
+		std::vector<int> blockedFds;
 		//! Function to call to pass messages to requests
 		boost::function<void(Protocol::FullId, Message)> sendMessage;
 		
-		//! poll() file descriptors container
-		std::vector<pollfd> pollFds;
+		//! Event notification for the listening socket, the wakeup socket and all connections
+		Poller poller;
 		//! Socket to listen for connections on
 		int socket;
-		//! Input file descriptor to the wakeup socket pair
+		//! Input file descriptor to the wakeup eventfd or socket pair
 		int wakeUpFdIn;
-		//! Output file descriptor to the wakeup socket pair
+		//! Output file descriptor to the wakeup socket pair. Same as wakeUpFdIn with an eventfd.
 		int wakeUpFdOut;
+		//! True if wake() has signalled wakeUpFdOut and handler() hasn't consumed it yet
+		boost::atomic<bool> wakePending;
 		
 		//! Container associating file descriptors with their receive buffers
-		std::map<int, fdBuffer> fdBuffers;
+		FdBuffers fdBuffers;
+
+		//! Maximum amount of connections open at a time or 0 for unlimited
+		unsigned int maxConnections;
+		//! Amount of connections currently open. Only changed by handler().
+		boost::atomic<size_t> connectionCount;
+		//! True if the poller is watching the listening socket
+		bool listening;
+		//! False once the listening socket has been handed off for good
+		bool accepting;
+
+		//! State of a handoff of the listening socket
+		enum HandoffState
+		{
+			//! Nothing is being handed off
+			NO_HANDOFF,
+			//! The successor has been started and is expected to report that it's ready
+			STARTING,
+			//! The successor has the listening socket and gets the connections once they're idle
+			DRAINING,
+			//! We are the successor and are receiving connections
+			SUCCEEDING
+		};
+		HandoffState handoffState;
+		//! Channel to the predecessor or successor or -1
+		int handoffChannel;
+		//! Process id of the successor
+		pid_t successor;
+		//! True if idle connections are passed on to the successor
+		bool handoffConnections;
+		//! True once the successor is ready and until handedOff() is called
+		bool m_handedOff;
+		//! True if the last call to sweep() left connections behind that may soon be idle
+		bool sweepAgain;
+		//! Handle a message on the handoff channel
+		void handoff();
+		//! Pass every idle connection on to the successor
+		void sweep();
+		//! Stop watching and forget about the handoff channel
+		void endHandoff();
+
+		//! Counters and histograms describing the work done
+		Metrics m_metrics;
+		//! Count the records in a block of data as sent
+		/*!
+		 * The write buffer must be locked when calling this.
+		 *
+		 * @param[in] data Pointer to the first byte of the first record
+		 * @param[in] size Size of the records in bytes
+		 * @param[in] fd File descriptor of the connection the records are sent to
+		 */
+		void countRecords(const char* data, size_t size, int fd);
+
+		//! Timers run by handler()
+		Timers m_timers;
+		//! Time after which an idle connection is closed or 0 for never
+		unsigned int idleTimeout;
+		//! Close a connection if it has been idle too long or check again later
+		/*!
+		 * Called by the connection's idle timer.
+		 */
+		void idle(int fd);
 		
+		//! Maximum amount of data blocks handed to a single call to writev()
+		static const int maxIovecs=64;
+
 		//! Transmit all buffered data possible
-		int transmit();
+		/*!
+		 * Consecutive frames for the same file descriptor are sent with a single call to
+		 * writev(). The write buffer must be locked when calling this.
+		 */
+		void transmit();
+
+		//! Wait for a full connection to drain
+		/*!
+		 * Transmits to the connection directly, waiting for it to become writable with the write
+		 * buffer unlocked, until it's below it's low watermark or has gone away. A signal also
+		 * ends the wait.
+		 *
+		 * @param[in] lock Lock held on the write buffer
+		 * @param[in] fd File descriptor of the connection
+		 */
+		void drain(boost::unique_lock<boost::mutex>& lock, int fd);
+
+		//! Start watching the connections that became blocked for the ability to write
+		/*!
+		 * Only called by handler().
+		 */
+		void watchBlocked();
+
+		//! Send a region of a file to a connection
+		/*!
+		 * Uses sendfile() where it is available. Should that fail or the file have shrunk, the
+		 * data is read into memory and written instead, with zeros standing in for whatever can't
+		 * be read so as to not break up the record stream.
+		 *
+		 * @param[in] fd File descriptor of the connection
+		 * @param[in] file File descriptor of the file
+		 * @param[in] offset Offset in the file of the first byte to send
+		 * @param[in] size Amount of bytes to send
+		 * @return Amount of bytes sent or -1 on a write error (see errno)
+		 */
+		static ssize_t sendFile(int fd, int file, off_t offset, size_t size);
+
+		//! Accept a new connection on the listening socket
+		void accept();
+		//! Take charge of a connection accepted here or passed on by a predecessor
+		void adopt(int fd);
+
+		//! Receive data from a connection
+		/*!
+		 * Reads as much as is available on the file descriptor with a single read() and passes on
+		 * every complete record in it as a Message. Messages don't own a copy of their record;
+		 * they share the read buffer it was received into.
+		 *
+		 * @param[in] fd File descriptor of the connection
+		 */
+		void receive(int fd);
+
+		//! Size of the receive buffers. Large enough to hold at least one record of the largest size.
+		static const size_t readBufferSize=131072;
+		//! Maximum amount of idle receive buffers kept around for reuse
+		static const size_t readPoolSize=16;
+		//! Receive buffers not attached to a connection
+		/*!
+		 * A buffer can only be reused once every Message sharing it is gone, that is when the
+		 * pool holds the only reference to it. Only ever accessed by the thread running handler().
+		 */
+		std::vector<boost::shared_array<char> > readPool;
+		//! Get a receive buffer that no one else is using
+		boost::shared_array<char> getReadBuffer();
+		//! Give a receive buffer back to the pool
+		void releaseReadBuffer(boost::shared_array<char>& buffer);
 
 	public:
 		//! Free fd/pipe and all it's associated resources
@@ -281,30 +914,12 @@ namespace Fastcgipp
 		 * and free up it's associated buffers and resources. It is safe
 		 * to call this function at any time with any fd(even bad ones).
 		 * If requests still exists with this fd then they will be lost.
+		 * This must only be called from the thread running handler().
 		 *
 		 * @param fd File descriptor to delete/free up
-		 * @param pollFds Epoll container
-		 * @param fdBuffers Container of fd/pipe buffers
 		 */
-		static void freeFd(int fd, std::vector<pollfd>& pollFds, std::map<int, fdBuffer>& fdBuffers);
-
-		//! Helper function for freeFd(int fd, std::vector<pollfd> pollFds, std::map<int, fdBuffer> fdBuffers)
-		void freeFd(int fd_) { freeFd(fd_, pollFds, fdBuffers);  }
-	};
-	
-	//! Predicate for comparing the file descriptor of a pollfd
-	struct equalsFd : public std::unary_function<pollfd, bool>
-	{
-		int fd;
-		explicit equalsFd(int fd_): fd(fd_) {}
-		bool operator()(const pollfd& x) const { return x.fd==fd; };
+		void freeFd(int fd);
 	};
-	
-	//! Predicate for testing if the revents in a pollfd is non-zero
-	inline bool reventsZero(const pollfd& x)
-	{
-		return x.revents;
-	}
 
 	namespace Exceptions
 	{
@@ -0,0 +1,102 @@
+//! \file arena.cpp Defines member functions for Fastcgipp::Arena
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <boost/thread/locks.hpp>
+
+#include <fastcgi++/arena.hpp>
+
+Fastcgipp::Arena::Chunk* Fastcgipp::Arena::s_freeChunks=0;
+size_t Fastcgipp::Arena::s_freeCount=0;
+boost::mutex Fastcgipp::Arena::s_freeMutex;
+
+void* Fastcgipp::Arena::allocate(size_t size)
+{
+	size=(size+alignment-1)/alignment*alignment;
+
+	if(size<=size_t(m_end-m_position))
+	{
+		void* block=m_position;
+		m_position+=size;
+		return block;
+	}
+
+	if(size>chunkSize/4)
+	{
+		// Large blocks are kept out of the way of the current chunk
+		Chunk* chunk=(Chunk*)new char[headerSize+size];
+		chunk->recycle=false;
+		if(m_chunks)
+		{
+			chunk->next=m_chunks->next;
+			m_chunks->next=chunk;
+		}
+		else
+		{
+			chunk->next=0;
+			m_chunks=chunk;
+		}
+		return chunk->data();
+	}
+
+	Chunk* chunk=0;
+	{
+		boost::lock_guard<boost::mutex> freeLock(s_freeMutex);
+		if(s_freeChunks)
+		{
+			chunk=s_freeChunks;
+			s_freeChunks=chunk->next;
+			--s_freeCount;
+		}
+	}
+	if(!chunk)
+		chunk=(Chunk*)new char[headerSize+chunkSize];
+
+	chunk->recycle=true;
+	chunk->next=m_chunks;
+	m_chunks=chunk;
+	m_position=chunk->data()+size;
+	m_end=chunk->data()+chunkSize;
+	return chunk->data();
+}
+
+void Fastcgipp::Arena::release()
+{
+	while(m_chunks)
+	{
+		Chunk* chunk=m_chunks;
+		m_chunks=chunk->next;
+
+		if(chunk->recycle)
+		{
+			boost::lock_guard<boost::mutex> freeLock(s_freeMutex);
+			if(s_freeCount<maxFreeChunks)
+			{
+				chunk->next=s_freeChunks;
+				s_freeChunks=chunk;
+				++s_freeCount;
+				continue;
+			}
+		}
+		delete [] (char*)chunk;
+	}
+	m_position=0;
+	m_end=0;
+}
@@ -0,0 +1,218 @@
+//! \file async.cpp Defines member functions for Fastcgipp::AsyncRequest and Fastcgipp::Fiber
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <vector>
+#include <utility>
+#include <new>
+#include <exception>
+
+#include <fastcgi++/async.hpp>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace Fastcgipp
+{
+	//! Maximum amount of stacks kept for reuse
+	static const size_t stackPoolSize=64;
+	//! Stacks kept for reuse along with their size
+	static std::vector<std::pair<size_t, char*> > stackPool;
+	//! Protects stackPool
+	static boost::mutex stackPoolMutex;
+}
+
+size_t Fastcgipp::Fiber::pageSize()
+{
+	static const size_t size=sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+char* Fastcgipp::Fiber::allocateStack(size_t size)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(stackPoolMutex);
+		for(std::vector<std::pair<size_t, char*> >::iterator it=stackPool.begin(); it!=stackPool.end(); ++it)
+			if(it->first==size)
+			{
+				char* const stack=it->second;
+				*it=stackPool.back();
+				stackPool.pop_back();
+				return stack;
+			}
+	}
+
+	// Pages are only backed by memory once they are touched
+	void* const stack=mmap(0, size+pageSize(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(stack==MAP_FAILED)
+		throw std::bad_alloc();
+	// Stacks grow down so an overflow runs into the guard page instead of whatever is below
+	mprotect(stack, pageSize(), PROT_NONE);
+	return (char*)stack;
+}
+
+void Fastcgipp::Fiber::freeStack(char* stack, size_t size)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(stackPoolMutex);
+		if(stackPool.size()<stackPoolSize)
+		{
+			stackPool.push_back(std::make_pair(size, stack));
+			return;
+		}
+	}
+	munmap(stack, size+pageSize());
+}
+
+Fastcgipp::Fiber::Fiber(const boost::function<void()>& function, size_t stackSize):
+	m_function(function),
+	m_stackSize((stackSize+pageSize()-1)/pageSize()*pageSize()),
+	m_stack(0),
+	m_started(false),
+	m_finished(false)
+{
+}
+
+Fastcgipp::Fiber::~Fiber()
+{
+	if(m_stack)
+		freeStack(m_stack, m_stackSize);
+}
+
+void Fastcgipp::Fiber::trampoline(unsigned int high, unsigned int low)
+{
+	Fiber& fiber=*(Fiber*)(uintptr_t)(((uint64_t)high<<32)|low);
+	fiber.m_function();
+	fiber.m_finished=true;
+	// Returning switches to m_caller through uc_link
+}
+
+void Fastcgipp::Fiber::resume()
+{
+	if(!m_started)
+	{
+		m_stack=allocateStack(m_stackSize);
+		getcontext(&m_context);
+		m_context.uc_stack.ss_sp=m_stack+pageSize();
+		m_context.uc_stack.ss_size=m_stackSize;
+		m_context.uc_link=&m_caller;
+		const uint64_t pointer=(uintptr_t)this;
+		makecontext(&m_context, (void(*)())trampoline, 2, (unsigned int)(pointer>>32), (unsigned int)pointer);
+		m_started=true;
+	}
+
+	swapcontext(&m_caller, &m_context);
+
+	if(m_finished && m_stack)
+	{
+		freeStack(m_stack, m_stackSize);
+		m_stack=0;
+	}
+}
+
+void Fastcgipp::Fiber::suspend()
+{
+	swapcontext(&m_context, &m_caller);
+}
+
+template Fastcgipp::AsyncRequest<char>::AsyncRequest(const size_t maxPostSize, const bool lazyEnvironment, const size_t stackSize);
+template Fastcgipp::AsyncRequest<wchar_t>::AsyncRequest(const size_t maxPostSize, const bool lazyEnvironment, const size_t stackSize);
+template<class charT> Fastcgipp::AsyncRequest<charT>::AsyncRequest(const size_t maxPostSize, const bool lazyEnvironment, const size_t stackSize):
+	Request<charT>(maxPostSize, lazyEnvironment),
+	m_fiber(boost::bind(&AsyncRequest::run, this), stackSize),
+	m_unwinding(false)
+{
+}
+
+template Fastcgipp::AsyncRequest<char>::~AsyncRequest();
+template Fastcgipp::AsyncRequest<wchar_t>::~AsyncRequest();
+template<class charT> Fastcgipp::AsyncRequest<charT>::~AsyncRequest()
+{
+	if(m_fiber.started() && !m_fiber.finished())
+	{
+		m_unwinding=true;
+		m_fiber.resume();
+	}
+}
+
+template void Fastcgipp::AsyncRequest<char>::run();
+template void Fastcgipp::AsyncRequest<wchar_t>::run();
+template<class charT> void Fastcgipp::AsyncRequest<charT>::run()
+{
+	try
+	{
+		handle();
+	}
+	catch(const Unwind&)
+	{
+	}
+	catch(const std::exception& e)
+	{
+		this->errorHandler(e);
+	}
+	catch(...)
+	{
+		// Nothing may escape the fiber
+		this->errorHandler(std::bad_exception());
+	}
+}
+
+template bool Fastcgipp::AsyncRequest<char>::response();
+template bool Fastcgipp::AsyncRequest<wchar_t>::response();
+template<class charT> bool Fastcgipp::AsyncRequest<charT>::response()
+{
+	m_fiber.resume();
+	return m_fiber.finished();
+}
+
+template const Fastcgipp::Message& Fastcgipp::AsyncRequest<char>::await();
+template const Fastcgipp::Message& Fastcgipp::AsyncRequest<wchar_t>::await();
+template<class charT> const Fastcgipp::Message& Fastcgipp::AsyncRequest<charT>::await()
+{
+	if(!m_deferred.empty())
+	{
+		m_awaited=m_deferred.front();
+		m_deferred.pop_front();
+		return m_awaited;
+	}
+
+	m_fiber.suspend();
+	if(m_unwinding)
+		throw Unwind();
+	m_awaited=this->message();
+	return m_awaited;
+}
+
+template void Fastcgipp::AsyncRequest<char>::sleep(unsigned int milliseconds);
+template void Fastcgipp::AsyncRequest<wchar_t>::sleep(unsigned int milliseconds);
+template<class charT> void Fastcgipp::AsyncRequest<charT>::sleep(unsigned int milliseconds)
+{
+	this->setTimer(milliseconds, Message(WAKE));
+	while(1)
+	{
+		m_fiber.suspend();
+		if(m_unwinding)
+			throw Unwind();
+		if(this->message().type==WAKE)
+			return;
+		m_deferred.push_back(this->message());
+	}
+}
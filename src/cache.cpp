@@ -0,0 +1,166 @@
+//! \file cache.cpp Defines member functions for Fastcgipp::ResponseCache
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <algorithm>
+
+#include <boost/thread/locks.hpp>
+
+#include <fastcgi++/cache.hpp>
+#include <fastcgi++/metrics.hpp>
+#include <fastcgi++/timers.hpp>
+
+void Fastcgipp::ResponseCache::unlink(Node* node)
+{
+	if(node->older)
+		node->older->newer=node->newer;
+	else
+		m_oldest=node->newer;
+	if(node->newer)
+		node->newer->older=node->older;
+	else
+		m_newest=node->older;
+	node->older=0;
+	node->newer=0;
+}
+
+void Fastcgipp::ResponseCache::link(Node* node)
+{
+	node->older=m_newest;
+	node->newer=0;
+	if(m_newest)
+		m_newest->newer=node;
+	else
+		m_oldest=node;
+	m_newest=node;
+}
+
+void Fastcgipp::ResponseCache::remove(Node* node)
+{
+	unlink(node);
+	m_nodes.erase(node->key);
+	m_bytes-=node->key.size()+node->response.records->size();
+	delete node;
+}
+
+void Fastcgipp::ResponseCache::shrink()
+{
+	while(m_oldest && m_bytes>m_capacity)
+	{
+		remove(m_oldest);
+		m_evictions.fetch_add(1, boost::memory_order_relaxed);
+	}
+}
+
+void Fastcgipp::ResponseCache::setCapacity(size_t capacity, size_t maxEntrySize)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_capacity=capacity;
+	m_maxEntrySize=maxEntrySize?std::min(maxEntrySize, capacity):capacity/8;
+	shrink();
+}
+
+bool Fastcgipp::ResponseCache::find(const std::string& key, Response& response)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		const Nodes::iterator it=m_nodes.find(key);
+		if(it!=m_nodes.end())
+		{
+			Node* const node=it->second;
+			if(node->expires && node->expires<=Timers::now())
+				remove(node);
+			else
+			{
+				unlink(node);
+				link(node);
+				response=node->response;
+				m_hits.fetch_add(1, boost::memory_order_relaxed);
+				return true;
+			}
+		}
+	}
+	m_misses.fetch_add(1, boost::memory_order_relaxed);
+	return false;
+}
+
+void Fastcgipp::ResponseCache::store(const std::string& key, const Response& response, unsigned int maxAge)
+{
+	if(!response.records)
+		return;
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	const size_t size=key.size()+response.records->size();
+	if(!m_capacity || size>m_maxEntrySize)
+		return;
+
+	const Nodes::iterator it=m_nodes.find(key);
+	if(it!=m_nodes.end())
+		remove(it->second);
+
+	Node* const node=new Node(key);
+	node->response=response;
+	node->expires=maxAge?Timers::now()+(uint64_t)maxAge*1000:0;
+	m_nodes[key]=node;
+	link(node);
+	m_bytes+=size;
+	m_stores.fetch_add(1, boost::memory_order_relaxed);
+	shrink();
+}
+
+bool Fastcgipp::ResponseCache::erase(const std::string& key)
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	const Nodes::iterator it=m_nodes.find(key);
+	if(it==m_nodes.end())
+		return false;
+	remove(it->second);
+	return true;
+}
+
+void Fastcgipp::ResponseCache::clear()
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	while(m_oldest)
+		remove(m_oldest);
+}
+
+size_t Fastcgipp::ResponseCache::size()
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_nodes.size();
+}
+
+size_t Fastcgipp::ResponseCache::bytes()
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_bytes;
+}
+
+void Fastcgipp::ResponseCache::dumpMetrics(std::ostream& stream)
+{
+	Metrics::print(stream, "cache_hits_total", "counter", "Requests answered from the response cache.", m_hits.load(boost::memory_order_relaxed));
+	Metrics::print(stream, "cache_misses_total", "counter", "Requests looked up in the response cache and not found.", m_misses.load(boost::memory_order_relaxed));
+	Metrics::print(stream, "cache_not_modified_total", "counter", "Requests answered from the response cache with 304 Not Modified.", m_notModified.load(boost::memory_order_relaxed));
+	Metrics::print(stream, "cache_stores_total", "counter", "Responses stored in the response cache.", m_stores.load(boost::memory_order_relaxed));
+	Metrics::print(stream, "cache_evictions_total", "counter", "Responses evicted from the response cache to make room.", m_evictions.load(boost::memory_order_relaxed));
+	Metrics::print(stream, "cache_entries", "gauge", "Responses in the response cache.", size());
+	Metrics::print(stream, "cache_bytes", "gauge", "Bytes taken up by the responses in the response cache.", bytes());
+}
@@ -1,207 +1,384 @@
 #include <cstring>
 #include <algorithm>
-#include <map>
-#include <iterator>
-#include <boost/iostreams/code_converter.hpp>
+#include <limits>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 #include "fastcgi++/fcgistream.hpp"
-#include "utf8_codecvt.hpp"
+#include "fastcgi++/http.hpp"
 
-template<typename charT> template<typename Sink> std::streamsize Fastcgipp::Fcgistream<charT>::Encoder::write(Sink& dest, const charT* s, std::streamsize n)
+namespace Fastcgipp
 {
-	static std::map<charT, std::basic_string<charT> > htmlCharacters;
-	if(!htmlCharacters.size())
+	//! HTML escape sequences indexed by character
+	const char* const htmlEscapes[128] =
+	{
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, "&quot;", 0, 0, 0, "&amp;", "&apos;",
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, "&lt;", 0, "&gt;", 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0
+	};
+
+	//! URL escape sequences indexed by character
+	const char* const urlEscapes[128] =
 	{
-		const char quot[]="&quot;";
-		std::copy(quot, quot+sizeof(quot)-1, std::back_inserter(htmlCharacters['"']));
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		"%20", "%21", "%22", "%23", "%24", "%25", "%26", "%27",
+		"%28", "%29", "%2A", "%2B", "%2C", 0, 0, "%2F",
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, "%3A", "%3B", "%3C", "%3D", "%3E", "%3F",
+		"%40", 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, "%5B", 0, "%5D", 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0
+	};
+
+	//! Get the escape table of an encoding
+	inline const char* const* escapeTable(OutputEncoding encoding)
+	{
+		return encoding==HTML?htmlEscapes:urlEscapes;
+	}
 
-		const char gt[]="&gt;";
-		std::copy(gt, gt+sizeof(gt)-1, std::back_inserter(htmlCharacters['>']));
+#if defined (__SSE2__)
+	//! Mask of the bytes in a block that are in the range [low, high]
+	inline __m128i inRange(__m128i block, char low, char high)
+	{
+		return _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(low-1)), _mm_cmplt_epi8(block, _mm_set1_epi8(high+1)));
+	}
 
-		const char lt[]="&lt;";
-		std::copy(lt, lt+sizeof(lt)-1, std::back_inserter(htmlCharacters['<']));
+	//! Mask of the bytes in a block that are equal to c
+	inline __m128i equalTo(__m128i block, char c)
+	{
+		return _mm_cmpeq_epi8(block, _mm_set1_epi8(c));
+	}
+#endif
+}
 
-		const char amp[]="&amp;";
-		std::copy(amp, amp+sizeof(amp)-1, std::back_inserter(htmlCharacters['&']));
+const char* Fastcgipp::findEscape(const char* begin, const char* end, OutputEncoding encoding)
+{
+	if(encoding==NONE)
+		return end;
 
-		const char apos[]="&apos;";
-		std::copy(apos, apos+sizeof(apos)-1, std::back_inserter(htmlCharacters['\'']));
+#if defined (__SSE2__)
+	// Skip sixteen byte blocks that contain nothing to escape. These tests must agree with the tables.
+	for(; end-begin>=16; begin+=16)
+	{
+		const __m128i block=_mm_loadu_si128((const __m128i*)begin);
+		__m128i mask;
+		if(encoding==HTML)
+			mask=_mm_or_si128(
+					_mm_or_si128(equalTo(block, '"'), equalTo(block, '&')),
+					_mm_or_si128(_mm_or_si128(equalTo(block, '\''), equalTo(block, '<')), equalTo(block, '>')));
+		else
+			mask=_mm_or_si128(
+					_mm_or_si128(inRange(block, ' ', ','), inRange(block, ':', '@')),
+					_mm_or_si128(_mm_or_si128(equalTo(block, '/'), equalTo(block, '[')), equalTo(block, ']')));
+
+		const int bits=_mm_movemask_epi8(mask);
+		if(bits)
+			return begin+__builtin_ctz(bits);
 	}
+#endif
 
-	static std::map<charT, std::basic_string<charT> > urlCharacters;
-	if(!urlCharacters.size())
+	const char* const* table=escapeTable(encoding);
+	for(; begin!=end; ++begin)
 	{
-		const char exclaim[]="%21";
-		std::copy(exclaim, exclaim+sizeof(exclaim)-1, std::back_inserter(urlCharacters['!']));
+		const unsigned char c=*begin;
+		if(c<128 && table[c])
+			break;
+	}
+	return begin;
+}
 
-		const char rightbrac[]="%5D";
-		std::copy(rightbrac, rightbrac+sizeof(rightbrac)-1, std::back_inserter(urlCharacters[']']));
+const wchar_t* Fastcgipp::findEscape(const wchar_t* begin, const wchar_t* end, OutputEncoding encoding)
+{
+	if(encoding==NONE)
+		return end;
 
-		const char leftbrac[]="%5B";
-		std::copy(leftbrac, leftbrac+sizeof(leftbrac)-1, std::back_inserter(urlCharacters['[']));
+	const char* const* table=escapeTable(encoding);
+	for(; begin!=end; ++begin)
+		if((unsigned long)*begin<128 && table[*begin])
+			break;
+	return begin;
+}
 
-		const char number[]="%23";
-		std::copy(number, number+sizeof(number)-1, std::back_inserter(urlCharacters['#']));
+const char* Fastcgipp::escapeSequence(wchar_t c, OutputEncoding encoding)
+{
+	if(encoding==NONE || (unsigned long)c>=128)
+		return 0;
+	return escapeTable(encoding)[c];
+}
 
-		const char question[]="%3F";
-		std::copy(question, question+sizeof(question)-1, std::back_inserter(urlCharacters['?']));
+Fastcgipp::Protocol::Header Fastcgipp::FcgistreamSink::header(size_t remaining) const
+{
+	using namespace std;
+	using namespace Protocol;
 
-		const char slash[]="%2F";
-		std::copy(slash, slash+sizeof(slash)-1, std::back_inserter(urlCharacters['/']));
+	// Padded records must still fit the 16 bit content length once rounded up
+	const size_t maxContentLength=m_padding?numeric_limits<uint16_t>::max()/chunkSize*chunkSize:numeric_limits<uint16_t>::max();
 
-		const char comma[]="%2C";
-		std::copy(comma, comma+sizeof(comma)-1, std::back_inserter(urlCharacters[',']));
+	const uint16_t contentLength=std::min(remaining, maxContentLength);
+	const uint8_t contentPadding=m_padding?(chunkSize-contentLength%chunkSize)%chunkSize:0;
 
-		const char money[]="%24";
-		std::copy(money, money+sizeof(money)-1, std::back_inserter(urlCharacters['$']));
+	Header header=Header();
+	header.setVersion(Protocol::version);
+	header.setType(m_type);
+	header.setRequestId(m_id.fcgiId);
+	header.setContentLength(contentLength);
+	header.setPaddingLength(contentPadding);
+	return header;
+}
 
-		const char plus[]="%2B";
-		std::copy(plus, plus+sizeof(plus)-1, std::back_inserter(urlCharacters['+']));
+void Fastcgipp::RecordCapture::append(const Protocol::Header& header, const char* content)
+{
+	if(abandoned)
+		return;
 
-		const char equal[]="%3D";
-		std::copy(equal, equal+sizeof(equal)-1, std::back_inserter(urlCharacters['=']));
+	const size_t contentLength=header.getContentLength();
+	const size_t paddingLength=header.getPaddingLength();
+	if(records.size()+sizeof(header)+contentLength+paddingLength>limit)
+	{
+		abandon();
+		return;
+	}
 
-		const char andsym[]="%26";
-		std::copy(andsym, andsym+sizeof(andsym)-1, std::back_inserter(urlCharacters['&']));
+	records.append((const char*)&header, sizeof(header));
+	records.append(content, contentLength);
+	records.append(paddingLength, '\0');
+}
 
-		const char at[]="%40";
-		std::copy(at, at+sizeof(at)-1, std::back_inserter(urlCharacters['@']));
+std::streamsize Fastcgipp::FcgistreamSink::write(const char* s, std::streamsize n)
+{
+	const std::streamsize totalUsed=n;
+	while(n)
+	{
+		const Protocol::Header record(header(n));
+		m_transceiver->writeRecord(record, s, m_id);
+		if(m_capture)
+			m_capture->append(record, s);
 
-		const char colon[]="%3A";
-		std::copy(colon, colon+sizeof(colon)-1, std::back_inserter(urlCharacters[':']));
+		s+=record.getContentLength();
+		n-=record.getContentLength();
+	}
+	return totalUsed;
+}
 
-		const char semi[]="%3B";
-		std::copy(semi, semi+sizeof(semi)-1, std::back_inserter(urlCharacters[';']));
+void Fastcgipp::FcgistreamSink::dump(std::basic_istream<char>& stream)
+{
+	const size_t bufferSize=32768;
+	char buffer[bufferSize];
 
-		const char rightpar[]="%29";
-		std::copy(rightpar, rightpar+sizeof(rightpar)-1, std::back_inserter(urlCharacters[')']));
+	while(stream.good())
+	{
+		stream.read(buffer, bufferSize);
+		write(buffer, stream.gcount());
+	}
+}
 
-		const char leftpar[]="%28";
-		std::copy(leftpar, leftpar+sizeof(leftpar)-1, std::back_inserter(urlCharacters['(']));
+void Fastcgipp::FcgistreamSink::dump(int fd, off_t offset, size_t size)
+{
+	struct stat status;
+	const bool regular=fstat(fd, &status)==0 && S_ISREG(status.st_mode);
+	if(regular)
+		size=offset<status.st_size?std::min(size, size_t(status.st_size-offset)):0;
+
+	// Held on to for as long as the output is buffered so it mustn't leak into a successor
+#if defined (F_DUPFD_CLOEXEC)
+	const SharedFile file(regular?fcntl(fd, F_DUPFD_CLOEXEC, 0):-1);
+#else
+	const SharedFile file(regular?dup(fd):-1);
+	if(file.fd()>=0)
+		fcntl(file.fd(), F_SETFD, FD_CLOEXEC);
+#endif
+	if(file.fd()<0)
+	{
+		char buffer[32768];
+		while(size)
+		{
+			const size_t length=std::min(size, sizeof(buffer));
+			const ssize_t actual=regular?pread(fd, buffer, length, offset):read(fd, buffer, length);
+			if(actual<=0)
+				break;
+			write(buffer, actual);
+			offset+=actual;
+			size-=actual;
+		}
+		return;
+	}
 
-		const char apos[]="%27";
-		std::copy(apos, apos+sizeof(apos)-1, std::back_inserter(urlCharacters['\'']));
+	// The file may well change before the records are replayed
+	if(m_capture)
+		m_capture->abandon();
 
-		const char star[]="%2A";
-		std::copy(star, star+sizeof(star)-1, std::back_inserter(urlCharacters['*']));
+	while(size)
+	{
+		const Protocol::Header record(header(size));
+		m_transceiver->writeFile(record, file, offset, m_id);
 
-		const char lt[]="%3C";
-		std::copy(lt, lt+sizeof(lt)-1, std::back_inserter(urlCharacters['<']));
+		offset+=record.getContentLength();
+		size-=record.getContentLength();
+	}
+}
 
-		const char gt[]="%3E";
-		std::copy(gt, gt+sizeof(gt)-1, std::back_inserter(urlCharacters['>']));
+namespace Fastcgipp
+{
+	template<> void FcgistreamBuf<char>::send(const char* data, size_t size)
+	{
+		m_sink.write(data, size);
+	}
 
-		const char quot[]="%22";
-		std::copy(quot, quot+sizeof(quot)-1, std::back_inserter(urlCharacters['"']));
+	template<> void FcgistreamBuf<wchar_t>::send(const wchar_t* data, size_t size);
+}
 
-		const char space[]="%20";
-		std::copy(space, space+sizeof(space)-1, std::back_inserter(urlCharacters[' ']));
+template<> void Fastcgipp::FcgistreamBuf<wchar_t>::send(const wchar_t* data, size_t size)
+{
+	using namespace std;
 
-		const char percent[]="%25";
-		std::copy(percent, percent+sizeof(percent)-1, std::back_inserter(urlCharacters['%']));
-	}
+	// Converted pieces go out as records so don't bother with more than fits in one
+	const size_t maxPieceSize=numeric_limits<uint16_t>::max()/Protocol::chunkSize*Protocol::chunkSize;
 
-	if(m_state==NONE)
-		boost::iostreams::write(dest, s, n);
-	else
+	const wchar_t* const dataEnd=data+size;
+	while(data!=dataEnd)
 	{
-		std::map<charT, std::basic_string<charT> >* characters;
-		switch(m_state)
-		{
-			case HTML:
-				characters = &htmlCharacters;
-				break;
-			case URL:
-				characters = &urlCharacters;
-				break;
-		}
-
-		const charT* start=s;
-		typename std::map<charT, std::basic_string<charT> >::const_iterator it;
-		for(const charT* i=s; i < s+n; ++i)
-		{
-			it=characters->find(*i);
-			if(it!=characters->end())
-			{
-				if(start<i) boost::iostreams::write(dest, start, start-i);
-				boost::iostreams::write(dest, it->second.data(), it->second.size());
-				start=i+1;
-			}
-		}
-		int size=s+n-start;
-		if(size) boost::iostreams::write(dest, start, size);
+		const size_t pieceSize=min(size_t(dataEnd-data), maxPieceSize/Http::maxUtf8Size);
+		if(m_converted.size()<pieceSize*Http::maxUtf8Size)
+			m_converted.resize(pieceSize*Http::maxUtf8Size);
+
+		char* const to=&m_converted[0];
+		char* const toNext=Http::wideToUtf8(data, data+pieceSize, to);
+		m_sink.write(to, toNext-to);
+		data+=pieceSize;
 	}
-	return n;
 }
 
-std::streamsize Fastcgipp::FcgistreamSink::write(const char* s, std::streamsize n)
+template void Fastcgipp::FcgistreamBuf<char>::setPolicy(const OutputPolicy& policy);
+template void Fastcgipp::FcgistreamBuf<wchar_t>::setPolicy(const OutputPolicy& policy);
+template<class charT> void Fastcgipp::FcgistreamBuf<charT>::setPolicy(const OutputPolicy& policy)
 {
-	using namespace std;
-	using namespace Protocol;
-	const std::streamsize totalUsed=n;
-	while(1)
-	{{
-		if(!n)
-			break;
-
-		int remainder=n%chunkSize;
-		size_t size=n+sizeof(Header)+(remainder?(chunkSize-remainder):remainder);
-		if(size>numeric_limits<uint16_t>::max()) size=numeric_limits<uint16_t>::max();
-		Block dataBlock(m_transceiver->requestWrite(size));
-		size=(dataBlock.size/chunkSize)*chunkSize;
-
-		uint16_t contentLength=std::min(size-sizeof(Header), size_t(n));
-		memcpy(dataBlock.data+sizeof(Header), s, contentLength);
-
-		s+=contentLength;
-		n-=contentLength;
-
-		uint8_t contentPadding=chunkSize-contentLength%chunkSize;
-		if(contentPadding==8) contentPadding=0;
-		
-		Header& header=*(Header*)dataBlock.data;
-		header.setVersion(Protocol::version);
-		header.setType(m_type);
-		header.setRequestId(m_id.fcgiId);
-		header.setContentLength(contentLength);
-		header.setPaddingLength(contentPadding);
-
-		m_transceiver->secureWrite(size, m_id, false);	
-	}}
-	return totalUsed;
+	emit();
+	m_policy=policy;
+	if(!m_policy.bufferSize)
+		m_policy.bufferSize=1;
+	m_sink.setPadding(m_policy.padding);
+
+	// The buffer is allocated again on the next write
+	std::vector<charT>().swap(m_buffer);
+	place(begin());
 }
 
-void Fastcgipp::FcgistreamSink::dump(std::basic_istream<char>& stream)
+template Fastcgipp::FcgistreamBuf<char>::int_type Fastcgipp::FcgistreamBuf<char>::overflow(int_type c);
+template Fastcgipp::FcgistreamBuf<wchar_t>::int_type Fastcgipp::FcgistreamBuf<wchar_t>::overflow(int_type c);
+template<class charT> typename Fastcgipp::FcgistreamBuf<charT>::int_type Fastcgipp::FcgistreamBuf<charT>::overflow(int_type c)
 {
-	const size_t bufferSize=32768;
-	char buffer[bufferSize];
+	if(traits_type::eq_int_type(c, traits_type::eof()))
+		return traits_type::not_eof(c);
 
-	while(stream.good())
+	const charT character=traits_type::to_char_type(c);
+	xsputn(&character, 1);
+	return c;
+}
+
+template std::streamsize Fastcgipp::FcgistreamBuf<char>::xsputn(const char* s, std::streamsize n);
+template std::streamsize Fastcgipp::FcgistreamBuf<wchar_t>::xsputn(const wchar_t* s, std::streamsize n);
+template<class charT> std::streamsize Fastcgipp::FcgistreamBuf<charT>::xsputn(const charT* s, std::streamsize n)
+{
+	const charT* const end=s+n;
+	while(s!=end)
 	{
-		stream.read(buffer, bufferSize);
-		write(buffer, stream.gcount());
+		// Runs of characters that need no escaping are appended in one piece
+		const charT* escape=findEscape(s, end, m_encoding);
+		append(s, escape-s);
+		if(escape==end)
+			break;
+
+		charT sequence[8];
+		charT* sequenceEnd=sequence;
+		for(const char* i=escapeSequence(*escape, m_encoding); *i; ++i)
+			*sequenceEnd++=*i;
+		append(sequence, sequenceEnd-sequence);
+		s=escape+1;
 	}
+	return n;
 }
 
-template<typename T, typename toChar, typename fromChar> T& fixPush(boost::iostreams::filtering_stream<boost::iostreams::output, fromChar>& stream, const T& t, int buffer_size)
+template int Fastcgipp::FcgistreamBuf<char>::sync();
+template int Fastcgipp::FcgistreamBuf<wchar_t>::sync();
+template<class charT> int Fastcgipp::FcgistreamBuf<charT>::sync()
 {
-	stream.push(t, buffer_size);
-	return *stream.template component<T>(stream.size()-1);
+	if(!m_corked && size_t(this->pptr()-begin())>=m_policy.minFlushSize)
+		emit();
+	return 0;
 }
 
-template<> Fastcgipp::FcgistreamSink& fixPush<Fastcgipp::FcgistreamSink, char, wchar_t>(boost::iostreams::filtering_stream<boost::iostreams::output, wchar_t>& stream, const Fastcgipp::FcgistreamSink& t, int buffer_size)
+template void Fastcgipp::FcgistreamBuf<char>::append(const char* data, size_t size);
+template void Fastcgipp::FcgistreamBuf<wchar_t>::append(const wchar_t* data, size_t size);
+template<class charT> void Fastcgipp::FcgistreamBuf<charT>::append(const charT* data, size_t size)
 {
-	stream.push(boost::iostreams::code_converter<Fastcgipp::FcgistreamSink, utf8CodeCvt::utf8_codecvt_facet>(t, buffer_size));
-	return **stream.component<boost::iostreams::code_converter<Fastcgipp::FcgistreamSink, utf8CodeCvt::utf8_codecvt_facet> >(stream.size()-1);
-}
+	while(size)
+	{
+		if(this->pptr()==begin() && size>=m_policy.bufferSize)
+		{
+			send(data, size);
+			return;
+		}
 
+		if(m_buffer.empty())
+		{
+			m_buffer.resize(m_policy.bufferSize);
+			place(begin());
+		}
 
-template Fastcgipp::Fcgistream<char>::Fcgistream();
-template Fastcgipp::Fcgistream<wchar_t>::Fcgistream();
-template<typename charT> Fastcgipp::Fcgistream<charT>::Fcgistream():
-	m_encoder(fixPush<Encoder, charT, charT>(*this, Encoder(), 0)),
-	m_sink(fixPush<FcgistreamSink, char, charT>(*this, FcgistreamSink(), 8192))
-{}
+		const size_t space=end()-this->pptr();
+		if(!space)
+		{
+			emit();
+			continue;
+		}
+
+		const size_t taken=std::min(size, space);
+		std::copy(data, data+taken, this->pptr());
+		place(this->pptr()+taken);
+		data+=taken;
+		size-=taken;
+	}
+}
+
+template void Fastcgipp::FcgistreamBuf<char>::emit();
+template void Fastcgipp::FcgistreamBuf<wchar_t>::emit();
+template<class charT> void Fastcgipp::FcgistreamBuf<charT>::emit()
+{
+	if(this->pptr()!=begin())
+	{
+		send(begin(), this->pptr()-begin());
+		place(begin());
+	}
+}
 
 template std::basic_ostream<char, std::char_traits<char> >& Fastcgipp::operator<< <char, std::char_traits<char> >(std::basic_ostream<char, std::char_traits<char> >& os, const encoding& enc);
 template std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& Fastcgipp::operator<< <wchar_t, std::char_traits<wchar_t> >(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& os, const encoding& enc);
@@ -0,0 +1,190 @@
+//! \file handoff.cpp Defines member functions for Fastcgipp::Handoff
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <fastcgi++/handoff.hpp>
+
+extern char** environ;
+
+const char Fastcgipp::Handoff::environment[]="FASTCGIPP_HANDOFF";
+
+int Fastcgipp::Handoff::spawn(const std::vector<std::string>& command, pid_t& pid)
+{
+	std::vector<std::string> arguments(command);
+	if(arguments.empty())
+	{
+		std::ifstream cmdline("/proc/self/cmdline");
+		std::string argument;
+		while(std::getline(cmdline, argument, '\0'))
+			arguments.push_back(argument);
+		if(arguments.empty())
+			return -1;
+	}
+
+	int channel[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, channel)<0)
+		return -1;
+	// Only the successor's end is inherited by it
+	fcntl(channel[0], F_SETFD, FD_CLOEXEC);
+
+	std::ostringstream variable;
+	variable << environment << '=' << channel[1];
+	const std::string assignment(variable.str());
+
+	const size_t length=sizeof(environment)-1;
+	std::vector<char*> env;
+	for(char** it=environ; *it; ++it)
+		if(std::strncmp(*it, environment, length) || (*it)[length]!='=')
+			env.push_back(*it);
+	env.push_back(const_cast<char*>(assignment.c_str()));
+	env.push_back(0);
+
+	std::vector<char*> argv;
+	for(std::vector<std::string>::iterator it=arguments.begin(); it!=arguments.end(); ++it)
+		argv.push_back(const_cast<char*>(it->c_str()));
+	argv.push_back(0);
+
+	// Worker threads may have signals blocked which the successor shouldn't inherit
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	sigset_t mask;
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attributes, &mask);
+	posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+	const int result=posix_spawnp(&pid, argv[0], 0, &attributes, &argv[0], &env[0]);
+	posix_spawnattr_destroy(&attributes);
+	close(channel[1]);
+	if(result)
+	{
+		close(channel[0]);
+		return -1;
+	}
+	return channel[0];
+}
+
+int Fastcgipp::Handoff::inherited()
+{
+	const char* const value=std::getenv(environment);
+	if(!value)
+		return -1;
+	const int channel=std::atoi(value);
+	unsetenv(environment);
+
+	if(channel<0 || fcntl(channel, F_SETFD, FD_CLOEXEC)<0)
+		return -1;
+	return channel;
+}
+
+namespace Fastcgipp
+{
+	//! Buffer for the control message of the largest batch of file descriptors
+	union HandoffControl
+	{
+		cmsghdr header;
+		char space[CMSG_SPACE(sizeof(int)*Handoff::maxFds)];
+	};
+}
+
+bool Fastcgipp::Handoff::send(int channel, Tag tag, const int* fds, size_t count)
+{
+	char data=tag;
+	iovec iov;
+	iov.iov_base=&data;
+	iov.iov_len=1;
+
+	msghdr message;
+	std::memset(&message, 0, sizeof(message));
+	message.msg_iov=&iov;
+	message.msg_iovlen=1;
+
+	HandoffControl control;
+	if(count)
+	{
+		message.msg_control=control.space;
+		message.msg_controllen=CMSG_SPACE(sizeof(int)*count);
+		cmsghdr* const header=CMSG_FIRSTHDR(&message);
+		header->cmsg_level=SOL_SOCKET;
+		header->cmsg_type=SCM_RIGHTS;
+		header->cmsg_len=CMSG_LEN(sizeof(int)*count);
+		std::memcpy(CMSG_DATA(header), fds, sizeof(int)*count);
+	}
+
+	ssize_t sent;
+	do sent=sendmsg(channel, &message, 0);
+	while(sent<0 && errno==EINTR);
+	return sent==1;
+}
+
+int Fastcgipp::Handoff::receive(int channel, std::vector<int>& fds, bool block)
+{
+	char data=0;
+	iovec iov;
+	iov.iov_base=&data;
+	iov.iov_len=1;
+
+	HandoffControl control;
+	msghdr message;
+	std::memset(&message, 0, sizeof(message));
+	message.msg_iov=&iov;
+	message.msg_iovlen=1;
+	message.msg_control=control.space;
+	message.msg_controllen=sizeof(control.space);
+
+	int flags=block?0:MSG_DONTWAIT;
+#if defined (MSG_CMSG_CLOEXEC)
+	flags|=MSG_CMSG_CLOEXEC;
+#endif
+	ssize_t received;
+	do received=recvmsg(channel, &message, flags);
+	while(received<0 && errno==EINTR);
+	if(received<0)
+		return -1;
+
+	for(cmsghdr* header=CMSG_FIRSTHDR(&message); header; header=CMSG_NXTHDR(&message, header))
+		if(header->cmsg_level==SOL_SOCKET && header->cmsg_type==SCM_RIGHTS)
+		{
+			const int* const passed=(const int*)CMSG_DATA(header);
+			const size_t count=(header->cmsg_len-CMSG_LEN(0))/sizeof(int);
+			for(size_t i=0; i<count; ++i)
+			{
+#if !defined (MSG_CMSG_CLOEXEC)
+				fcntl(passed[i], F_SETFD, FD_CLOEXEC);
+#endif
+				fds.push_back(passed[i]);
+			}
+		}
+
+	return received?(unsigned char)data:0;
+}
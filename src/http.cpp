@@ -19,34 +19,194 @@
 ****************************************************************************/
 
 
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cerrno>
+#include <cwchar>
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <fastcgi++/http.hpp>
 #include <fastcgi++/protocol.hpp>
 
-#include "utf8_codecvt.hpp"
+#include <fcntl.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#if defined (HAVE_SYS_RANDOM_H)
+#include <sys/random.h>
+#endif
 
 void Fastcgipp::Http::charToString(const char* data, size_t size, std::wstring& string)
 {
-	const size_t bufferSize=512;
-	wchar_t buffer[bufferSize];
-	using namespace std;
+	if(!size)
+		return;
+
+	// Decoded straight into the string as UTF-8 never takes up more characters than bytes
+	const size_t start=string.size();
+	string.resize(start+size);
+	try
+	{
+		string.resize(utf8ToWide(data, data+size, &string[start])-&string[0]);
+	}
+	catch(...)
+	{
+		string.resize(start);
+		throw;
+	}
+}
+
+wchar_t* Fastcgipp::Http::utf8ToWide(const char* data, const char* end, wchar_t* destination)
+{
+	const unsigned char* it=(const unsigned char*)data;
+	const unsigned char* const stop=(const unsigned char*)end;
 
-	if(size)
+	while(it!=stop)
 	{
-		codecvt_base::result cr=codecvt_base::partial;
-		while(cr==codecvt_base::partial)
-		{{
-			wchar_t* it;
-			const char* tmpData;
-			mbstate_t conversionState = mbstate_t();
-			cr=use_facet<codecvt<wchar_t, char, mbstate_t> >(locale(locale::classic(), new utf8CodeCvt::utf8_codecvt_facet)).in(conversionState, data, data+size, tmpData, buffer, buffer+bufferSize, it);
-			string.append(buffer, it);
-			size-=tmpData-data;
-			data=tmpData;
-		}}
-		if(cr==codecvt_base::error) throw Exceptions::CodeCvt();
+		const unsigned char* chunkEnd=stop;
+
+#if defined (__SSE2__) && __WCHAR_MAX__ > 0xffff
+		const __m128i zero=_mm_setzero_si128();
+		for(; stop-it>=16; it+=16, destination+=16)
+		{
+			const __m128i block=_mm_loadu_si128((const __m128i*)it);
+			if(_mm_movemask_epi8(block))
+				break;
+
+			// All ASCII so every byte is zero extended into a character of it's own
+			const __m128i low=_mm_unpacklo_epi8(block, zero);
+			const __m128i high=_mm_unpackhi_epi8(block, zero);
+			_mm_storeu_si128((__m128i*)destination, _mm_unpacklo_epi16(low, zero));
+			_mm_storeu_si128((__m128i*)(destination+4), _mm_unpackhi_epi16(low, zero));
+			_mm_storeu_si128((__m128i*)(destination+8), _mm_unpacklo_epi16(high, zero));
+			_mm_storeu_si128((__m128i*)(destination+12), _mm_unpackhi_epi16(high, zero));
+		}
+
+		// Get past the block that wasn't all ASCII before trying again
+		if(stop-it>16)
+			chunkEnd=it+16;
+#endif
+
+		while(it<chunkEnd)
+		{
+			const unsigned char first=*it;
+			if(first<0x80)
+			{
+				*destination++=first;
+				++it;
+				continue;
+			}
+
+			size_t length;
+			unsigned long character;
+			unsigned long minimum;
+			if(first<0xc2)
+				throw Exceptions::CodeCvt();
+			else if(first<0xe0)
+			{
+				length=2;
+				character=first&0x1f;
+				minimum=0x80;
+			}
+			else if(first<0xf0)
+			{
+				length=3;
+				character=first&0x0f;
+				minimum=0x800;
+			}
+			else if(first<0xf5)
+			{
+				length=4;
+				character=first&0x07;
+				minimum=0x10000;
+			}
+			else
+				throw Exceptions::CodeCvt();
+
+			if(size_t(stop-it)<length)
+				throw Exceptions::CodeCvt();
+			for(size_t i=1; i<length; ++i)
+			{
+				if((it[i]&0xc0)!=0x80)
+					throw Exceptions::CodeCvt();
+				character=character<<6 | (it[i]&0x3f);
+			}
+
+			if(character<minimum || (character>=0xd800 && character<=0xdfff) || character>0x10ffff || character>(unsigned long)WCHAR_MAX)
+				throw Exceptions::CodeCvt();
+
+			*destination++=wchar_t(character);
+			it+=length;
+		}
+	}
+
+	return destination;
+}
+
+char* Fastcgipp::Http::wideToUtf8(const wchar_t* data, const wchar_t* end, char* destination)
+{
+	while(data!=end)
+	{
+		const wchar_t* chunkEnd=end;
+
+#if defined (__SSE2__) && __WCHAR_MAX__ > 0xffff
+		const __m128i notAscii=_mm_set1_epi32(~0x7f);
+		const __m128i zero=_mm_setzero_si128();
+		for(; end-data>=16; data+=16, destination+=16)
+		{
+			const __m128i a=_mm_loadu_si128((const __m128i*)data);
+			const __m128i b=_mm_loadu_si128((const __m128i*)(data+4));
+			const __m128i c=_mm_loadu_si128((const __m128i*)(data+8));
+			const __m128i d=_mm_loadu_si128((const __m128i*)(data+12));
+			const __m128i any=_mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), notAscii);
+			if(_mm_movemask_epi8(_mm_cmpeq_epi32(any, zero))!=0xffff)
+				break;
+
+			// All ASCII so the saturating packs just drop the zero bytes
+			_mm_storeu_si128((__m128i*)destination, _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+		}
+
+		// Get past the block that wasn't all ASCII before trying again
+		if(end-data>16)
+			chunkEnd=data+16;
+#endif
+
+		for(; data<chunkEnd; ++data)
+		{
+			const unsigned long character=(unsigned long)*data;
+			if(character<0x80)
+				*destination++=char(character);
+			else if(character<0x800)
+			{
+				*destination++=char(0xc0 | character>>6);
+				*destination++=char(0x80 | (character&0x3f));
+			}
+			else if(character<0x10000)
+			{
+				if(character>=0xd800 && character<=0xdfff)
+					throw Exceptions::CodeCvt();
+				*destination++=char(0xe0 | character>>12);
+				*destination++=char(0x80 | (character>>6&0x3f));
+				*destination++=char(0x80 | (character&0x3f));
+			}
+			else if(character<=0x10ffff)
+			{
+				*destination++=char(0xf0 | character>>18);
+				*destination++=char(0x80 | (character>>12&0x3f));
+				*destination++=char(0x80 | (character>>6&0x3f));
+				*destination++=char(0x80 | (character&0x3f));
+			}
+			else
+				throw Exceptions::CodeCvt();
+		}
 	}
+
+	return destination;
 }
 
 int Fastcgipp::Http::atoi(const char* start, const char* end)
@@ -64,6 +224,41 @@ int Fastcgipp::Http::atoi(const char* start, const char* end)
 	return neg?-result:result;
 }
 
+boost::posix_time::ptime Fastcgipp::Http::parseHttpDate(const char* start, const char* end)
+{
+	using namespace boost;
+
+	static const char months[]="JanFebMarAprMayJunJulAugSepOctNovDec";
+
+	// Skip the day of the week
+	while(start<end && *start!=' ') ++start;
+	// " 06 Nov 1994 08:49:37 GMT"
+	if(end-start < 25 || start[3]!=' ' || start[7]!=' ' || start[12]!=' ' || start[15]!=':' || start[18]!=':')
+		return posix_time::ptime();
+
+	int month=0;
+	while(month<12 && std::memcmp(months+month*3, start+4, 3)) ++month;
+	if(month==12)
+		return posix_time::ptime();
+
+	const int day=atoi(start+1, start+3);
+	const int year=atoi(start+8, start+12);
+	const int hours=atoi(start+13, start+15);
+	const int minutes=atoi(start+16, start+18);
+	const int seconds=atoi(start+19, start+21);
+	if(hours>23 || minutes>59 || seconds>60)
+		return posix_time::ptime();
+
+	try
+	{
+		return posix_time::ptime(gregorian::date(year, month+1, day), posix_time::time_duration(hours, minutes, seconds));
+	}
+	catch(const std::out_of_range&)
+	{
+		return posix_time::ptime();
+	}
+}
+
 size_t Fastcgipp::Http::percentEscapedToRealBytes(const char* source, char* destination, size_t size)
 {
 	if (size < 1) return 0;
@@ -100,6 +295,105 @@ size_t Fastcgipp::Http::percentEscapedToRealBytes(const char* source, char* dest
 	return destination-start;
 }
 
+namespace Fastcgipp
+{
+	namespace Http
+	{
+		//! Parameters known to Environment::fill()
+		enum KnownParam
+		{
+			PARAM_HTTP_HOST,
+			PARAM_PATH_INFO,
+			PARAM_HTTP_ACCEPT,
+			PARAM_HTTP_COOKIE,
+			PARAM_REMOTE_ADDR,
+			PARAM_REMOTE_PORT,
+			PARAM_REQUEST_URI,
+			PARAM_SCRIPT_NAME,
+			PARAM_SERVER_ADDR,
+			PARAM_SERVER_PORT,
+			PARAM_CONTENT_TYPE,
+			PARAM_HTTP_REFERER,
+			PARAM_QUERY_STRING,
+			PARAM_DOCUMENT_ROOT,
+			PARAM_CONTENT_LENGTH,
+			PARAM_REQUEST_METHOD,
+			PARAM_HTTP_KEEP_ALIVE,
+			PARAM_HTTP_USER_AGENT,
+			PARAM_HTTP_IF_NONE_MATCH,
+			PARAM_HTTP_ACCEPT_CHARSET,
+			PARAM_HTTP_ACCEPT_LANGUAGE,
+			PARAM_HTTP_IF_MODIFIED_SINCE
+		};
+
+		//! Entry in the table of known parameters
+		struct KnownParamName
+		{
+			const char* name;
+			size_t size;
+			KnownParam param;
+			//! True if the parameter is parsed right away even in lazy mode
+			bool eager;
+		};
+
+		//! Known parameters sorted the same way as Environment's parameter index
+		const KnownParamName knownParams[] =
+		{
+			{ "HTTP_HOST", 9, PARAM_HTTP_HOST, false },
+			{ "PATH_INFO", 9, PARAM_PATH_INFO, false },
+			{ "HTTP_ACCEPT", 11, PARAM_HTTP_ACCEPT, false },
+			{ "HTTP_COOKIE", 11, PARAM_HTTP_COOKIE, false },
+			{ "REMOTE_ADDR", 11, PARAM_REMOTE_ADDR, true },
+			{ "REMOTE_PORT", 11, PARAM_REMOTE_PORT, true },
+			{ "REQUEST_URI", 11, PARAM_REQUEST_URI, false },
+			{ "SCRIPT_NAME", 11, PARAM_SCRIPT_NAME, false },
+			{ "SERVER_ADDR", 11, PARAM_SERVER_ADDR, true },
+			{ "SERVER_PORT", 11, PARAM_SERVER_PORT, true },
+			{ "CONTENT_TYPE", 12, PARAM_CONTENT_TYPE, true },
+			{ "HTTP_REFERER", 12, PARAM_HTTP_REFERER, false },
+			{ "QUERY_STRING", 12, PARAM_QUERY_STRING, false },
+			{ "DOCUMENT_ROOT", 13, PARAM_DOCUMENT_ROOT, false },
+			{ "CONTENT_LENGTH", 14, PARAM_CONTENT_LENGTH, true },
+			{ "REQUEST_METHOD", 14, PARAM_REQUEST_METHOD, true },
+			{ "HTTP_KEEP_ALIVE", 15, PARAM_HTTP_KEEP_ALIVE, true },
+			{ "HTTP_USER_AGENT", 15, PARAM_HTTP_USER_AGENT, false },
+			{ "HTTP_IF_NONE_MATCH", 18, PARAM_HTTP_IF_NONE_MATCH, true },
+			{ "HTTP_ACCEPT_CHARSET", 19, PARAM_HTTP_ACCEPT_CHARSET, false },
+			{ "HTTP_ACCEPT_LANGUAGE", 20, PARAM_HTTP_ACCEPT_LANGUAGE, false },
+			{ "HTTP_IF_MODIFIED_SINCE", 22, PARAM_HTTP_IF_MODIFIED_SINCE, true }
+		};
+		const KnownParamName* const knownParamsEnd=knownParams+sizeof(knownParams)/sizeof(KnownParamName);
+
+		//! Order parameter names by size first and then by content
+		inline bool paramNameLess(const char* x, size_t xSize, const char* y, size_t ySize)
+		{
+			return xSize<ySize || (xSize==ySize && std::memcmp(x, y, xSize)<0);
+		}
+
+		struct KnownParamLess
+		{
+			bool operator()(const KnownParamName& x, const Param& y) const { return paramNameLess(x.name, x.size, y.name, y.nameSize); }
+			bool operator()(const Param& x, const KnownParamName& y) const { return paramNameLess(x.name, x.nameSize, y.name, y.size); }
+			bool operator()(const KnownParamName& x, const KnownParamName& y) const { return paramNameLess(x.name, x.size, y.name, y.size); }
+		};
+
+		//! Find a known parameter. Returns 0 if the name isn't one.
+		const KnownParamName* findKnownParam(const char* name, size_t size)
+		{
+			const Param key(name, size, 0, 0);
+			const KnownParamName* it=std::lower_bound(knownParams, knownParamsEnd, key, KnownParamLess());
+			if(it==knownParamsEnd || it->size!=size || std::memcmp(it->name, name, size))
+				return 0;
+			return it;
+		}
+	}
+}
+
+bool Fastcgipp::Http::Param::operator<(const Param& x) const
+{
+	return paramNameLess(name, nameSize, x.name, x.nameSize);
+}
+
 template void Fastcgipp::Http::Environment<char>::fill(const char* data, size_t size);
 template void Fastcgipp::Http::Environment<wchar_t>::fill(const char* data, size_t size);
 template<class charT> void Fastcgipp::Http::Environment<charT>::fill(const char* data, size_t size)
@@ -107,6 +401,11 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::fill(const char*
 	using namespace std;
 	using namespace boost;
 
+	// The record goes away once it's handled so keep a copy for the parameter index
+	char* copy=m_arena.allocate<char>(size);
+	memcpy(copy, data, size);
+	data=copy;
+
 	while(size)
 	{{
 		size_t nameSize;
@@ -117,313 +416,666 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::fill(const char*
 		size-=value-data+valueSize;
 		data=value+valueSize;
 
-		switch(nameSize)
+		m_params.push_back(Param(name, nameSize, value, valueSize));
+
+		const KnownParamName* known=findKnownParam(name, nameSize);
+		if(!known || (m_lazy && !known->eager))
+			continue;
+
+		switch(known->param)
 		{
-		case 9:
-			if(!memcmp(name, "HTTP_HOST", 9))
-				charToString(value, valueSize, host);
-			else if(!memcmp(name, "PATH_INFO", 9))
-			{
-				boost::scoped_array<char> buffer(new char[valueSize]);
-				const char* source=value;
-				int size=-1;
-				for(; source<value+valueSize+1; ++source, ++size)
-				{
-					if(*source == '/' || source == value+valueSize)
-					{
-						if(size > 0)
-						{
-							percentEscapedToRealBytes(source-size, buffer.get(), size);
-							pathInfo.push_back(std::basic_string<charT>());
-							charToString(buffer.get(), size, pathInfo.back());
-						}
-						size=-1;						
-					}
-				}
-			}
+		case PARAM_HTTP_HOST:
+			charToString(value, valueSize, host);
+			break;
+		case PARAM_PATH_INFO:
+			decodePathInfo(value, valueSize);
+			break;
+		case PARAM_HTTP_ACCEPT:
+			charToString(value, valueSize, acceptContentTypes);
+			break;
+		case PARAM_HTTP_COOKIE:
+			decodeUrlEncoded(value, valueSize, cookies, ';');
+			break;
+		case PARAM_SERVER_ADDR:
+			serverAddress.assign(value, value+valueSize);
+			break;
+		case PARAM_REMOTE_ADDR:
+			remoteAddress.assign(value, value+valueSize);
 			break;
-		case 11:
-			if(!memcmp(name, "HTTP_ACCEPT", 11))
-				charToString(value, valueSize, acceptContentTypes);
-			else if(!memcmp(name, "HTTP_COOKIE", 11))
-				decodeUrlEncoded(value, valueSize, cookies, ';');
-			else if(!memcmp(name, "SERVER_ADDR", 11))
-				serverAddress.assign(value, value+valueSize);
-			else if(!memcmp(name, "REMOTE_ADDR", 11))
-				remoteAddress.assign(value, value+valueSize);
-			else if(!memcmp(name, "SERVER_PORT", 11))
-				serverPort=atoi(value, value+valueSize);
-			else if(!memcmp(name, "REMOTE_PORT", 11))
-				remotePort=atoi(value, value+valueSize);
-			else if(!memcmp(name, "SCRIPT_NAME", 11))
-				charToString(value, valueSize, scriptName);
-			else if(!memcmp(name, "REQUEST_URI", 11))
-				charToString(value, valueSize, requestUri);
+		case PARAM_SERVER_PORT:
+			serverPort=atoi(value, value+valueSize);
 			break;
-		case 12:
-			if(!memcmp(name, "HTTP_REFERER", 12) && valueSize)
+		case PARAM_REMOTE_PORT:
+			remotePort=atoi(value, value+valueSize);
+			break;
+		case PARAM_SCRIPT_NAME:
+			charToString(value, valueSize, scriptName);
+			break;
+		case PARAM_REQUEST_URI:
+			charToString(value, valueSize, requestUri);
+			break;
+		case PARAM_HTTP_REFERER:
+			if(valueSize)
 				charToString(value, valueSize, referer);
-			else if(!memcmp(name, "CONTENT_TYPE", 12))
+			break;
+		case PARAM_CONTENT_TYPE:
+		{
+			const char* end=(char*)memchr(value, ';', valueSize);
+			charToString(value, end?end-value:valueSize, contentType);
+			if(end)
 			{
-				const char* end=(char*)memchr(value, ';', valueSize);
-				charToString(value, end?end-value:valueSize, contentType);
-				if(end)
+				const char* start=(char*)memchr(end, '=', valueSize-(end-value));
+				if(start)
 				{
-					const char* start=(char*)memchr(end, '=', valueSize-(end-data));
-					if(start)
-					{
-						boundarySize=valueSize-(++start-value);
-						boundary.reset(new char[boundarySize]);
-						memcpy(boundary.get(), start, boundarySize);
-					}
+					boundarySize=valueSize-(++start-value);
+					boundary=m_arena.allocate<char>(boundarySize);
+					memcpy(boundary, start, boundarySize);
 				}
 			}
-			else if(!memcmp(name, "QUERY_STRING", 12) && valueSize)
+			break;
+		}
+		case PARAM_QUERY_STRING:
+			if(valueSize)
 				decodeUrlEncoded(value, valueSize, gets);
 			break;
-		case 13:
-			if(!memcmp(name, "DOCUMENT_ROOT", 13))
-				charToString(value, valueSize, root);
+		case PARAM_DOCUMENT_ROOT:
+			charToString(value, valueSize, root);
 			break;
-		case 14:
-			if(!memcmp(name, "REQUEST_METHOD", 14))
+		case PARAM_REQUEST_METHOD:
+			requestMethod = HTTP_METHOD_ERROR;
+			switch(valueSize)
 			{
-				requestMethod = HTTP_METHOD_ERROR;
-				switch(valueSize)
-				{
-				case 3:
-					if(!memcmp(value, requestMethodLabels[HTTP_METHOD_GET], 3)) requestMethod = HTTP_METHOD_GET;
-					else if(!memcmp(value, requestMethodLabels[HTTP_METHOD_PUT], 3)) requestMethod = HTTP_METHOD_PUT;
-					break;
-				case 4:
-					if(!memcmp(value, requestMethodLabels[HTTP_METHOD_HEAD], 4)) requestMethod = HTTP_METHOD_HEAD;
-					else if(!memcmp(value, requestMethodLabels[HTTP_METHOD_POST], 4)) requestMethod = HTTP_METHOD_POST;
-					break;
-				case 5:
-					if(!memcmp(value, requestMethodLabels[HTTP_METHOD_TRACE], 5)) requestMethod = HTTP_METHOD_TRACE;
-					break;
-				case 6:
-					if(!memcmp(value, requestMethodLabels[HTTP_METHOD_DELETE], 6)) requestMethod = HTTP_METHOD_DELETE;
-					break;
-				case 7:
-					if(!memcmp(value, requestMethodLabels[HTTP_METHOD_OPTIONS], 7)) requestMethod = HTTP_METHOD_OPTIONS;
-					else if(!memcmp(value, requestMethodLabels[HTTP_METHOD_OPTIONS], 7)) requestMethod = HTTP_METHOD_CONNECT;
-					break;
-				}
+			case 3:
+				if(!memcmp(value, requestMethodLabels[HTTP_METHOD_GET], 3)) requestMethod = HTTP_METHOD_GET;
+				else if(!memcmp(value, requestMethodLabels[HTTP_METHOD_PUT], 3)) requestMethod = HTTP_METHOD_PUT;
+				break;
+			case 4:
+				if(!memcmp(value, requestMethodLabels[HTTP_METHOD_HEAD], 4)) requestMethod = HTTP_METHOD_HEAD;
+				else if(!memcmp(value, requestMethodLabels[HTTP_METHOD_POST], 4)) requestMethod = HTTP_METHOD_POST;
+				break;
+			case 5:
+				if(!memcmp(value, requestMethodLabels[HTTP_METHOD_TRACE], 5)) requestMethod = HTTP_METHOD_TRACE;
+				break;
+			case 6:
+				if(!memcmp(value, requestMethodLabels[HTTP_METHOD_DELETE], 6)) requestMethod = HTTP_METHOD_DELETE;
+				break;
+			case 7:
+				if(!memcmp(value, requestMethodLabels[HTTP_METHOD_OPTIONS], 7)) requestMethod = HTTP_METHOD_OPTIONS;
+				else if(!memcmp(value, requestMethodLabels[HTTP_METHOD_CONNECT], 7)) requestMethod = HTTP_METHOD_CONNECT;
+				break;
 			}
-			else if(!memcmp(name, "CONTENT_LENGTH", 14))
-				contentLength=atoi(value, value+valueSize);
 			break;
-		case 15:
-			if(!memcmp(name, "HTTP_USER_AGENT", 15))
-				charToString(value, valueSize, userAgent);
-			else if(!memcmp(name, "HTTP_KEEP_ALIVE", 15))
-				keepAlive=atoi(value, value+valueSize);
+		case PARAM_CONTENT_LENGTH:
+			contentLength=atoi(value, value+valueSize);
 			break;
-		case 18:
-			if(!memcmp(name, "HTTP_IF_NONE_MATCH", 18))
-				etag=atoi(value, value+valueSize);
+		case PARAM_HTTP_USER_AGENT:
+			charToString(value, valueSize, userAgent);
 			break;
-		case 19:
-			if(!memcmp(name, "HTTP_ACCEPT_CHARSET", 19))
-				charToString(value, valueSize, acceptCharsets);
+		case PARAM_HTTP_KEEP_ALIVE:
+			keepAlive=atoi(value, value+valueSize);
 			break;
-		case 20:
-			if(!memcmp(name, "HTTP_ACCEPT_LANGUAGE", 20))
-				charToString(value, valueSize, acceptLanguages);
+		case PARAM_HTTP_IF_NONE_MATCH:
+		{
+			// Entity tags are quoted and may be marked as weak
+			const char* start=value;
+			const char* const end=value+valueSize;
+			if(end-start>=2 && start[0]=='W' && start[1]=='/')
+				start+=2;
+			if(start<end && *start=='"')
+				++start;
+			etag=atoi(start, end);
 			break;
-		case 22:
-			if(!memcmp(name, "HTTP_IF_MODIFIED_SINCE", 22))
-			{
-				stringstream dateStream;
-				dateStream.write(value, valueSize);
-				dateStream.imbue(locale(locale::classic(), new posix_time::time_input_facet("%a, %d %b %Y %H:%M:%S GMT")));
-				dateStream >> ifModifiedSince;
-			}
+		}
+		case PARAM_HTTP_ACCEPT_CHARSET:
+			charToString(value, valueSize, acceptCharsets);
+			break;
+		case PARAM_HTTP_ACCEPT_LANGUAGE:
+			charToString(value, valueSize, acceptLanguages);
+			break;
+		case PARAM_HTTP_IF_MODIFIED_SINCE:
+			ifModifiedSince=parseHttpDate(value, value+valueSize);
 			break;
 		}
 	}}
+
+	// Keep the index sorted by name. Duplicate names stay in the order they were received.
+	std::stable_sort(m_params.begin(), m_params.end());
 }
 
-template bool Fastcgipp::Http::Environment<char>::fillPostBuffer(const char* data, size_t size);
-template bool Fastcgipp::Http::Environment<wchar_t>::fillPostBuffer(const char* data, size_t size);
-template<class charT> bool Fastcgipp::Http::Environment<charT>::fillPostBuffer(const char* data, size_t size)
+template void Fastcgipp::Http::Environment<char>::decodePathInfo(const char* value, size_t valueSize);
+template void Fastcgipp::Http::Environment<wchar_t>::decodePathInfo(const char* value, size_t valueSize);
+template<class charT> void Fastcgipp::Http::Environment<charT>::decodePathInfo(const char* value, size_t valueSize)
 {
-	if(!m_postBuffer)
+	char* buffer=m_arena.allocate<char>(valueSize);
+	const char* source=value;
+	int size=-1;
+	for(; source<value+valueSize+1; ++source, ++size)
 	{
-		m_postBuffer.reset(new char[contentLength]);
-		pPostBuffer=m_postBuffer.get();
+		if(source == value+valueSize || *source == '/')
+		{
+			if(size > 0)
+			{
+				percentEscapedToRealBytes(source-size, buffer, size);
+				pathInfo.push_back(std::basic_string<charT>());
+				charToString(buffer, size, pathInfo.back());
+			}
+			size=-1;
+		}
 	}
+}
+
+template const Fastcgipp::Http::Param* Fastcgipp::Http::Environment<char>::locateParam(const char* name) const;
+template const Fastcgipp::Http::Param* Fastcgipp::Http::Environment<wchar_t>::locateParam(const char* name) const;
+template<class charT> const Fastcgipp::Http::Param* Fastcgipp::Http::Environment<charT>::locateParam(const char* name) const
+{
+	const Param key(name, std::strlen(name), 0, 0);
+	typename Params::const_iterator it=std::lower_bound(m_params.begin(), m_params.end(), key);
+	if(it==m_params.end() || it->nameSize!=key.nameSize || std::memcmp(it->name, name, key.nameSize))
+		return 0;
+	return &*it;
+}
 
-	size_t trueSize=minPostBufferSize(size);
-	if(trueSize)
+template Fastcgipp::Http::CharView Fastcgipp::Http::Environment<char>::findParam(const char* name) const;
+template Fastcgipp::Http::CharView Fastcgipp::Http::Environment<wchar_t>::findParam(const char* name) const;
+template<class charT> Fastcgipp::Http::CharView Fastcgipp::Http::Environment<charT>::findParam(const char* name) const
+{
+	const Param* param=locateParam(name);
+	return param?CharView(param->value, param->valueSize):CharView();
+}
+
+template bool Fastcgipp::Http::Environment<char>::checkForParam(const char* name) const;
+template bool Fastcgipp::Http::Environment<wchar_t>::checkForParam(const char* name) const;
+template<class charT> bool Fastcgipp::Http::Environment<charT>::checkForParam(const char* name) const
+{
+	return locateParam(name);
+}
+
+template const std::basic_string<char>& Fastcgipp::Http::Environment<char>::param(const char* name) const;
+template const std::basic_string<wchar_t>& Fastcgipp::Http::Environment<wchar_t>::param(const char* name) const;
+template<class charT> const std::basic_string<charT>& Fastcgipp::Http::Environment<charT>::param(const char* name) const
+{
+	static const std::basic_string<charT> emptyString;
+	const Param* param=locateParam(name);
+	if(!param)
+		return emptyString;
+
+	typename Converted::iterator it=m_converted.find(param->value);
+	if(it==m_converted.end())
 	{
-		std::memcpy(pPostBuffer, data, trueSize);
-		pPostBuffer+=trueSize;
-		return true;
+		it=m_converted.insert(std::make_pair(param->value, std::basic_string<charT>())).first;
+		charToString(param->value, param->valueSize, it->second);
 	}
-	else
-		return false;
+	return it->second;
 }
 
-template void Fastcgipp::Http::Environment<char>::parsePostsMultipart();
-template void Fastcgipp::Http::Environment<wchar_t>::parsePostsMultipart();
-template<class charT> void Fastcgipp::Http::Environment<charT>::parsePostsMultipart()
+template const typename Fastcgipp::Http::Environment<char>::PathInfo& Fastcgipp::Http::Environment<char>::getPathInfo() const;
+template const typename Fastcgipp::Http::Environment<wchar_t>::PathInfo& Fastcgipp::Http::Environment<wchar_t>::getPathInfo() const;
+template<class charT> const typename Fastcgipp::Http::Environment<charT>::PathInfo& Fastcgipp::Http::Environment<charT>::getPathInfo() const
 {
-	using namespace std;
+	if(m_lazy && !m_pathInfoDecoded)
+	{
+		m_pathInfoDecoded=true;
+		const Param* param=locateParam("PATH_INFO");
+		if(param)
+			const_cast<Environment*>(this)->decodePathInfo(param->value, param->valueSize);
+	}
+	return pathInfo;
+}
 
-	if(!m_postBuffer)
+template void Fastcgipp::Http::Environment<char>::decodeLazy() const;
+template void Fastcgipp::Http::Environment<wchar_t>::decodeLazy() const;
+template<class charT> void Fastcgipp::Http::Environment<charT>::decodeLazy() const
+{
+	if(!m_lazy)
 		return;
 
-	const char cName[] = "name=\"";
-	const char cFilename[] = "filename=\"";
-	const char cContentType[] = "Content-Type: ";
-	const char cBodyStart[] = "\r\n\r\n";
+	Environment& self=*const_cast<Environment*>(this);
+	if(!m_getsDecoded)
+	{
+		m_getsDecoded=true;
+		const Param* param=locateParam("QUERY_STRING");
+		if(param && param->valueSize)
+			decodeUrlEncoded(param->value, param->valueSize, self.gets);
+	}
+	if(!m_cookiesDecoded)
+	{
+		m_cookiesDecoded=true;
+		const Param* param=locateParam("HTTP_COOKIE");
+		if(param)
+			decodeUrlEncoded(param->value, param->valueSize, self.cookies, ';');
+	}
+}
 
-	pPostBuffer=m_postBuffer.get()+boundarySize+1;
-	const char* contentTypeStart=0;
-	ssize_t contentTypeSize=-1;
-	const char* nameStart=0;
-	ssize_t nameSize=-1;
-	const char* filenameStart=0;
-	ssize_t filenameSize=-1;
-	const char* bodyStart=0;
-	ssize_t bodySize=-1;
-	enum ParseState { HEADER, NAME, FILENAME, CONTENT_TYPE, BODY } parseState=HEADER;
-	for(pPostBuffer=m_postBuffer.get()+boundarySize+2; pPostBuffer<m_postBuffer.get()+contentLength; ++pPostBuffer)
+template char* Fastcgipp::Http::Post<char>::steal() const;
+template char* Fastcgipp::Http::Post<wchar_t>::steal() const;
+template<class charT> char* Fastcgipp::Http::Post<charT>::steal() const
+{
+	char* ptr=m_data;
+	if(m_mapped && m_size)
 	{
-		switch(parseState)
+		ptr=new char[m_size];
+		std::memcpy(ptr, m_data, m_size);
+		release();
+	}
+	m_data=0;
+	m_size=0;
+	m_mapped=false;
+	return ptr;
+}
+
+template void Fastcgipp::Http::Post<char>::release() const;
+template void Fastcgipp::Http::Post<wchar_t>::release() const;
+template<class charT> void Fastcgipp::Http::Post<charT>::release() const
+{
+	if(m_mapped)
+		munmap(m_data, m_size);
+	else
+		delete [] m_data;
+	m_data=0;
+	m_mapped=false;
+}
+
+const char* Fastcgipp::Http::findPattern(const char* data, size_t size, const char* pattern, size_t patternSize)
+{
+	const char* const end=data+size;
+	if(!patternSize || patternSize>size)
+		return end;
+	// Last position the pattern could start at
+	const char* const last=end-patternSize;
+
+#if defined (__SSE2__)
+	if(patternSize>1)
+	{
+		// Only offsets where both the first and the last byte of the pattern match get a full comparison
+		const __m128i first=_mm_set1_epi8(pattern[0]);
+		const __m128i final=_mm_set1_epi8(pattern[patternSize-1]);
+		for(; data+16<=last+1; data+=16)
 		{
-			case HEADER:
+			const __m128i blockFirst=_mm_loadu_si128((const __m128i*)data);
+			const __m128i blockFinal=_mm_loadu_si128((const __m128i*)(data+patternSize-1));
+			unsigned int mask=_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(final, blockFinal)));
+			while(mask)
 			{
-				if(nameSize == -1)
-				{
-					const size_t size=minPostBufferSize(sizeof(cName)-1);
-					if(!memcmp(pPostBuffer, cName, size))
-					{
-						pPostBuffer+=size-1;
-						nameStart=pPostBuffer+1;
-						parseState=NAME;
-						continue;
-					}
-				}
-				if(filenameSize == -1)
-				{
-					const size_t size=minPostBufferSize(sizeof(cFilename)-1);
-					if(!memcmp(pPostBuffer, cFilename, size))
-					{
-						pPostBuffer+=size-1;
-						filenameStart=pPostBuffer+1;
-						parseState=FILENAME;
-						continue;
-					}
-				}
-				if(contentTypeSize == -1)
-				{
-					const size_t size=minPostBufferSize(sizeof(cContentType)-1);
-					if(!memcmp(pPostBuffer, cContentType, size))
-					{
-						pPostBuffer+=size-1;
-						contentTypeStart=pPostBuffer+1;
-						parseState=CONTENT_TYPE;
-						continue;
-					}
-				}
-				if(bodySize == -1)
+				const int offset=__builtin_ctz(mask);
+				if(!std::memcmp(data+offset+1, pattern+1, patternSize-2))
+					return data+offset;
+				mask&=mask-1;
+			}
+		}
+	}
+#endif
+
+	while(data<=last)
+	{
+		data=(const char*)std::memchr(data, *pattern, last-data+1);
+		if(!data)
+			return end;
+		if(data[patternSize-1]==pattern[patternSize-1] && !std::memcmp(data+1, pattern+1, patternSize-1))
+			return data;
+		++data;
+	}
+	return end;
+}
+
+namespace Fastcgipp
+{
+	namespace Http
+	{
+		//! Find the longest suffix of a block of memory that starts a pattern
+		/*!
+		 * @param[in] data Pointer to the first byte of data
+		 * @param[in] size Size of data in bytes
+		 * @param[in] pattern Pointer to the first byte of the pattern
+		 * @param[in] patternSize Size of pattern in bytes
+		 * @return Size of the suffix. Always less than patternSize.
+		 */
+		size_t partialPattern(const char* data, size_t size, const char* pattern, size_t patternSize)
+		{
+			for(size_t suffix=std::min(size, patternSize-1); suffix; --suffix)
+				if(data[size-suffix]==*pattern && !std::memcmp(data+size-suffix, pattern, suffix))
+					return suffix;
+			return 0;
+		}
+
+		//! Open an unlinked temporary file to spill post data to. Returns -1 on failure.
+		int openSpillFile()
+		{
+			const char* directory=std::getenv("TMPDIR");
+			if(!directory || !*directory)
+				directory=P_tmpdir;
+
+			std::vector<char> path(directory, directory+std::strlen(directory));
+			const char name[]="/fastcgi++XXXXXX";
+			path.insert(path.end(), name, name+sizeof(name));
+
+			// A successor started by a handoff would otherwise pin the file's space for it's whole life
+#if defined (HAVE_MKOSTEMP)
+			const int fd=mkostemp(&path[0], O_CLOEXEC);
+			if(fd>=0)
+				unlink(&path[0]);
+#else
+			const int fd=mkstemp(&path[0]);
+			if(fd>=0)
+			{
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				unlink(&path[0]);
+			}
+#endif
+			return fd;
+		}
+
+		//! Write all of a block of data to a spill file
+		void writeSpill(int fd, const char* data, size_t size)
+		{
+			while(size)
+			{
+				const ssize_t written=write(fd, data, size);
+				if(written<0)
 				{
-					const size_t size=minPostBufferSize(sizeof(cBodyStart)-1);
-					if(!memcmp(pPostBuffer, cBodyStart, size))
-					{
-						pPostBuffer+=size-1;
-						bodyStart=pPostBuffer+1;
-						parseState=BODY;
+					if(errno==EINTR)
 						continue;
-					}
+					throw Exceptions::PostSpill(errno);
 				}
-				continue;
+				data+=written;
+				size-=written;
 			}
+		}
+	}
+}
+
+template bool Fastcgipp::Http::Environment<char>::fillPostBuffer(const char* data, size_t size);
+template bool Fastcgipp::Http::Environment<wchar_t>::fillPostBuffer(const char* data, size_t size);
+template<class charT> bool Fastcgipp::Http::Environment<charT>::fillPostBuffer(const char* data, size_t size)
+{
+	if(!m_postReceived)
+	{
+		const char multipart[] = "multipart/form-data";
+		if(boundary && sizeof(multipart)-1 == contentType.size() && std::equal(multipart, multipart+sizeof(multipart)-1, contentType.begin()))
+		{
+			m_delimiterSize=boundarySize+4;
+			m_delimiter=m_arena.allocate<char>(m_delimiterSize);
+			std::memcpy(m_delimiter, "\r\n--", 4);
+			std::memcpy(m_delimiter+4, boundary, boundarySize);
+
+			// The first boundary needn't be preceded by a line break so pretend one was received
+			m_carry.assign(m_delimiter, m_delimiter+2);
+			m_multipartState=MULTIPART_PREAMBLE;
+		}
+	}
+
+	size_t trueSize=std::min(size, contentLength-m_postReceived);
+	if(!trueSize)
+		return false;
+	m_postReceived+=trueSize;
+
+	if(m_multipartState!=MULTIPART_NONE)
+	{
+		parseMultipart(data, trueSize);
+		return true;
+	}
+
+	if(!m_postBuffer)
+	{
+		m_postBuffer=m_arena.allocate<char>(contentLength);
+		pPostBuffer=m_postBuffer;
+	}
+
+	std::memcpy(pPostBuffer, data, trueSize);
+	pPostBuffer+=trueSize;
+	return true;
+}
+
+template void Fastcgipp::Http::Environment<char>::parseMultipart(const char* data, size_t size);
+template void Fastcgipp::Http::Environment<wchar_t>::parseMultipart(const char* data, size_t size);
+template<class charT> void Fastcgipp::Http::Environment<charT>::parseMultipart(const char* data, size_t size)
+{
+	using namespace std;
+
+	const char cHeadersEnd[] = "\r\n\r\n";
+
+	while(size && m_multipartState!=MULTIPART_DONE)
+	{
+		if(m_multipartState==MULTIPART_HEADERS)
+		{
+			const size_t carried=m_carry.size();
+			const size_t taken=min(size, maxPartHeaderSize-carried);
+			m_carry.insert(m_carry.end(), data, data+taken);
 
-			case NAME:
+			// A delimiter followed by "--" closes the body
+			if(m_carry.size()>=2 && m_carry[0]=='-' && m_carry[1]=='-')
 			{
-				if(*pPostBuffer == '"')
-				{
-					nameSize=pPostBuffer-nameStart;
-					parseState=HEADER;
-				}
-				continue;
+				m_multipartState=MULTIPART_DONE;
+				break;
 			}
 
-			case FILENAME:
+			const char* const begin=&m_carry[0];
+			const size_t searchStart=carried>3?carried-3:0;
+			const char* const end=findPattern(begin+searchStart, m_carry.size()-searchStart, cHeadersEnd, sizeof(cHeadersEnd)-1);
+			if(end==begin+m_carry.size())
 			{
-				if(*pPostBuffer == '"')
-				{
-					filenameSize=pPostBuffer-filenameStart;
-					parseState=HEADER;
-				}
+				// Oversized headers mean the data is malformed
+				if(m_carry.size()>=maxPartHeaderSize)
+					m_multipartState=MULTIPART_DONE;
+				data+=taken;
+				size-=taken;
 				continue;
 			}
 
-			case CONTENT_TYPE:
+			const size_t used=end+sizeof(cHeadersEnd)-1-begin-carried;
+			data+=used;
+			size-=used;
+			startPart(end+2-begin);
+			m_carry.clear();
+			m_multipartState=MULTIPART_BODY;
+			continue;
+		}
+
+		const char* found;
+		size_t used;
+		if(m_carry.empty())
+		{
+			found=findPattern(data, size, m_delimiter, m_delimiterSize);
+			if(found==data+size)
+			{
+				// Hold back whatever might be the start of a delimiter split across records
+				const size_t held=partialPattern(data, size, m_delimiter, m_delimiterSize);
+				if(m_multipartState==MULTIPART_BODY)
+					partData(data, size-held);
+				m_carry.assign(data+size-held, data+size);
+				break;
+			}
+			if(m_multipartState==MULTIPART_BODY)
+				partData(data, found-data);
+			used=found-data+m_delimiterSize;
+		}
+		else
+		{
+			// Only as much new data as is needed to settle what was carried over is copied
+			const size_t carried=m_carry.size();
+			size_t taken=min(size, m_delimiterSize);
+			m_carry.insert(m_carry.end(), data, data+taken);
+			const char* const begin=&m_carry[0];
+			found=findPattern(begin, m_carry.size(), m_delimiter, m_delimiterSize);
+			if(found==begin+m_carry.size())
 			{
-				if(*pPostBuffer == '\r' || *pPostBuffer == '\n')
+				size_t held=0;
+				if(taken==m_delimiterSize)
 				{
-					contentTypeSize=pPostBuffer-contentTypeStart;
-					--pPostBuffer;
-					parseState=HEADER;
+					// A delimiter starting in the carried data would have been found
+					m_carry.resize(carried);
+					taken=0;
 				}
+				else
+					held=partialPattern(begin, m_carry.size(), m_delimiter, m_delimiterSize);
+				if(m_multipartState==MULTIPART_BODY)
+					partData(begin, m_carry.size()-held);
+				m_carry.erase(m_carry.begin(), m_carry.end()-held);
+				data+=taken;
+				size-=taken;
 				continue;
 			}
+			if(m_multipartState==MULTIPART_BODY)
+				partData(begin, found-begin);
+			used=found+m_delimiterSize-begin-carried;
+			m_carry.clear();
+		}
 
-			case BODY:
-			{
-				const size_t size=minPostBufferSize(boundarySize);
-				if(boundary.get() && !memcmp(pPostBuffer, boundary.get(), size))
-				{
-					bodySize=pPostBuffer-bodyStart-2;
-					if(bodySize<0) bodySize=0;
-					else if(bodySize>=2 && *(bodyStart+bodySize-1)=='\n' && *(bodyStart+bodySize-2)=='\r')
-						bodySize -= 2;
+		data+=used;
+		size-=used;
+		if(m_multipartState==MULTIPART_BODY)
+			finishPart();
+		m_multipartState=MULTIPART_HEADERS;
+	}
+}
 
-					if(nameSize != -1)
-					{
-						basic_string<charT> name;
-						charToString(nameStart, nameSize, name);
+template void Fastcgipp::Http::Environment<char>::startPart(size_t size);
+template void Fastcgipp::Http::Environment<wchar_t>::startPart(size_t size);
+template<class charT> void Fastcgipp::Http::Environment<charT>::startPart(size_t size)
+{
+	using namespace std;
 
-						Post<charT>& thePost=posts[name];
-						if(contentTypeSize != -1)
-						{
-							thePost.type=Post<charT>::file;
-							charToString(contentTypeStart, contentTypeSize, thePost.contentType);
-							if(filenameSize != -1) charToString(filenameStart, filenameSize, thePost.filename);
-							thePost.m_size=bodySize;
-							if(bodySize)
-							{
-								thePost.m_data = new char[bodySize];
-								memcpy(thePost.m_data, bodyStart, bodySize);
-							}
-						}
-						else
-						{
-							thePost.type=Post<charT>::form;
-							charToString(bodyStart, bodySize, thePost.value);
-						}
-					}
+	const char cName[] = "name=\"";
+	const char cFilename[] = "filename=\"";
+	const char cContentType[] = "Content-Type: ";
 
-					pPostBuffer+=size;
-					parseState=HEADER;
-					contentTypeStart=0;
-					contentTypeSize=-1;
-					nameStart=0;
-					nameSize=-1;
-					filenameStart=0;
-					filenameSize=-1;
-					bodyStart=0;
-					bodySize=-1;
-				}
-				continue;
+	const char* nameStart=0;
+	size_t nameSize=0;
+	const char* filenameStart=0;
+	size_t filenameSize=0;
+	const char* contentTypeStart=0;
+	size_t contentTypeSize=0;
+
+	const char* const end=&m_carry[0]+size;
+	for(const char* i=&m_carry[0]; i<end; ++i)
+	{
+		if(!nameStart && size_t(end-i)>=sizeof(cName)-1 && !memcmp(i, cName, sizeof(cName)-1))
+		{
+			nameStart=i+sizeof(cName)-1;
+			i=find(nameStart, end, '"');
+			nameSize=i-nameStart;
+		}
+		else if(!filenameStart && size_t(end-i)>=sizeof(cFilename)-1 && !memcmp(i, cFilename, sizeof(cFilename)-1))
+		{
+			filenameStart=i+sizeof(cFilename)-1;
+			i=find(filenameStart, end, '"');
+			filenameSize=i-filenameStart;
+		}
+		else if(!contentTypeStart && size_t(end-i)>=sizeof(cContentType)-1 && !memcmp(i, cContentType, sizeof(cContentType)-1))
+		{
+			contentTypeStart=i+sizeof(cContentType)-1;
+			const char lineEnd[] = "\r\n";
+			i=find_first_of(contentTypeStart, end, lineEnd, lineEnd+2)-1;
+			contentTypeSize=i+1-contentTypeStart;
+		}
+	}
+
+	m_partNamed=nameStart;
+	if(!m_partNamed)
+		return;
+	charToString(nameStart, nameSize, m_partName);
+	m_partFile=contentTypeStart;
+	if(m_partFile)
+	{
+		charToString(contentTypeStart, contentTypeSize, m_partContentType);
+		if(filenameStart) charToString(filenameStart, filenameSize, m_partFilename);
+	}
+}
+
+template void Fastcgipp::Http::Environment<char>::partData(const char* data, size_t size);
+template void Fastcgipp::Http::Environment<wchar_t>::partData(const char* data, size_t size);
+template<class charT> void Fastcgipp::Http::Environment<charT>::partData(const char* data, size_t size)
+{
+	if(!m_partNamed || !size)
+		return;
+
+	m_partSize+=size;
+	if(m_partFd<0)
+	{
+		if(!m_partFile || m_partSize<=postSpillSize)
+		{
+			m_partData.insert(m_partData.end(), data, data+size);
+			return;
+		}
+
+		m_partFd=openSpillFile();
+		if(m_partFd<0)
+			throw Exceptions::PostSpill(errno);
+		if(!m_partData.empty())
+			writeSpill(m_partFd, &m_partData[0], m_partData.size());
+		m_partData.clear();
+	}
+	writeSpill(m_partFd, data, size);
+}
+
+template void Fastcgipp::Http::Environment<char>::finishPart();
+template void Fastcgipp::Http::Environment<wchar_t>::finishPart();
+template<class charT> void Fastcgipp::Http::Environment<charT>::finishPart()
+{
+	if(m_partNamed)
+	{
+		Post<charT>& thePost=posts[m_partName];
+		thePost.release();
+		thePost.m_size=0;
+		if(m_partFile)
+		{
+			thePost.type=Post<charT>::file;
+			thePost.contentType.swap(m_partContentType);
+			thePost.filename.swap(m_partFilename);
+			if(m_partFd>=0)
+			{
+				void* map=mmap(0, m_partSize, PROT_READ|PROT_WRITE, MAP_PRIVATE, m_partFd, 0);
+				if(map==MAP_FAILED)
+					throw Exceptions::PostSpill(errno);
+				thePost.m_data=(char*)map;
+				thePost.m_mapped=true;
 			}
+			else if(m_partSize)
+			{
+				thePost.m_data=new char[m_partSize];
+				std::memcpy(thePost.m_data, &m_partData[0], m_partSize);
+			}
+			thePost.m_size=m_partSize;
 		}
+		else
+		{
+			thePost.type=Post<charT>::form;
+			if(m_partData.empty())
+				thePost.value.clear();
+			else
+				charToString(&m_partData[0], m_partData.size(), thePost.value);
+		}
+	}
+	discardPart();
+}
+
+template void Fastcgipp::Http::Environment<char>::discardPart();
+template void Fastcgipp::Http::Environment<wchar_t>::discardPart();
+template<class charT> void Fastcgipp::Http::Environment<charT>::discardPart()
+{
+	if(m_partFd>=0)
+	{
+		close(m_partFd);
+		m_partFd=-1;
 	}
+	m_partNamed=false;
+	m_partFile=false;
+	m_partSize=0;
+	m_partData.clear();
+	m_partName.clear();
+	m_partFilename.clear();
+	m_partContentType.clear();
+}
+
+template void Fastcgipp::Http::Environment<char>::parsePostsMultipart();
+template void Fastcgipp::Http::Environment<wchar_t>::parsePostsMultipart();
+template<class charT> void Fastcgipp::Http::Environment<charT>::parsePostsMultipart()
+{
+	// A part still open here was cut short by the end of the data
+	discardPart();
+	std::vector<char>().swap(m_carry);
+	std::vector<char>().swap(m_partData);
+	if(m_multipartState!=MULTIPART_NONE)
+		m_multipartState=MULTIPART_DONE;
 }
 
 template void Fastcgipp::Http::Environment<char>::parsePostsUrlEncoded();
@@ -433,19 +1085,19 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::parsePostsUrlEnc
 	if(!m_postBuffer)
 		return;
 
-	char* nameStart=m_postBuffer.get();
+	char* nameStart=m_postBuffer;
 	size_t nameSize;
 	char* valueStart=0;
 	size_t valueSize;
 
-	for(char* i=m_postBuffer.get(); i<=m_postBuffer.get()+contentLength; ++i)
+	for(char* i=m_postBuffer; i<=m_postBuffer+contentLength; ++i)
 	{
 		if(*i == '=' && nameStart && !valueStart)
 		{
 			nameSize=percentEscapedToRealBytes(nameStart, nameStart, i-nameStart);
 			valueStart=i+1;
 		}
-		else if( (i==m_postBuffer.get()+contentLength || *i == '&') && nameStart && valueStart)
+		else if( (i==m_postBuffer+contentLength || *i == '&') && nameStart && valueStart)
 		{
 			valueSize=percentEscapedToRealBytes(valueStart, valueStart, i-valueStart);
 
@@ -460,18 +1112,61 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::parsePostsUrlEnc
 	}
 }
 
-bool Fastcgipp::Http::SessionId::seeded=false;
-
-Fastcgipp::Http::SessionId::SessionId()
+namespace Fastcgipp
 {
-	if(!seeded)
+	namespace Http
 	{
-		std::srand(boost::posix_time::microsec_clock::universal_time().time_of_day().fractional_seconds());
-		seeded=true;
+		//! Protects randomDevice
+		static boost::mutex randomMutex;
+		//! File descriptor of /dev/urandom once opened
+		static int randomDevice=-1;
+
+		//! Fill a buffer from the cryptographically secure generator of the system
+		static void secureRandom(char* data, size_t size)
+		{
+#if defined (HAVE_SYS_RANDOM_H)
+			while(size)
+			{
+				const ssize_t actual=getrandom(data, size, 0);
+				if(actual<0)
+				{
+					if(errno==EINTR)
+						continue;
+					// Older kernels lack the system call so the device is used instead
+					break;
+				}
+				data+=actual;
+				size-=actual;
+			}
+			if(!size)
+				return;
+#endif
+
+			boost::lock_guard<boost::mutex> lock(randomMutex);
+			if(randomDevice<0)
+			{
+				randomDevice=open("/dev/urandom", O_RDONLY);
+				if(randomDevice<0)
+					throw Exceptions::CodedException("Unable to open /dev/urandom for session ids.", errno);
+				fcntl(randomDevice, F_SETFD, FD_CLOEXEC);
+			}
+			while(size)
+			{
+				const ssize_t actual=read(randomDevice, data, size);
+				if(actual<0 && errno==EINTR)
+					continue;
+				if(actual<=0)
+					throw Exceptions::CodedException("Unable to read random data for a session id.", errno);
+				data+=actual;
+				size-=actual;
+			}
+		}
 	}
+}
 
-	for(char* i=data; i<data+size; ++i)
-		*i=char(rand()%256);
+Fastcgipp::Http::SessionId::SessionId()
+{
+	secureRandom(data, size);
 	timestamp = boost::posix_time::second_clock::universal_time();
 }
 
@@ -491,16 +1186,24 @@ template<class charT> void Fastcgipp::Http::decodeUrlEncoded(const char* data, s
 {
 	using namespace std;
 
-	boost::scoped_array<char> buffer(new char[size]);
-	memcpy(buffer.get(), data, size);
+	// Cookies and query strings are usually short enough to be decoded on the stack
+	char stackBuffer[1024];
+	boost::scoped_array<char> heapBuffer;
+	char* buffer=stackBuffer;
+	if(size>sizeof(stackBuffer))
+	{
+		heapBuffer.reset(new char[size]);
+		buffer=heapBuffer.get();
+	}
+	memcpy(buffer, data, size);
 
-	char* nameStart=buffer.get();
+	char* nameStart=buffer;
 	size_t nameSize;
 	char* valueStart=0;
 	size_t valueSize;
-	for(char* i=buffer.get(); i<=buffer.get()+size; ++i)
+	for(char* i=buffer; i<=buffer+size; ++i)
 	{
-		if(i==buffer.get()+size || *i == fieldSeperator)
+		if(i==buffer+size || *i == fieldSeperator)
 		{
 			if(nameStart && valueStart)
 			{
@@ -544,6 +1247,7 @@ template const std::basic_string<wchar_t>& Fastcgipp::Http::Environment<wchar_t>
 template<class charT> const std::basic_string<charT>& Fastcgipp::Http::Environment<charT>::findCookie(const charT* key) const
 {
 	static const std::basic_string<charT> emptyString;
+	decodeLazy();
 	typename Cookies::const_iterator it=cookies.find(key);
 	if(it==cookies.end())
 		return emptyString;
@@ -556,6 +1260,7 @@ template const std::basic_string<wchar_t>& Fastcgipp::Http::Environment<wchar_t>
 template<class charT> const std::basic_string<charT>& Fastcgipp::Http::Environment<charT>::findGet(const charT* key) const
 {
 	static const std::basic_string<charT> emptyString;
+	decodeLazy();
 	typename Gets::const_iterator it=gets.find(key);
 	if(it==gets.end())
 		return emptyString;
@@ -579,6 +1284,7 @@ template bool Fastcgipp::Http::Environment<char>::checkForGet(const char* key) c
 template bool Fastcgipp::Http::Environment<wchar_t>::checkForGet(const wchar_t* key) const;
 template<class charT> bool Fastcgipp::Http::Environment<charT>::checkForGet(const charT* key) const
 {
+	decodeLazy();
 	typename Gets::const_iterator it=gets.find(key);
 	if(it==gets.end())
 		return false;
@@ -1,36 +1,96 @@
+#include <cstdio>
 #include <fastcgi++/manager.hpp>
 
 
-Fastcgipp::ManagerPar* Fastcgipp::ManagerPar::instance=0;
+std::vector<Fastcgipp::ManagerPar*> Fastcgipp::ManagerPar::instances;
 
-Fastcgipp::ManagerPar::ManagerPar(int fd, const boost::function<void(Protocol::FullId, Message)>& sendMessage_, bool doSetupSignals): transceiver(fd, sendMessage_), asleep(false), stopBool(false), terminateBool(false)
+Fastcgipp::ManagerPar::ManagerPar(int fd, const boost::function<void(Protocol::FullId, Message)>& sendMessage_, bool doSetupSignals, unsigned int workers_): transceiver(fd, sendMessage_), workers(workers_), idleWorkers(0), workersStop(false), asleep(false), stopBool(false), terminateBool(false), reloadBool(false), reloadConnections(true)
 {
 	if(doSetupSignals) setupSignals();
-	instance=this;
+	instances.push_back(this);
 }
 
 void Fastcgipp::ManagerPar::terminate()
 {
 	boost::lock_guard<boost::mutex> terminateLock(terminateMutex);
-	boost::lock_guard<boost::mutex> sleepLock(sleepMutex);
 	terminateBool=true;
 	if(asleep)
-	{
 		transceiver.wake();
-		asleep=false;
+}
+
+void Fastcgipp::ManagerPar::reload()
+{
+	boost::lock_guard<boost::mutex> reloadLock(reloadMutex);
+	reloadBool=true;
+	if(asleep)
+		transceiver.wake();
+}
+
+void Fastcgipp::ManagerPar::checkReload()
+{
+	bool reload;
+	{
+		boost::lock_guard<boost::mutex> reloadLock(reloadMutex);
+		reload=reloadBool;
+		reloadBool=false;
 	}
+	if(reload)
+		transceiver.handOff(reloadCommand, reloadConnections);
+
+	if(transceiver.handedOff())
+		// Every other manager in the process goes along with the one that handed over
+		for(std::vector<ManagerPar*>::iterator it=instances.begin(); it!=instances.end(); ++it)
+		{
+			// Listening sockets of their own aren't passed on so they stop taking connections
+			// right away. Any still waiting in their queues are reset.
+			if(*it!=this && (*it)->transceiver.listener()!=transceiver.listener())
+				(*it)->transceiver.shutListener();
+			(*it)->terminate();
+		}
 }
 
 void Fastcgipp::ManagerPar::stop()
 {
 	boost::lock_guard<boost::mutex> stopLock(stopMutex);
-	boost::lock_guard<boost::mutex> sleepLock(sleepMutex);
 	stopBool=true;
 	if(asleep)
-	{
 		transceiver.wake();
-		asleep=false;
+}
+
+void Fastcgipp::ManagerPar::wake()
+{
+	if(asleep)
+		transceiver.wake();
+}
+
+void Fastcgipp::ManagerPar::releaseThrottled()
+{
+	std::vector<Protocol::FullId> waiting;
+	{
+		boost::lock_guard<boost::mutex> tasksLock(tasks);
+		if(throttledTasks.empty())
+			return;
+		waiting.swap(throttledTasks);
 	}
+
+	// The transceiver is asked without holding the task queue lock
+	std::vector<Protocol::FullId> released;
+	std::vector<Protocol::FullId>::iterator it=waiting.begin();
+	while(it!=waiting.end())
+		if(transceiver.throttled(it->fd))
+			++it;
+		else
+		{
+			released.push_back(*it);
+			it=waiting.erase(it);
+		}
+
+	{
+		boost::lock_guard<boost::mutex> tasksLock(tasks);
+		throttledTasks.insert(throttledTasks.end(), waiting.begin(), waiting.end());
+	}
+	for(it=released.begin(); it!=released.end(); ++it)
+		schedule(*it);
 }
 
 void Fastcgipp::ManagerPar::signalHandler(int signum)
@@ -39,12 +99,21 @@ void Fastcgipp::ManagerPar::signalHandler(int signum)
 	{
 		case SIGUSR1:
 		{
-			if(instance) instance->terminate();
+			for(std::vector<ManagerPar*>::iterator it=instances.begin(); it!=instances.end(); ++it)
+				(*it)->terminate();
 			break;
 		}
 		case SIGTERM:
 		{
-			if(instance) instance->stop();
+			for(std::vector<ManagerPar*>::iterator it=instances.begin(); it!=instances.end(); ++it)
+				(*it)->stop();
+			break;
+		}
+		case SIGHUP:
+		{
+			// Only one successor is started. It takes over from all managers.
+			if(!instances.empty())
+				instances.front()->reload();
 			break;
 		}
 	}
@@ -60,14 +129,48 @@ void Fastcgipp::ManagerPar::setupSignals()
 	sigaction(SIGPIPE, &sigAction, NULL);
 	sigaction(SIGUSR1, &sigAction, NULL);
 	sigaction(SIGTERM, &sigAction, NULL);
+	sigaction(SIGHUP, &sigAction, NULL);
+}
+
+void Fastcgipp::ManagerPar::dumpMetrics(std::ostream& stream)
+{
+	Metrics::print(stream, "requests", "gauge", "Requests currently active.", getRequestsSize());
+	Metrics::print(stream, "tasks", "gauge", "Tasks waiting in the task queue.", tasks.size());
+	Metrics::print(stream, "management_messages", "gauge", "Management messages waiting to be handled.", getMessagesSize());
+	transceiver.dumpMetrics(stream);
+	if(cache.enabled())
+		cache.dumpMetrics(stream);
+}
+
+void Fastcgipp::ManagerPar::reject(Protocol::FullId id, Protocol::ProtocolStatus status, bool kill)
+{
+	using namespace Protocol;
+	Block buffer(transceiver.requestWrite(sizeof(Header)+sizeof(EndRequest)));
+
+	Header& header=*(Header*)buffer.data;
+	header.setVersion(Protocol::version);
+	header.setType(END_REQUEST);
+	header.setRequestId(id.fcgiId);
+	header.setContentLength(sizeof(EndRequest));
+	header.setPaddingLength(0);
+
+	EndRequest& body=*(EndRequest*)(buffer.data+sizeof(Header));
+	body.setAppStatus(0);
+	body.setProtocolStatus(status);
+
+	transceiver.secureWrite(sizeof(Header)+sizeof(EndRequest), id, kill);
+	transceiver.flush();
 }
 
 void Fastcgipp::ManagerPar::localHandler(Protocol::FullId id)
 {
 	using namespace std;
 	using namespace Protocol;
-	Message message(messages.front());
-	messages.pop();
+	Message message;
+	{
+		boost::lock_guard<boost::mutex> tasksLock(tasks);
+		messages.pop(message);
+	}
 	
 	if(!message.type)
 	{
@@ -76,30 +179,47 @@ void Fastcgipp::ManagerPar::localHandler(Protocol::FullId id)
 		{
 			case GET_VALUES:
 			{
-				size_t nameSize;
-				size_t valueSize;
-				const char* name;
-				const char* value;
-				processParamHeader(message.data.get()+sizeof(Header), header.getContentLength(), name, nameSize, value, valueSize);
-				if(nameSize==14 && !memcmp(name, "FCGI_MAX_CONNS", 14))
+				// Every name asked for that we know of is answered in a single record
+				string content;
+				const char* data=message.data.get()+sizeof(Header);
+				const char* const end=data+header.getContentLength();
+				while(data<end)
 				{
-					Block buffer(transceiver.requestWrite(sizeof(maxConnsReply)));
-					memcpy(buffer.data, (const char*)&maxConnsReply, sizeof(maxConnsReply));
-					transceiver.secureWrite(sizeof(maxConnsReply), id, false);
-				}
-				else if(nameSize==13 && !memcmp(name, "FCGI_MAX_REQS", 13))
-				{
-					Block buffer(transceiver.requestWrite(sizeof(maxReqsReply)));
-					memcpy(buffer.data, (const char*)&maxReqsReply, sizeof(maxReqsReply));
-					transceiver.secureWrite(sizeof(maxReqsReply), id, false);
-				}
-				else if(nameSize==15 && !memcmp(name, "FCGI_MPXS_CONNS", 15))
-				{
-					Block buffer(transceiver.requestWrite(sizeof(mpxsConnsReply)));
-					memcpy(buffer.data, (const char*)&mpxsConnsReply, sizeof(mpxsConnsReply));
-					transceiver.secureWrite(sizeof(mpxsConnsReply), id, false);
+					size_t nameSize;
+					size_t valueSize;
+					const char* name;
+					const char* value;
+					processParamHeader(data, end-data, name, nameSize, value, valueSize);
+					data=value+valueSize;
+					if(data>end) break;
+
+					// Unlimited maximums are left out so the other side goes with it's own defaults
+					unsigned int answer;
+					if(nameSize==14 && !memcmp(name, "FCGI_MAX_CONNS", 14) && limits.maxConns)
+						answer=limits.maxConns;
+					else if(nameSize==13 && !memcmp(name, "FCGI_MAX_REQS", 13) && limits.maxReqs)
+						answer=limits.maxReqs;
+					else if(nameSize==15 && !memcmp(name, "FCGI_MPXS_CONNS", 15))
+						answer=limits.multiplex?1:0;
+					else
+						continue;
+
+					char digits[16];
+					const int digitsSize=sprintf(digits, "%u", answer);
+					content+=(char)nameSize;
+					content+=(char)digitsSize;
+					content.append(name, nameSize);
+					content.append(digits, digitsSize);
 				}
 
+				Header sendHeader;
+				sendHeader.setVersion(Protocol::version);
+				sendHeader.setType(GET_VALUES_RESULT);
+				sendHeader.setRequestId(0);
+				sendHeader.setContentLength(content.size());
+				sendHeader.setPaddingLength((chunkSize-content.size()%chunkSize)%chunkSize);
+				transceiver.writeRecord(sendHeader, content.data(), id);
+
 				break;
 			}
 
@@ -0,0 +1,83 @@
+//! \file metrics.cpp Defines member functions for Fastcgipp::Metrics
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <fastcgi++/metrics.hpp>
+
+Fastcgipp::Metrics::Metrics(): connections(0), bytesIn(0)
+{
+	for(unsigned int i=0; i<recordTypes; ++i)
+	{
+		recordsIn[i].store(0, boost::memory_order_relaxed);
+		recordsOut[i].store(0, boost::memory_order_relaxed);
+	}
+}
+
+void Fastcgipp::Metrics::print(std::ostream& stream, const char* name, const char* type, const char* help, uint64_t value)
+{
+	stream << "# HELP fastcgipp_" << name << ' ' << help << "\n# TYPE fastcgipp_" << name << ' ' << type << "\nfastcgipp_" << name << ' ' << value << '\n';
+}
+
+namespace Fastcgipp
+{
+	//! Output a histogram in the Prometheus text format
+	/*!
+	 * @param[in] scale Amount of recorded units per unit output (1000000 for microseconds as seconds)
+	 */
+	static void printHistogram(std::ostream& stream, const char* name, const char* help, const Histogram& histogram, double scale)
+	{
+		stream << "# HELP fastcgipp_" << name << ' ' << help << "\n# TYPE fastcgipp_" << name << " histogram\n";
+		// The bounds are exact powers of two so they can't be rounded in the output
+		const std::streamsize precision=stream.precision(16);
+		uint64_t total=0;
+		for(unsigned int i=0; i<Histogram::buckets; ++i)
+		{
+			total+=histogram.count(i);
+			stream << "fastcgipp_" << name << "_bucket{le=\"";
+			if(i+1<Histogram::buckets)
+				stream << Histogram::bound(i)/scale;
+			else
+				stream << "+Inf";
+			stream << "\"} " << total << '\n';
+		}
+		stream << "fastcgipp_" << name << "_sum " << histogram.sum()/scale << '\n';
+		stream << "fastcgipp_" << name << "_count " << total << '\n';
+		stream.precision(precision);
+	}
+
+	//! Output a counter per record type in the Prometheus text format
+	static void printRecords(std::ostream& stream, const char* name, const char* help, const boost::atomic<uint64_t>* records)
+	{
+		stream << "# HELP fastcgipp_" << name << ' ' << help << "\n# TYPE fastcgipp_" << name << " counter\n";
+		for(unsigned int i=0; i<Metrics::recordTypes; ++i)
+			stream << "fastcgipp_" << name << "{type=\"" << Protocol::recordTypeLabels[i] << "\"} " << records[i].load(boost::memory_order_relaxed) << '\n';
+	}
+}
+
+void Fastcgipp::Metrics::dump(std::ostream& stream) const
+{
+	print(stream, "connections_accepted_total", "counter", "Connections accepted.", connections.load(boost::memory_order_relaxed));
+	print(stream, "received_bytes_total", "counter", "Bytes received.", bytesIn.load(boost::memory_order_relaxed));
+	printRecords(stream, "records_received_total", "Records received by type.", recordsIn);
+	printRecords(stream, "records_sent_total", "Records queued for transmission by type.", recordsOut);
+	printHistogram(stream, "transmit_writes", "Write system calls per transmission of the write buffer.", transmitWrites, 1);
+	printHistogram(stream, "task_latency_seconds", "Time requests wait in the task queue.", taskLatency, 1000000);
+	printHistogram(stream, "response_seconds", "Time spent generating the response of each request.", responseTime, 1000000);
+}
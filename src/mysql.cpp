@@ -20,61 +20,190 @@
 
 
 #include <asql/mysql.hpp>
+#include <mysql/errmsg.h>
 #include <utf8_codecvt.hpp>
 #include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <strings.h>
 
-void ASql::MySQL::Connection::connect(const char* host, const char* user, const char* passwd, const char* db, unsigned int port, const char* unix_socket, unsigned long client_flag, const char* const charset)
+namespace
 {
-	if(m_initialized)
+	//! True if the character before position is the end of a VALUES keyword
+	bool valuesBefore(const std::string& query, size_t position)
+	{
+		while(position && std::isspace((unsigned char)query[position-1]))
+			--position;
+		if(position<6 || strncasecmp(query.data()+position-6, "VALUES", 6))
+			return false;
+		return position==6 || !(std::isalnum((unsigned char)query[position-7]) || query[position-7]=='_');
+	}
+
+	//! Find the single parenthesised VALUES row of an INSERT/REPLACE query
+	/** 
+	 * \param[in] query Query with '?' placeholders.
+	 * \param[out] start Position of the opening parenthesis.
+	 * \param[out] end Position following the closing parenthesis.
+	 *
+	 * \return False unless there is exactly one such row and all the placeholders are in it.
+	 */
+	bool findValuesRow(const std::string& query, size_t& start, size_t& end)
 	{
-		for(unsigned int i=0; i<threads(); ++i)
+		start=end=std::string::npos;
+		char quote=0;
+		int depth=0;
+		unsigned int inside=0;
+		unsigned int outside=0;
+
+		for(size_t i=0; i<query.size(); ++i)
 		{
-			mysql_stmt_close(foundRowsStatement[i]);
-			mysql_close(&m_connection[i]);
+			const char c=query[i];
+			if(quote)
+			{
+				if(c=='\\' && quote!='`') ++i;
+				else if(c==quote) quote=0;
+				continue;
+			}
+
+			const bool inRow = start!=std::string::npos && end==std::string::npos;
+			switch(c)
+			{
+				case '\'':
+				case '"':
+				case '`':
+					quote=c;
+					break;
+				case '?':
+					if(inRow) ++inside;
+					else ++outside;
+					break;
+				case '(':
+					if(inRow) ++depth;
+					else if(start==std::string::npos && valuesBefore(query, i))
+					{
+						start=i;
+						depth=1;
+					}
+					break;
+				case ')':
+					if(inRow && !--depth) end=i+1;
+					break;
+			}
 		}
-		m_initialized = false;
+
+		if(end==std::string::npos || !inside || outside)
+			return false;
+
+		for(size_t i=end; i<query.size(); ++i)
+		{
+			if(query[i]==',') return false;
+			if(!std::isspace((unsigned char)query[i])) break;
+		}
+		return true;
 	}
+}
 
+void ASql::MySQL::Connection::connect(const char* host, const char* user, const char* passwd, const char* db, unsigned int port, const char* unix_socket, unsigned long client_flag, const char* const charset)
+{
 	for(unsigned int i=0; i<threads(); ++i)
+		close(i);
+
+	m_parameters.hasHost = host;
+	m_parameters.host = host?host:"";
+	m_parameters.hasUser = user;
+	m_parameters.user = user?user:"";
+	m_parameters.hasPasswd = passwd;
+	m_parameters.passwd = passwd?passwd:"";
+	m_parameters.hasDb = db;
+	m_parameters.db = db?db:"";
+	m_parameters.hasUnixSocket = unix_socket;
+	m_parameters.unixSocket = unix_socket?unix_socket:"";
+	m_parameters.charset = charset;
+	m_parameters.port = port;
+	m_parameters.clientFlag = client_flag;
+
+	for(int i=0; i<std::max(minThreads(), 1); ++i)
+		open(i, false);
+}
+
+void ASql::MySQL::Connection::open(const unsigned int thread, const bool check)
+{
+	if(m_open[thread])
 	{
-		if(!mysql_init(&m_connection[i]))
-			throw Error(&m_connection[i]);
+		if(!check || !mysql_ping(&m_connection[thread]))
+			return;
+		close(thread);
+	}
 
-		if(!mysql_real_connect(&m_connection[i], host, user, passwd, db, port, unix_socket, client_flag))
-			throw Error(&m_connection[i]);
+	MYSQL& connection = m_connection[thread];
+	const Parameters& p = m_parameters;
 
-		if(mysql_set_character_set(&m_connection[i], charset))
-			throw Error(&m_connection[i]);
-		
-		if(mysql_autocommit(&m_connection[i], 0))
-			throw Error(&m_connection[i]);
-		
-		if(!(foundRowsStatement[i] = mysql_stmt_init(&m_connection[i])))
-			throw Error(&m_connection[i]);
+	if(!mysql_init(&connection))
+		throw Error(&connection);
 
-		if(mysql_stmt_prepare(foundRowsStatement[i], "SELECT FOUND_ROWS()", 19))
-			throw Error(foundRowsStatement[i]);
+	if(!mysql_real_connect(&connection, p.hasHost?p.host.c_str():0, p.hasUser?p.user.c_str():0, p.hasPasswd?p.passwd.c_str():0, p.hasDb?p.db.c_str():0, p.port, p.hasUnixSocket?p.unixSocket.c_str():0, p.clientFlag)
+		|| mysql_set_character_set(&connection, p.charset.c_str())
+		|| mysql_autocommit(&connection, 0))
+	{
+		Error error(&connection);
+		mysql_close(&connection);
+		throw error;
+	}
+		
+	if(!(foundRowsStatement[thread] = mysql_stmt_init(&connection)))
+	{
+		Error error(&connection);
+		mysql_close(&connection);
+		throw error;
+	}
 
-		std::memset(&foundRowsBinding[i], 0, sizeof(MYSQL_BIND));
-		foundRowsBinding[i].buffer_type = MYSQL_TYPE_LONGLONG;
-		foundRowsBinding[i].is_unsigned = 1;
+	if(mysql_stmt_prepare(foundRowsStatement[thread], "SELECT FOUND_ROWS()", 19))
+	{
+		Error error(foundRowsStatement[thread]);
+		mysql_close(&connection);
+		throw error;
 	}
 
-	m_initialized = true;
+	std::memset(&foundRowsBinding[thread], 0, sizeof(MYSQL_BIND));
+	foundRowsBinding[thread].buffer_type = MYSQL_TYPE_LONGLONG;
+	foundRowsBinding[thread].is_unsigned = 1;
+
+	m_open[thread] = true;
+	++m_generation[thread];
 }
 
-ASql::MySQL::Connection::~Connection()
+void ASql::MySQL::Connection::close(const unsigned int thread)
 {
-	if(m_initialized)
+	if(m_open[thread])
 	{
-		for(unsigned int i=0; i<threads(); ++i)
-		{
-			mysql_stmt_close(foundRowsStatement[i]);
-			mysql_close(&m_connection[i]);
-		}
+		mysql_stmt_close(foundRowsStatement[thread]);
+		mysql_close(&m_connection[thread]);
+		m_open[thread] = false;
+	}
+}
+
+bool ASql::MySQL::Connection::lost(const ASql::Error& error, bool& retry) const
+{
+	switch(error.erno)
+	{
+		case CR_SERVER_GONE_ERROR:
+			retry = true;
+			return true;
+		case CR_SERVER_LOST:
+		case CR_SERVER_LOST_EXTENDED:
+			retry = false;
+			return true;
+		default:
+			return false;
 	}
 }
 
+ASql::MySQL::Connection::~Connection()
+{
+	for(unsigned int i=0; i<threads(); ++i)
+		close(i);
+}
+
 void ASql::MySQL::Connection::getFoundRows(unsigned long long* const& rows, const unsigned int thread)
 {
 	if(mysql_stmt_bind_param(foundRowsStatement[thread], 0))
@@ -94,12 +223,18 @@ void ASql::MySQL::Connection::getFoundRows(unsigned long long* const& rows, cons
 
 }
 
-void ASql::MySQL::Statement::init(const char* const& queryString, const size_t& queryLength, const Data::Set* const parameterSet, const Data::Set* const resultSet, bool customPlaceholders)
+void ASql::MySQL::Statement::init(const char* const& queryString, const size_t& queryLength, const Data::Set* const parameterSet, const Data::Set* const resultSet, bool customPlaceholders, bool lazy)
 {
 	if(m_initialized)
 	{
 		for(unsigned int i=0; i<connection.threads(); ++i)
-			mysql_stmt_close(stmt[i]);
+		{
+			m_batches[i].close();
+			m_tails[i].close();
+			if(stmt[i]) mysql_stmt_close(stmt[i]);
+			stmt[i]=0;
+			m_generations[i]=0;
+		}
 		m_initialized = false;
 	}
 
@@ -144,30 +279,155 @@ void ASql::MySQL::Statement::init(const char* const& queryString, const size_t&
 		if(inPlaceholder) paramOrder.push_back(std::atoi(intBuffer));
 	}
 	
+	m_query.assign(realQueryString, realQueryLength);
+
 	for(unsigned int i=0; i<connection.threads(); ++i)
 	{
 		m_stop[i]=&ConnectionPar<Statement>::s_false;
-		stmt[i]=mysql_stmt_init(&connection.connection(i));
-		if(!stmt)
-			throw Error(&connection.connection(i));
 
-		if(mysql_stmt_prepare(stmt[i], realQueryString, realQueryLength))
-			throw Error(stmt[i]);
+		m_paramsLayouts[i]=Layout();
+		m_resultsLayouts[i]=Layout();
 
-		if(parameterSet) buildBindings(stmt[i], *parameterSet, paramsConversions[i], paramsBindings[i], paramOrder.size()?&paramOrder:0);
-		if(resultSet) buildBindings(stmt[i], *resultSet, resultsConversions[i], resultsBindings[i]);
+		if(parameterSet)
+		{
+			buildBindings(stmt[i], *parameterSet, paramsConversions[i], paramsBindings[i], paramOrder.size()?&paramOrder:0);
+			buildLayout(*parameterSet, paramsConversions[i], paramOrder.size()?&paramOrder:0, m_paramsLayouts[i]);
+		}
+		if(resultSet)
+		{
+			buildBindings(stmt[i], *resultSet, resultsConversions[i], resultsBindings[i]);
+			buildLayout(*resultSet, resultsConversions[i], 0, m_resultsLayouts[i]);
+		}
 	}
 
 	m_initialized = true;
+
+	if(!lazy)
+		for(unsigned int i=0; i<connection.threads(); ++i)
+			if(connection.isOpen(i)) prepare(i);
+}
+
+void ASql::MySQL::Statement::prepare(const unsigned int thread)
+{
+	m_batches[thread].close();
+	m_tails[thread].close();
+	if(stmt[thread]) mysql_stmt_close(stmt[thread]);
+	m_generations[thread]=0;
+
+	if(!(stmt[thread]=mysql_stmt_init(&connection.connection(thread))))
+		throw Error(&connection.connection(thread));
+
+	if(mysql_stmt_prepare(stmt[thread], m_query.data(), m_query.size()))
+		throw Error(stmt[thread]);
+
+	if(m_prefetchRows) setCursor(thread);
+	if(m_batchRows) prepareBatch(m_batches[thread], m_batchRows, thread);
+
+	m_generations[thread]=connection.generation(thread);
+}
+
+void ASql::MySQL::Statement::setBatchRows(unsigned int rows)
+{
+	m_batchRows = rows<2?0:rows;
+
+	if(m_initialized)
+		for(unsigned int i=0; i<connection.threads(); ++i)
+		{
+			m_batches[i].close();
+			if(m_batchRows && prepared(i)) prepareBatch(m_batches[i], m_batchRows, i);
+		}
+}
+
+void ASql::MySQL::Statement::setPrefetchRows(unsigned long rows)
+{
+	m_prefetchRows=rows;
+
+	if(m_initialized)
+		for(unsigned int i=0; i<connection.threads(); ++i)
+			if(prepared(i)) setCursor(i);
+}
+
+void ASql::MySQL::Statement::setCursor(const unsigned int thread)
+{
+	const unsigned long type = m_prefetchRows?CURSOR_TYPE_READ_ONLY:CURSOR_TYPE_NO_CURSOR;
+	if(mysql_stmt_attr_set(stmt[thread], STMT_ATTR_CURSOR_TYPE, &type))
+		throw Error(stmt[thread]);
+
+	if(m_prefetchRows && mysql_stmt_attr_set(stmt[thread], STMT_ATTR_PREFETCH_ROWS, &m_prefetchRows))
+		throw Error(stmt[thread]);
+}
+
+void ASql::MySQL::Statement::Batch::close()
+{
+	if(stmt) mysql_stmt_close(stmt);
+	stmt=0;
+	rows=0;
+	conversions.clear();
+	bindings.reset();
+	built=false;
+}
+
+void ASql::MySQL::Statement::prepareBatch(Batch& batch, const unsigned int rows, const unsigned int thread)
+{
+	size_t start;
+	size_t end;
+	if(!findValuesRow(m_query, start, end))
+		throw ASql::Error(BatchQueryErrorMsg, -1);
+
+	const std::string row(m_query, start, end-start);
+	const size_t placeholders=std::count(row.begin(), row.end(), '?');
+
+	batch.close();
+	batch.rows=std::min<size_t>(rows, 65535/placeholders);
+
+	std::string query(m_query, 0, end);
+	query.reserve(m_query.size()+(row.size()+1)*(batch.rows-1));
+	for(unsigned int i=1; i<batch.rows; ++i)
+	{
+		query += ',';
+		query += row;
+	}
+	query.append(m_query, end, std::string::npos);
+
+	if(!(batch.stmt=mysql_stmt_init(&connection.connection(thread))))
+		throw Error(&connection.connection(thread));
+
+	if(mysql_stmt_prepare(batch.stmt, query.data(), query.size()))
+		throw Error(batch.stmt);
+}
+
+void ASql::MySQL::Statement::executeBatch(Batch& batch, const Data::SetContainer& parameters, const unsigned int thread)
+{
+	const std::deque<unsigned char>* const order=paramOrder.size()?&paramOrder:0;
+	int offset=0;
+
+	for(unsigned int row=0; row<batch.rows; ++row)
+	{
+		Data::Set& set=*const_cast<Data::Set*>(parameters.pull());
+		if(!batch.built)
+		{
+			buildBindings(batch.stmt, set, batch.conversions, batch.bindings, order, batch.rows);
+			batch.built=true;
+		}
+		bindBindings(set, batch.conversions, batch.bindings, order, offset);
+		offset += order?order->size():set.numberOfSqlElements();
+	}
+
+	for(Data::Conversions::iterator it=batch.conversions.begin(); it!=batch.conversions.end(); ++it)
+		if(!(batch.bindings[it->first].is_null && *batch.bindings[it->first].is_null)) it->second->convertParam();
+	if(mysql_stmt_bind_param(batch.stmt, batch.bindings.get())!=0) throw Error(batch.stmt);
+	if(mysql_stmt_execute(batch.stmt)!=0) throw Error(batch.stmt);
 }
 
 void ASql::MySQL::Statement::executeParameters(const Data::Set* const& parameters, const unsigned int thread)
 {
 	if(parameters)
 	{
-		bindBindings(*const_cast<Data::Set*>(parameters), paramsConversions[thread], paramsBindings[thread], paramOrder.size()?&paramOrder:0);
-		for(Data::Conversions::iterator it=paramsConversions[thread].begin(); it!=paramsConversions[thread].end(); ++it)
-			if(!(paramsBindings[thread][it->first].is_null && *paramsBindings[thread][it->first].is_null)) it->second->convertParam();
+		const Layout& layout=m_paramsLayouts[thread];
+		MYSQL_BIND* const bindings=paramsBindings[thread].get();
+		bindBindings(*const_cast<Data::Set*>(parameters), layout, paramsBindings[thread], paramOrder.size()?&paramOrder:0);
+		for(size_t i=0; i<layout.conversions.size(); ++i)
+			if(layout.conversions[i] && !(bindings[i].is_null && *bindings[i].is_null)) layout.conversions[i]->convertParam();
 		if(mysql_stmt_bind_param(stmt[thread], paramsBindings[thread].get())!=0) throw Error(stmt[thread]);
 	}
 
@@ -176,7 +436,9 @@ void ASql::MySQL::Statement::executeParameters(const Data::Set* const& parameter
 
 bool ASql::MySQL::Statement::executeResult(Data::Set& row, const unsigned int thread)
 {
-	bindBindings(row, resultsConversions[thread], resultsBindings[thread]);
+	const Layout& layout=m_resultsLayouts[thread];
+	MYSQL_BIND* const bindings=resultsBindings[thread].get();
+	bindBindings(row, layout, resultsBindings[thread]);
 	if(mysql_stmt_bind_result(stmt[thread], resultsBindings[thread].get())!=0) throw Error(stmt[thread]);
 	switch (mysql_stmt_fetch(stmt[thread]))
 	{
@@ -185,14 +447,15 @@ bool ASql::MySQL::Statement::executeResult(Data::Set& row, const unsigned int th
 	case MYSQL_NO_DATA:
 		return false;
 	default:
-		for(Data::Conversions::iterator it=resultsConversions[thread].begin(); it!=resultsConversions[thread].end(); ++it)
-			if(!(resultsBindings[thread][it->first].is_null && *resultsBindings[thread][it->first].is_null)) it->second->convertResult();
+		for(size_t i=0; i<layout.conversions.size(); ++i)
+			if(layout.conversions[i] && !(bindings[i].is_null && *bindings[i].is_null)) layout.conversions[i]->convertResult();
 		return true;
 	};
 }
 
 void ASql::MySQL::Statement::execute(const Data::Set* const parameters, Data::SetContainer* const results, unsigned long long int* const insertId, unsigned long long int* const rows, bool docommit, const unsigned int thread)
 {
+	ready(thread);
 	if(*m_stop[thread]) goto end;
 	executeParameters(parameters, thread);
 
@@ -200,10 +463,15 @@ void ASql::MySQL::Statement::execute(const Data::Set* const parameters, Data::Se
 	{
 		Data::SetContainer& res=*results;
 
+		if(m_storeResult)
+		{
+			if(mysql_stmt_store_result(stmt[thread])!=0) throw Error(stmt[thread]);
+			res.reserve(mysql_stmt_num_rows(stmt[thread]));
+		}
+
 		while(1)
 		{{
 			Data::Set& row=res.manufacture();
-			bindBindings(row, resultsConversions[thread], resultsBindings[thread]);
 			if(!executeResult(row, thread))
 			{
 				res.trim();
@@ -239,6 +507,7 @@ end:
 bool ASql::MySQL::Statement::execute(const Data::Set* const parameters, Data::Set& results, bool docommit, const unsigned int thread)
 {
 	bool retval(false);
+	ready(thread);
 	if(*m_stop[thread]) goto end;
 	executeParameters(parameters, thread);
 	if(*m_stop[thread]) goto end;
@@ -255,10 +524,38 @@ end:
 
 void ASql::MySQL::Statement::execute(const Data::SetContainer& parameters, unsigned long long int* rows, bool docommit, const unsigned int thread)
 {
+	ready(thread);
 	if(rows) *rows = 0;
 	
 	parameters.init();
-	for(const Data::Set* set=parameters.pull(); set!=0; set=parameters.pull())
+	if(m_batchRows)
+	{
+		size_t left=0;
+		while(parameters.pull()) ++left;
+		parameters.init();
+
+		Batch& batch=m_batches[thread];
+		Batch& tail=m_tails[thread];
+		while(left && !*m_stop[thread])
+		{
+			if(left==1)
+			{
+				executeParameters(parameters.pull(), thread);
+				if(rows) *rows += mysql_stmt_affected_rows(stmt[thread]);
+				left=0;
+			}
+			else
+			{
+				if(left<batch.rows && tail.rows!=left) prepareBatch(tail, left, thread);
+				Batch& current=left<batch.rows?tail:batch;
+				executeBatch(current, parameters, thread);
+				if(rows) *rows += mysql_stmt_affected_rows(current.stmt);
+				mysql_stmt_reset(current.stmt);
+				left -= current.rows;
+			}
+		}
+	}
+	else for(const Data::Set* set=parameters.pull(); set!=0; set=parameters.pull())
 	{
 		if(*m_stop[thread]) break;
 		executeParameters(set, thread);
@@ -273,13 +570,14 @@ void ASql::MySQL::Statement::execute(const Data::SetContainer& parameters, unsig
 	mysql_stmt_reset(stmt[thread]);
 }
 
-void ASql::MySQL::Statement::buildBindings(MYSQL_STMT* const& stmt, const ASql::Data::Set& set, ASql::Data::Conversions& conversions, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order)
+void ASql::MySQL::Statement::buildBindings(MYSQL_STMT* const& stmt, const ASql::Data::Set& set, ASql::Data::Conversions& conversions, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order, const unsigned int rows)
 {
 	using namespace Data;
 	
 	conversions.clear();
 
-	const int bindSize=order?order->size():set.numberOfSqlElements();
+	const int rowSize=order?order->size():set.numberOfSqlElements();
+	const int bindSize=rowSize*rows;
 	if(!bindSize) return;
 	bindings.reset(new MYSQL_BIND[bindSize]);
 
@@ -287,7 +585,7 @@ void ASql::MySQL::Statement::buildBindings(MYSQL_STMT* const& stmt, const ASql::
 
 	for(int i=0; i<bindSize; ++i)
 	{
-		const unsigned char index = order?(*order)[i]:i;
+		const unsigned char index = order?(*order)[i%rowSize]:i%rowSize;
 		Data::Index element = set.getSqlIndex(index);
 
 		// Handle NULL
@@ -412,28 +710,75 @@ void ASql::MySQL::Statement::buildBindings(MYSQL_STMT* const& stmt, const ASql::
 	}
 }
 
-void ASql::MySQL::Statement::bindBindings(Data::Set& set, Data::Conversions& conversions, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order)
+void ASql::MySQL::Statement::bindBindings(Data::Set& set, Data::Conversions& conversions, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order, const int offset)
 {
 	const int bindSize=order?order->size():set.numberOfSqlElements();
 	for(int i=0; i<bindSize; ++i)
 	{
 		const unsigned char index = order?(*order)[i]:i;
 		Data::Index element = set.getSqlIndex(index);
+		MYSQL_BIND& binding=bindings[offset+i];
 
 		if(element.type >= Data::U_TINY_N)
 		{
-			bindings[i].is_null = (my_bool*)&((Data::NullablePar*)element.data)->nullness;
+			binding.is_null = (my_bool*)&((Data::NullablePar*)element.data)->nullness;
 			element.data = ((Data::NullablePar*)element.data)->getVoid();
 		}
 
-		Data::Conversions::iterator it=conversions.find(i);
+		Data::Conversions::iterator it=conversions.find(offset+i);
 		if(it==conversions.end())
-			bindings[i].buffer=element.data;
+			binding.buffer=element.data;
 		else
 		{
 			it->second->external=element.data;
-			bindings[i].buffer=it->second->getPointer();
+			binding.buffer=it->second->getPointer();
+		}
+	}
+}
+
+void ASql::MySQL::Statement::buildLayout(const Data::Set& set, Data::Conversions& conversions, const std::deque<unsigned char>* order, Layout& layout)
+{
+	layout.build(set, order);
+	layout.conversions.assign(layout.data.size(), (Data::Conversion*)0);
+
+	for(Data::Conversions::iterator it=conversions.begin(); it!=conversions.end(); ++it)
+		if(size_t(it->first)<layout.conversions.size()) layout.conversions[it->first]=it->second.get();
+}
+
+void ASql::MySQL::Statement::bindBindings(Data::Set& set, const Layout& layout, boost::scoped_array<MYSQL_BIND>& bindings, const std::deque<unsigned char>* order)
+{
+	char* const base=layout.base(set);
+	const int bindSize=layout.conversions.size();
+	for(int i=0; i<bindSize; ++i)
+	{
+		MYSQL_BIND& binding=bindings[i];
+		void* data;
+
+		if(base)
+		{
+			if(layout.nullness[i]!=-1)
+				binding.is_null = (my_bool*)(base+layout.nullness[i]);
+			data=base+layout.data[i];
+		}
+		else
+		{
+			Data::Index element = set.getSqlIndex(order?(*order)[i]:i);
+			if(element.type >= Data::U_TINY_N)
+			{
+				binding.is_null = (my_bool*)&((Data::NullablePar*)element.data)->nullness;
+				element.data = ((Data::NullablePar*)element.data)->getVoid();
+			}
+			data=element.data;
 		}
+
+		Data::Conversion* const conversion=layout.conversions[i];
+		if(conversion)
+		{
+			conversion->external=data;
+			binding.buffer=conversion->getPointer();
+		}
+		else
+			binding.buffer=data;
 	}
 }
 
@@ -579,12 +924,17 @@ ASql::MySQL::Error::Error(MYSQL* mysql): ASql::Error(mysql_error(mysql), mysql_e
 ASql::MySQL::Error::Error(MYSQL_STMT* stmt): ASql::Error(mysql_stmt_error(stmt), mysql_stmt_errno(stmt)) { }
 
 const char ASql::MySQL::CodeConversionErrorMsg[]="Error in code conversion to/from MySQL server.";
+const char ASql::MySQL::BatchQueryErrorMsg[]="Batched statements need a single VALUES row holding all the placeholders.";
 
 ASql::MySQL::Statement::~Statement()
 {
 	if(m_initialized)
 	{
 		for(unsigned int i=0; i<connection.threads(); ++i)
-			mysql_stmt_close(stmt[i]);
+		{
+			m_batches[i].close();
+			m_tails[i].close();
+			if(stmt[i]) mysql_stmt_close(stmt[i]);
+		}
 	}
 }
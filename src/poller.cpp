@@ -0,0 +1,226 @@
+//! \file poller.cpp Defines member functions for Fastcgipp::Poller
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <unistd.h>
+#include <errno.h>
+
+#include <fastcgi++/poller.hpp>
+#include <fastcgi++/transceiver.hpp>
+
+void Fastcgipp::Poller::forget(int fd)
+{
+	for(size_t i=0; i<m_ready; ++i)
+		if(m_events[i].fd==fd)
+		{
+			m_events[i].fd=-1;
+			m_events[i].flags=0;
+		}
+}
+
+#if defined (FASTCGIPP_POLLER_EPOLL)
+
+Fastcgipp::Poller::Poller(): m_events(maxEvents), m_ready(0), m_epoll(epoll_create(maxEvents)), m_backendEvents(maxEvents)
+{
+	if(m_epoll<0) throw Exceptions::SocketPoll(errno);
+	// A successor process started by a handoff mustn't inherit it
+	fcntl(m_epoll, F_SETFD, FD_CLOEXEC);
+}
+
+Fastcgipp::Poller::~Poller()
+{
+	close(m_epoll);
+}
+
+void Fastcgipp::Poller::add(int fd)
+{
+	epoll_event event;
+	event.events=EPOLLIN;
+	event.data.fd=fd;
+	if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event)<0 && errno!=EEXIST)
+		throw Exceptions::SocketPoll(errno);
+}
+
+void Fastcgipp::Poller::del(int fd)
+{
+	epoll_event event;
+	epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, &event);
+	forget(fd);
+}
+
+void Fastcgipp::Poller::watchWrite(int fd, bool watch)
+{
+	epoll_event event;
+	event.events=EPOLLIN|(watch?uint32_t(EPOLLOUT):0u);
+	event.data.fd=fd;
+	if(epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &event)<0)
+		throw Exceptions::SocketPoll(errno);
+}
+
+size_t Fastcgipp::Poller::poll(int timeout)
+{
+	int retVal=epoll_wait(m_epoll, &m_backendEvents.front(), maxEvents, timeout);
+	if(retVal<0)
+	{
+		if(errno==EINTR) return m_ready=0;
+		throw Exceptions::SocketPoll(errno);
+	}
+
+	for(int i=0; i<retVal; ++i)
+	{
+		m_events[i].fd=m_backendEvents[i].data.fd;
+		m_events[i].flags=((m_backendEvents[i].events&EPOLLIN)?READ:0)
+			| ((m_backendEvents[i].events&EPOLLHUP)?HANGUP:0)
+			| ((m_backendEvents[i].events&EPOLLERR)?ERROR:0)
+			| ((m_backendEvents[i].events&EPOLLOUT)?WRITE:0);
+	}
+	return m_ready=retVal;
+}
+
+#elif defined (FASTCGIPP_POLLER_KQUEUE)
+
+Fastcgipp::Poller::Poller(): m_events(maxEvents), m_ready(0), m_kqueue(kqueue()), m_backendEvents(maxEvents)
+{
+	if(m_kqueue<0) throw Exceptions::SocketPoll(errno);
+	// A successor process started by a handoff mustn't inherit it
+	fcntl(m_kqueue, F_SETFD, FD_CLOEXEC);
+}
+
+Fastcgipp::Poller::~Poller()
+{
+	close(m_kqueue);
+}
+
+void Fastcgipp::Poller::add(int fd)
+{
+	struct kevent event;
+	EV_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+	if(kevent(m_kqueue, &event, 1, 0, 0, 0)<0)
+		throw Exceptions::SocketPoll(errno);
+}
+
+void Fastcgipp::Poller::del(int fd)
+{
+	struct kevent event;
+	EV_SET(&event, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+	kevent(m_kqueue, &event, 1, 0, 0, 0);
+	forget(fd);
+}
+
+void Fastcgipp::Poller::watchWrite(int fd, bool watch)
+{
+	struct kevent event;
+	EV_SET(&event, fd, EVFILT_WRITE, watch?EV_ADD:EV_DELETE, 0, 0, 0);
+	if(kevent(m_kqueue, &event, 1, 0, 0, 0)<0 && watch)
+		throw Exceptions::SocketPoll(errno);
+}
+
+size_t Fastcgipp::Poller::poll(int timeout)
+{
+	timespec time;
+	time.tv_sec=timeout/1000;
+	time.tv_nsec=(timeout%1000)*1000000;
+
+	int retVal=kevent(m_kqueue, 0, 0, &m_backendEvents.front(), maxEvents, timeout<0?0:&time);
+	if(retVal<0)
+	{
+		if(errno==EINTR) return m_ready=0;
+		throw Exceptions::SocketPoll(errno);
+	}
+
+	for(int i=0; i<retVal; ++i)
+	{
+		m_events[i].fd=m_backendEvents[i].ident;
+		m_events[i].flags=((m_backendEvents[i].filter==EVFILT_READ)?READ:0)
+			| ((m_backendEvents[i].flags&EV_EOF)?HANGUP:0)
+			| ((m_backendEvents[i].flags&EV_ERROR)?ERROR:0)
+			| ((m_backendEvents[i].filter==EVFILT_WRITE)?WRITE:0);
+	}
+	return m_ready=retVal;
+}
+
+#else
+
+Fastcgipp::Poller::Poller(): m_events(maxEvents), m_ready(0) { }
+
+Fastcgipp::Poller::~Poller() { }
+
+void Fastcgipp::Poller::add(int fd)
+{
+	if(fd>=(int)m_positions.size())
+		m_positions.resize(fd+1, -1);
+	if(m_positions[fd]!=-1)
+		return;
+
+	m_positions[fd]=m_pollFds.size();
+	m_pollFds.push_back(pollfd());
+	m_pollFds.back().fd=fd;
+	m_pollFds.back().events=POLLIN;
+	m_pollFds.back().revents=0;
+}
+
+void Fastcgipp::Poller::del(int fd)
+{
+	if(fd>=(int)m_positions.size() || m_positions[fd]==-1)
+		return;
+
+	// Move the last entry into the vacated spot so removal stays constant time
+	const int position=m_positions[fd];
+	m_pollFds[position]=m_pollFds.back();
+	m_positions[m_pollFds[position].fd]=position;
+	m_pollFds.pop_back();
+	m_positions[fd]=-1;
+	forget(fd);
+}
+
+void Fastcgipp::Poller::watchWrite(int fd, bool watch)
+{
+	if(fd>=(int)m_positions.size() || m_positions[fd]==-1)
+		return;
+
+	m_pollFds[m_positions[fd]].events=POLLIN|(watch?POLLOUT:0);
+}
+
+size_t Fastcgipp::Poller::poll(int timeout)
+{
+	int retVal=::poll(&m_pollFds.front(), m_pollFds.size(), timeout);
+	if(retVal<0)
+	{
+		if(errno==EINTR) return m_ready=0;
+		throw Exceptions::SocketPoll(errno);
+	}
+
+	m_ready=0;
+	for(std::vector<pollfd>::iterator it=m_pollFds.begin(); it!=m_pollFds.end() && m_ready<(size_t)retVal && m_ready<maxEvents; ++it)
+	{
+		if(it->revents)
+		{
+			m_events[m_ready].fd=it->fd;
+			m_events[m_ready].flags=((it->revents&POLLIN)?READ:0)
+				| ((it->revents&POLLHUP)?HANGUP:0)
+				| ((it->revents&(POLLERR|POLLNVAL))?ERROR:0)
+				| ((it->revents&POLLOUT)?WRITE:0);
+			++m_ready;
+		}
+	}
+	return m_ready;
+}
+
+#endif
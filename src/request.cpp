@@ -18,15 +18,47 @@
 * along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
 ****************************************************************************/
 
+#include <sstream>
+#include <algorithm>
+
 #include <fastcgi++/request.hpp>
+#include <fastcgi++/manager.hpp>
+
+template Fastcgipp::Request<char>::~Request();
+template Fastcgipp::Request<wchar_t>::~Request();
+template<class charT> Fastcgipp::Request<charT>::~Request()
+{
+	for(std::vector<Timers::Handle>::iterator it=m_timers.begin(); it!=m_timers.end(); ++it)
+		transceiver->timers().cancel(*it);
+}
+
+template Fastcgipp::Timers::Handle Fastcgipp::Request<char>::setTimer(unsigned int milliseconds, const Message& message);
+template Fastcgipp::Timers::Handle Fastcgipp::Request<wchar_t>::setTimer(unsigned int milliseconds, const Message& message);
+template<class charT> Fastcgipp::Timers::Handle Fastcgipp::Request<charT>::setTimer(unsigned int milliseconds, const Message& message)
+{
+	Timers& timers=transceiver->timers();
+	for(std::vector<Timers::Handle>::iterator it=m_timers.begin(); it!=m_timers.end();)
+		if(timers.pending(*it))
+			++it;
+		else
+		{
+			*it=m_timers.back();
+			m_timers.pop_back();
+		}
+
+	m_timers.push_back(timers.add(milliseconds, boost::bind(m_callback, message)));
+	return m_timers.back();
+}
 
 template void Fastcgipp::Request<char>::complete();
 template void Fastcgipp::Request<wchar_t>::complete();
 template<class charT> void Fastcgipp::Request<charT>::complete()
 {
 	using namespace Protocol;
-	out.flush();
-	err.flush();
+	transceiver->metrics().responseTime.record(m_responseTime);
+	// Whatever the output policy held back goes out now along with END_REQUEST
+	out.drain();
+	err.drain();
 
 	Block buffer(transceiver->requestWrite(sizeof(Header)+sizeof(EndRequest)));
 
@@ -72,11 +104,7 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 			return true;
 		}
 
-		{
-			boost::lock_guard<boost::mutex> lock(messages);
-			m_message=messages.front();
-			messages.pop();
-		}
+		messages.pop(m_message);
 
 		if(message().type==0)
 		{
@@ -95,6 +123,11 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 							complete();
 							return true;
 						}
+						if(metricsResponse() || cachedResponse())
+						{
+							complete();
+							return true;
+						}
 						state=IN;
 						break;
 					}
@@ -128,7 +161,7 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 
 						m_environment.clearPostBuffer();
 						state=OUT;
-						if(response())
+						if(timedResponse())
 						{
 							complete();
 							return true;
@@ -153,7 +186,13 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 				}
 			}
 		}
-		else if(response())
+		else if(message().type==Message::TIMEOUT)
+		{
+			timeoutHandler();
+			complete();
+			return true;
+		}
+		else if(timedResponse())
 		{
 			complete();
 			return true;
@@ -168,6 +207,118 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 	return false;
 }
 
+template bool Fastcgipp::Request<char>::timedResponse();
+template bool Fastcgipp::Request<wchar_t>::timedResponse();
+template<class charT> bool Fastcgipp::Request<charT>::timedResponse()
+{
+	const uint64_t start=Metrics::now();
+	try
+	{
+		const bool complete=response();
+		m_responseTime+=Metrics::now()-start;
+		if(complete && m_caching)
+			storeResponse();
+		return complete;
+	}
+	catch(...)
+	{
+		m_responseTime+=Metrics::now()-start;
+		throw;
+	}
+}
+
+template bool Fastcgipp::Request<char>::metricsResponse();
+template bool Fastcgipp::Request<wchar_t>::metricsResponse();
+template<class charT> bool Fastcgipp::Request<charT>::metricsResponse()
+{
+	const std::string& path=manager->getMetricsPath();
+	if(path.empty())
+		return false;
+
+	// The query string is ignored
+	const Http::CharView uri=m_environment.findParam("REQUEST_URI");
+	const char* const end=std::find(uri.begin(), uri.end(), '?');
+	if((size_t)(end-uri.begin())!=path.size() || !std::equal(path.begin(), path.end(), uri.begin()))
+		return false;
+
+	std::ostringstream metrics;
+	metrics << "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+	manager->dumpMetrics(metrics);
+	const std::string text(metrics.str());
+	out.dump(text.data(), text.size());
+	return true;
+}
+
+template bool Fastcgipp::Request<char>::cachedResponse();
+template bool Fastcgipp::Request<wchar_t>::cachedResponse();
+template<class charT> bool Fastcgipp::Request<charT>::cachedResponse()
+{
+	ResponseCache& cache=manager->responseCache();
+	if(!cache.enabled() || m_environment.requestMethod!=Http::HTTP_METHOD_GET)
+		return false;
+
+	std::string key;
+	if(!cacheKey(key))
+		return false;
+
+	ResponseCache::Response response;
+	if(!cache.find(key, response))
+	{
+		m_cacheKey.swap(key);
+		m_capture.limit=cache.getMaxEntrySize();
+		out.setCapture(&m_capture);
+		m_caching=true;
+		return false;
+	}
+
+	// An If-None-Match takes precedence over an If-Modified-Since
+	const bool notModified=m_environment.etag?
+		response.etag && response.etag==m_environment.etag:
+		!response.lastModified.is_not_a_date_time() && !m_environment.ifModifiedSince.is_not_a_date_time() && response.lastModified<=m_environment.ifModifiedSince;
+
+	if(notModified)
+	{
+		cache.notModified();
+		std::ostringstream headers;
+		headers << "Status: 304 Not Modified\r\n";
+		if(response.etag)
+			headers << "ETag: \"" << response.etag << "\"\r\n";
+		headers << "\r\n";
+		const std::string text(headers.str());
+		out.dump(text.data(), text.size());
+	}
+	else
+		transceiver->writeRecords(response.records->data(), response.records->size(), id);
+	return true;
+}
+
+template void Fastcgipp::Request<char>::storeResponse();
+template void Fastcgipp::Request<wchar_t>::storeResponse();
+template<class charT> void Fastcgipp::Request<charT>::storeResponse()
+{
+	// Whatever is still buffered has to be in the copy
+	out.drain();
+	out.setCapture(0);
+	m_caching=false;
+	if(m_capture.abandoned)
+		return;
+
+	boost::shared_ptr<std::string> records(new std::string);
+	records->swap(m_capture.records);
+	m_cached.records=records;
+	manager->responseCache().store(m_cacheKey, m_cached, m_cacheMaxAge);
+}
+
+template void Fastcgipp::Request<char>::setCacheValidators(int etag, const boost::posix_time::ptime& lastModified);
+template void Fastcgipp::Request<wchar_t>::setCacheValidators(int etag, const boost::posix_time::ptime& lastModified);
+template<class charT> void Fastcgipp::Request<charT>::setCacheValidators(int etag, const boost::posix_time::ptime& lastModified)
+{
+	using namespace boost::posix_time;
+	m_cached.etag=etag;
+	// HTTP dates carry no fractions of a second
+	m_cached.lastModified=lastModified.is_special()?lastModified:ptime(lastModified.date(), seconds(lastModified.time_of_day().total_seconds()));
+}
+
 template void Fastcgipp::Request<char>::errorHandler(const std::exception& error);
 template void Fastcgipp::Request<wchar_t>::errorHandler(const std::exception& error);
 template<class charT> void Fastcgipp::Request<charT>::errorHandler(const std::exception& error)
@@ -205,3 +356,23 @@ template<class charT> void Fastcgipp::Request<charT>::bigPostErrorHandler()
 	"</body>"\
 "</html>";
 }
+
+template void Fastcgipp::Request<char>::timeoutHandler();
+template void Fastcgipp::Request<wchar_t>::timeoutHandler();
+template<class charT> void Fastcgipp::Request<charT>::timeoutHandler()
+{
+		out << \
+"Status: 504 Gateway Timeout\n"\
+"Content-Type: text/html; charset=ISO-8859-1\r\n\r\n"\
+"<!DOCTYPE html>"\
+"<html lang='en'>"\
+	"<head>"\
+		"<title>504 Gateway Timeout</title>"\
+	"</head>"\
+	"<body>"\
+		"<h1>504 Gateway Timeout</h1>"\
+	"</body>"\
+"</html>";
+
+		err << "Timed out answering \"http://" << environment().host << environment().requestUri << "\" with a " << environment().requestMethod << " request method.";
+}
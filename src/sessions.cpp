@@ -0,0 +1,467 @@
+//! \file sessions.cpp Defines member functions for the session containers
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+
+#include <cerrno>
+
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fastcgi++/sessions.hpp>
+
+uint64_t Fastcgipp::Http::SessionsPar::now()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec*1000+time.tv_nsec/1000000;
+}
+
+//! Start of the shared memory
+struct Fastcgipp::Http::SharedSessionTable::Header
+{
+	//! Set to magic once the creator has laid out the table
+	volatile uint32_t ready;
+	uint32_t shards;
+	uint64_t capacity;
+	uint64_t valueSize;
+	//! Amount of entries in every shard
+	uint32_t entries;
+	//! Amount of buckets in every shard. A power of two.
+	uint32_t buckets;
+	//! Size in bytes of an entry including the session data
+	uint64_t entrySize;
+	//! Offsets from the start of the memory at which the shards, buckets and entries start
+	uint64_t shardOffset;
+	uint64_t bucketOffset;
+	uint64_t entryOffset;
+};
+
+//! A part of the sessions with a lock of it's own
+struct Fastcgipp::Http::SharedSessionTable::Shard
+{
+	pthread_mutex_t mutex;
+	//! First entry not in use. They are linked through Entry::next.
+	uint32_t free;
+	//! Least recently used session
+	uint32_t oldest;
+	//! Most recently used session
+	uint32_t newest;
+	//! Amount of sessions in the shard
+	uint32_t size;
+};
+
+//! A session. It's data follows it directly.
+struct Fastcgipp::Http::SharedSessionTable::Entry
+{
+	char id[SessionId::size];
+	//! Next entry in the same bucket or the free list
+	uint32_t next;
+	//! Session used just before this one
+	uint32_t previous;
+	//! Session used just after this one
+	uint32_t later;
+	//! Time the session expires at (see now())
+	uint64_t expires;
+};
+
+namespace Fastcgipp
+{
+	namespace Http
+	{
+		//! Value of Header::ready once the table is laid out
+		static const uint32_t sharedSessionsMagic=0x46435353;
+
+		//! Round a size up to a multiple of an alignment
+		static size_t align(size_t size, size_t alignment) { return (size+alignment-1)/alignment*alignment; }
+	}
+}
+
+//! Holds the lock of a shard, clearing the shard should whoever held it before have died
+class Fastcgipp::Http::SharedSessionTable::Lock
+{
+public:
+	Lock(SharedSessionTable& table, unsigned int index): m_mutex(table.shard(index).mutex)
+	{
+		const int result=pthread_mutex_lock(&m_mutex);
+#if defined (HAVE_PTHREAD_MUTEXATTR_SETROBUST)
+		if(result==EOWNERDEAD)
+		{
+			// Whatever the owner was doing may have been left half done
+			table.clear(index);
+			pthread_mutex_consistent(&m_mutex);
+		}
+#endif
+	}
+	~Lock() { pthread_mutex_unlock(&m_mutex); }
+private:
+	pthread_mutex_t& m_mutex;
+};
+
+Fastcgipp::Http::SharedSessionTable::SharedSessionTable(size_t capacity, unsigned int keepAlive, size_t valueSize, const char* name, unsigned int shards):
+	m_keepAlive(keepAlive),
+	m_region(0),
+	m_regionSize(0),
+	m_header(0)
+{
+	if(!shards)
+		shards=1;
+	if(capacity<shards)
+		capacity=shards;
+	const size_t entries=(capacity+shards-1)/shards;
+	size_t buckets=1;
+	while(buckets<entries)
+		buckets<<=1;
+
+	// Shards are kept on cache lines of their own
+	const size_t shardOffset=align(sizeof(Header), 64);
+	const size_t bucketOffset=shardOffset+shards*align(sizeof(Shard), 64);
+	const size_t entryOffset=align(bucketOffset+shards*buckets*sizeof(uint32_t), 64);
+	const size_t entrySize=align(sizeof(Entry)+valueSize, 16);
+	m_regionSize=entryOffset+shards*entries*entrySize;
+
+	int fd=-1;
+	bool create=true;
+	if(name)
+	{
+		fd=shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+		if(fd<0 && errno==EEXIST)
+		{
+			create=false;
+			fd=shm_open(name, O_RDWR, 0600);
+		}
+		if(fd<0)
+			throw Exceptions::CodedException("Unable to open the shared memory for sessions.", errno);
+
+		if(create)
+		{
+			if(ftruncate(fd, m_regionSize)<0)
+			{
+				const int erno=errno;
+				close(fd);
+				shm_unlink(name);
+				throw Exceptions::CodedException("Unable to size the shared memory for sessions.", erno);
+			}
+		}
+		else
+		{
+			// The creator may not have sized it yet
+			struct stat status;
+			for(unsigned int i=0; fstat(fd, &status)==0 && !status.st_size && i<5000; ++i)
+				usleep(1000);
+			if((size_t)status.st_size!=m_regionSize)
+			{
+				close(fd);
+				throw Exceptions::CodedException("The shared memory for sessions was set up for a different capacity, size of session data or amount of shards.", 0);
+			}
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	void* const region=mmap(0, m_regionSize, PROT_READ|PROT_WRITE, fd<0?MAP_SHARED|MAP_ANONYMOUS:MAP_SHARED, fd, 0);
+	const int erno=errno;
+	if(fd>=0)
+		close(fd);
+	if(region==MAP_FAILED)
+		throw Exceptions::CodedException("Unable to map the shared memory for sessions.", erno);
+	m_region=(char*)region;
+	m_header=(Header*)m_region;
+
+	if(create)
+	{
+		m_header->shards=shards;
+		m_header->capacity=capacity;
+		m_header->valueSize=valueSize;
+		m_header->entries=entries;
+		m_header->buckets=buckets;
+		m_header->entrySize=entrySize;
+		m_header->shardOffset=shardOffset;
+		m_header->bucketOffset=bucketOffset;
+		m_header->entryOffset=entryOffset;
+		initialize();
+		return;
+	}
+
+	for(unsigned int i=0; m_header->ready!=sharedSessionsMagic; ++i)
+	{
+		if(i==5000)
+		{
+			munmap(m_region, m_regionSize);
+			throw Exceptions::CodedException("Timed out waiting for the shared memory for sessions to be set up.", 0);
+		}
+		usleep(1000);
+	}
+	__sync_synchronize();
+
+	if(m_header->shards!=shards || m_header->capacity!=capacity || m_header->valueSize!=valueSize)
+	{
+		munmap(m_region, m_regionSize);
+		throw Exceptions::CodedException("The shared memory for sessions was set up for a different capacity, size of session data or amount of shards.", 0);
+	}
+}
+
+Fastcgipp::Http::SharedSessionTable::~SharedSessionTable()
+{
+	munmap(m_region, m_regionSize);
+}
+
+bool Fastcgipp::Http::SharedSessionTable::unlink(const char* name)
+{
+	return shm_unlink(name)==0;
+}
+
+Fastcgipp::Http::SharedSessionTable::Shard& Fastcgipp::Http::SharedSessionTable::shard(unsigned int index)
+{
+	return *(Shard*)(m_region+m_header->shardOffset+index*align(sizeof(Shard), 64));
+}
+
+uint32_t* Fastcgipp::Http::SharedSessionTable::buckets(unsigned int index)
+{
+	return (uint32_t*)(m_region+m_header->bucketOffset)+(size_t)index*m_header->buckets;
+}
+
+Fastcgipp::Http::SharedSessionTable::Entry& Fastcgipp::Http::SharedSessionTable::entry(unsigned int index, uint32_t position)
+{
+	return *(Entry*)(m_region+m_header->entryOffset+((size_t)index*m_header->entries+position)*m_header->entrySize);
+}
+
+uint32_t Fastcgipp::Http::SharedSessionTable::bucket(const char* id) const
+{
+	// The same as SessionId::hash()
+	size_t hash;
+	std::memcpy(&hash, id, sizeof(hash));
+	return hash&(m_header->buckets-1);
+}
+
+char* Fastcgipp::Http::SharedSessionTable::value(Entry& entry)
+{
+	return (char*)&entry+sizeof(Entry);
+}
+
+void Fastcgipp::Http::SharedSessionTable::initialize()
+{
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+#if defined (HAVE_PTHREAD_MUTEXATTR_SETROBUST)
+	pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+#endif
+	for(unsigned int i=0; i<m_header->shards; ++i)
+	{
+		pthread_mutex_init(&shard(i).mutex, &attributes);
+		clear(i);
+	}
+	pthread_mutexattr_destroy(&attributes);
+
+	__sync_synchronize();
+	m_header->ready=sharedSessionsMagic;
+}
+
+void Fastcgipp::Http::SharedSessionTable::clear(unsigned int index)
+{
+	Shard& shard=this->shard(index);
+	uint32_t* const buckets=this->buckets(index);
+	for(uint32_t i=0; i<m_header->buckets; ++i)
+		buckets[i]=none;
+	for(uint32_t i=0; i<m_header->entries; ++i)
+		entry(index, i).next=i+1<m_header->entries?i+1:none;
+	shard.free=0;
+	shard.oldest=none;
+	shard.newest=none;
+	shard.size=0;
+}
+
+uint32_t Fastcgipp::Http::SharedSessionTable::lookup(unsigned int index, const SessionId& id)
+{
+	uint32_t position=buckets(index)[bucket(id.getInternalPointer())];
+	while(position!=none)
+	{
+		Entry& entry=this->entry(index, position);
+		if(!std::memcmp(entry.id, id.getInternalPointer(), SessionId::size))
+			return position;
+		position=entry.next;
+	}
+	return none;
+}
+
+void Fastcgipp::Http::SharedSessionTable::remove(unsigned int index, uint32_t position)
+{
+	Shard& shard=this->shard(index);
+	Entry& entry=this->entry(index, position);
+
+	uint32_t* link=&buckets(index)[bucket(entry.id)];
+	while(*link!=position)
+		link=&this->entry(index, *link).next;
+	*link=entry.next;
+
+	if(entry.previous!=none)
+		this->entry(index, entry.previous).later=entry.later;
+	else
+		shard.oldest=entry.later;
+	if(entry.later!=none)
+		this->entry(index, entry.later).previous=entry.previous;
+	else
+		shard.newest=entry.previous;
+
+	entry.next=shard.free;
+	shard.free=position;
+	--shard.size;
+}
+
+void Fastcgipp::Http::SharedSessionTable::touch(unsigned int index, uint32_t position, uint64_t now)
+{
+	Shard& shard=this->shard(index);
+	Entry& entry=this->entry(index, position);
+	entry.expires=now+(uint64_t)m_keepAlive*1000;
+	if(shard.newest==position)
+		return;
+
+	// Out of the list
+	if(entry.previous!=none)
+		this->entry(index, entry.previous).later=entry.later;
+	else
+		shard.oldest=entry.later;
+	this->entry(index, entry.later).previous=entry.previous;
+
+	// And in at the back
+	entry.previous=shard.newest;
+	entry.later=none;
+	this->entry(index, shard.newest).later=position;
+	shard.newest=position;
+}
+
+void Fastcgipp::Http::SharedSessionTable::expire(unsigned int index, uint64_t now)
+{
+	Shard& shard=this->shard(index);
+	while(shard.oldest!=none && entry(index, shard.oldest).expires<=now)
+		remove(index, shard.oldest);
+}
+
+bool Fastcgipp::Http::SharedSessionTable::find(const SessionId& id, void* value)
+{
+	const unsigned int index=SessionsPar::shard(id, m_header->shards);
+	const uint64_t current=now();
+	Lock lock(*this, index);
+	expire(index, current);
+
+	const uint32_t position=lookup(index, id);
+	if(position==none)
+		return false;
+	std::memcpy(value, this->value(entry(index, position)), m_header->valueSize);
+	touch(index, position, current);
+	return true;
+}
+
+bool Fastcgipp::Http::SharedSessionTable::update(const SessionId& id, const void* value)
+{
+	const unsigned int index=SessionsPar::shard(id, m_header->shards);
+	const uint64_t current=now();
+	Lock lock(*this, index);
+	expire(index, current);
+
+	const uint32_t position=lookup(index, id);
+	if(position==none)
+		return false;
+	std::memcpy(this->value(entry(index, position)), value, m_header->valueSize);
+	touch(index, position, current);
+	return true;
+}
+
+void Fastcgipp::Http::SharedSessionTable::generate(SessionId& id, const void* value)
+{
+	while(1)
+	{
+		const unsigned int index=SessionsPar::shard(id, m_header->shards);
+		const uint64_t current=now();
+		Lock lock(*this, index);
+		expire(index, current);
+
+		if(lookup(index, id)!=none)
+		{
+			id=SessionId();
+			continue;
+		}
+
+		Shard& shard=this->shard(index);
+		if(shard.free==none)
+			// Full so the least recently used session makes room
+			remove(index, shard.oldest);
+
+		const uint32_t position=shard.free;
+		Entry& entry=this->entry(index, position);
+		shard.free=entry.next;
+
+		std::memcpy(entry.id, id.getInternalPointer(), SessionId::size);
+		std::memcpy(this->value(entry), value, m_header->valueSize);
+		entry.expires=current+(uint64_t)m_keepAlive*1000;
+
+		uint32_t& head=buckets(index)[bucket(id.getInternalPointer())];
+		entry.next=head;
+		head=position;
+
+		entry.previous=shard.newest;
+		entry.later=none;
+		if(shard.newest!=none)
+			this->entry(index, shard.newest).later=position;
+		else
+			shard.oldest=position;
+		shard.newest=position;
+		++shard.size;
+		return;
+	}
+}
+
+bool Fastcgipp::Http::SharedSessionTable::erase(const SessionId& id)
+{
+	const unsigned int index=SessionsPar::shard(id, m_header->shards);
+	Lock lock(*this, index);
+	const uint32_t position=lookup(index, id);
+	if(position==none)
+		return false;
+	remove(index, position);
+	return true;
+}
+
+size_t Fastcgipp::Http::SharedSessionTable::size()
+{
+	const uint64_t current=now();
+	size_t total=0;
+	for(unsigned int i=0; i<m_header->shards; ++i)
+	{
+		Lock lock(*this, i);
+		expire(i, current);
+		total+=shard(i).size;
+	}
+	return total;
+}
+
+void Fastcgipp::Http::SharedSessionTable::cleanup()
+{
+	const uint64_t current=now();
+	for(unsigned int i=0; i<m_header->shards; ++i)
+	{
+		Lock lock(*this, i);
+		expire(i, current);
+	}
+}
@@ -0,0 +1,89 @@
+//! \file sharded.cpp Defines member functions for Fastcgipp::ShardedManagerPar
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <fastcgi++/sharded.hpp>
+
+#if defined (HAVE_PTHREAD_SETAFFINITY_NP)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+int Fastcgipp::ShardedManagerPar::reusePort(int fd)
+{
+#if defined (SO_REUSEPORT)
+	sockaddr_storage address;
+	socklen_t addressSize=sizeof(address);
+	if(getsockname(fd, (sockaddr*)&address, &addressSize)<0)
+		return -1;
+	if(address.ss_family!=AF_INET && address.ss_family!=AF_INET6)
+		return -1;
+
+	// The existing socket has to allow reuse as well or the bind below fails
+	const int on=1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+	// A successor process started by a handoff is only passed the listening socket of the first shard
+#if defined (SOCK_CLOEXEC)
+	const int newFd=::socket(address.ss_family, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if(newFd<0)
+		return -1;
+#else
+	const int newFd=::socket(address.ss_family, SOCK_STREAM, 0);
+	if(newFd<0)
+		return -1;
+	fcntl(newFd, F_SETFD, FD_CLOEXEC);
+#endif
+
+	if(setsockopt(newFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))<0
+			|| setsockopt(newFd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))<0
+			|| bind(newFd, (sockaddr*)&address, addressSize)<0
+			|| listen(newFd, SOMAXCONN)<0)
+	{
+		close(newFd);
+		return -1;
+	}
+	return newFd;
+#else
+	return -1;
+#endif
+}
+
+bool Fastcgipp::ShardedManagerPar::pin(unsigned int cpu)
+{
+#if defined (HAVE_PTHREAD_SETAFFINITY_NP)
+	const unsigned int cpus=boost::thread::hardware_concurrency();
+	if(!cpus)
+		return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu%cpus, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set)==0;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,267 @@
+//! \file timers.cpp Defines member functions for Fastcgipp::Timers
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <climits>
+
+#include <fastcgi++/timers.hpp>
+
+Fastcgipp::Timers::Timers(): m_free(0), m_expired(0), m_tick(now()), m_wakeAt(0), m_size(0)
+{
+	for(unsigned int level=0; level<levels; ++level)
+	{
+		m_occupied[level]=0;
+		for(unsigned int slot=0; slot<slots; ++slot)
+			m_slots[level][slot]=0;
+	}
+}
+
+Fastcgipp::Timers::Node* Fastcgipp::Timers::acquire()
+{
+	if(!m_free)
+	{
+		m_nodes.push_back(Node());
+		return &m_nodes.back();
+	}
+	Node* node=m_free;
+	m_free=node->next;
+	node->next=0;
+	return node;
+}
+
+void Fastcgipp::Timers::release(Node* node)
+{
+	// Nothing the callback was bound to is held on to
+	node->callback.clear();
+	++node->sequence;
+	node->next=m_free;
+	m_free=node;
+	--m_size;
+}
+
+void Fastcgipp::Timers::link(Node* node, Node** list)
+{
+	node->next=*list;
+	if(node->next)
+		node->next->previous=&node->next;
+	node->previous=list;
+	node->list=list;
+	*list=node;
+}
+
+void Fastcgipp::Timers::unlink(Node* node)
+{
+	*node->previous=node->next;
+	if(node->next)
+		node->next->previous=node->previous;
+
+	if(!*node->list && node->list!=&m_expired)
+	{
+		const size_t index=node->list-&m_slots[0][0];
+		m_occupied[index/slots]&=~((uint64_t)1<<(index%slots));
+	}
+
+	node->next=0;
+	node->previous=0;
+	node->list=0;
+}
+
+void Fastcgipp::Timers::insert(Node* node)
+{
+	const uint64_t delta=node->expires>m_tick?node->expires-m_tick:0;
+
+	unsigned int level=0;
+	unsigned int slot;
+	while(level<levels-1 && delta>=(uint64_t)1<<((level+1)*slotBits))
+		++level;
+
+	if(level==0)
+		// Anything overdue goes in the slot processed next
+		slot=(delta?node->expires:m_tick)&(slots-1);
+	else if(delta>=(uint64_t)1<<(levels*slotBits))
+		// Beyond the reach of the wheel. It goes in the furthest slot and round again from there.
+		slot=((m_tick>>(level*slotBits))+slots-1)&(slots-1);
+	else
+		slot=(node->expires>>(level*slotBits))&(slots-1);
+
+	link(node, &m_slots[level][slot]);
+	m_occupied[level]|=(uint64_t)1<<slot;
+}
+
+void Fastcgipp::Timers::cascade(unsigned int level, unsigned int slot)
+{
+	Node* node=m_slots[level][slot];
+	m_slots[level][slot]=0;
+	m_occupied[level]&=~((uint64_t)1<<slot);
+
+	while(node)
+	{
+		Node* const next=node->next;
+		node->next=0;
+		node->previous=0;
+		insert(node);
+		node=next;
+	}
+}
+
+uint64_t Fastcgipp::Timers::next() const
+{
+	uint64_t earliest=~(uint64_t)0;
+	for(unsigned int level=0; level<levels; ++level)
+	{
+		if(!m_occupied[level])
+			continue;
+
+		const unsigned int shift=level*slotBits;
+		// The first tick from now on at which this level comes round to a new slot
+		const uint64_t first=((m_tick+((uint64_t)1<<shift)-1)>>shift)<<shift;
+		const unsigned int position=(first>>shift)&(slots-1);
+		const uint64_t rotated=position?(m_occupied[level]>>position)|(m_occupied[level]<<(slots-position)):m_occupied[level];
+		const uint64_t tick=first+((uint64_t)__builtin_ctzll(rotated)<<shift);
+		if(tick<earliest)
+			earliest=tick;
+	}
+	return earliest;
+}
+
+void Fastcgipp::Timers::advance(uint64_t now)
+{
+	while(m_tick<=now)
+	{
+		for(unsigned int level=levels-1; level>0; --level)
+			if(!(m_tick&(((uint64_t)1<<(level*slotBits))-1)))
+				cascade(level, (m_tick>>(level*slotBits))&(slots-1));
+
+		Node*& slot=m_slots[0][m_tick&(slots-1)];
+		while(slot)
+		{
+			Node* const node=slot;
+			unlink(node);
+			link(node, &m_expired);
+		}
+
+		// Empty slots are skipped over entirely
+		const uint64_t upcoming=(++m_tick, next());
+		m_tick=upcoming>now?now+1:upcoming;
+	}
+}
+
+Fastcgipp::Timers::Handle Fastcgipp::Timers::add(uint64_t milliseconds, const Callback& callback)
+{
+	Handle handle;
+	bool wake;
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		Node* node=acquire();
+		node->expires=now()+milliseconds;
+		node->callback=callback;
+		insert(node);
+		++m_size;
+		handle=Handle(node, node->sequence);
+
+		wake=node->expires<m_wakeAt;
+		if(wake)
+			m_wakeAt=node->expires;
+	}
+	if(wake && m_wake)
+		m_wake();
+	return handle;
+}
+
+bool Fastcgipp::Timers::cancel(const Handle& handle)
+{
+	if(!handle.node)
+		return false;
+
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		if(handle.node->sequence!=handle.sequence)
+			return false;
+		if(handle.node->list)
+		{
+			unlink(handle.node);
+			release(handle.node);
+			return true;
+		}
+	}
+
+	// The callback is being called right now. run() holds the lock until it returns.
+	boost::lock_guard<boost::recursive_mutex> runLock(m_runMutex);
+	return false;
+}
+
+bool Fastcgipp::Timers::pending(const Handle& handle)
+{
+	if(!handle.node)
+		return false;
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return handle.node->sequence==handle.sequence && handle.node->list;
+}
+
+size_t Fastcgipp::Timers::run()
+{
+	boost::lock_guard<boost::recursive_mutex> runLock(m_runMutex);
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	m_wakeAt=0;
+	advance(now());
+
+	size_t count=0;
+	while(m_expired)
+	{
+		Node* const node=m_expired;
+		unlink(node);
+		Callback callback;
+		callback.swap(node->callback);
+		lock.unlock();
+		try
+		{
+			callback();
+		}
+		catch(...)
+		{
+			lock.lock();
+			release(node);
+			throw;
+		}
+		lock.lock();
+		release(node);
+		++count;
+	}
+	return count;
+}
+
+int Fastcgipp::Timers::timeout()
+{
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if(m_expired)
+	{
+		m_wakeAt=0;
+		return 0;
+	}
+
+	m_wakeAt=next();
+	if(m_wakeAt==~(uint64_t)0)
+		return -1;
+
+	const uint64_t current=now();
+	if(m_wakeAt<=current)
+		return 0;
+	return m_wakeAt-current>INT_MAX?INT_MAX:m_wakeAt-current;
+}
@@ -19,201 +19,1034 @@
 ****************************************************************************/
 
 
+#include <cstring>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
 #include <fastcgi++/transceiver.hpp>
 
-int Fastcgipp::Transceiver::transmit()
+#if defined (HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#endif
+#if defined (HAVE_SYS_EVENTFD_H)
+#include <sys/eventfd.h>
+#endif
+
+void Fastcgipp::Transceiver::transmit()
 {
+	iovec iov[maxIovecs];
+	int iovCount;
+	uint64_t writes=0;
+
+	buffer.rewind();
 	while(1)
 	{{
-		Buffer::SendBlock sendBlock(buffer.requestRead());
-		if(sendBlock.size)
+		int file;
+		off_t offset;
+		const int fd=buffer.requestRead(iov, maxIovecs, iovCount, file, offset);
+		if(fd<0)
+			break;
+
+		size_t size=0;
+		for(int i=0; i<iovCount; ++i)
+			size+=iov[i].iov_len;
+
+		ssize_t sent=file<0?writev(fd, iov, iovCount):sendFile(fd, file, offset, size);
+		++stats.writes;
+		++writes;
+		if(sent<0)
 		{
-			ssize_t sent = write(sendBlock.fd, sendBlock.data, sendBlock.size);
-			if(sent<0)
+			if(errno==EPIPE || errno==EBADF || errno==ECONNRESET)
 			{
-				if(errno==EPIPE || errno==EBADF)
-				{
-					freeFd(sendBlock.fd);
-					sent=sendBlock.size;
-				}
-				else if(errno!=EAGAIN) throw Exceptions::SocketWrite(sendBlock.fd, errno);
+				// Nothing more is getting through to this connection
+				buffer.closeFd(fd);
+				buffer.discard(fd);
+				continue;
 			}
-
-			buffer.freeRead(sent);
-			if(sent!=(ssize_t)sendBlock.size)
-				break;
+			else if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR) sent=0;
+			else throw Exceptions::SocketWrite(fd, errno);
 		}
 		else
-			break;
+			stats.bytes+=sent;
+
+		stats.frames+=buffer.freeRead(sent);
 	}}
+	buffer.reclaim();
+	if(writes)
+		m_metrics.transmitWrites.record(writes);
 
-	return buffer.empty();
+	if(buffer.takeWake())
+		wake();
 }
 
-void Fastcgipp::Transceiver::Buffer::secureWrite(size_t size, Protocol::FullId id, bool kill)
+void Fastcgipp::Transceiver::drain(boost::unique_lock<boost::mutex>& lock, int fd)
 {
-	writeIt->end+=size;
-	if(minBlockSize>(writeIt->data.get()+Chunk::size-writeIt->end) && ++writeIt==chunks.end())
+	while(buffer.full(fd) || buffer.connectionThrottled(fd))
 	{
-		chunks.push_back(Chunk());
-		--writeIt;
+		buffer.unblock(fd);
+		transmit();
+		if(!buffer.full(fd) && !buffer.connectionThrottled(fd))
+			break;
+
+		lock.unlock();
+		pollfd pollFd;
+		pollFd.fd=fd;
+		pollFd.events=POLLOUT;
+		pollFd.revents=0;
+		const int result=::poll(&pollFd, 1, -1);
+		lock.lock();
+
+		// Should the connection have gone bad handler() will deal with it
+		if(result<0 || pollFd.revents&(POLLERR|POLLHUP|POLLNVAL))
+			break;
 	}
-	frames.push(Frame(size, kill, id));
 }
 
-bool Fastcgipp::Transceiver::handler()
+bool Fastcgipp::Transceiver::Buffer::secureWrite(size_t size, Protocol::FullId id, bool kill)
 {
-	using namespace std;
-	using namespace Protocol;
-
-	bool transmitEmpty=transmit();
-
-	int retVal=poll(&pollFds.front(), pollFds.size(), 0);
-	if(retVal==0)
+	frames.push_back(Frame(size, kill, id, writeChunk->end));
+	writeChunk->end+=size;
+	account(id.fd, size, 0);
+	if(minBlockSize>(size_t)(writeChunk->limit-writeChunk->end))
 	{
-		if(transmitEmpty) return true;
-		else return false;
+		if(!writeChunk->next)
+		{
+			lastChunk->next=acquire();
+			lastChunk=lastChunk->next;
+		}
+		writeChunk=writeChunk->next;
+		return true;
 	}
-	if(retVal<0) throw Exceptions::SocketPoll(errno);
-	
-	std::vector<pollfd>::iterator pollFd = find_if(pollFds.begin(), pollFds.end(), reventsZero);
+	return false;
+}
+
+Fastcgipp::Transceiver::Buffer::Buffer():
+	m_buffered(0),
+	m_throttled(false),
+	m_throttles(0),
+	m_wake(false),
+	m_ended(false),
+	scan(0),
+	freeChunks(0),
+	freeCount(0),
+	region(0),
+	regionSize(0),
+	regionStart(0),
+	regionEnd(0)
+{
+	readChunk=writeChunk=lastChunk=acquire();
+	pRead=readChunk->data();
+}
 
-	if(pollFd->revents & (POLLHUP|POLLERR|POLLNVAL) )
+Fastcgipp::Transceiver::Buffer::~Buffer()
+{
+	while(readChunk)
 	{
-		fdBuffers.erase(pollFd->fd);
-		pollFds.erase(pollFd);
-		return false;
+		Chunk* chunk=readChunk;
+		readChunk=chunk->next;
+		release(chunk);
 	}
-	
-	int fd=pollFd->fd;
-	if(fd==socket)
-	{
-		sockaddr_un addr;
-		socklen_t addrlen=sizeof(sockaddr_un);
-		fd=accept(fd, (sockaddr*)&addr, &addrlen);
-		fcntl(fd, F_SETFL, (fcntl(fd, F_GETFL)|O_NONBLOCK)^O_NONBLOCK);
-		
-		pollFds.push_back(pollfd());
-		pollFds.back().fd = fd;
-		pollFds.back().events = POLLIN|POLLHUP|POLLERR|POLLNVAL;
-
-		Message& messageBuffer=fdBuffers[fd].messageBuffer;
-		messageBuffer.size=0;
-		messageBuffer.type=0;
-	}
-	else if(fd==wakeUpFdIn)
-	{
-		char x;
-		read(wakeUpFdIn, &x, 1);
+	freeStorage();
+}
+
+bool Fastcgipp::Transceiver::Buffer::setStorage(const Storage& storage)
+{
+	if(!frames.empty())
 		return false;
+
+	while(readChunk)
+	{
+		Chunk* chunk=readChunk;
+		readChunk=chunk->next;
+		release(chunk);
 	}
-	
-	Message& messageBuffer=fdBuffers[fd].messageBuffer;
-	Header& headerBuffer=fdBuffers[fd].headerBuffer;
+	freeStorage();
+
+	m_storage=storage;
+	// Chunks must hold at least a few minimum sized blocks and stay aligned back to back
+	m_storage.chunkSize=(std::max(m_storage.chunkSize, (size_t)minBlockSize*4)+alignment-1)/alignment*alignment;
 
-	ssize_t actual;
-	// Are we in the process of recieving some part of a frame?
-	if(!messageBuffer.data)
+	if(m_storage.hugePages && m_storage.retainedChunks)
 	{
-		// Are we recieving a partial header or new?
-		actual=read(fd, (char*)&headerBuffer+messageBuffer.size, sizeof(Header)-messageBuffer.size);
-		if(actual<0 && errno!=EAGAIN) throw Exceptions::SocketRead(fd, errno);
-		if(actual>0) messageBuffer.size+=actual;
-		
-		if( actual == 0 )
+		const size_t hugePageSize=2097152;
+		const size_t chunksSize=m_storage.retainedChunks*blockSize();
+		regionSize=chunksSize+hugePageSize;
+		region=(char*)mmap(0, regionSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(region==MAP_FAILED)
+			region=0;
+		else
 		{
-			if (pollFd->fd != socket)
+			// Huge pages can only back the aligned part of the region
+			regionStart=region+(hugePageSize-(size_t)region%hugePageSize)%hugePageSize;
+			regionEnd=regionStart+chunksSize;
+#if defined (MADV_HUGEPAGE)
+			madvise(regionStart, (chunksSize+hugePageSize-1)/hugePageSize*hugePageSize, MADV_HUGEPAGE);
+#endif
+			for(char* block=regionEnd-blockSize(); block>=regionStart; block-=blockSize())
 			{
-				fdBuffers.erase( pollFd->fd );
-				pollFds.erase( pollFd );
+				Chunk* chunk=(Chunk*)block;
+				chunk->next=freeChunks;
+				freeChunks=chunk;
+				++freeCount;
 			}
-			else
-				freeFd(fd);	
-			return false;
 		}
+	}
+
+	readChunk=writeChunk=lastChunk=acquire();
+	pRead=readChunk->data();
+	return true;
+}
+
+Fastcgipp::Transceiver::Buffer::Chunk* Fastcgipp::Transceiver::Buffer::acquire()
+{
+	Chunk* chunk;
+	if(freeChunks)
+	{
+		chunk=freeChunks;
+		freeChunks=chunk->next;
+		--freeCount;
+	}
+	else
+		chunk=(Chunk*)new char[blockSize()];
+
+	chunk->next=0;
+	chunk->end=chunk->data();
+	chunk->limit=chunk->data()+m_storage.chunkSize;
+	return chunk;
+}
+
+void Fastcgipp::Transceiver::Buffer::release(Chunk* chunk)
+{
+	const bool inRegion=(char*)chunk>=regionStart && (char*)chunk<regionEnd;
+	if(inRegion || freeCount<m_storage.retainedChunks)
+	{
+		chunk->next=freeChunks;
+		freeChunks=chunk;
+		++freeCount;
+	}
+	else
+		delete [] (char*)chunk;
+}
+
+void Fastcgipp::Transceiver::Buffer::freeStorage()
+{
+	while(freeChunks)
+	{
+		Chunk* chunk=freeChunks;
+		freeChunks=chunk->next;
+		if((char*)chunk<regionStart || (char*)chunk>=regionEnd)
+			delete [] (char*)chunk;
+	}
+	freeCount=0;
+
+	if(region)
+		munmap(region, regionSize);
+	region=0;
+	regionSize=0;
+	regionStart=0;
+	regionEnd=0;
+}
+
+bool Fastcgipp::Transceiver::Buffer::write(const char* data, size_t size, Protocol::FullId id)
+{
+	bool filled=false;
+	while(size)
+	{
+		const Block block(requestWrite(size));
+		std::memcpy(block.data, data, block.size);
+		filled|=secureWrite(block.size, id, false);
+		data+=block.size;
+		size-=block.size;
+	}
+	return filled;
+}
+
+bool Fastcgipp::Transceiver::Buffer::pad(size_t size, Protocol::FullId id)
+{
+	static const char padding[Protocol::chunkSize]={};
+
+	bool filled=false;
+	while(size)
+	{
+		const size_t length=std::min(size, sizeof(padding));
+		filled|=write(padding, length, id);
+		size-=length;
+	}
+	return filled;
+}
+
+void Fastcgipp::Transceiver::writeRecord(const Protocol::Header& header, const char* content, Protocol::FullId id)
+{
+	m_metrics.recordOut(header.getType());
+	boost::unique_lock<boost::mutex> writeLock(writeMutex);
+	bool filled=buffer.write((const char*)&header, sizeof(header), id);
+	filled|=buffer.write(content, header.getContentLength(), id);
+	filled|=buffer.pad(header.getPaddingLength(), id);
+	if(buffer.full(id.fd))
+		drain(writeLock, id.fd);
+	else if(filled)
+		transmit();
+}
+
+void Fastcgipp::Transceiver::writeRecords(const char* records, size_t size, Protocol::FullId id)
+{
+	boost::unique_lock<boost::mutex> writeLock(writeMutex);
+	const char* const end=records+size;
+	while(records<end)
+	{
+		Protocol::Header header=*(const Protocol::Header*)records;
+		m_metrics.recordOut(header.getType());
+		header.setRequestId(id.fcgiId);
+		const size_t length=header.getContentLength()+header.getPaddingLength();
+
+		bool filled=buffer.write((const char*)&header, sizeof(header), id);
+		filled|=buffer.write(records+sizeof(header), length, id);
+		records+=sizeof(header)+length;
+
+		if(buffer.full(id.fd))
+			drain(writeLock, id.fd);
+		else if(filled)
+			transmit();
+	}
+}
 
-		if(messageBuffer.size!=sizeof(Header))
+void Fastcgipp::Transceiver::countRecords(const char* data, size_t size, int fd)
+{
+	const char* const end=data+size;
+	while(data<end)
+	{
+		const Protocol::Header& header=*(const Protocol::Header*)data;
+		m_metrics.recordOut(header.getType());
+		if(header.getType()==Protocol::END_REQUEST)
+			buffer.end(fd);
+		data+=sizeof(Protocol::Header)+header.getContentLength()+header.getPaddingLength();
+	}
+}
+
+void Fastcgipp::Transceiver::dumpMetrics(std::ostream& stream)
+{
+	Statistics statistics;
+	size_t chunks;
+	size_t retainedChunks;
+	{
+		boost::lock_guard<boost::mutex> writeLock(writeMutex);
+		statistics=stats;
+		statistics.buffered=buffer.buffered();
+		statistics.throttles=buffer.throttles();
+		chunks=buffer.chunks();
+		retainedChunks=buffer.retainedChunks();
+	}
+
+	Metrics::print(stream, "connections", "gauge", "Connections currently open.", connectionCount.load());
+	Metrics::print(stream, "sent_bytes_total", "counter", "Bytes transmitted.", statistics.bytes);
+	Metrics::print(stream, "writes_total", "counter", "Write system calls made.", statistics.writes);
+	Metrics::print(stream, "frames_total", "counter", "Frames (records or parts thereof) transmitted.", statistics.frames);
+	Metrics::print(stream, "buffered_bytes", "gauge", "Bytes buffered waiting to be transmitted.", statistics.buffered);
+	Metrics::print(stream, "buffer_chunks", "gauge", "Chunks in the write buffer's queue.", chunks);
+	Metrics::print(stream, "buffer_retained_chunks", "gauge", "Chunks kept for reuse by the write buffer.", retainedChunks);
+	Metrics::print(stream, "throttles_total", "counter", "Times a connection was throttled by the watermarks.", statistics.throttles);
+	m_metrics.dump(stream);
+}
+
+void Fastcgipp::Transceiver::writeFile(const Protocol::Header& header, const SharedFile& file, off_t offset, Protocol::FullId id)
+{
+	m_metrics.recordOut(header.getType());
+	boost::unique_lock<boost::mutex> writeLock(writeMutex);
+	bool filled=buffer.write((const char*)&header, sizeof(header), id);
+	if(header.getContentLength())
+		buffer.writeFile(file, offset, header.getContentLength(), id);
+	filled|=buffer.pad(header.getPaddingLength(), id);
+	if(buffer.full(id.fd))
+		drain(writeLock, id.fd);
+	else if(filled)
+		transmit();
+}
+
+ssize_t Fastcgipp::Transceiver::sendFile(int fd, int file, off_t offset, size_t size)
+{
+#if defined (HAVE_SYS_SENDFILE_H)
+	{
+		const ssize_t sent=sendfile(fd, file, &offset, size);
+		if(sent>0 || (sent<0 && (errno==EAGAIN || errno==EPIPE || errno==EBADF)))
+			return sent;
+	}
+#endif
+
+	char data[16384];
+	ssize_t sent=0;
+	while(size)
+	{
+		const size_t length=std::min(size, sizeof(data));
+		ssize_t actual=pread(file, data, length, offset);
+		if(actual<=0)
 		{
-			if(transmitEmpty) return true;
-			else return false;
+			std::memset(data, 0, length);
+			actual=length;
 		}
 
-		messageBuffer.data.reset(new char[sizeof(Header)+headerBuffer.getContentLength()+headerBuffer.getPaddingLength()]);
-		memcpy(static_cast<void*>(messageBuffer.data.get()), static_cast<const void*>(&headerBuffer), sizeof(Header));
+		const ssize_t written=::write(fd, data, actual);
+		if(written<0)
+			return sent?sent:-1;
+		sent+=written;
+		if(written<actual)
+			break;
+		offset+=written;
+		size-=written;
 	}
+	return sent;
+}
 
-	const Header& header=*(const Header*)messageBuffer.data.get();
-	size_t needed=header.getContentLength()+header.getPaddingLength()+sizeof(Header)-messageBuffer.size;
-	actual=read(fd, messageBuffer.data.get()+messageBuffer.size, needed);
-	if(actual<0 && errno!=EAGAIN) throw Exceptions::SocketRead(fd, errno);
-	if(actual>0) messageBuffer.size+=actual;
+int Fastcgipp::Transceiver::Buffer::requestRead(iovec* iov, int iovSize, int& iovCount, int& file, off_t& offset)
+{
+	iovCount=0;
+	file=-1;
+	batch.clear();
 
-	// Did we recieve a full frame?
-	if(actual==(ssize_t)needed)
-	{		
-		sendMessage(FullId(headerBuffer.getRequestId(), fd), messageBuffer);
-		messageBuffer.size=0;
-		messageBuffer.data.reset();
-		return false;
+	// Find the first frame still to be transmitted to a connection that isn't blocked
+	for(; scan<frames.size(); ++scan)
+	{
+		const Frame& frame=frames[scan];
+		if(frame.sent<frame.size && !connection(frame.id.fd).blocked)
+			break;
+	}
+	if(scan==frames.size())
+		return -1;
+
+	const int fd=frames[scan].id.fd;
+	for(size_t i=scan; i<frames.size(); ++i)
+	{
+		const Frame& frame=frames[i];
+		if(frame.id.fd!=fd || frame.sent==frame.size)
+			continue;
+
+		if(frame.file.fd()>=0)
+		{
+			if(!iovCount)
+			{
+				file=frame.file.fd();
+				offset=frame.offset+frame.sent;
+				iov[0].iov_base=0;
+				iov[0].iov_len=frame.size-frame.sent;
+				iovCount=1;
+				batch.push_back(i);
+			}
+			break;
+		}
+
+		const char* data=frame.data+frame.sent;
+		const size_t size=frame.size-frame.sent;
+		if(iovCount && (const char*)iov[iovCount-1].iov_base+iov[iovCount-1].iov_len==data)
+			iov[iovCount-1].iov_len+=size;
+		else if(iovCount==iovSize)
+			break;
+		else
+		{
+			iov[iovCount].iov_base=const_cast<char*>(data);
+			iov[iovCount].iov_len=size;
+			++iovCount;
+		}
+		batch.push_back(i);
+
+		if(frame.closeFd)
+			break;
 	}
-	if(transmitEmpty) return true;
-	else return false;
+	return fd;
 }
 
-void Fastcgipp::Transceiver::Buffer::freeRead(size_t size)
+size_t Fastcgipp::Transceiver::Buffer::freeRead(size_t size)
 {
-	pRead+=size;
-	if(pRead>=chunks.begin()->end)
+	size_t freed=0;
+	std::vector<size_t>::const_iterator it=batch.begin();
+	for(; it!=batch.end() && size; ++it)
 	{
-		if(writeIt==chunks.begin())
+		Frame& frame=frames[*it];
+		const size_t frameSize=std::min(size, frame.size-frame.sent);
+		frame.sent+=frameSize;
+		size-=frameSize;
+		if(frame.file.fd()<0)
+			account(frame.id.fd, 0, frameSize);
+
+		if(frame.sent==frame.size)
 		{
-			pRead=writeIt->data.get();
-			writeIt->end=pRead;
+			if(frame.closeFd)
+				closeFd(frame.id.fd);
+			++freed;
 		}
-		else
+	}
+
+	if(!batch.empty() && frames[batch.back()].sent<frames[batch.back()].size)
+	{
+		// The connection didn't take it all so there is no use in trying again until it's writable
+		const int fd=frames[batch.back()].id.fd;
+		connection(fd).blocked=true;
+		if(std::find(blockedFds.begin(), blockedFds.end(), fd)==blockedFds.end())
+		{
+			blockedFds.push_back(fd);
+			m_wake=true;
+		}
+	}
+	batch.clear();
+	return freed;
+}
+
+void Fastcgipp::Transceiver::Buffer::reclaim()
+{
+	while(!frames.empty() && frames.front().sent==frames.front().size)
+	{
+		const Frame& frame=frames.front();
+		// Frames sent from a file take up no space in the buffer
+		if(frame.file.fd()<0 && (pRead+=frame.size)>=readChunk->end)
 		{
-			if(writeIt==--chunks.end())
+			if(writeChunk==readChunk)
 			{
-				chunks.begin()->end=chunks.begin()->data.get();
-				chunks.splice(chunks.end(), chunks, chunks.begin());
+				pRead=writeChunk->data();
+				writeChunk->end=pRead;
 			}
 			else
-				chunks.pop_front();
-			pRead=chunks.begin()->data.get();
+			{
+				Chunk* chunk=readChunk;
+				readChunk=chunk->next;
+				if(writeChunk==lastChunk)
+				{
+					// Keep a spare chunk at the back of the queue
+					chunk->end=chunk->data();
+					chunk->next=0;
+					lastChunk->next=chunk;
+					lastChunk=chunk;
+				}
+				else
+					release(chunk);
+				pRead=readChunk->data();
+			}
 		}
+		frames.pop_front();
 	}
-	if((frames.front().size-=size)==0)
+}
+
+void Fastcgipp::Transceiver::Buffer::discard(int fd)
+{
+	for(std::deque<Frame>::iterator it=frames.begin(); it!=frames.end(); ++it)
+		if(it->id.fd==fd)
+			it->sent=it->size;
+
+	if(fd<(int)connections.size())
 	{
-		if(frames.front().closeFd)
-			freeFd(frames.front().id.fd);
-		frames.pop();
+		Connection& state=connections[fd];
+		m_buffered-=state.buffered;
+		if(state.throttled)
+			m_wake=true;
+		state=Connection();
+		if(m_throttled && m_buffered<m_watermarks.totalLow)
+		{
+			m_throttled=false;
+			m_wake=true;
+		}
 	}
+	blockedFds.erase(std::remove(blockedFds.begin(), blockedFds.end(), fd), blockedFds.end());
+}
+
+bool Fastcgipp::Transceiver::Buffer::busy(int fd)
+{
+	const Connection& state=connection(fd);
+	if(state.requests || state.buffered)
+		return true;
+	// Frames sent from files take up no memory so they have to be looked for
+	for(std::deque<Frame>::const_iterator it=frames.begin(); it!=frames.end(); ++it)
+		if(it->id.fd==fd && it->sent<it->size)
+			return true;
+	return false;
+}
+
+void Fastcgipp::Transceiver::Buffer::account(int fd, size_t added, size_t removed)
+{
+	Connection& state=connection(fd);
+	state.buffered+=added;
+	state.buffered-=removed;
+	m_buffered+=added;
+	m_buffered-=removed;
 
+	if(added)
+	{
+		if(!state.throttled && m_watermarks.connectionHigh && state.buffered>m_watermarks.connectionHigh)
+		{
+			state.throttled=true;
+			++m_throttles;
+		}
+		if(!m_throttled && m_watermarks.totalHigh && m_buffered>m_watermarks.totalHigh)
+		{
+			m_throttled=true;
+			++m_throttles;
+		}
+	}
+	else
+	{
+		if(state.throttled && state.buffered<m_watermarks.connectionLow)
+		{
+			state.throttled=false;
+			m_wake=true;
+		}
+		if(m_throttled && m_buffered<m_watermarks.totalLow)
+		{
+			m_throttled=false;
+			m_wake=true;
+		}
+	}
+}
+
+bool Fastcgipp::Transceiver::handler()
+{
+	m_timers.run();
+
+	{
+		boost::lock_guard<boost::mutex> writeLock(writeMutex);
+		transmit();
+		buffer.takeCloseFds(closeFds);
+	}
+	watchBlocked();
+	for(std::vector<int>::iterator it=closeFds.begin(); it!=closeFds.end(); ++it)
+		freeFd(*it);
+	closeFds.clear();
+
+	if(handoffState==DRAINING && handoffConnections)
+	{
+		bool ended;
+		{
+			boost::lock_guard<boost::mutex> writeLock(writeMutex);
+			ended=buffer.takeEnded();
+		}
+		if(ended || sweepAgain)
+			sweep();
+	}
+
+	if(!poller.ready() && !poller.poll(0))
+		return true;
+
+	bool writable=false;
+	for(size_t i=0; i<poller.ready(); ++i)
+	{
+		const Poller::Event& event=poller[i];
+
+		if(event.fd==socket)
+			accept();
+		else if(event.fd==handoffChannel)
+			handoff();
+		else if(event.fd==wakeUpFdIn)
+		{
+			// Only cleared once the signal is consumed so a pending wakeup is never left unsignalled
+			char x[256];
+			read(wakeUpFdIn, x, sizeof(x));
+			wakePending=false;
+		}
+		else if(event.fd>=0 && event.fd<(int)fdBuffers.size() && fdBuffers[event.fd].open)
+		{
+			if(event.flags & (Poller::HANGUP|Poller::ERROR))
+				freeFd(event.fd);
+			else
+			{
+				if(event.flags & Poller::WRITE)
+				{
+					poller.watchWrite(event.fd, false);
+					fdBuffers[event.fd].writing=false;
+					boost::lock_guard<boost::mutex> writeLock(writeMutex);
+					buffer.unblock(event.fd);
+					writable=true;
+				}
+				if(event.flags & Poller::READ)
+					receive(event.fd);
+			}
+		}
+	}
+	poller.clear();
+
+	if(writable)
+	{
+		{
+			boost::lock_guard<boost::mutex> writeLock(writeMutex);
+			transmit();
+		}
+		watchBlocked();
+	}
+
+	return true;
+}
+
+void Fastcgipp::Transceiver::watchBlocked()
+{
+	{
+		boost::lock_guard<boost::mutex> writeLock(writeMutex);
+		buffer.takeBlocked(blockedFds);
+	}
+	for(std::vector<int>::iterator it=blockedFds.begin(); it!=blockedFds.end(); ++it)
+		if(*it<(int)fdBuffers.size() && fdBuffers[*it].open && !fdBuffers[*it].writing)
+		{
+			poller.watchWrite(*it, true);
+			fdBuffers[*it].writing=true;
+		}
+	blockedFds.clear();
+}
+
+void Fastcgipp::Transceiver::accept()
+{
+	sockaddr_un addr;
+	socklen_t addrlen=sizeof(sockaddr_un);
+#if defined (HAVE_ACCEPT4)
+	// Writes never block so one slow connection can't hold up all the others
+	const int fd=accept4(socket, (sockaddr*)&addr, &addrlen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+	const int fd=::accept(socket, (sockaddr*)&addr, &addrlen);
+#endif
+	if(fd<0)
+	{
+		// Should the listening socket have been shut down (see shutListener()) it's done for
+		if(errno==EINVAL)
+		{
+			if(listening)
+				poller.del(socket);
+			listening=false;
+			accepting=false;
+		}
+		return;
+	}
+#if !defined (HAVE_ACCEPT4)
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+	m_metrics.connections.fetch_add(1, boost::memory_order_relaxed);
+	adopt(fd);
+}
+
+void Fastcgipp::Transceiver::adopt(int fd)
+{
+	if(++connectionCount>=maxConnections && maxConnections && listening)
+	{
+		// Further connections wait in the listen queue until one closes
+		poller.del(socket);
+		listening=false;
+	}
+
+	if(fd>=(int)fdBuffers.size())
+		fdBuffers.resize(fd+1);
+	fdBuffer& buffer=fdBuffers[fd];
+	buffer.open=true;
+	buffer.writing=false;
+	buffer.start=0;
+	buffer.end=0;
+	if(idleTimeout)
+	{
+		buffer.lastActive=Timers::now();
+		buffer.idleTimer=m_timers.add(idleTimeout, boost::bind(&Transceiver::idle, this, fd));
+	}
+
+	poller.add(fd);
+}
+
+void Fastcgipp::Transceiver::idle(int fd)
+{
+	fdBuffer& connection=fdBuffers[fd];
+	if(!connection.open)
+		return;
+
+	const uint64_t now=Timers::now();
+	{
+		boost::lock_guard<boost::mutex> writeLock(writeMutex);
+		if(buffer.busy(fd))
+			connection.lastActive=now;
+		else
+			connection.lastActive=std::max(connection.lastActive, buffer.lastEnd(fd));
+	}
+	const uint64_t due=connection.lastActive+idleTimeout;
+	if(now>=due)
+	{
+		freeFd(fd);
+		return;
+	}
+
+	// Activity doesn't touch the timer so it's only ever pushed back here
+	connection.idleTimer=m_timers.add(due-now, boost::bind(&Transceiver::idle, this, fd));
+}
+
+void Fastcgipp::Transceiver::receive(int fd)
+{
+	using namespace std;
+	using namespace Protocol;
+
+	fdBuffer& buffer=fdBuffers[fd];
+	if(!buffer.data)
+	{
+		buffer.data=getReadBuffer();
+		buffer.start=0;
+		buffer.end=0;
+	}
+
+	const ssize_t actual=read(fd, buffer.data.get()+buffer.end, readBufferSize-buffer.end);
+	if(actual<0)
+	{
+		if(errno==EAGAIN) return;
+		throw Exceptions::SocketRead(fd, errno);
+	}
+	if(actual==0)
+	{
+		freeFd(fd);
+		return;
+	}
+	buffer.end+=actual;
+	m_metrics.bytesIn.fetch_add(actual, boost::memory_order_relaxed);
+	if(idleTimeout)
+		buffer.lastActive=Timers::now();
+
+	// Pass on every complete record
+	while(buffer.end-buffer.start >= sizeof(Header))
+	{
+		const Header& header=*(const Header*)(buffer.data.get()+buffer.start);
+		const size_t size=sizeof(Header)+header.getContentLength()+header.getPaddingLength();
+		if(buffer.end-buffer.start < size)
+			break;
+
+		Message message;
+		message.size=size;
+		message.data=boost::shared_array<char>(buffer.data, buffer.data.get()+buffer.start);
+		buffer.start+=size;
+		m_metrics.recordIn(header.getType());
+		if(header.getType()==BEGIN_REQUEST)
+		{
+			boost::lock_guard<boost::mutex> writeLock(writeMutex);
+			this->buffer.begin(fd);
+		}
+		sendMessage(FullId(header.getRequestId(), fd), message);
+	}
+
+	if(buffer.start==buffer.end)
+	{
+		// Nothing left over so an idle connection doesn't hold on to a buffer
+		releaseReadBuffer(buffer.data);
+		return;
+	}
+
+	// Make sure the rest of a partial record fits
+	const size_t remaining=buffer.end-buffer.start;
+	size_t needed=sizeof(Header);
+	if(remaining >= sizeof(Header))
+	{
+		const Header& header=*(const Header*)(buffer.data.get()+buffer.start);
+		needed+=header.getContentLength()+header.getPaddingLength();
+	}
+	if(buffer.start+needed <= readBufferSize)
+		return;
+
+	if(buffer.data.use_count()==1)
+		memmove(buffer.data.get(), buffer.data.get()+buffer.start, remaining);
+	else
+	{
+		// Messages still share this buffer so the partial record moves to a fresh one
+		boost::shared_array<char> fresh(getReadBuffer());
+		memcpy(fresh.get(), buffer.data.get()+buffer.start, remaining);
+		releaseReadBuffer(buffer.data);
+		buffer.data=fresh;
+	}
+	buffer.start=0;
+	buffer.end=remaining;
+}
+
+boost::shared_array<char> Fastcgipp::Transceiver::getReadBuffer()
+{
+	for(std::vector<boost::shared_array<char> >::iterator it=readPool.begin(); it!=readPool.end(); ++it)
+		if(it->use_count()==1)
+		{
+			boost::shared_array<char> buffer;
+			buffer.swap(*it);
+			*it=readPool.back();
+			readPool.pop_back();
+			return buffer;
+		}
+	return boost::shared_array<char>(new char[readBufferSize]);
+}
+
+void Fastcgipp::Transceiver::releaseReadBuffer(boost::shared_array<char>& buffer)
+{
+	if(readPool.size()<readPoolSize)
+		readPool.push_back(buffer);
+	buffer.reset();
 }
 
 void Fastcgipp::Transceiver::wake()
 {
-	char x=0;
+	if(wakePending.exchange(true))
+		return;
+#if defined (HAVE_SYS_EVENTFD_H)
+	const uint64_t x=1;
+	write(wakeUpFdOut, &x, sizeof(x));
+#else
+	const char x=0;
 	write(wakeUpFdOut, &x, 1);
+#endif
 }
 
 Fastcgipp::Transceiver::Transceiver(int fd_, boost::function<void(Protocol::FullId, Message)> sendMessage_)
-:buffer(pollFds, fdBuffers), sendMessage(sendMessage_), pollFds(2), socket(fd_)
+:sendMessage(sendMessage_), socket(fd_), wakePending(false), maxConnections(0), connectionCount(0), listening(true), accepting(true), handoffState(NO_HANDOFF), handoffChannel(-1), successor(0), handoffConnections(false), m_handedOff(false), sweepAgain(false), idleTimeout(0)
 {
 	socket=fd_;
+	m_timers.setWake(boost::bind(&Transceiver::wake, this));
+
+	// A predecessor handing off to us passes it's listening socket first thing
+	const int channel=Handoff::inherited();
+	if(channel>=0)
+	{
+		std::vector<int> fds;
+		if(Handoff::receive(channel, fds, true)==Handoff::LISTENER && fds.size()==1)
+		{
+			socket=fds.front();
+			handoffChannel=channel;
+			handoffState=SUCCEEDING;
+		}
+		else
+		{
+			for(std::vector<int>::iterator it=fds.begin(); it!=fds.end(); ++it)
+				close(*it);
+			close(channel);
+		}
+	}
 	
+#if defined (HAVE_SYS_EVENTFD_H)
+	// A single eventfd counter is all that's needed for waking up poll()
+	wakeUpFdIn=wakeUpFdOut=eventfd(0, EFD_NONBLOCK);
+	fcntl(wakeUpFdIn, F_SETFD, FD_CLOEXEC);
+#else
 	// Let's setup a in/out socket for waking up poll()
 	int socPair[2];
 	socketpair(AF_UNIX, SOCK_STREAM, 0, socPair);
 	wakeUpFdIn=socPair[0];
-	fcntl(wakeUpFdIn, F_SETFL, (fcntl(wakeUpFdIn, F_GETFL)|O_NONBLOCK)^O_NONBLOCK);	
+	fcntl(wakeUpFdIn, F_SETFL, fcntl(wakeUpFdIn, F_GETFL)|O_NONBLOCK);
 	wakeUpFdOut=socPair[1];	
+	// Once the socket is full a wakeup is pending anyway so there's no need to wait
+	fcntl(wakeUpFdOut, F_SETFL, fcntl(wakeUpFdOut, F_GETFL)|O_NONBLOCK);
+	fcntl(wakeUpFdIn, F_SETFD, FD_CLOEXEC);
+	fcntl(wakeUpFdOut, F_SETFD, FD_CLOEXEC);
+#endif
 	
-	fcntl(socket, F_SETFL, (fcntl(socket, F_GETFL)|O_NONBLOCK)^O_NONBLOCK);
-	pollFds[0].events = POLLIN|POLLHUP;
-	pollFds[0].fd = socket;
-	pollFds[1].events = POLLIN|POLLHUP;
-	pollFds[1].fd = wakeUpFdIn;
+	// Non-blocking so a connection taken by someone else sharing the socket doesn't stall accept()
+	fcntl(socket, F_SETFL, fcntl(socket, F_GETFL)|O_NONBLOCK);
+	poller.add(socket);
+	poller.add(wakeUpFdIn);
+
+	if(handoffState==SUCCEEDING)
+	{
+		// The predecessor stops accepting once it hears from us
+		poller.add(handoffChannel);
+		if(!Handoff::send(handoffChannel, Handoff::READY))
+			endHandoff();
+	}
+}
+
+bool Fastcgipp::Transceiver::handOff(const std::vector<std::string>& command, bool connections)
+{
+	if(handoffState!=NO_HANDOFF || !accepting)
+		return false;
+
+	handoffChannel=Handoff::spawn(command, successor);
+	if(handoffChannel<0)
+		return false;
+	if(!Handoff::send(handoffChannel, Handoff::LISTENER, &socket, 1))
+	{
+		close(handoffChannel);
+		handoffChannel=-1;
+		return false;
+	}
+
+	handoffState=STARTING;
+	handoffConnections=connections;
+	poller.add(handoffChannel);
+	return true;
+}
+
+void Fastcgipp::Transceiver::handoff()
+{
+	while(handoffChannel>=0)
+	{
+		std::vector<int> fds;
+		const int tag=Handoff::receive(handoffChannel, fds, false);
+		if(tag<0)
+		{
+			if(errno!=EAGAIN && errno!=EWOULDBLOCK)
+				endHandoff();
+			return;
+		}
+		if(tag==0)
+		{
+			// Should the successor have died on us before taking over we simply carry on
+			if(handoffState==STARTING)
+				waitpid(successor, 0, WNOHANG);
+			endHandoff();
+			return;
+		}
+
+		if(tag==Handoff::READY && handoffState==STARTING)
+		{
+			if(listening)
+				poller.del(socket);
+			listening=false;
+			accepting=false;
+			handoffState=DRAINING;
+			m_handedOff=true;
+			if(handoffConnections)
+				sweep();
+		}
+		else if(tag==Handoff::CONNECTIONS && handoffState==SUCCEEDING)
+		{
+			for(std::vector<int>::iterator it=fds.begin(); it!=fds.end(); ++it)
+				adopt(*it);
+			fds.clear();
+		}
+
+		// Anything unexpected is not ours to keep
+		for(std::vector<int>::iterator it=fds.begin(); it!=fds.end(); ++it)
+			close(*it);
+	}
+}
+
+void Fastcgipp::Transceiver::sweep()
+{
+	std::vector<int> quiet;
+	sweepAgain=false;
+	{
+		boost::lock_guard<boost::mutex> writeLock(writeMutex);
+		for(int fd=0; fd<(int)fdBuffers.size(); ++fd)
+		{
+			if(!fdBuffers[fd].open)
+				continue;
+			// Part of a record already read can't be passed on
+			if(fdBuffers[fd].data || buffer.busy(fd))
+				sweepAgain=true;
+			else
+				quiet.push_back(fd);
+		}
+	}
+
+	for(size_t i=0; i<quiet.size(); i+=Handoff::maxFds)
+	{
+		const size_t count=std::min(quiet.size()-i, (size_t)Handoff::maxFds);
+		if(!Handoff::send(handoffChannel, Handoff::CONNECTIONS, &quiet[i], count))
+		{
+			endHandoff();
+			return;
+		}
+		// The successor has it's own copy now
+		for(size_t j=i; j<i+count; ++j)
+			freeFd(quiet[j]);
+	}
+}
+
+void Fastcgipp::Transceiver::endHandoff()
+{
+	if(handoffChannel>=0)
+	{
+		poller.del(handoffChannel);
+		close(handoffChannel);
+	}
+	handoffChannel=-1;
+	handoffState=NO_HANDOFF;
+	sweepAgain=false;
 }
 
 Fastcgipp::Exceptions::SocketWrite::SocketWrite(int fd_, int erno_): Socket(fd_, erno_)
@@ -318,13 +1151,30 @@ Fastcgipp::Exceptions::SocketPoll::SocketPoll(int erno_): CodedException(0, erno
 	}
 }
 
-void Fastcgipp::Transceiver::freeFd(int fd, std::vector<pollfd>& pollFds, std::map<int, fdBuffer>& fdBuffers)
+void Fastcgipp::Transceiver::freeFd(int fd)
 {
-	std::vector<pollfd>::iterator it=std::find_if(pollFds.begin(), pollFds.end(), equalsFd(fd));
-	if(it != pollFds.end())
+	if(fd>=0 && fd<(int)fdBuffers.size() && fdBuffers[fd].open)
 	{
-		pollFds.erase(it);
-		close(fd);
-		fdBuffers.erase(fd);
+		poller.del(fd);
+		{
+			boost::lock_guard<boost::mutex> writeLock(writeMutex);
+			close(fd);
+			buffer.cancelClose(fd);
+			buffer.discard(fd);
+		}
+		fdBuffer& buffer=fdBuffers[fd];
+		buffer.open=false;
+		buffer.writing=false;
+		m_timers.cancel(buffer.idleTimer);
+		buffer.idleTimer=Timers::Handle();
+		if(buffer.data)
+			releaseReadBuffer(buffer.data);
+
+		--connectionCount;
+		if(!listening && accepting && (!maxConnections || connectionCount<maxConnections))
+		{
+			poller.add(socket);
+			listening=true;
+		}
 	}
 }